@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "expr.h"
+#include "nl.h"
+#include "sparse.h"
+#include "op_derivs.h"
+#include "tape.h"
+#include "hessian.h"
+#include "evaluator.h"
+
+/*
+ * Time each stage of loading and evaluating a model: parsing the .nl file,
+ * setting up the tape evaluator (compiling the tape, Hessian sparsity and
+ * coloring), then constraint values, Jacobian and Hessian of the Lagrangian.
+ *
+ * Usage: ./bench-model FILE [repeats]
+ *
+ * Results are written as one line of JSON to stdout, so a series of runs
+ * (see `make bench`) can be compared between commits. Evaluation times are
+ * per call, averaged over the repeats.
+ *
+ * Built with -DINSTRUMENT (make profile), this also prints a breakdown by
+ * phase and the most expensive constraints to stderr. Built with -DTRACE
+ * (make trace), it writes a timeline of the same stages to FILE.trace.json
+ * (see trace.h).
+ */
+
+double seconds(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+int main(int narg, char ** argv){
+  if (narg < 2){
+    printf("No file provided. Please provide an nl file.\n");
+    return -1;
+  }
+  int repeats = narg > 2 ? atoi(argv[2]) : 5;
+#ifdef TRACE
+  trace_start(1 << 20);
+#endif
+
+  double start = seconds();
+  FILE * fp = fopen(argv[1], "r");
+  if (fp == NULL){
+    printf("ERROR: Could not open %s\n", argv[1]);
+    return -1;
+  }
+  struct NLHeader header = read_nl_header(fp);
+  fclose(fp);
+  int nvar = header.nvar;
+  int ncon = header.ncon;
+  // Only used if built with -DINSTRUMENT (see instrument.h)
+  instrument_init(ncon);
+  struct Variable * variables = malloc(nvar * sizeof(struct Variable));
+  for (int j=0; j<nvar; j++){variables[j].index = j;}
+  struct Node * constraints = malloc(ncon * sizeof(struct Node));
+  fp = fopen(argv[1], "r");
+  read_nl_constraints(fp, constraints, ncon, variables, nvar);
+  fclose(fp);
+  double parse_time = seconds() - start;
+  // Bytes counted by memory.h: the expression trees, then the peak while
+  // setting up derivatives
+  long model_bytes = memory_total().bytes;
+  memory_reset_peak();
+
+  start = seconds();
+  struct Evaluator ev = tape_evaluator(constraints, ncon, nvar);
+  double setup_time = seconds() - start;
+  long setup_peak_bytes = memory_total().peak;
+  struct TapeEvaluatorData * td = ev.data;
+
+  double * x = malloc(nvar * sizeof(double));
+  double * g = malloc(ncon * sizeof(double));
+  double * lambda = malloc(ncon * sizeof(double));
+  double * jac_values = malloc((ev.jacobian.nnz + 1) * sizeof(double));
+  double * hess_values = malloc((ev.hessian.nnz + 1) * sizeof(double));
+  for (int j=0; j<nvar; j++){x[j] = 1.0 + (j % 10) / 10.0;}
+  for (int i=0; i<ncon; i++){lambda[i] = 1.0;}
+
+  start = seconds();
+  for (int r=0; r<repeats; r++){ev.eval_g(ev.data, x, NULL, g);}
+  double eval_time = (seconds() - start) / repeats;
+  start = seconds();
+  for (int r=0; r<repeats; r++){ev.eval_jac(ev.data, x, NULL, jac_values);}
+  double jac_time = (seconds() - start) / repeats;
+  start = seconds();
+  for (int r=0; r<repeats; r++){ev.eval_hess(ev.data, x, NULL, lambda, hess_values);}
+  double hess_time = (seconds() - start) / repeats;
+
+  // A checksum, so a change in results shows up alongside a change in time
+  double checksum = 0.0;
+  for (int i=0; i<ncon; i++){checksum += g[i];}
+
+  printf(
+    "{\"file\": \"%s\", \"nvar\": %d, \"ncon\": %d, \"tape_nodes\": %d, "
+    "\"jac_nnz\": %d, \"hess_nnz\": %d, \"hess_colors\": %d, \"repeats\": %d, "
+    "\"parse_s\": %.6f, \"setup_s\": %.6f, \"eval_s\": %.6f, \"jac_s\": %.6f, "
+    "\"hess_s\": %.6f, \"model_bytes\": %ld, \"setup_peak_bytes\": %ld, \"g_sum\": %.10g}\n",
+    argv[1], nvar, ncon, td->model.tape.nnode,
+    ev.jacobian.nnz, ev.hessian.nnz, td->model.coloring.ncolor, repeats,
+    parse_time, setup_time, eval_time, jac_time,
+    hess_time, model_bytes, setup_peak_bytes, checksum
+  );
+
+#ifdef INSTRUMENT
+  // JSON on stdout stays machine-readable
+  instrument_report(stderr, 10, constraints);
+#endif
+  instrument_free();
+#ifdef TRACE
+  char * trace_file = malloc(strlen(argv[1]) + 12);
+  sprintf(trace_file, "%s.trace.json", argv[1]);
+  trace_write(trace_file);
+  fprintf(stderr, "Wrote %s\n", trace_file);
+  free(trace_file);
+  trace_stop();
+#endif
+
+  free(x);
+  free(g);
+  free(lambda);
+  free(jac_values);
+  free(hess_values);
+  free_evaluator(ev);
+  for (int i=0; i<ncon; i++){free_expression(constraints[i]);}
+  free(constraints);
+  free(variables);
+  return 0;
+}
@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include "expr.h"
+#include "sparse.h"
+#include "op_derivs.h"
+#include "tape.h"
+
+/*
+ * Microbenchmarks for each operator's kernels, so changes to a single kernel
+ * can be measured on their own:
+ * - eval: evaluate_operator, on an OperatorNode's arguments
+ * - diff: diff_operator, the partial derivatives with respect to each argument
+ * - tape_value, tape_tangent, tape_reverse: the tape's kernels (see tape.h).
+ *   Operators without fused code on the tape, e.g. atan, go through the
+ *   generic path, which calls their kernels in OPERATOR_DATA.
+ *
+ * Each operator is applied to many argument lists, with arguments chosen at
+ * random from a pool of variables with values in [0.5, 1.5), so every
+ * operator is in its domain. n-ary operators are timed at several arities.
+ *
+ * Usage: ./bench-ops [ninstance] [repeats] [case]
+ *
+ * where case (e.g. "product" or "pow_const_int") restricts the run to one
+ * operator.
+ */
+
+#define NPOOL 4096
+
+double seconds(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+unsigned int lcg_state = 12345;
+unsigned int lcg(){
+  lcg_state = lcg_state * 1103515245u + 12345u;
+  return lcg_state >> 8;
+}
+
+struct OpCase {
+  char * name;
+  enum OperatorType op;
+  int nargs;
+  // Index of an argument that must be a constant, or -1
+  int const_arg;
+  double const_value;
+};
+
+const struct OpCase CASES[] = {
+  {"sum",            SUM,            2,  -1, 0.0},
+  {"sum",            SUM,            4,  -1, 0.0},
+  {"sum",            SUM,            16, -1, 0.0},
+  {"product",        PRODUCT,        2,  -1, 0.0},
+  {"product",        PRODUCT,        4,  -1, 0.0},
+  {"product",        PRODUCT,        16, -1, 0.0},
+  {"subtraction",    SUBTRACTION,    2,  -1, 0.0},
+  {"division",       DIVISION,       2,  -1, 0.0},
+  {"power",          POWER,          2,  -1, 0.0},
+  {"neg",            NEG,            1,  -1, 0.0},
+  {"sqrt",           SQRT,           1,  -1, 0.0},
+  {"exp",            EXP,            1,  -1, 0.0},
+  {"log",            LOG,            1,  -1, 0.0},
+  {"sin",            SIN,            1,  -1, 0.0},
+  {"cos",            COS,            1,  -1, 0.0},
+  {"tan",            TAN,            1,  -1, 0.0},
+  {"square",         SQUARE,         1,  -1, 0.0},
+  {"pow_const_int",  POW_CONST_INT,  2,  1,  3.0},
+  {"pow_const_real", POW_CONST_REAL, 2,  1,  2.5},
+  {"exp_const_base", EXP_CONST_BASE, 2,  0,  2.0},
+  {"abs",            ABS,            1,  -1, 0.0},
+  {"tanh",           TANH,           1,  -1, 0.0},
+  {"atan",           ATAN,           1,  -1, 0.0},
+  {"min",            MIN,            2,  -1, 0.0},
+  {"min",            MIN,            4,  -1, 0.0},
+  {"if_then_else",   IF_THEN_ELSE,   3,  -1, 0.0},
+};
+const int NCASE = sizeof(CASES) / sizeof(CASES[0]);
+
+// Accumulate results here, so the compiler can't drop the calls
+double sink = 0.0;
+
+void report(const struct OpCase * c, char * kernel, double elapsed, long ncall){
+  double ns = 1e9 * elapsed / ncall;
+  printf("%-16s %3d  %-13s %9.2f ns/op %9.1f Mop/s\n", c->name, c->nargs, kernel, ns, 1e3 / ns);
+}
+
+void bench_case(const struct OpCase * c, struct Variable * pool, int n, int repeats){
+  int nargs = c->nargs;
+  long ncall = (long)n * repeats;
+  // Arguments for the tree kernels, and the same arguments as tape indices.
+  // On the tape, the constant is node NPOOL.
+  struct Node * args = malloc((long)n * nargs * sizeof(struct Node));
+  uint32_t * a = malloc((long)n * nargs * sizeof(uint32_t));
+  double * v = malloc((NPOOL + 1) * sizeof(double));
+  double * dv = malloc((NPOOL + 1) * sizeof(double));
+  double * adj = calloc(NPOOL + 1, sizeof(double));
+  double * op_values = malloc(n * sizeof(double));
+  double * deriv = malloc(nargs * sizeof(double));
+  for (int j=0; j<NPOOL; j++){
+    v[j] = pool[j].value;
+    dv[j] = 1.0 / (j + 1);
+  }
+  v[NPOOL] = c->const_value;
+  dv[NPOOL] = 0.0;
+  for (long k=0; k<(long)n*nargs; k++){
+    if (k % nargs == c->const_arg){
+      args[k].type = CONST_NODE;
+      args[k].data.value = c->const_value;
+      a[k] = NPOOL;
+    }else{
+      int j = lcg() % NPOOL;
+      args[k].type = VAR_NODE;
+      args[k].data.var = &pool[j];
+      a[k] = j;
+    }
+  }
+
+  double start = seconds();
+  for (int r=0; r<repeats; r++){
+    for (int i=0; i<n; i++){sink += evaluate_operator(c->op, nargs, args + (long)i*nargs);}
+  }
+  report(c, "eval", seconds() - start, ncall);
+
+  start = seconds();
+  for (int r=0; r<repeats; r++){
+    for (int i=0; i<n; i++){
+      diff_operator(c->op, args + (long)i*nargs, nargs, deriv);
+      sink += deriv[nargs-1];
+    }
+  }
+  report(c, "diff", seconds() - start, ncall);
+
+  start = seconds();
+  for (int r=0; r<repeats; r++){
+    for (int i=0; i<n; i++){op_values[i] = _tape_op_value(c->op, nargs, a + (long)i*nargs, v);}
+  }
+  report(c, "tape_value", seconds() - start, ncall);
+
+  start = seconds();
+  for (int r=0; r<repeats; r++){
+    for (int i=0; i<n; i++){
+      sink += _tape_op_tangent(c->op, nargs, a + (long)i*nargs, v, dv, op_values[i]);
+    }
+  }
+  report(c, "tape_tangent", seconds() - start, ncall);
+
+  start = seconds();
+  for (int r=0; r<repeats; r++){
+    for (int i=0; i<n; i++){
+      _tape_op_reverse(c->op, nargs, a + (long)i*nargs, v, op_values[i], 1.0, adj);
+    }
+  }
+  report(c, "tape_reverse", seconds() - start, ncall);
+  sink += adj[0];
+
+  free(args);
+  free(a);
+  free(v);
+  free(dv);
+  free(adj);
+  free(op_values);
+  free(deriv);
+}
+
+int main(int narg, char ** argv){
+  int n = narg > 1 ? atoi(argv[1]) : 100000;
+  int repeats = narg > 2 ? atoi(argv[2]) : 20;
+  char * only = narg > 3 ? argv[3] : NULL;
+  printf("%d argument lists, %d repeats\n", n, repeats);
+  printf("%-16s %3s  %-13s %15s %15s\n", "operator", "n", "kernel", "time", "throughput");
+
+  struct Variable * pool = malloc(NPOOL * sizeof(struct Variable));
+  for (int j=0; j<NPOOL; j++){
+    pool[j].index = j;
+    pool[j].value = 0.5 + (lcg() % 1000) / 1000.0;
+  }
+  int nrun = 0;
+  for (int c=0; c<NCASE; c++){
+    if (only != NULL && strcmp(only, CASES[c].name) != 0){continue;}
+    bench_case(&CASES[c], pool, n, repeats);
+    nrun++;
+  }
+  if (nrun == 0){
+    printf("ERROR: Unknown operator %s\n", only);
+    return -1;
+  }
+  // Print the checksum so it is used
+  printf("checksum: %g\n", sink);
+  free(pool);
+  return 0;
+}
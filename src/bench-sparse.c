@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include "expr.h"
+#include "sparse.h"
+
+/*
+ * Benchmarks for the sparse matrix conversions and products, on a random
+ * square matrix with a fixed number of entries per row (like a Jacobian).
+ *
+ * Usage: ./bench-sparse [nrow] [nnz per row] [repeats]
+ */
+
+double seconds(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+// Deterministic pseudo-random numbers, so runs are comparable
+unsigned int lcg_state = 12345;
+unsigned int lcg(){
+  lcg_state = lcg_state * 1103515245u + 12345u;
+  return lcg_state >> 8;
+}
+
+void report(char * name, double elapsed, int repeats, long bytes){
+  double per_call = elapsed / repeats;
+  printf("%-24s %10.3f ms %8.2f GB/s\n", name, 1e3 * per_call, bytes / per_call / 1e9);
+}
+
+int main(int narg, char ** argv){
+  int nrow = narg > 1 ? atoi(argv[1]) : 1000000;
+  int per_row = narg > 2 ? atoi(argv[2]) : 8;
+  int repeats = narg > 3 ? atoi(argv[3]) : 20;
+  int nnz = nrow * per_row;
+  printf("%d x %d matrix, %d nonzeros, %d repeats\n", nrow, nrow, nnz, repeats);
+
+  struct COOMatrix coo = {
+    .nnz = nnz,
+    .nrow = nrow,
+    .ncol = nrow,
+    .rows = mem_alloc(MEM_SPARSE, nnz * sizeof(int)),
+    .cols = mem_alloc(MEM_SPARSE, nnz * sizeof(int)),
+    .values = mem_alloc(MEM_SPARSE, nnz * sizeof(double)),
+  };
+  // Entries in random order, as a Jacobian might be assembled
+  for (int k=0; k<nnz; k++){
+    coo.rows[k] = lcg() % nrow;
+    coo.cols[k] = lcg() % nrow;
+    coo.values[k] = (lcg() % 1000) / 1000.0;
+  }
+  double * x = malloc(nrow * sizeof(double));
+  double * y = malloc(nrow * sizeof(double));
+  for (int i=0; i<nrow; i++){x[i] = 1.0 / (i + 1);}
+  // Bytes moved by a product: values and indices, plus x and y
+  long spmv_bytes = (long)nnz * (sizeof(double) + sizeof(int)) + 2L * nrow * sizeof(double);
+  long permute_bytes = (long)nnz * (2 * sizeof(double) + sizeof(int));
+
+  int * coo_perm = malloc(nnz * sizeof(int));
+  int * csc_perm = malloc(nnz * sizeof(int));
+  double start = seconds();
+  struct CSRMatrix csr = coo_to_csr(coo, coo_perm);
+  report("coo_to_csr", seconds() - start, 1, permute_bytes);
+  start = seconds();
+  struct CSCMatrix csc = csr_to_csc(csr, csc_perm);
+  report("csr_to_csc", seconds() - start, 1, permute_bytes);
+
+  start = seconds();
+  for (int r=0; r<repeats; r++){permute_values(nnz, coo_perm, coo.values, csr.values);}
+  report("permute_values (COO)", seconds() - start, repeats, permute_bytes);
+  start = seconds();
+  for (int r=0; r<repeats; r++){permute_values(nnz, csc_perm, csr.values, csc.values);}
+  report("permute_values (CSC)", seconds() - start, repeats, permute_bytes);
+
+  start = seconds();
+  for (int r=0; r<repeats; r++){csr_matvec(csr, x, y);}
+  report("csr_matvec", seconds() - start, repeats, spmv_bytes);
+  start = seconds();
+  for (int r=0; r<repeats; r++){csr_matvec_transpose(csr, x, y);}
+  report("csr_matvec_transpose", seconds() - start, repeats, spmv_bytes);
+  start = seconds();
+  for (int r=0; r<repeats; r++){csc_matvec_transpose(csc, x, y);}
+  report("csc_matvec_transpose", seconds() - start, repeats, spmv_bytes);
+
+  free(x);
+  free(y);
+  free(coo_perm);
+  free(csc_perm);
+  free_coomatrix(coo);
+  free_csrmatrix(csr);
+  free_cscmatrix(csc);
+  return 0;
+}
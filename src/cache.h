@@ -0,0 +1,523 @@
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * On-disk cache of compiled models
+ *
+ * Parsing a large .nl file and compiling it is slow, and we often load the
+ * same model many times. Here we store the compiled model (see
+ * compile_model in evaluator.h), i.e. the tape, the Jacobian and Hessian
+ * structures and the coloring of the Hessian, along with the initial
+ * variable values and parameter values, in a binary file keyed by a hash of
+ * the .nl file contents.
+ *
+ * The cache file is relocatable: it contains no pointers, only indices and
+ * byte offsets from the start of the file. It is read by mmap-ing the file,
+ * and the arrays of the loaded CompiledModel point straight into the
+ * mapping, so loading costs one pass to validate the indices, and nothing
+ * is copied except the variable and parameter values. Shared
+ * subexpressions (see cse.h) are stored once, as they are on the tape. It
+ * is written in the native byte order, so it should not be shared between
+ * machines with different endianness.
+ *
+ * File layout:
+ *
+ *     struct CacheHeader
+ *     double[nvar]                 initial variable values
+ *     double[nparam]               parameter values
+ *     struct TapeNode[nnode]       tape nodes
+ *     uint32_t[narg]               tape arguments
+ *     int32_t[ncon+1]              tape expr_start
+ *     uint32_t[ncon]               tape roots
+ *     int32_t[ncon+1]              tape ext_indptr
+ *     uint32_t[next]               tape ext_nodes
+ *     int32_t[ncon+1]              tape jac_indptr (also the Jacobian indptr)
+ *     uint32_t[jac_nnz]            tape jac_vars (also the Jacobian indices)
+ *     int32_t[nvar+1]              Hessian indptr
+ *     int32_t[hess_nnz]            Hessian indices
+ *     int32_t[nvar]                colors
+ *     int32_t[ncolor+1]            coloring entry_indptr
+ *     int32_t[hess_nnz]            coloring entries
+ *     int32_t[hess_nnz]            coloring source_rows
+ *
+ * Each section starts at the offset recorded in the header, which is a
+ * multiple of 8 bytes.
+ *
+ * Models with external functions are not cached, as the functions are
+ * loaded from the libraries named in the .nl file.
+ */
+
+#define CACHE_MAGIC "NLCACHE\0"
+#define CACHE_VERSION 3
+
+enum CacheSection {
+  CACHE_VAR_VALUES,
+  CACHE_PARAM_VALUES,
+  CACHE_TAPE_NODES,
+  CACHE_TAPE_ARGS,
+  CACHE_EXPR_START,
+  CACHE_ROOTS,
+  CACHE_EXT_INDPTR,
+  CACHE_EXT_NODES,
+  CACHE_JAC_INDPTR,
+  CACHE_JAC_VARS,
+  CACHE_HESS_INDPTR,
+  CACHE_HESS_INDICES,
+  CACHE_COLORS,
+  CACHE_COLOR_INDPTR,
+  CACHE_COLOR_ENTRIES,
+  CACHE_COLOR_ROWS,
+  CACHE_NSECTION,
+};
+
+struct CacheHeader {
+  char magic[8];
+  uint64_t nl_hash;
+  int32_t version;
+  int32_t nvar;
+  int32_t nparam;
+  int32_t ncon;
+  int32_t nnode;
+  int32_t narg;
+  int32_t next;
+  int32_t jac_nnz;
+  int32_t hess_nnz;
+  int32_t ncolor;
+  // Byte offsets of each section from the start of the file
+  int64_t offsets[CACHE_NSECTION];
+};
+
+/*
+ * A model loaded from a cache file. Everything in model points into the
+ * mapped file, which is read-only, so the model can be evaluated (with
+ * new_eval_context) but not modified. The values of model.jacobian and
+ * model.hessian are NULL, as only their structures are stored.
+ */
+struct CachedModel {
+  int nvar;
+  int ncon;
+  int nparam;
+  struct Variable * variables;
+  struct Parameter * parameters;
+  struct CompiledModel model;
+  char * data;
+  size_t size;
+};
+
+/*
+ * Compute a 64-bit FNV-1a hash of the remaining contents of a file.
+ */
+uint64_t hash_nl_file(FILE * fp);
+
+/*
+ * Write the name of the cache file for a hash into buffer, e.g.
+ * "<cache_dir>/0123456789abcdef.nlc". Returns the length of the name.
+ */
+int model_cache_path(char * buffer, int bsize, char * cache_dir, uint64_t hash);
+
+/*
+ * Write a cache file for a compiled model. The file is written under a
+ * temporary name and renamed, so concurrent jobs never see a partial file.
+ * Returns 0 on success, and -1 if the file could not be written or the
+ * model calls external functions.
+ */
+int write_model_cache(
+  char * fname,
+  uint64_t hash,
+  struct Variable * variables,
+  int nvar,
+  struct Parameter * parameters,
+  int nparam,
+  struct CompiledModel * model
+);
+
+/*
+ * Load a model from a cache file. Returns 0 on success and -1 if the file
+ * does not exist or is not a valid cache for the .nl file with this hash,
+ * in which case the caller should parse the .nl file (and probably write
+ * the cache). Every index in the file is checked, so a stale, truncated or
+ * corrupted file is rejected rather than read out of bounds. On success,
+ * the model should be freed with free_cached_model.
+ */
+int read_model_cache(char * fname, uint64_t hash, struct CachedModel * cached);
+void free_cached_model(struct CachedModel cached);
+
+int64_t _cache_align(int64_t offset);
+void * _cache_section(char * data, enum CacheSection s);
+void _cache_section_sizes(struct CacheHeader * header, int64_t * sizes);
+int _cache_check_indptr(int32_t * indptr, int n, int nnz);
+int _cache_check_indices(uint32_t * indices, int n, int bound);
+int _cache_check_tape(struct CacheHeader * header, char * data);
+int _cache_check_hessian(struct CacheHeader * header, char * data);
+
+uint64_t hash_nl_file(FILE * fp){
+  // FNV-1a parameters for 64-bit hashes
+  uint64_t hash = 14695981039346656037ULL;
+  const uint64_t prime = 1099511628211ULL;
+  unsigned char buffer[1 << 16];
+  size_t nread;
+  while ((nread = fread(buffer, sizeof(char), sizeof(buffer), fp)) > 0){
+    for (size_t i=0; i<nread; i++){
+      hash ^= buffer[i];
+      hash *= prime;
+    }
+  }
+  return hash;
+}
+
+int model_cache_path(char * buffer, int bsize, char * cache_dir, uint64_t hash){
+  return snprintf(buffer, bsize, "%s/%016llx.nlc", cache_dir, (unsigned long long)hash);
+}
+
+int64_t _cache_align(int64_t offset){
+  return (offset + 7) / 8 * 8;
+}
+
+void * _cache_section(char * data, enum CacheSection s){
+  return data + ((struct CacheHeader *)data)->offsets[s];
+}
+
+// Size in bytes of each section, from the counts in the header
+void _cache_section_sizes(struct CacheHeader * header, int64_t * sizes){
+  int64_t ncon = header->ncon;
+  int64_t nvar = header->nvar;
+  sizes[CACHE_VAR_VALUES] = nvar * sizeof(double);
+  sizes[CACHE_PARAM_VALUES] = header->nparam * (int64_t)sizeof(double);
+  sizes[CACHE_TAPE_NODES] = header->nnode * (int64_t)sizeof(struct TapeNode);
+  sizes[CACHE_TAPE_ARGS] = header->narg * (int64_t)sizeof(uint32_t);
+  sizes[CACHE_EXPR_START] = (ncon + 1) * sizeof(int32_t);
+  sizes[CACHE_ROOTS] = ncon * sizeof(uint32_t);
+  sizes[CACHE_EXT_INDPTR] = (ncon + 1) * sizeof(int32_t);
+  sizes[CACHE_EXT_NODES] = header->next * (int64_t)sizeof(uint32_t);
+  sizes[CACHE_JAC_INDPTR] = (ncon + 1) * sizeof(int32_t);
+  sizes[CACHE_JAC_VARS] = header->jac_nnz * (int64_t)sizeof(uint32_t);
+  sizes[CACHE_HESS_INDPTR] = (nvar + 1) * sizeof(int32_t);
+  sizes[CACHE_HESS_INDICES] = header->hess_nnz * (int64_t)sizeof(int32_t);
+  sizes[CACHE_COLORS] = nvar * sizeof(int32_t);
+  sizes[CACHE_COLOR_INDPTR] = (header->ncolor + 1) * (int64_t)sizeof(int32_t);
+  sizes[CACHE_COLOR_ENTRIES] = header->hess_nnz * (int64_t)sizeof(int32_t);
+  sizes[CACHE_COLOR_ROWS] = header->hess_nnz * (int64_t)sizeof(int32_t);
+}
+
+int write_model_cache(
+  char * fname,
+  uint64_t hash,
+  struct Variable * variables,
+  int nvar,
+  struct Parameter * parameters,
+  int nparam,
+  struct CompiledModel * model
+){
+  struct Tape * tape = &model->tape;
+  if (tape->ncall > 0){
+    return -1;
+  }
+  double * values = malloc((nvar + 1) * sizeof(double));
+  for (int i=0; i<nvar; i++){values[i] = variables[i].value;}
+  double * param_values = malloc((nparam + 1) * sizeof(double));
+  for (int i=0; i<nparam; i++){param_values[i] = parameters[i].value;}
+
+  struct CacheHeader header = {
+    .nl_hash = hash,
+    .version = CACHE_VERSION,
+    .nvar = nvar,
+    .nparam = nparam,
+    .ncon = tape->nexpr,
+    .nnode = tape->nnode,
+    .narg = tape->narg,
+    .next = tape->next,
+    .jac_nnz = tape->jac_nnz,
+    .hess_nnz = model->hessian.nnz,
+    .ncolor = model->coloring.ncolor,
+  };
+  memcpy(header.magic, CACHE_MAGIC, 8);
+  void * sections[CACHE_NSECTION] = {
+    [CACHE_VAR_VALUES] = values,
+    [CACHE_PARAM_VALUES] = param_values,
+    [CACHE_TAPE_NODES] = tape->nodes,
+    [CACHE_TAPE_ARGS] = tape->args,
+    [CACHE_EXPR_START] = tape->expr_start,
+    [CACHE_ROOTS] = tape->roots,
+    [CACHE_EXT_INDPTR] = tape->ext_indptr,
+    [CACHE_EXT_NODES] = tape->ext_nodes,
+    [CACHE_JAC_INDPTR] = tape->jac_indptr,
+    [CACHE_JAC_VARS] = tape->jac_vars,
+    [CACHE_HESS_INDPTR] = model->hessian.indptr,
+    [CACHE_HESS_INDICES] = model->hessian.indices,
+    [CACHE_COLORS] = model->coloring.colors,
+    [CACHE_COLOR_INDPTR] = model->coloring.entry_indptr,
+    [CACHE_COLOR_ENTRIES] = model->coloring.entries,
+    [CACHE_COLOR_ROWS] = model->coloring.source_rows,
+  };
+  int64_t sizes[CACHE_NSECTION];
+  _cache_section_sizes(&header, sizes);
+  int64_t offset = _cache_align(sizeof(struct CacheHeader));
+  for (int s=0; s<CACHE_NSECTION; s++){
+    header.offsets[s] = offset;
+    offset = _cache_align(offset + sizes[s]);
+  }
+
+  int namelen = strlen(fname);
+  char * tmpname = malloc(namelen + 32);
+  snprintf(tmpname, namelen + 32, "%s.tmp%d", fname, (int)getpid());
+  FILE * fp = fopen(tmpname, "wb");
+  bool ok = fp != NULL;
+  if (ok){
+    ok = fwrite(&header, sizeof(struct CacheHeader), 1, fp) == 1;
+    char zeros[8] = {0};
+    offset = sizeof(struct CacheHeader);
+    for (int s=0; s<CACHE_NSECTION && ok; s++){
+      // Pad to the start of this section
+      int64_t npad = header.offsets[s] - offset;
+      ok = fwrite(zeros, sizeof(char), npad, fp) == (size_t)npad;
+      ok = ok && fwrite(sections[s], sizeof(char), sizes[s], fp) == (size_t)sizes[s];
+      offset = header.offsets[s] + sizes[s];
+    }
+    // Buffered data is only written (and errors like a full disk only
+    // reported) when the file is closed
+    ok = (fclose(fp) == 0) && ok;
+    ok = ok && rename(tmpname, fname) == 0;
+  }
+  if (!ok){
+    printf("ERROR: Could not write cache file %s\n", fname);
+    unlink(tmpname);
+  }
+
+  free(tmpname);
+  free(values);
+  free(param_values);
+  return ok ? 0 : -1;
+}
+
+// 0 if indptr is nondecreasing from 0 to nnz, -1 otherwise
+int _cache_check_indptr(int32_t * indptr, int n, int nnz){
+  if (indptr[0] != 0 || indptr[n] != nnz){
+    return -1;
+  }
+  for (int i=0; i<n; i++){
+    if (indptr[i] > indptr[i+1]){
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// 0 if every index is less than bound, -1 otherwise
+int _cache_check_indices(uint32_t * indices, int n, int bound){
+  for (int k=0; k<n; k++){
+    if (indices[k] >= (uint32_t)bound){
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Check that evaluating and differentiating the tape only touches nodes on
+ * the tape: every argument comes before its node, and every expression's
+ * segment, root, external nodes and variables are in range.
+ */
+int _cache_check_tape(struct CacheHeader * header, char * data){
+  int nvar = header->nvar;
+  int ncon = header->ncon;
+  int nnode = header->nnode;
+  struct TapeNode * nodes = (struct TapeNode *)(data + header->offsets[CACHE_TAPE_NODES]);
+  uint32_t * args = (uint32_t *)(data + header->offsets[CACHE_TAPE_ARGS]);
+  for (int i=0; i<nnode; i++){
+    struct TapeNode node = nodes[i];
+    if (i < nvar){
+      if (node.type != VAR_NODE || node.data.index != (uint32_t)i){return -1;}
+      continue;
+    }
+    switch(node.type){
+      case CONST_NODE:
+        break;
+      case PARAM_NODE:
+        if (node.data.index >= (uint32_t)header->nparam){return -1;}
+        break;
+      case OP_NODE:
+      {
+        if (node.op >= N_OPERATORS || node.op == EXTERNAL){return -1;}
+        int nargs = OPERATOR_DATA[node.op].nargs;
+        if ((nargs >= 0 && node.nargs != (uint32_t)nargs) || node.nargs < 1){return -1;}
+        if ((uint64_t)node.data.index + node.nargs > (uint64_t)header->narg){return -1;}
+        if (_cache_check_indices(args + node.data.index, node.nargs, i) != 0){return -1;}
+        break;
+      }
+      default:
+        return -1;
+    }
+  }
+
+  int32_t * expr_start = (int32_t *)(data + header->offsets[CACHE_EXPR_START]);
+  uint32_t * roots = (uint32_t *)(data + header->offsets[CACHE_ROOTS]);
+  int32_t * ext_indptr = (int32_t *)(data + header->offsets[CACHE_EXT_INDPTR]);
+  uint32_t * ext_nodes = (uint32_t *)(data + header->offsets[CACHE_EXT_NODES]);
+  int32_t * jac_indptr = (int32_t *)(data + header->offsets[CACHE_JAC_INDPTR]);
+  uint32_t * jac_vars = (uint32_t *)(data + header->offsets[CACHE_JAC_VARS]);
+  if (
+    expr_start[0] != nvar
+    || expr_start[ncon] != nnode
+    || _cache_check_indptr(ext_indptr, ncon, header->next) != 0
+    || _cache_check_indptr(jac_indptr, ncon, header->jac_nnz) != 0
+    || _cache_check_indices(jac_vars, header->jac_nnz, nvar) != 0
+  ){
+    return -1;
+  }
+  for (int i=0; i<ncon; i++){
+    if (expr_start[i] > expr_start[i+1] || roots[i] >= (uint32_t)expr_start[i+1]){
+      return -1;
+    }
+    int nbefore = ext_indptr[i+1] - ext_indptr[i];
+    if (_cache_check_indices(ext_nodes + ext_indptr[i], nbefore, expr_start[i]) != 0){
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Check the Hessian structure and its coloring
+int _cache_check_hessian(struct CacheHeader * header, char * data){
+  int nvar = header->nvar;
+  int hess_nnz = header->hess_nnz;
+  int32_t * indptr = (int32_t *)(data + header->offsets[CACHE_HESS_INDPTR]);
+  int32_t * indices = (int32_t *)(data + header->offsets[CACHE_HESS_INDICES]);
+  int32_t * colors = (int32_t *)(data + header->offsets[CACHE_COLORS]);
+  int32_t * entry_indptr = (int32_t *)(data + header->offsets[CACHE_COLOR_INDPTR]);
+  int32_t * entries = (int32_t *)(data + header->offsets[CACHE_COLOR_ENTRIES]);
+  int32_t * source_rows = (int32_t *)(data + header->offsets[CACHE_COLOR_ROWS]);
+  if (
+    _cache_check_indptr(indptr, nvar, hess_nnz) != 0
+    || _cache_check_indices((uint32_t *)indices, hess_nnz, nvar) != 0
+    || _cache_check_indices((uint32_t *)colors, nvar, header->ncolor) != 0
+    || _cache_check_indptr(entry_indptr, header->ncolor, hess_nnz) != 0
+    || _cache_check_indices((uint32_t *)entries, hess_nnz, hess_nnz) != 0
+    || _cache_check_indices((uint32_t *)source_rows, hess_nnz, nvar) != 0
+  ){
+    return -1;
+  }
+  return 0;
+}
+
+int read_model_cache(char * fname, uint64_t hash, struct CachedModel * cached){
+  int fd = open(fname, O_RDONLY);
+  if (fd < 0){
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct CacheHeader)){
+    close(fd);
+    return -1;
+  }
+  char * data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED){
+    return -1;
+  }
+
+  struct CacheHeader * header = (struct CacheHeader *)data;
+  bool valid = (
+    memcmp(header->magic, CACHE_MAGIC, 8) == 0
+    && header->version == CACHE_VERSION
+    && header->nl_hash == hash
+    && header->nvar >= 0 && header->nparam >= 0 && header->ncon >= 0
+    && header->nnode >= header->nvar && header->narg >= 0 && header->next >= 0
+    && header->jac_nnz >= 0 && header->hess_nnz >= 0 && header->ncolor >= 0
+  );
+  if (valid){
+    int64_t sizes[CACHE_NSECTION];
+    _cache_section_sizes(header, sizes);
+    for (int s=0; s<CACHE_NSECTION; s++){
+      int64_t offset = header->offsets[s];
+      if (offset < (int64_t)sizeof(struct CacheHeader) || offset % 8 != 0 || offset + sizes[s] > st.st_size){
+        valid = false;
+      }
+    }
+  }
+  valid = valid && _cache_check_tape(header, data) == 0 && _cache_check_hessian(header, data) == 0;
+  if (!valid){
+    munmap(data, st.st_size);
+    return -1;
+  }
+
+  int nvar = header->nvar;
+  int ncon = header->ncon;
+  int nparam = header->nparam;
+  double * values = (double *)(data + header->offsets[CACHE_VAR_VALUES]);
+  double * param_values = (double *)(data + header->offsets[CACHE_PARAM_VALUES]);
+  cached->nvar = nvar;
+  cached->ncon = ncon;
+  cached->nparam = nparam;
+  cached->data = data;
+  cached->size = st.st_size;
+  cached->variables = malloc((nvar + 1) * sizeof(struct Variable));
+  for (int i=0; i<nvar; i++){
+    cached->variables[i].index = i;
+    cached->variables[i].value = values[i];
+  }
+  cached->parameters = malloc((nparam + 1) * sizeof(struct Parameter));
+  for (int i=0; i<nparam; i++){
+    cached->parameters[i].index = i;
+    cached->parameters[i].value = param_values[i];
+  }
+
+  struct Tape tape = {
+    .nvar = nvar,
+    .nnode = header->nnode,
+    .nodes = _cache_section(data, CACHE_TAPE_NODES),
+    .narg = header->narg,
+    .args = _cache_section(data, CACHE_TAPE_ARGS),
+    .nexpr = ncon,
+    .expr_start = _cache_section(data, CACHE_EXPR_START),
+    .roots = _cache_section(data, CACHE_ROOTS),
+    .next = header->next,
+    .ext_indptr = _cache_section(data, CACHE_EXT_INDPTR),
+    .ext_nodes = _cache_section(data, CACHE_EXT_NODES),
+    .jac_nnz = header->jac_nnz,
+    .jac_indptr = _cache_section(data, CACHE_JAC_INDPTR),
+    .jac_vars = _cache_section(data, CACHE_JAC_VARS),
+    .ncall = 0,
+  };
+  // The Jacobian structure is the tape's, as in tape_jacobian_structure
+  struct CSRMatrix jacobian = {
+    .nnz = header->jac_nnz,
+    .nrow = ncon,
+    .ncol = nvar,
+    .indptr = tape.jac_indptr,
+    .indices = (int *)tape.jac_vars,
+  };
+  struct CSRMatrix hessian = {
+    .nnz = header->hess_nnz,
+    .nrow = nvar,
+    .ncol = nvar,
+    .indptr = _cache_section(data, CACHE_HESS_INDPTR),
+    .indices = _cache_section(data, CACHE_HESS_INDICES),
+  };
+  struct HessianColoring coloring = {
+    .nvar = nvar,
+    .ncolor = header->ncolor,
+    .colors = _cache_section(data, CACHE_COLORS),
+    .entry_indptr = _cache_section(data, CACHE_COLOR_INDPTR),
+    .entries = _cache_section(data, CACHE_COLOR_ENTRIES),
+    .source_rows = _cache_section(data, CACHE_COLOR_ROWS),
+  };
+  struct CompiledModel model = {
+    .nvar = nvar,
+    .ncon = ncon,
+    .tape = tape,
+    .jacobian = jacobian,
+    .hessian = hessian,
+    .coloring = coloring,
+  };
+  cached->model = model;
+  return 0;
+}
+
+void free_cached_model(struct CachedModel cached){
+  free(cached.variables);
+  free(cached.parameters);
+  munmap(cached.data, cached.size);
+}
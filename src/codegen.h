@@ -0,0 +1,935 @@
+#include <dlfcn.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/*
+ * Native code generation
+ *
+ * Even a compact tape (see tape.h) is interpreted: every node costs a
+ * switch on the operator and loads of its argument indices. For a model
+ * we evaluate many times, we can instead generate straight-line C code for
+ * the tape, compile it with the system's C compiler into a shared library,
+ * and load the library with dlopen.
+ *
+ * The generated library exports
+ *
+ *     int workspace_size(void);
+ *     int eval_g(const double * x, const double * p, double * g, double * w);
+ *     int eval_jac(const double * x, const double * p, double * jac, double * w);
+ *     int eval_hess(const double * x, const double * p, const double * lambda, double * hess, double * w);
+ *
+ * where w is a workspace of workspace_size() doubles. The Jacobian is in
+ * the order of tape_jacobian_structure, and the Hessian in the order of the
+ * structure from hessian_sparsity, as for tape_evaluator. Node values,
+ * adjoints and directional derivatives are stored in the workspace at fixed
+ * offsets, i.e. node k of the tape is v[k], with a constant index, so the
+ * compiler sees every operation explicitly. The Jacobian is computed one
+ * expression at a time as in tape_jacobian. The Hessian is computed as in
+ * colored_hessian, with one forward-over-reverse sweep over the tape per
+ * color of a star coloring (see hessian.h), and the generator skips
+ * directional derivatives that are known to be zero.
+ *
+ * The size of the generated code is proportional to the size of the tape
+ * for eval_g and eval_jac, and to the size of the tape times the number of
+ * colors for eval_hess.
+ *
+ * compiled_evaluator wraps this in the Evaluator interface (see evaluator.h).
+ * The C compiler is $CC, or cc if CC is not set.
+ *
+ * Models with external functions are not compiled, as the functions are
+ * loaded from the libraries named in the .nl file. compiled_evaluator
+ * returns -1 for them, and the caller falls back to tape_evaluator.
+ */
+
+/*
+ * Write C source code evaluating the tape's expressions and their first and
+ * second derivatives to fp. The Hessian is computed with the coloring of
+ * its structure returned by star_coloring. Returns -1 if the tape has an
+ * operator we can't generate code for (the source is then incomplete),
+ * otherwise 0.
+ */
+int write_model_source(FILE * fp, struct Tape * tape, struct HessianColoring * coloring);
+
+/*
+ * Compile a C source file into a shared library with $CC (default cc),
+ * which is run without a shell, so it must name a single program. Returns 0
+ * on success and -1 if the compiler failed.
+ */
+int compile_model_source(char * source, char * library);
+
+/*
+ * Construct an evaluator for the expressions by generating, compiling, and
+ * loading native code. The source and library are written to prefix.c and
+ * prefix.so. Returns 0 on success, or -1 if the code could not be compiled
+ * or loaded, the expressions call external functions, or they use an
+ * operator we can't generate code for. The caller may then fall back to
+ * tape_evaluator.
+ */
+int compiled_evaluator(struct Evaluator * ev, struct Node * exprs, int ncon, int nvar, char * prefix);
+
+struct CompiledEvaluatorData {
+  void * handle;
+  double * work;
+  // Lengths of the outputs, to check them (see evaluator.h)
+  int ncon;
+  int jac_nnz;
+  int hess_nnz;
+  int (* eval_g)(const double *, const double *, double *, double *);
+  int (* eval_jac)(const double *, const double *, double *, double *);
+  int (* eval_hess)(const double *, const double *, const double *, double *, double *);
+};
+
+// Generator state for one expression
+struct ExprNodes {
+  // Nodes the expression depends on (other than variables) in increasing
+  // order: its external nodes, then its segment
+  int nnode;
+  uint32_t * nodes;
+  // Variables in the expression
+  int nvar;
+  uint32_t * vars;
+};
+
+struct ExprNodes _expr_nodes(struct Tape * tape, int iexpr);
+// Number of unsupported operators found since write_model_source started
+_Thread_local int _cg_errors = 0;
+
+void _cg_write_forward(FILE * fp, struct Tape * tape);
+void _cg_unary_derivs(struct Tape * tape, int k, char * x, char * y, char * f1, char * f2, int bsize);
+int _cg_unary_arg(struct TapeNode node);
+void _cg_expand(char * buffer, int bsize, const char * template, struct Tape * tape, int k);
+bool _cg_select_condition(char * buffer, int bsize, struct Tape * tape, int k, int i);
+void _cg_write_value(FILE * fp, struct Tape * tape, int k);
+void _cg_write_reverse(FILE * fp, struct Tape * tape, int k);
+void _cg_dref(char * buffer, int bsize, struct Tape * tape, uint32_t k, bool * active, bool * seed);
+bool _cg_write_tangent(FILE * fp, struct Tape * tape, int k, bool * active, bool * seed);
+void _cg_write_reverse2(FILE * fp, struct Tape * tape, int k, bool * active, bool * seed);
+bool * _cg_conditional_nodes(struct Tape * tape);
+int _compiled_eval_g(void * data, double * x, double * p, double * g);
+int _compiled_eval_jac(void * data, double * x, double * p, double * jac_values);
+int _compiled_eval_hess(void * data, double * x, double * p, double * lambda, double * hess_values);
+void _compiled_free_data(void * data);
+
+struct ExprNodes _expr_nodes(struct Tape * tape, int iexpr){
+  int start = tape->expr_start[iexpr];
+  int end = tape->expr_start[iexpr+1];
+  int next = tape->ext_indptr[iexpr+1] - tape->ext_indptr[iexpr];
+  struct ExprNodes en = {
+    .nnode = next + end - start,
+    .nodes = malloc((next + end - start + 1) * sizeof(uint32_t)),
+    .nvar = tape->jac_indptr[iexpr+1] - tape->jac_indptr[iexpr],
+    .vars = tape->jac_vars + tape->jac_indptr[iexpr],
+  };
+  for (int k=0; k<next; k++){
+    en.nodes[k] = tape->ext_nodes[tape->ext_indptr[iexpr] + k];
+  }
+  for (int i=start; i<end; i++){
+    en.nodes[next + i - start] = i;
+  }
+  return en;
+}
+
+void _cg_write_forward(FILE * fp, struct Tape * tape){
+  for (int k=0; k<tape->nnode; k++){
+    _cg_write_value(fp, tape, k);
+  }
+}
+
+// Room for a constant written by _cg_constant
+#define CG_CONSTANT_SIZE 32
+
+/*
+ * Write a constant as a C expression into buffer. %.17g round-trips finite
+ * values, but prints NaN and infinities as nan and inf, which aren't C.
+ */
+char * _cg_constant(char * buffer, double value){
+  if (isnan(value)){
+    snprintf(buffer, CG_CONSTANT_SIZE, "NAN");
+  }else if (isinf(value)){
+    snprintf(buffer, CG_CONSTANT_SIZE, value > 0.0 ? "INFINITY" : "(-INFINITY)");
+  }else{
+    snprintf(buffer, CG_CONSTANT_SIZE, "%.17g", value);
+  }
+  return buffer;
+}
+
+// Index of the non-constant argument of a specialized power
+int _cg_unary_arg(struct TapeNode node){
+  return node.op == EXP_CONST_BASE ? 1 : 0;
+}
+
+/*
+ * Write the first and second derivatives of the specialized power at node
+ * k with respect to its non-constant argument as C expressions, where x is
+ * that argument and y its value. The constant is written into the code.
+ */
+void _cg_unary_derivs(struct Tape * tape, int k, char * x, char * y, char * f1, char * f2, int bsize){
+  struct TapeNode node = tape->nodes[k];
+  uint32_t * a = tape->args + node.data.index;
+  char c0[CG_CONSTANT_SIZE], c1[CG_CONSTANT_SIZE];
+  switch(node.op){
+    case POW_CONST_INT:
+    {
+      int n = (int)tape->nodes[a[1]].data.value;
+      snprintf(f1, bsize, "(%d.0 * _pow_int(%s, %d))", n, x, n - 1);
+      snprintf(f2, bsize, "(%s * _pow_int(%s, %d))", _cg_constant(c0, (double)n * (n - 1)), x, n - 2);
+      return;
+    }
+    case POW_CONST_REAL:
+    {
+      double c = tape->nodes[a[1]].data.value;
+      snprintf(f1, bsize, "(%s * pow(%s, %s))", _cg_constant(c0, c), x, _cg_constant(c1, c - 1.0));
+      snprintf(f2, bsize, "(%s * pow(%s, %s))", _cg_constant(c0, c * (c - 1.0)), x, _cg_constant(c1, c - 2.0));
+      return;
+    }
+    case EXP_CONST_BASE:
+    {
+      double logc = log(tape->nodes[a[0]].data.value);
+      snprintf(f1, bsize, "(%s * %s)", y, _cg_constant(c0, logc));
+      snprintf(f2, bsize, "(%s * %s)", y, _cg_constant(c0, logc * logc));
+      return;
+    }
+  }
+  printf("ERROR: Unsupported operator %d in code generation\n", node.op);
+  _cg_errors += 1;
+  snprintf(f1, bsize, "NAN");
+  snprintf(f2, bsize, "NAN");
+}
+
+/*
+ * Expand a C template from OPERATOR_DATA (see operators.h) for node k,
+ * replacing $0, $1, ... with its arguments and $y with its value.
+ */
+void _cg_expand(char * buffer, int bsize, const char * template, struct Tape * tape, int k){
+  uint32_t * a = tape->args + tape->nodes[k].data.index;
+  int n = 0;
+  for (const char * c = template; *c != '\0' && n < bsize - 1; c++){
+    if (c[0] == '$' && c[1] == 'y'){
+      n += snprintf(buffer + n, bsize - n, "v[%d]", k);
+      c++;
+    }else if (c[0] == '$' && c[1] >= '0' && c[1] <= '9'){
+      n += snprintf(buffer + n, bsize - n, "v[%d]", a[c[1] - '0']);
+      c++;
+    }else{
+      buffer[n] = *c;
+      n += 1;
+    }
+  }
+  buffer[n < bsize ? n : bsize - 1] = '\0';
+}
+
+/*
+ * For operators whose value is one of their arguments (min, max and
+ * if-then-else), write the condition under which it is argument i. The
+ * conditions are tested in order, as in their kernels, so the first true
+ * one chooses. Returns false if the operator is never argument i.
+ */
+bool _cg_select_condition(char * buffer, int bsize, struct Tape * tape, int k, int i){
+  uint32_t * a = tape->args + tape->nodes[k].data.index;
+  if (tape->nodes[k].op == IF_THEN_ELSE){
+    if (i == 0){
+      return false;
+    }
+    snprintf(buffer, bsize, "v[%d] %s 0.0", a[0], i == 1 ? "!=" : "==");
+    return true;
+  }
+  snprintf(buffer, bsize, "v[%d] == v[%d]", a[i], k);
+  return true;
+}
+
+// Write the statement computing the value of node k
+void _cg_write_value(FILE * fp, struct Tape * tape, int k){
+  struct TapeNode node = tape->nodes[k];
+  char c0[CG_CONSTANT_SIZE];
+  switch(node.type){
+    case CONST_NODE:
+      fprintf(fp, "  v[%d] = %s;\n", k, _cg_constant(c0, node.data.value));
+      return;
+    case VAR_NODE:
+      fprintf(fp, "  v[%d] = x[%d];\n", k, node.data.index);
+      return;
+    case PARAM_NODE:
+      fprintf(fp, "  v[%d] = p[%d];\n", k, node.data.index);
+      return;
+  }
+  uint32_t * a = tape->args + node.data.index;
+  fprintf(fp, "  v[%d] = ", k);
+  switch(node.op){
+    case SUM:
+    case PRODUCT:
+      for (int i=0; i<node.nargs; i++){
+        if (i > 0){
+          fprintf(fp, node.op == SUM ? " + " : " * ");
+          // Keep lines short for long sums
+          if (i % 8 == 0){fprintf(fp, "\n    ");}
+        }
+        fprintf(fp, "v[%d]", a[i]);
+      }
+      break;
+    case SUBTRACTION:
+      fprintf(fp, "v[%d] - v[%d]", a[0], a[1]);
+      break;
+    case DIVISION:
+      fprintf(fp, "v[%d] / v[%d]", a[0], a[1]);
+      break;
+    case POWER:
+      fprintf(fp, "pow(v[%d], v[%d])", a[0], a[1]);
+      break;
+    case POW_CONST_INT:
+      fprintf(fp, "_pow_int(v[%d], %d)", a[0], (int)tape->nodes[a[1]].data.value);
+      break;
+    case POW_CONST_REAL:
+      fprintf(fp, "pow(v[%d], %s)", a[0], _cg_constant(c0, tape->nodes[a[1]].data.value));
+      break;
+    case EXP_CONST_BASE:
+      fprintf(fp, "pow(%s, v[%d])", _cg_constant(c0, tape->nodes[a[0]].data.value), a[1]);
+      break;
+    case MIN:
+    case MAX:
+      fprintf(fp, "v[%d];\n", a[0]);
+      for (int i=1; i<node.nargs; i++){
+        fprintf(fp, "  if (v[%d] %s v[%d]){v[%d] = v[%d];}\n", a[i], node.op == MIN ? "<" : ">", k, k, a[i]);
+      }
+      return;
+    case IF_THEN_ELSE:
+      fprintf(fp, "v[%d] != 0.0 ? v[%d] : v[%d]", a[0], a[1], a[2]);
+      break;
+    case AND:
+    case OR:
+      fprintf(fp, "(");
+      for (int i=0; i<node.nargs; i++){
+        fprintf(fp, "%sv[%d] != 0.0", i == 0 ? "" : (node.op == AND ? " && " : " || "), a[i]);
+      }
+      fprintf(fp, ") ? 1.0 : 0.0");
+      break;
+    default:
+    {
+      const char * template = OPERATOR_DATA[node.op].c_value;
+      if (template == NULL){
+        printf("ERROR: Unsupported operator %d in code generation\n", node.op);
+        _cg_errors += 1;
+        fprintf(fp, "NAN");
+        break;
+      }
+      char value[512];
+      _cg_expand(value, 512, template, tape, k);
+      fprintf(fp, "%s", value);
+    }
+  }
+  fprintf(fp, ";\n");
+}
+
+// Write the statements propagating the adjoint of node k to its arguments
+void _cg_write_reverse(FILE * fp, struct Tape * tape, int k){
+  struct TapeNode node = tape->nodes[k];
+  if (node.type != OP_NODE){
+    return;
+  }
+  uint32_t * a = tape->args + node.data.index;
+  switch(node.op){
+    case SUM:
+      for (int i=0; i<node.nargs; i++){
+        fprintf(fp, "    a[%d] += a[%d];\n", a[i], k);
+      }
+      return;
+    case PRODUCT:
+      for (int i=0; i<node.nargs; i++){
+        fprintf(fp, "    a[%d] += a[%d]", a[i], k);
+        for (int q=0; q<node.nargs; q++){
+          if (q != i){fprintf(fp, " * v[%d]", a[q]);}
+        }
+        fprintf(fp, ";\n");
+      }
+      return;
+    case SUBTRACTION:
+      fprintf(fp, "    a[%d] += a[%d];\n", a[0], k);
+      fprintf(fp, "    a[%d] -= a[%d];\n", a[1], k);
+      return;
+    case DIVISION:
+      fprintf(fp, "    a[%d] += a[%d] / v[%d];\n", a[0], k, a[1]);
+      fprintf(fp, "    a[%d] -= a[%d] * v[%d] / v[%d];\n", a[1], k, k, a[1]);
+      return;
+    case POWER:
+      fprintf(fp, "    a[%d] += a[%d] * v[%d] * pow(v[%d], v[%d] - 1.0);\n", a[0], k, a[1], a[0], a[1]);
+      fprintf(fp, "    if (v[%d] != 0.0){a[%d] += a[%d] * v[%d] * log(v[%d]);}\n", a[0], a[1], k, k, a[0]);
+      return;
+    case POW_CONST_INT:
+    case POW_CONST_REAL:
+    case EXP_CONST_BASE:
+    {
+      char x[32];
+      char y[32];
+      char f1[128];
+      char f2[128];
+      int iarg = _cg_unary_arg(node);
+      snprintf(x, 32, "v[%d]", a[iarg]);
+      snprintf(y, 32, "v[%d]", k);
+      _cg_unary_derivs(tape, k, x, y, f1, f2, 128);
+      fprintf(fp, "    a[%d] += a[%d] * %s;\n", a[iarg], k, f1);
+      return;
+    }
+    case MIN:
+    case MAX:
+    case IF_THEN_ELSE:
+    {
+      char cond[64];
+      bool first = true;
+      for (int i=0; i<node.nargs; i++){
+        if (_cg_select_condition(cond, 64, tape, k, i)){
+          fprintf(fp, first ? "    if (%s){" : "else if (%s){", cond);
+          fprintf(fp, "a[%d] += a[%d];}", a[i], k);
+          first = false;
+        }
+      }
+      fprintf(fp, "\n");
+      return;
+    }
+  }
+  // The other operators' partials are templates (see operators.h). Zero
+  // partials have no template.
+  for (int i=0; i<node.nargs && i<3; i++){
+    const char * template = OPERATOR_DATA[node.op].c_deriv[i];
+    if (template != NULL){
+      char fi[512];
+      _cg_expand(fi, 512, template, tape, k);
+      fprintf(fp, "    a[%d] += a[%d] * %s;\n", a[i], k, fi);
+    }
+  }
+}
+
+/*
+ * Write a reference to the directional derivative of node k, in the
+ * direction of the sum of the unit vectors of the variables j with seed[j].
+ * This is a constant for variables and nodes that don't depend on them.
+ */
+void _cg_dref(char * buffer, int bsize, struct Tape * tape, uint32_t k, bool * active, bool * seed){
+  if (k < tape->nvar && seed[k]){
+    snprintf(buffer, bsize, "1.0");
+  }else if (k < tape->nvar || !active[k]){
+    snprintf(buffer, bsize, "0.0");
+  }else{
+    snprintf(buffer, bsize, "d[%d]", k);
+  }
+}
+
+/*
+ * Write the statement computing the directional derivative of node k,
+ * if it depends on the seeded variables, and mark the node as active.
+ * Returns whether the node is active.
+ */
+bool _cg_write_tangent(FILE * fp, struct Tape * tape, int k, bool * active, bool * seed){
+  struct TapeNode node = tape->nodes[k];
+  active[k] = false;
+  if (node.type != OP_NODE){
+    return false;
+  }
+  uint32_t * a = tape->args + node.data.index;
+  for (int i=0; i<node.nargs; i++){
+    if (a[i] < tape->nvar ? seed[a[i]] : active[a[i]]){
+      active[k] = true;
+    }
+  }
+  if (!active[k]){
+    return false;
+  }
+  if (node.op == MIN || node.op == MAX || node.op == IF_THEN_ELSE){
+    char cond[64];
+    char di[32];
+    fprintf(fp, "      d[%d] = 0.0;\n      ", k);
+    bool first = true;
+    for (int i=0; i<node.nargs; i++){
+      if (_cg_select_condition(cond, 64, tape, k, i)){
+        _cg_dref(di, 32, tape, a[i], active, seed);
+        fprintf(fp, first ? "if (%s){" : "else if (%s){", cond);
+        fprintf(fp, "d[%d] = %s;}", k, di);
+        first = false;
+      }
+    }
+    fprintf(fp, "\n");
+    return true;
+  }
+  char d0[32];
+  char d1[32];
+  _cg_dref(d0, 32, tape, a[0], active, seed);
+  if (node.nargs > 1){
+    _cg_dref(d1, 32, tape, a[1], active, seed);
+  }
+  fprintf(fp, "      d[%d] = ", k);
+  switch(node.op){
+    case SUM:
+    {
+      bool first = true;
+      for (int i=0; i<node.nargs; i++){
+        char di[32];
+        _cg_dref(di, 32, tape, a[i], active, seed);
+        if (strcmp(di, "0.0") != 0){
+          fprintf(fp, first ? "%s" : " + %s", di);
+          first = false;
+        }
+      }
+      break;
+    }
+    case PRODUCT:
+    {
+      bool first = true;
+      for (int i=0; i<node.nargs; i++){
+        char di[32];
+        _cg_dref(di, 32, tape, a[i], active, seed);
+        if (strcmp(di, "0.0") == 0){
+          continue;
+        }
+        fprintf(fp, first ? "%s" : " + %s", di);
+        first = false;
+        for (int q=0; q<node.nargs; q++){
+          if (q != i){fprintf(fp, " * v[%d]", a[q]);}
+        }
+      }
+      break;
+    }
+    case SUBTRACTION:
+      fprintf(fp, "%s - %s", d0, d1);
+      break;
+    case DIVISION:
+      fprintf(fp, "(%s - v[%d] * %s) / v[%d]", d0, k, d1, a[1]);
+      break;
+    case POWER:
+      fprintf(fp, "v[%d] * pow(v[%d], v[%d] - 1.0) * %s", a[1], a[0], a[1], d0);
+      fprintf(fp, " + (v[%d] != 0.0 ? v[%d] * log(v[%d]) : 0.0) * %s", a[0], k, a[0], d1);
+      break;
+    case POW_CONST_INT:
+    case POW_CONST_REAL:
+    case EXP_CONST_BASE:
+    {
+      char x[32];
+      char y[32];
+      char f1[128];
+      char f2[128];
+      char di[32];
+      int iarg = _cg_unary_arg(node);
+      snprintf(x, 32, "v[%d]", a[iarg]);
+      snprintf(y, 32, "v[%d]", k);
+      _cg_unary_derivs(tape, k, x, y, f1, f2, 128);
+      _cg_dref(di, 32, tape, a[iarg], active, seed);
+      fprintf(fp, "%s * %s", f1, di);
+      break;
+    }
+    default:
+    {
+      bool first = true;
+      for (int i=0; i<node.nargs && i<3; i++){
+        const char * template = OPERATOR_DATA[node.op].c_deriv[i];
+        char di[32];
+        _cg_dref(di, 32, tape, a[i], active, seed);
+        if (template == NULL || strcmp(di, "0.0") == 0){
+          continue;
+        }
+        char fi[512];
+        _cg_expand(fi, 512, template, tape, k);
+        fprintf(fp, first ? "%s * %s" : " + %s * %s", fi, di);
+        first = false;
+      }
+      if (first){
+        fprintf(fp, "0.0");
+      }
+    }
+  }
+  fprintf(fp, ";\n");
+  return true;
+}
+
+/*
+ * Write the statements propagating the directional derivative of the adjoint
+ * of node k, e[k], to its arguments. The adjoints, a, are already known.
+ */
+void _cg_write_reverse2(FILE * fp, struct Tape * tape, int k, bool * active, bool * seed){
+  struct TapeNode node = tape->nodes[k];
+  if (node.type != OP_NODE){
+    return;
+  }
+  uint32_t * a = tape->args + node.data.index;
+  char d0[32];
+  char d1[32];
+  _cg_dref(d0, 32, tape, a[0], active, seed);
+  if (node.nargs > 1){
+    _cg_dref(d1, 32, tape, a[1], active, seed);
+  }
+  switch(node.op){
+    case SUM:
+      for (int i=0; i<node.nargs; i++){
+        fprintf(fp, "      e[%d] += e[%d];\n", a[i], k);
+      }
+      return;
+    case PRODUCT:
+      for (int i=0; i<node.nargs; i++){
+        fprintf(fp, "      e[%d] += e[%d]", a[i], k);
+        for (int q=0; q<node.nargs; q++){
+          if (q != i){fprintf(fp, " * v[%d]", a[q]);}
+        }
+        // Directional derivative of the product of the other arguments
+        for (int q=0; q<node.nargs; q++){
+          char dq[32];
+          _cg_dref(dq, 32, tape, a[q], active, seed);
+          if (q == i || strcmp(dq, "0.0") == 0){
+            continue;
+          }
+          fprintf(fp, " + a[%d] * %s", k, dq);
+          for (int r=0; r<node.nargs; r++){
+            if (r != i && r != q){fprintf(fp, " * v[%d]", a[r]);}
+          }
+        }
+        fprintf(fp, ";\n");
+      }
+      return;
+    case SUBTRACTION:
+      fprintf(fp, "      e[%d] += e[%d];\n", a[0], k);
+      fprintf(fp, "      e[%d] -= e[%d];\n", a[1], k);
+      return;
+    case DIVISION:
+      fprintf(fp, "      e[%d] += e[%d] / v[%d] - a[%d] * %s / (v[%d] * v[%d]);\n",
+        a[0], k, a[1], k, d1, a[1], a[1]);
+      fprintf(fp, "      e[%d] += -e[%d] * v[%d] / (v[%d] * v[%d]) + a[%d] * (-%s / (v[%d] * v[%d]) + 2.0 * v[%d] * %s / (v[%d] * v[%d] * v[%d]));\n",
+        a[1], k, a[0], a[1], a[1], k, d0, a[1], a[1], a[0], d1, a[1], a[1], a[1]);
+      return;
+    case POWER:
+      fprintf(fp, "      {\n");
+      fprintf(fp, "        double x = v[%d];\n", a[0]);
+      fprintf(fp, "        double y = v[%d];\n", a[1]);
+      fprintf(fp, "        double fx = y * pow(x, y - 1.0);\n");
+      fprintf(fp, "        double fxx = y * (y - 1.0) * pow(x, y - 2.0);\n");
+      fprintf(fp, "        if (x == 0.0){\n");
+      fprintf(fp, "          e[%d] += e[%d] * fx + a[%d] * fxx * %s;\n", a[0], k, k, d0);
+      fprintf(fp, "        }else{\n");
+      fprintf(fp, "          double lx = log(x);\n");
+      fprintf(fp, "          double fy = v[%d] * lx;\n", k);
+      fprintf(fp, "          double fxy = pow(x, y - 1.0) * (1.0 + y * lx);\n");
+      fprintf(fp, "          double fyy = fy * lx;\n");
+      fprintf(fp, "          e[%d] += e[%d] * fx + a[%d] * (fxx * %s + fxy * %s);\n", a[0], k, k, d0, d1);
+      fprintf(fp, "          e[%d] += e[%d] * fy + a[%d] * (fxy * %s + fyy * %s);\n", a[1], k, k, d0, d1);
+      fprintf(fp, "        }\n");
+      fprintf(fp, "      }\n");
+      return;
+    case POW_CONST_INT:
+    case POW_CONST_REAL:
+    case EXP_CONST_BASE:
+    {
+      char x[32];
+      char y[32];
+      char f1[128];
+      char f2[128];
+      char di[32];
+      int iarg = _cg_unary_arg(node);
+      snprintf(x, 32, "v[%d]", a[iarg]);
+      snprintf(y, 32, "v[%d]", k);
+      _cg_unary_derivs(tape, k, x, y, f1, f2, 128);
+      _cg_dref(di, 32, tape, a[iarg], active, seed);
+      fprintf(fp, "      e[%d] += e[%d] * %s", a[iarg], k, f1);
+      if (strcmp(di, "0.0") != 0){
+        fprintf(fp, " + a[%d] * %s * %s", k, f2, di);
+      }
+      fprintf(fp, ";\n");
+      return;
+    }
+    case MIN:
+    case MAX:
+    case IF_THEN_ELSE:
+    {
+      // Piecewise linear, so there are no second-order terms
+      char cond[64];
+      bool first = true;
+      for (int i=0; i<node.nargs; i++){
+        if (_cg_select_condition(cond, 64, tape, k, i)){
+          fprintf(fp, first ? "      if (%s){" : "else if (%s){", cond);
+          fprintf(fp, "e[%d] += e[%d];}", a[i], k);
+          first = false;
+        }
+      }
+      fprintf(fp, "\n");
+      return;
+    }
+  }
+  // Templates, as in _cg_write_reverse, with the second partials
+  // c_deriv2[hessian_index(i, j)]
+  const struct OperatorData * data = &OPERATOR_DATA[node.op];
+  for (int i=0; i<node.nargs && i<3; i++){
+    char second[2048];
+    int n = 0;
+    for (int j=0; j<node.nargs && j<3; j++){
+      const char * template = data->c_deriv2[hessian_index(i, j)];
+      char dj[32];
+      _cg_dref(dj, 32, tape, a[j], active, seed);
+      if (template == NULL || strcmp(dj, "0.0") == 0){
+        continue;
+      }
+      char fij[512];
+      _cg_expand(fij, 512, template, tape, k);
+      n += snprintf(second + n, sizeof(second) - n, n == 0 ? "%s * %s" : " + %s * %s", fij, dj);
+    }
+    if (data->c_deriv[i] == NULL && n == 0){
+      continue;
+    }
+    fprintf(fp, "      e[%d] += ", a[i]);
+    if (data->c_deriv[i] != NULL){
+      char fi[512];
+      _cg_expand(fi, 512, data->c_deriv[i], tape, k);
+      fprintf(fp, "e[%d] * %s%s", k, fi, n > 0 ? " + " : "");
+    }
+    if (n > 0){
+      fprintf(fp, "a[%d] * (%s)", k, second);
+    }
+    fprintf(fp, ";\n");
+  }
+}
+
+/*
+ * Mark the nodes below a min, max or if-then-else. A branch that isn't
+ * chosen may be undefined, e.g. in if x > 0 then log(x) else 0, so as on
+ * the tape, their adjoints are only propagated if they are nonzero, and
+ * 0 * NaN doesn't reach the variables.
+ */
+bool * _cg_conditional_nodes(struct Tape * tape){
+  bool * conditional = calloc(tape->nnode > 0 ? tape->nnode : 1, sizeof(bool));
+  for (int k=tape->nnode-1; k>=tape->nvar; k--){
+    struct TapeNode node = tape->nodes[k];
+    if (node.type != OP_NODE){
+      continue;
+    }
+    if (conditional[k] || node.op == MIN || node.op == MAX || node.op == IF_THEN_ELSE){
+      uint32_t * a = tape->args + node.data.index;
+      for (int i=0; i<node.nargs; i++){conditional[a[i]] = true;}
+    }
+  }
+  return conditional;
+}
+
+int write_model_source(FILE * fp, struct Tape * tape, struct HessianColoring * coloring){
+  int nnode = tape->nnode;
+  _cg_errors = 0;
+  fprintf(fp, "// Generated by codegen.h from a tape of %d nodes and %d expressions\n", nnode, tape->nexpr);
+  fprintf(fp, "#include <math.h>\n\n");
+  fprintf(fp, "static double _pow_int(double x, int n){\n");
+  fprintf(fp, "  if (n < 0){return 1.0 / _pow_int(x, -n);}\n");
+  fprintf(fp, "  double result = 1.0;\n");
+  fprintf(fp, "  while (n > 0){\n");
+  fprintf(fp, "    if (n & 1){result *= x;}\n");
+  fprintf(fp, "    x *= x;\n");
+  fprintf(fp, "    n >>= 1;\n");
+  fprintf(fp, "  }\n");
+  fprintf(fp, "  return result;\n");
+  fprintf(fp, "}\n\n");
+  fprintf(fp, "int workspace_size(void){\n  return %d;\n}\n\n", 4 * nnode);
+
+  fprintf(fp, "int eval_g(const double * x, const double * p, double * g, double * w){\n");
+  fprintf(fp, "  double * v = w;\n");
+  _cg_write_forward(fp, tape);
+  for (int i=0; i<tape->nexpr; i++){
+    fprintf(fp, "  g[%d] = v[%d];\n", i, tape->roots[i]);
+  }
+  fprintf(fp, "  return 0;\n}\n\n");
+
+  bool * conditional = _cg_conditional_nodes(tape);
+  fprintf(fp, "int eval_jac(const double * x, const double * p, double * jac, double * w){\n");
+  fprintf(fp, "  double * v = w;\n");
+  fprintf(fp, "  double * a = w + %d;\n", nnode);
+  _cg_write_forward(fp, tape);
+  for (int i=0; i<tape->nexpr; i++){
+    struct ExprNodes en = _expr_nodes(tape, i);
+    fprintf(fp, "  {\n");
+    for (int k=0; k<en.nnode; k++){fprintf(fp, "    a[%d] = 0.0;\n", en.nodes[k]);}
+    for (int k=0; k<en.nvar; k++){fprintf(fp, "    a[%d] = 0.0;\n", en.vars[k]);}
+    fprintf(fp, "    a[%d] = 1.0;\n", tape->roots[i]);
+    for (int k=en.nnode-1; k>=0; k--){
+      if (conditional[en.nodes[k]]){fprintf(fp, "    if (a[%d] != 0.0){\n", en.nodes[k]);}
+      _cg_write_reverse(fp, tape, en.nodes[k]);
+      if (conditional[en.nodes[k]]){fprintf(fp, "    }\n");}
+    }
+    for (int k=0; k<en.nvar; k++){
+      fprintf(fp, "    jac[%d] = a[%d];\n", tape->jac_indptr[i] + k, en.vars[k]);
+    }
+    fprintf(fp, "  }\n");
+    free(en.nodes);
+  }
+  fprintf(fp, "  return 0;\n}\n\n");
+
+  fprintf(fp, "int eval_hess(const double * x, const double * p, const double * lambda, double * hess, double * w){\n");
+  fprintf(fp, "  double * v = w;\n");
+  fprintf(fp, "  double * a = w + %d;\n", nnode);
+  fprintf(fp, "  double * d = w + %d;\n", 2 * nnode);
+  fprintf(fp, "  double * e = w + %d;\n", 3 * nnode);
+  _cg_write_forward(fp, tape);
+  // Adjoints of the Lagrangian, which are the same for every color
+  for (int k=0; k<nnode; k++){fprintf(fp, "  a[%d] = 0.0;\n", k);}
+  for (int i=0; i<tape->nexpr; i++){
+    fprintf(fp, "  a[%d] += lambda[%d];\n", tape->roots[i], i);
+  }
+  for (int k=nnode-1; k>=tape->nvar; k--){
+    if (conditional[k]){fprintf(fp, "  if (a[%d] != 0.0){\n", k);}
+    _cg_write_reverse(fp, tape, k);
+    if (conditional[k]){fprintf(fp, "  }\n");}
+  }
+  // One forward-over-reverse sweep in the direction of each color
+  bool * active = malloc((nnode > 0 ? nnode : 1) * sizeof(bool));
+  bool * seed = malloc((tape->nvar > 0 ? tape->nvar : 1) * sizeof(bool));
+  for (int c=0; c<coloring->ncolor; c++){
+    if (coloring->entry_indptr[c] == coloring->entry_indptr[c+1]){
+      continue;
+    }
+    for (int j=0; j<tape->nvar; j++){seed[j] = coloring->colors[j] == c;}
+    fprintf(fp, "  {\n");
+    for (int k=tape->nvar; k<nnode; k++){
+      _cg_write_tangent(fp, tape, k, active, seed);
+    }
+    for (int k=0; k<nnode; k++){fprintf(fp, "    e[%d] = 0.0;\n", k);}
+    for (int k=nnode-1; k>=tape->nvar; k--){
+      if (conditional[k]){fprintf(fp, "    if (a[%d] != 0.0 || e[%d] != 0.0){\n", k, k);}
+      _cg_write_reverse2(fp, tape, k, active, seed);
+      if (conditional[k]){fprintf(fp, "    }\n");}
+    }
+    for (int k=coloring->entry_indptr[c]; k<coloring->entry_indptr[c+1]; k++){
+      fprintf(fp, "    hess[%d] = e[%d];\n", coloring->entries[k], coloring->source_rows[k]);
+    }
+    fprintf(fp, "  }\n");
+  }
+  free(seed);
+  free(active);
+  free(conditional);
+  fprintf(fp, "  return 0;\n}\n");
+  return _cg_errors > 0 ? -1 : 0;
+}
+
+int compile_model_source(char * source, char * library){
+  char * cc = getenv("CC");
+  if (cc == NULL){
+    cc = "cc";
+  }
+  // Run the compiler directly rather than through the shell, so the paths
+  // don't need quoting
+  int ret = -1;
+  pid_t pid = fork();
+  if (pid == 0){
+    execlp(cc, cc, "-O2", "-shared", "-fPIC", "-o", library, source, "-lm", (char *)NULL);
+    _exit(127);
+  }else if (pid > 0){
+    int status;
+    while (waitpid(pid, &status, 0) == -1){
+      if (errno != EINTR){
+        status = -1;
+        break;
+      }
+    }
+    ret = status != -1 && WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+  }
+  if (ret != 0){
+    printf("ERROR: Could not compile %s\n", source);
+    return -1;
+  }
+  return 0;
+}
+
+int compiled_evaluator(struct Evaluator * ev, struct Node * exprs, int ncon, int nvar, char * prefix){
+  struct Tape tape = compile_tape(exprs, ncon, nvar);
+  if (tape.ncall > 0){
+    // External functions are loaded from the libraries named in the .nl
+    // file, which the generated code can't link against
+    printf("ERROR: Code generation doesn't support external functions\n");
+    free_tape(tape);
+    return -1;
+  }
+  struct CSRMatrix jac = tape_jacobian_structure(&tape);
+  struct CSRMatrix hess = hessian_sparsity(exprs, ncon, nvar);
+  struct HessianColoring coloring = star_coloring(hess);
+
+  // dlopen searches the library path for names without a slash
+  int namelen = strlen(prefix) + 8;
+  char * source = malloc(namelen);
+  char * library = malloc(namelen);
+  snprintf(source, namelen, "%s.c", prefix);
+  snprintf(library, namelen, strchr(prefix, '/') ? "%s.so" : "./%s.so", prefix);
+
+  FILE * fp = fopen(source, "w");
+  if (fp == NULL){
+    printf("ERROR: Could not open %s for writing\n", source);
+    free(source);
+    free(library);
+    free_tape(tape);
+    free_csrmatrix(jac);
+    free_csrmatrix(hess);
+    free_hessian_coloring(coloring);
+    return -1;
+  }
+  int status = write_model_source(fp, &tape, &coloring);
+  fclose(fp);
+  free_tape(tape);
+  free_hessian_coloring(coloring);
+
+  void * handle = NULL;
+  if (status == 0 && compile_model_source(source, library) == 0){
+    handle = dlopen(library, RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL){
+      printf("ERROR: Could not load %s: %s\n", library, dlerror());
+    }
+  }
+  free(source);
+  free(library);
+  if (handle == NULL){
+    free_csrmatrix(jac);
+    free_csrmatrix(hess);
+    return -1;
+  }
+
+  struct CompiledEvaluatorData * data = malloc(sizeof(struct CompiledEvaluatorData));
+  int (* workspace_size)(void) = (int (*)(void))dlsym(handle, "workspace_size");
+  data->handle = handle;
+  data->eval_g = (int (*)(const double *, const double *, double *, double *))dlsym(handle, "eval_g");
+  data->eval_jac = (int (*)(const double *, const double *, double *, double *))dlsym(handle, "eval_jac");
+  data->eval_hess = (int (*)(const double *, const double *, const double *, double *, double *))dlsym(handle, "eval_hess");
+  if (!workspace_size || !data->eval_g || !data->eval_jac || !data->eval_hess){
+    printf("ERROR: Missing functions in compiled model\n");
+    dlclose(handle);
+    free(data);
+    free_csrmatrix(jac);
+    free_csrmatrix(hess);
+    return -1;
+  }
+  int nwork = workspace_size();
+  data->work = malloc((nwork > 0 ? nwork : 1) * sizeof(double));
+  data->ncon = ncon;
+  data->jac_nnz = jac.nnz;
+  data->hess_nnz = hess.nnz;
+
+  ev->nvar = nvar;
+  ev->ncon = ncon;
+  ev->jacobian = jac;
+  ev->hessian = hess;
+  ev->data = data;
+  ev->eval_g = _compiled_eval_g;
+  ev->eval_jac = _compiled_eval_jac;
+  ev->eval_hess = _compiled_eval_hess;
+  ev->free_data = _compiled_free_data;
+  return 0;
+}
+
+int _compiled_eval_g(void * data, double * x, double * p, double * g){
+  struct CompiledEvaluatorData * cd = data;
+  cd->eval_g(x, p, g, cd->work);
+  return check_finite(g, cd->ncon);
+}
+
+int _compiled_eval_jac(void * data, double * x, double * p, double * jac_values){
+  struct CompiledEvaluatorData * cd = data;
+  cd->eval_jac(x, p, jac_values, cd->work);
+  return check_finite(jac_values, cd->jac_nnz);
+}
+
+int _compiled_eval_hess(void * data, double * x, double * p, double * lambda, double * hess_values){
+  struct CompiledEvaluatorData * cd = data;
+  cd->eval_hess(x, p, lambda, hess_values, cd->work);
+  return check_finite(hess_values, cd->hess_nnz);
+}
+
+void _compiled_free_data(void * data){
+  struct CompiledEvaluatorData * cd = data;
+  dlclose(cd->handle);
+  free(cd->work);
+  free(cd);
+}
@@ -0,0 +1,218 @@
+#include <stdint.h>
+
+/*
+ * Structural sharing of identical subexpressions (hash-consing)
+ *
+ * Generated .nl files often repeat the same subexpression in many
+ * constraints, e.g. exp(v3*cos(v4)). The parser allocates (and evaluate
+ * computes) each copy separately. Here we map identical subtrees onto a
+ * single OperatorNode, turning the expressions into a DAG.
+ *
+ * Two operator nodes are identical if they have the same operator and the
+ * same arguments, where arguments are compared by identity: constants by
+ * value, variables and parameters by address, and operators by the address
+ * of their (already shared) OperatorNode. Expressions are processed from the
+ * leaves up, so comparing arguments by identity is enough to find every
+ * identical subtree.
+ *
+ * A shared OperatorNode has nshared > 0, and is freed by free_expression
+ * only when its last reference is freed.
+ *
+ * Usage, right after reading constraints:
+ *
+ *     int nremoved = share_common_subexpressions(constraints, ncon);
+ *
+ * or, to share subexpressions across several groups of expressions (or as
+ * each expression is read), use a NodeTable and intern_expression directly.
+ */
+
+struct NodeTable {
+  // Capacity is always a power of two
+  int capacity;
+  int size;
+  struct OperatorNode ** entries;
+};
+
+struct NodeTable new_node_table(int capacity);
+void free_node_table(struct NodeTable table);
+
+/*
+ * Replace subexpressions of *expr that are identical to subexpressions
+ * already in the table with the existing OperatorNodes, freeing the
+ * duplicates, and add the remaining OperatorNodes to the table. Returns
+ * the number of OperatorNodes that were freed.
+ */
+int intern_expression(struct NodeTable * table, struct Node * expr);
+
+/*
+ * Share identical subexpressions among (and within) exprs. Returns the
+ * number of OperatorNodes that were freed.
+ */
+int share_common_subexpressions(struct Node * exprs, int nexpr);
+
+uint64_t _hash_operator_node(struct OperatorNode * expr);
+bool _args_identical(struct Node a, struct Node b);
+bool _operator_nodes_identical(struct OperatorNode * a, struct OperatorNode * b);
+void _node_table_insert(struct NodeTable * table, struct OperatorNode * expr);
+struct OperatorNode * _node_table_lookup(struct NodeTable * table, struct OperatorNode * expr);
+
+struct NodeTable new_node_table(int capacity){
+  int cap = 16;
+  while (cap < capacity){cap *= 2;}
+  struct NodeTable table = {
+    .capacity = cap,
+    .size = 0,
+    .entries = malloc(cap * sizeof(struct OperatorNode *)),
+  };
+  for (int i=0; i<cap; i++){table.entries[i] = NULL;}
+  return table;
+}
+
+void free_node_table(struct NodeTable table){
+  // The table does not own the nodes it points to
+  free(table.entries);
+}
+
+uint64_t _hash_operator_node(struct OperatorNode * expr){
+  // FNV-1a over the operator and the identities of the arguments
+  uint64_t hash = 14695981039346656037ULL;
+  const uint64_t prime = 1099511628211ULL;
+  hash = (hash ^ (uint64_t)expr->op) * prime;
+  hash = (hash ^ (uint64_t)expr->nargs) * prime;
+  for (int i=0; i<expr->nargs; i++){
+    struct Node arg = expr->args[i];
+    uint64_t key;
+    switch(arg.type){
+      case CONST_NODE:
+        memcpy(&key, &arg.data.value, sizeof(uint64_t));
+        break;
+      case VAR_NODE:
+        key = (uint64_t)(uintptr_t)arg.data.var;
+        break;
+      case PARAM_NODE:
+        key = (uint64_t)(uintptr_t)arg.data.param;
+        break;
+      case OP_NODE:
+        key = (uint64_t)(uintptr_t)arg.data.expr;
+        break;
+    }
+    hash = (hash ^ (uint64_t)arg.type) * prime;
+    hash = (hash ^ key) * prime;
+  }
+  // Mix the high bits into the low bits, which we use as the table index
+  return hash ^ (hash >> 29);
+}
+
+bool _args_identical(struct Node a, struct Node b){
+  if (a.type != b.type){
+    return false;
+  }
+  switch(a.type){
+    case CONST_NODE:
+      // Compare bits so that e.g. 0.0 and -0.0 are not considered identical
+      return memcmp(&a.data.value, &b.data.value, sizeof(double)) == 0;
+    case VAR_NODE:
+      return a.data.var == b.data.var;
+    case PARAM_NODE:
+      return a.data.param == b.data.param;
+    case OP_NODE:
+      return a.data.expr == b.data.expr;
+  }
+  return false;
+}
+
+bool _operator_nodes_identical(struct OperatorNode * a, struct OperatorNode * b){
+  if (a->op != b->op || a->nargs != b->nargs){
+    return false;
+  }
+  for (int i=0; i<a->nargs; i++){
+    if (!_args_identical(a->args[i], b->args[i])){
+      return false;
+    }
+  }
+  return true;
+}
+
+struct OperatorNode * _node_table_lookup(struct NodeTable * table, struct OperatorNode * expr){
+  int mask = table->capacity - 1;
+  int pos = _hash_operator_node(expr) & mask;
+  // Linear probing
+  while (table->entries[pos]){
+    if (_operator_nodes_identical(table->entries[pos], expr)){
+      return table->entries[pos];
+    }
+    pos = (pos + 1) & mask;
+  }
+  return NULL;
+}
+
+void _node_table_insert(struct NodeTable * table, struct OperatorNode * expr){
+  if (2 * (table->size + 1) > table->capacity){
+    // Keep the load factor below 1/2. Re-insert everything into a table
+    // of twice the size.
+    struct NodeTable larger = new_node_table(2 * table->capacity);
+    for (int i=0; i<table->capacity; i++){
+      if (table->entries[i]){
+        _node_table_insert(&larger, table->entries[i]);
+      }
+    }
+    free_node_table(*table);
+    *table = larger;
+  }
+  int mask = table->capacity - 1;
+  int pos = _hash_operator_node(expr) & mask;
+  while (table->entries[pos]){
+    pos = (pos + 1) & mask;
+  }
+  table->entries[pos] = expr;
+  table->size += 1;
+}
+
+int intern_expression(struct NodeTable * table, struct Node * expr){
+  if (expr->type != OP_NODE){
+    return 0;
+  }
+  struct OperatorNode * opnode = expr->data.expr;
+  int nremoved = 0;
+  // Share the arguments first, so we can compare arguments by identity
+  for (int i=0; i<opnode->nargs; i++){
+    nremoved += intern_expression(table, &opnode->args[i]);
+  }
+  if (opnode->op == EXTERNAL && external_is_random((int)opnode->args[0].data.value)){
+    // Identical calls still give different draws
+    return nremoved;
+  }
+
+  struct OperatorNode * existing = _node_table_lookup(table, opnode);
+  if (existing == opnode){
+    // This node is already shared. We got here through another reference.
+    return nremoved;
+  }else if (existing){
+    // opnode is a duplicate. Its arguments are the same OperatorNodes as
+    // the arguments of the existing node, so we release opnode's references
+    // to them before freeing it.
+    for (int i=0; i<opnode->nargs; i++){
+      if (opnode->args[i].type == OP_NODE){
+        opnode->args[i].data.expr->nshared -= 1;
+      }
+    }
+    mem_free(MEM_ARGS, opnode->args);
+    mem_free(MEM_OPERATOR_NODES, opnode);
+    existing->nshared += 1;
+    expr->data.expr = existing;
+    return nremoved + 1;
+  }else{
+    _node_table_insert(table, opnode);
+    return nremoved;
+  }
+}
+
+int share_common_subexpressions(struct Node * exprs, int nexpr){
+  struct NodeTable table = new_node_table(1024);
+  int nremoved = 0;
+  for (int i=0; i<nexpr; i++){
+    nremoved += intern_expression(&table, &exprs[i]);
+  }
+  free_node_table(table);
+  return nremoved;
+}
@@ -0,0 +1,251 @@
+/*
+ * A common interface for evaluating a model's constraints and their
+ * derivatives, e.g. from a solver's callbacks.
+ *
+ * An Evaluator holds the sparsity structures of the Jacobian and (the lower
+ * triangle of) the Hessian of the Lagrangian, and functions that compute
+ * values in the order of these structures. Each function takes the variable
+ * values x and parameter values p (which may be NULL if the model has no
+ * parameters), and evaluates everything it needs from scratch.
+ *
+ * Different backends implement the same interface:
+ * - tape_evaluator interprets a compiled tape (see tape.h), and computes
+ *   the Hessian with one Hessian-vector product per color (see hessian.h)
+ * - compiled_evaluator runs native code generated from the tape (see codegen.h)
+ *
+ * Usage:
+ *
+ *     struct Evaluator ev = tape_evaluator(constraints, ncon, nvar);
+ *     ev.eval_g(ev.data, x, p, g);
+ *     ev.eval_jac(ev.data, x, p, jac_values);
+ *     ev.eval_hess(ev.data, x, p, lambda, hess_values);
+ *     free_evaluator(ev);
+ */
+
+struct Evaluator {
+  int nvar;
+  int ncon;
+  // Sparsity structures. Values in these matrices are not used.
+  struct CSRMatrix jacobian;
+  struct CSRMatrix hessian;
+  // Backend-specific data, passed to each function
+  void * data;
+  // Constraint values, g, have length ncon
+  int (* eval_g)(void * data, double * x, double * p, double * g);
+  // Jacobian values, in the order of the jacobian structure
+  int (* eval_jac)(void * data, double * x, double * p, double * jac_values);
+  // Values of the lower triangle of the Hessian of sum_i lambda[i] * g[i],
+  // in the order of the hessian structure
+  int (* eval_hess)(void * data, double * x, double * p, double * lambda, double * hess_values);
+  void (* free_data)(void * data);
+};
+
+/*
+ * The eval functions return 0, or -1 if any output is NaN or infinite,
+ * e.g. because x is outside the domain of a log or sqrt, or a denominator
+ * is zero. The outputs are written either way, so a solver can look at
+ * them, backtrack and evaluate at another point. We only check outputs, so
+ * the kernels themselves don't branch on the domain of each operator.
+ */
+
+void free_evaluator(struct Evaluator ev);
+
+// 0 if the n values are all finite, -1 otherwise
+int check_finite(double * values, int n);
+
+/*
+ * Construct an evaluator that compiles the expressions into a tape and
+ * interprets it. The expressions may be freed afterwards.
+ */
+struct Evaluator tape_evaluator(struct Node * exprs, int ncon, int nvar);
+
+/*
+ * Evaluating from several threads
+ *
+ * An Evaluator owns its workspaces, so it can only be used by one thread at
+ * a time. (The same goes for evaluating the expression trees directly, as
+ * values live in the Variables and adjoints in the Nodes.) To evaluate one
+ * model at several points at once, compile it into a CompiledModel, which is
+ * never modified after compile_model returns, and give each thread its own
+ * EvalContext, which holds everything that depends on the point: the value,
+ * directional derivative and adjoints of every node on the tape.
+ *
+ *     struct CompiledModel model = compile_model(constraints, ncon, nvar);
+ *     #pragma omp parallel
+ *     {
+ *       struct EvalContext ctx = new_eval_context(&model);
+ *       ... context_eval_g(&ctx, x, p, g), etc. with this thread's x ...
+ *       free_eval_context(ctx);
+ *     }
+ *     free_compiled_model(model);
+ *
+ * A context costs 4 doubles per tape node, and none of the expression
+ * trees are copied. (The counters in instrument.h are not thread-safe, so
+ * leave -DINSTRUMENT off for threaded evaluation. Tracing is fine.)
+ */
+struct CompiledModel {
+  int nvar;
+  int ncon;
+  struct Tape tape;
+  struct CSRMatrix jacobian;
+  struct CSRMatrix hessian;
+  struct HessianColoring coloring;
+};
+
+struct EvalContext {
+  const struct CompiledModel * model;
+  // Workspaces of length tape.nnode
+  double * values;
+  double * adjoints;
+  double * dvalues;
+  double * dadjoints;
+};
+
+struct CompiledModel compile_model(struct Node * exprs, int ncon, int nvar);
+void free_compiled_model(struct CompiledModel model);
+struct EvalContext new_eval_context(const struct CompiledModel * model);
+void free_eval_context(struct EvalContext ctx);
+
+// The same as the Evaluator functions, in the order of model->jacobian and
+// model->hessian
+int context_eval_g(struct EvalContext * ctx, double * x, double * p, double * g);
+int context_eval_jac(struct EvalContext * ctx, double * x, double * p, double * jac_values);
+int context_eval_hess(struct EvalContext * ctx, double * x, double * p, double * lambda, double * hess_values);
+
+// An evaluator is a model with a single context
+struct TapeEvaluatorData {
+  struct CompiledModel model;
+  struct EvalContext ctx;
+};
+
+int _tape_eval_g(void * data, double * x, double * p, double * g);
+int _tape_eval_jac(void * data, double * x, double * p, double * jac_values);
+int _tape_eval_hess(void * data, double * x, double * p, double * lambda, double * hess_values);
+void _tape_free_data(void * data);
+
+int check_finite(double * values, int n){
+  // Accumulate rather than return early, so this vectorizes. x - x is NaN
+  // exactly when x is NaN or infinite.
+  double sum = 0.0;
+  for (int i=0; i<n; i++){sum += values[i] - values[i];}
+  return sum == 0.0 ? 0 : -1;
+}
+
+void free_evaluator(struct Evaluator ev){
+  free_csrmatrix(ev.jacobian);
+  free_csrmatrix(ev.hessian);
+  ev.free_data(ev.data);
+}
+
+struct CompiledModel compile_model(struct Node * exprs, int ncon, int nvar){
+  struct CompiledModel model = {
+    .nvar = nvar,
+    .ncon = ncon,
+    .tape = compile_tape(exprs, ncon, nvar),
+    .hessian = hessian_sparsity(exprs, ncon, nvar),
+  };
+  model.jacobian = tape_jacobian_structure(&model.tape);
+  model.coloring = star_coloring(model.hessian);
+  return model;
+}
+
+void free_compiled_model(struct CompiledModel model){
+  free_tape(model.tape);
+  free_csrmatrix(model.jacobian);
+  free_csrmatrix(model.hessian);
+  free_hessian_coloring(model.coloring);
+}
+
+struct EvalContext new_eval_context(const struct CompiledModel * model){
+  int nnode = model->tape.nnode;
+  struct EvalContext ctx = {
+    .model = model,
+    .values = malloc(nnode * sizeof(double)),
+    .adjoints = malloc(nnode * sizeof(double)),
+    .dvalues = malloc(nnode * sizeof(double)),
+    .dadjoints = malloc(nnode * sizeof(double)),
+  };
+  return ctx;
+}
+
+void free_eval_context(struct EvalContext ctx){
+  free(ctx.values);
+  free(ctx.adjoints);
+  free(ctx.dvalues);
+  free(ctx.dadjoints);
+}
+
+// The tape functions don't modify the tape, so we can pass them a pointer
+// into the shared model.
+int context_eval_g(struct EvalContext * ctx, double * x, double * p, double * g){
+  struct Tape * tape = (struct Tape *)&ctx->model->tape;
+  tape_evaluate(tape, x, p, ctx->values);
+  tape_expression_values(tape, ctx->values, g);
+  return check_finite(g, tape->nexpr);
+}
+
+int context_eval_jac(struct EvalContext * ctx, double * x, double * p, double * jac_values){
+  struct Tape * tape = (struct Tape *)&ctx->model->tape;
+  tape_evaluate(tape, x, p, ctx->values);
+  tape_jacobian(tape, ctx->values, ctx->adjoints, jac_values);
+  return check_finite(jac_values, ctx->model->jacobian.nnz);
+}
+
+int context_eval_hess(struct EvalContext * ctx, double * x, double * p, double * lambda, double * hess_values){
+  struct Tape * tape = (struct Tape *)&ctx->model->tape;
+  tape_evaluate(tape, x, p, ctx->values);
+  colored_hessian(
+    tape,
+    (struct HessianColoring *)&ctx->model->coloring,
+    ctx->values,
+    lambda,
+    ctx->dvalues,
+    ctx->adjoints,
+    ctx->dadjoints,
+    hess_values
+  );
+  return check_finite(hess_values, ctx->model->hessian.nnz);
+}
+
+struct Evaluator tape_evaluator(struct Node * exprs, int ncon, int nvar){
+  struct TapeEvaluatorData * data = malloc(sizeof(struct TapeEvaluatorData));
+  data->model = compile_model(exprs, ncon, nvar);
+  data->ctx = new_eval_context(&data->model);
+  // The evaluator shares the model's structures, and free_evaluator frees
+  // them, so _tape_free_data doesn't.
+  struct Evaluator ev = {
+    .nvar = nvar,
+    .ncon = ncon,
+    .jacobian = data->model.jacobian,
+    .hessian = data->model.hessian,
+    .data = data,
+    .eval_g = _tape_eval_g,
+    .eval_jac = _tape_eval_jac,
+    .eval_hess = _tape_eval_hess,
+    .free_data = _tape_free_data,
+  };
+  return ev;
+}
+
+int _tape_eval_g(void * data, double * x, double * p, double * g){
+  struct TapeEvaluatorData * td = data;
+  return context_eval_g(&td->ctx, x, p, g);
+}
+
+int _tape_eval_jac(void * data, double * x, double * p, double * jac_values){
+  struct TapeEvaluatorData * td = data;
+  return context_eval_jac(&td->ctx, x, p, jac_values);
+}
+
+int _tape_eval_hess(void * data, double * x, double * p, double * lambda, double * hess_values){
+  struct TapeEvaluatorData * td = data;
+  return context_eval_hess(&td->ctx, x, p, lambda, hess_values);
+}
+
+void _tape_free_data(void * data){
+  struct TapeEvaluatorData * td = data;
+  free_tape(td->model.tape);
+  free_hessian_coloring(td->model.coloring);
+  free_eval_context(td->ctx);
+  free(td);
+}
@@ -1,87 +1,29 @@
+#include <limits.h>
+
 #include "variable.h"
+#include "memory.h"
+#include "external.h"
+#include "operators.h"
 
 // Forward-declare structs for use in function prototypes
 struct Node;
 struct OperatorNode;
 
-// File-scope arrays with `const int` length appears to be an optional feature
-// of C99 compilers, supported by clang but not gcc-13.
-//const int N_OPERATORS = 12;
-#define N_OPERATORS 12
-enum OperatorType {
-  SUM,
-  PRODUCT,
-  SUBTRACTION,
-  DIVISION,
-  POWER,
-  NEG,
-  SQRT,
-  EXP,
-  LOG,
-  SIN,
-  COS,
-  TAN,
-};
-
-struct OperatorData {
-  enum OperatorType optype;
-  int nargs;
-  char * opstring;
-};
-
-// Global array of operator data?
-// We will then use OperatorType to look into this array to determine whether
-// our operators are binary/unary/n-ary, and what symbol(s) should be used to
-// represent them.
-//
-// Note that the order here must be the same as the order in OperatorType above
-const struct OperatorData OPERATOR_DATA[N_OPERATORS] = {
-  {SUM,         2, "+"},
-  {PRODUCT,     2, "*"},
-  {SUBTRACTION, 2, "-"},
-  {DIVISION,    2, "/"},
-  {POWER,       2, "^"},
-  // NOTE: If I had some data structure that contained the C functions for
-  // these unary operators, I could implement just a single evaluate_unary
-  // function.
-  {NEG,         1, "-"},
-  {SQRT,        1, "sqrt"},
-  {EXP,         1, "exp"},
-  {LOG,         1, "log"},
-  {SIN,         1, "sin"},
-  {COS,         1, "cos"},
-  {TAN,         1, "tan"},
-};
+// Largest number of arguments for which we place temporary arrays on the stack.
+// Sum nodes from the nl file can have a very large number of arguments.
+#define MAX_STACK_NARGS 64
 
 // Function forward declarations
 double evaluate(struct Node expr);
-double _evaluate_sum_node(int nargs, struct Node * args);
-double _evaluate_product_node(int nargs, struct Node * args);
-double _evaluate_subtraction_node(int nargs, struct Node * args);
-double _evaluate_division_node(int nargs, struct Node * args);
-double _evaluate_power_node(int nargs, struct Node * args);
-double _evaluate_neg_node(int nargs, struct Node * args);
-double _evaluate_sqrt_node(int nargs, struct Node * args);
-double _evaluate_exp_node(int nargs, struct Node * args);
-double _evaluate_log_node(int nargs, struct Node * args);
-double _evaluate_sin_node(int nargs, struct Node * args);
-double _evaluate_cos_node(int nargs, struct Node * args);
-double _evaluate_tan_node(int nargs, struct Node * args);
+// Evaluate the arguments, then apply the operator (see operators.h)
+double evaluate_operator(enum OperatorType op, int nargs, struct Node * args);
 
-double (* OP_EVALUATOR[N_OPERATORS])(int, struct Node *) = {
-  _evaluate_sum_node,
-  _evaluate_product_node,
-  _evaluate_subtraction_node,
-  _evaluate_division_node,
-  _evaluate_power_node,
-  _evaluate_sqrt_node,
-  _evaluate_neg_node,
-  _evaluate_exp_node,
-  _evaluate_log_node,
-  _evaluate_sin_node,
-  _evaluate_cos_node,
-  _evaluate_tan_node,
-};
+/*
+ * Allocate an OperatorNode with room for nargs arguments, which the caller
+ * fills in. Its memory is counted in MEM_OPERATOR_NODES and MEM_ARGS (see
+ * memory.h), so it must be freed with free_expression.
+ */
+struct OperatorNode * new_operator_node(enum OperatorType op, int nargs);
 
 int to_string(char * buffer, int bsize, struct Node expr);
 int _expr_to_string(char * buffer, int bsize, struct OperatorNode expr);
@@ -90,6 +32,7 @@ enum NodeType {
   CONST_NODE,
   VAR_NODE,
   OP_NODE,
+  PARAM_NODE,
 };
 
 struct OperatorNode{
@@ -98,7 +41,12 @@ struct OperatorNode{
   // Array of nodes. Each node contains a pointer to its underlying
   // variable or value.
   struct Node *args;
+  // Value of this expression the last time it was evaluated with
+  // evaluate_and_cache. This is not updated by evaluate.
   double value;
+  // Number of references to this node in addition to the first. This is
+  // nonzero only if identical subexpressions have been shared (see cse.h).
+  int nshared;
 };
 
 union NodeData {
@@ -115,14 +63,16 @@ union NodeData {
   //
   // Or I could use an actual array of Nodes in the OperatorNode, and have each
   // node simply point to the variable...
-  // With pointers to nodes, however, I can have "parameter nodes". It is unclear
-  // whether I want this.
+  // With pointers to nodes, however, I can have "parameter nodes". These
+  // point to a Parameter, whose value can be changed between evaluations
+  // without changing the structure of the expression. See bind_parameter.
   //
   // It may be useful for a user to compare their variable to the variable
   // stored in a node. In which case they would want the node to point to the
   // variable.
   struct Variable *var;
   struct OperatorNode *expr;
+  struct Parameter *param;
 };
 
 // How would a common "node" struct work?
@@ -151,79 +101,24 @@ double evaluate(struct Node expr){
       return expr.data.value;
     case VAR_NODE:
       return expr.data.var->value;
+    case PARAM_NODE:
+      return expr.data.param->value;
     case OP_NODE:
-      return OP_EVALUATOR[expr.data.expr->op](expr.data.expr->nargs, expr.data.expr->args);
+      return evaluate_operator(expr.data.expr->op, expr.data.expr->nargs, expr.data.expr->args);
   }
 }
 
-// Note that sum and product nodes are already implemented as n-ary
-double _evaluate_sum_node(int nargs, struct Node * args){
-  double sum = 0.0;
-  for (int i = 0; i < nargs; i++){
-    sum += evaluate(args[i]);
+double evaluate_operator(enum OperatorType op, int nargs, struct Node * args){
+  double stack_values[MAX_STACK_NARGS];
+  double * x = nargs <= MAX_STACK_NARGS ? stack_values : malloc(nargs * sizeof(double));
+  for (int i=0; i<nargs; i++){
+    x[i] = evaluate(args[i]);
   }
-  return sum;
-}
-
-double _evaluate_product_node(int nargs, struct Node * args){
-  double prod = 1.0;
-  for (int i = 0; i < nargs; i ++){
-    prod *= evaluate(args[i]);
+  double value = OPERATOR_DATA[op].value(nargs, x);
+  if (x != stack_values){
+    free(x);
   }
-  return prod;
-}
-
-double _evaluate_subtraction_node(int nargs, struct Node * args){
-  // TODO: Assert nargs == 2
-  return evaluate(args[0]) - evaluate(args[1]);
-}
-
-double _evaluate_division_node(int nargs, struct Node * args){
-  // TODO: Assert nargs == 2
-  return evaluate(args[0]) / evaluate(args[1]);
-}
-
-double _evaluate_power_node(int nargs, struct Node * args){
-  // TODO: Assert nargs == 2
-  return pow(evaluate(args[0]), evaluate(args[1]));
-}
-
-double _evaluate_neg_node(int nargs, struct Node * args){
-  // TODO: Assert nargs == 1
-  return -evaluate(args[0]);
-}
-
-double _evaluate_sqrt_node(int nargs, struct Node * args){
-  // TODO: Assert nargs == 1
-  return sqrt(evaluate(args[0]));
-}
-
-double _evaluate_exp_node(int nargs, struct Node * args){
-  // TODO: Assert nargs == 1
-  // TODO: Handle overflow. Should we check for HUGE_VAL and return
-  // NaN instead?
-  return exp(evaluate(args[0]));
-}
-
-double _evaluate_log_node(int nargs, struct Node * args){
-  // TODO: Assert nargs == 1
-  // TODO: Handle evaluation errors
-  return log(evaluate(args[0]));
-}
-
-double _evaluate_sin_node(int nargs, struct Node * args){
-  // TODO: Assert nargs == 1
-  return sin(evaluate(args[0]));
-}
-
-double _evaluate_cos_node(int nargs, struct Node * args){
-  // TODO: Assert nargs == 1
-  return cos(evaluate(args[0]));
-}
-
-double _evaluate_tan_node(int nargs, struct Node * args){
-  // TODO: Assert nargs == 1
-  return tan(evaluate(args[0]));
+  return value;
 }
 
 // Printing functions
@@ -233,6 +128,8 @@ int to_string(char * buffer, int bsize, struct Node expr){
       return snprintf(buffer, bsize, "%1.3f", expr.data.value);
     case VAR_NODE:
       return snprintf(buffer, bsize, "v%d", expr.data.var->index);
+    case PARAM_NODE:
+      return snprintf(buffer, bsize, "p%d", expr.data.param->index);
     case OP_NODE:
       return _expr_to_string(buffer, bsize, *expr.data.expr);
   }
@@ -299,16 +196,130 @@ void free_expression(struct Node node){
     case VAR_NODE:
       // TODO: Option to free variable nodes
       return;
+    case PARAM_NODE:
+      // Parameters are owned by the caller, like variables
+      return;
     case OP_NODE:
       return _free_expression(node.data.expr);
   }
 }
 
 void _free_expression(struct OperatorNode * expr){
+  if (expr->nshared > 0){
+    // Someone else still refers to this expression. Just drop our reference.
+    expr->nshared -= 1;
+    return;
+  }
   for (int i=0; i < expr->nargs; i++){
     // Free all subexpressions, if necessary
     free_expression(expr->args[i]);
   }
   // Free the expression itself
-  free(expr);
+  mem_free(MEM_ARGS, expr->args);
+  mem_free(MEM_OPERATOR_NODES, expr);
+}
+
+struct OperatorNode * new_operator_node(enum OperatorType op, int nargs){
+  struct OperatorNode * expr = mem_alloc(MEM_OPERATOR_NODES, sizeof(struct OperatorNode));
+  expr->op = op;
+  expr->nargs = nargs;
+  expr->args = mem_alloc(MEM_ARGS, (nargs > 0 ? nargs : 1) * sizeof(struct Node));
+  expr->value = 0.0;
+  expr->nshared = 0;
+  return expr;
+}
+
+/*
+ * If expr is a power with a constant operand, change its operator to the
+ * corresponding specialized power (SQUARE, POW_CONST_INT, POW_CONST_REAL or
+ * EXP_CONST_BASE), which are cheaper to evaluate and never compute the
+ * partial derivative with respect to the constant. Returns 1 if the operator
+ * was changed, 0 otherwise.
+ *
+ * Powers with two constant operands are left alone (simplify_expression
+ * will fold them).
+ */
+int specialize_power_node(struct OperatorNode * expr);
+
+int specialize_power_node(struct OperatorNode * expr){
+  if (expr->op != POWER){
+    return 0;
+  }
+  struct Node base = expr->args[0];
+  struct Node exponent = expr->args[1];
+  if (exponent.type == CONST_NODE && base.type != CONST_NODE){
+    double c = exponent.data.value;
+    if (c == 2.0){
+      // We don't need the exponent anymore, but it isn't allocated
+      // separately, so we just leave it at the end of args.
+      expr->op = SQUARE;
+      expr->nargs = 1;
+    }else if (c == floor(c) && fabs(c) <= INT_MAX){
+      expr->op = POW_CONST_INT;
+    }else{
+      expr->op = POW_CONST_REAL;
+    }
+    return 1;
+  }else if (base.type == CONST_NODE && exponent.type != CONST_NODE){
+    expr->op = EXP_CONST_BASE;
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Replace every constant node with the provided value in the expressions
+ * with a node pointing to `param`. Returns the number of nodes replaced.
+ *
+ * The .nl format has no parameters, so parameters in a model must be written
+ * as constants. To re-solve a family of models that differ only in some data,
+ * write the .nl file with a distinct value for each parameter, e.g.
+ * 1234.5678, then bind each value to a Parameter after reading the file.
+ * The parameter's value can then be changed between evaluations without
+ * invalidating anything derived from the structure of the expressions,
+ * e.g. Jacobian sparsity.
+ *
+ * A specialized power whose constant operand is bound becomes a generic
+ * POWER again. The exponent of a SQUARE is not a node, and is never bound.
+ */
+int bind_parameter(struct Node * exprs, int nexpr, double value, struct Parameter * param);
+int _bind_parameter(struct Node * node, double value, struct Parameter * param);
+
+int bind_parameter(struct Node * exprs, int nexpr, double value, struct Parameter * param){
+  int count = 0;
+  for (int i=0; i<nexpr; i++){
+    count += _bind_parameter(&exprs[i], value, param);
+  }
+  return count;
+}
+
+// Operates on a pointer so we can modify the node in its parent's args array
+int _bind_parameter(struct Node * node, double value, struct Parameter * param){
+  switch(node->type){
+    case CONST_NODE:
+      if (node->data.value == value){
+        node->type = PARAM_NODE;
+        node->data.param = param;
+        return 1;
+      }
+      return 0;
+    case OP_NODE:
+    {
+      struct OperatorNode * expr = node->data.expr;
+      if (expr->op == POW_CONST_INT || expr->op == POW_CONST_REAL || expr->op == EXP_CONST_BASE){
+        int iconst = expr->op == EXP_CONST_BASE ? 0 : 1;
+        if (expr->args[iconst].data.value == value){
+          // Specialized powers require a constant operand
+          expr->op = POWER;
+        }
+      }
+      int count = 0;
+      for (int i=0; i<node->data.expr->nargs; i++){
+        count += _bind_parameter(&node->data.expr->args[i], value, param);
+      }
+      return count;
+    }
+    default:
+      return 0;
+  }
 }
@@ -0,0 +1,497 @@
+#include <stdarg.h>
+#include <dlfcn.h>
+
+/*
+ * External functions
+ *
+ * Models can call functions supplied by the user in a shared library, e.g.
+ * thermodynamic property functions, which appear in .nl files as `f` nodes.
+ * Libraries follow AMPL's funcadd convention: the library exports
+ *
+ *     void funcadd_ASL(AmplExports * ae);
+ *
+ * which registers each function by calling ae->Addfunc(name, func, type,
+ * nargs, funcinfo, ae), and each function has the signature
+ *
+ *     double func(arglist * al);
+ *
+ * reading its arguments from al->ra and, if al->derivs (al->hes) is not
+ * NULL, writing its first (second) partial derivatives there. ExternalArgs
+ * and ExternalExports below have the layout of arglist and the start of
+ * AmplExports, so libraries compiled against funcadd.h can be loaded
+ * directly. We only fill in the parts of AmplExports that functions
+ * commonly use (printing, strtod and exit callbacks). The rest are NULL.
+ *
+ * A call is an operator node (EXTERNAL) whose first argument is a constant,
+ * the index of the function in EXTERNAL_FUNCTIONS, and whose remaining
+ * arguments are the function's (real) arguments.
+ *
+ * Calls are expensive, and derivatives are needed by several sweeps (e.g.
+ * the tape's Jacobian is one reverse sweep per expression, and its Hessian
+ * one sweep per color), so every call goes through a cache of results at
+ * the current point. The first call with given arguments computes the
+ * value and gradient together, the first sweep that needs second
+ * derivatives adds the Hessian, and every later call with the same
+ * function and arguments, from any node or sweep, is a lookup. The cache
+ * is emptied by external_new_point, which tape_evaluate calls for tapes
+ * with external calls. (With the tree functions, e.g. evaluate, call it
+ * yourself when x changes, or the cache keeps growing.) Functions registered
+ * with FUNCADD_RANDOM_VALUED may return a different value each time, so
+ * their calls are never looked up: every call calls the function.
+ *
+ * The funcadd interface takes one point per call, so a batch of calls
+ * (external_evaluate_batch) is a loop, but it sets up the argument list
+ * once and skips calls that are already cached. The tape groups calls of
+ * the same function that don't depend on each other into batches (see
+ * tape.h).
+ *
+ * The cache is thread-local, so evaluation contexts (see evaluator.h) on
+ * different threads can share a model, as long as the library's functions
+ * are themselves thread-safe.
+ *
+ * Usage:
+ *
+ *     load_external_library("libproperties.so");
+ *     ... read a model, using read_nl_functions before the expressions ...
+ *     free_external_functions();
+ */
+
+// Function types (the type argument of Addfunc)
+#define FUNCADD_REAL_VALUED 0
+#define FUNCADD_STRING_ARGS 1
+#define FUNCADD_OUTPUT_ARGS 2
+#define FUNCADD_RANDOM_VALUED 4
+
+struct ExternalExports;
+
+// arglist in funcadd.h
+struct ExternalArgs {
+  // Number of arguments, and number of real arguments
+  int n;
+  int nr;
+  // Argument types: at[i] >= 0 means argument i is ra[at[i]]
+  int * at;
+  double * ra;
+  const char ** sa;
+  // Partial derivatives, or NULL if they aren't needed
+  double * derivs;
+  // Upper triangle of the Hessian, by columns (ra[i], ra[j]) with i <= j
+  // at hes[i + j*(j+1)/2], or NULL
+  double * hes;
+  char * dig;
+  void * funcinfo;
+  struct ExternalExports * AE;
+  void * f;
+  void * tva;
+  // Set by the function to report an error
+  char * Errmsg;
+  void * TMI;
+  void * Private;
+  int nin;
+  int nout;
+  int nsin;
+  int nsout;
+};
+
+typedef double (* ExternalFunc)(struct ExternalArgs * al);
+
+// AmplExports in funcadd.h, up to StdOut
+struct ExternalExports {
+  FILE * StdErr;
+  void (* Addfunc)(const char * name, ExternalFunc func, int type, int nargs, void * funcinfo, struct ExternalExports * ae);
+  long ASLdate;
+  int (* FprintF)(FILE * fp, const char * fmt, ...);
+  int (* PrintF)(const char * fmt, ...);
+  int (* SprintF)(char * buffer, const char * fmt, ...);
+  int (* VfprintF)(FILE * fp, const char * fmt, va_list args);
+  int (* VsprintF)(char * buffer, const char * fmt, va_list args);
+  double (* Strtod)(const char * str, char ** end);
+  void * Crypto;
+  void * asl;
+  void (* AtExit)(struct ExternalExports * ae, void (* func)(void *), void * data);
+  void (* AtReset)(struct ExternalExports * ae, void (* func)(void *), void * data);
+  void * Tempmem;
+  void * Add_table_handler;
+  void * Private;
+  void * Qsortv;
+  FILE * StdIn;
+  FILE * StdOut;
+  // Later members of AmplExports, which we don't provide
+  void * reserved[64];
+};
+
+struct ExternalFunction {
+  char * name;
+  ExternalFunc func;
+  int type;
+  // Number of arguments, or -(n+1) for at least n arguments
+  int nargs;
+  void * funcinfo;
+};
+
+struct ExternalExitCallback {
+  void (* func)(void *);
+  void * data;
+};
+
+// Registered functions, and the libraries they came from
+struct ExternalFunction * EXTERNAL_FUNCTIONS = NULL;
+int N_EXTERNAL_FUNCTIONS = 0;
+void ** _external_libraries = NULL;
+int _n_external_libraries = 0;
+struct ExternalExitCallback * _external_exit_callbacks = NULL;
+int _n_external_exit_callbacks = 0;
+
+/*
+ * Register a function, as Addfunc does for a library. Returns the index of
+ * the function, which replaces any earlier function with the same name.
+ */
+int add_external_function(const char * name, ExternalFunc func, int type, int nargs, void * funcinfo);
+// Index of a registered function, or -1
+int find_external_function(const char * name);
+/*
+ * Whether function f was registered with FUNCADD_RANDOM_VALUED. Calls of
+ * such a function must not be shared, as each call is a new draw.
+ */
+bool external_is_random(int f);
+/*
+ * Load a funcadd library and register its functions. Returns the number of
+ * functions it added, or -1 if it couldn't be loaded.
+ */
+int load_external_library(const char * path);
+// Run the libraries' exit callbacks, unload them, and clear the registry
+void free_external_functions();
+
+// Start a new point: cached results are no longer valid
+void external_new_point();
+/*
+ * Value of function f at x (nargs real arguments). If grad (hes) is not
+ * NULL, also copy the gradient (the upper triangle of the Hessian, as in
+ * ExternalArgs) there. If the function reports an error, everything is NaN.
+ */
+double external_evaluate(int f, int nargs, double * x, double * grad, double * hes);
+/*
+ * Evaluate ncall calls of function f, whose arguments are x[k*nargs], ...,
+ * x[k*nargs + nargs-1], into values[k]. Gradients, and Hessians if hessian
+ * is true, are computed at the same time and cached for later sweeps.
+ */
+void external_evaluate_batch(int f, int nargs, int ncall, double * x, double * values, bool hessian);
+
+void _external_addfunc(const char * name, ExternalFunc func, int type, int nargs, void * funcinfo, struct ExternalExports * ae);
+void _external_at_exit(struct ExternalExports * ae, void (* func)(void *), void * data);
+struct ExternalExports * _external_exports();
+
+int add_external_function(const char * name, ExternalFunc func, int type, int nargs, void * funcinfo){
+  int f = find_external_function(name);
+  if (f < 0){
+    f = N_EXTERNAL_FUNCTIONS;
+    N_EXTERNAL_FUNCTIONS += 1;
+    EXTERNAL_FUNCTIONS = realloc(EXTERNAL_FUNCTIONS, N_EXTERNAL_FUNCTIONS * sizeof(struct ExternalFunction));
+    EXTERNAL_FUNCTIONS[f].name = strdup(name);
+  }
+  EXTERNAL_FUNCTIONS[f].func = func;
+  EXTERNAL_FUNCTIONS[f].type = type;
+  EXTERNAL_FUNCTIONS[f].nargs = nargs;
+  EXTERNAL_FUNCTIONS[f].funcinfo = funcinfo;
+  return f;
+}
+
+bool external_is_random(int f){
+  return f >= 0 && f < N_EXTERNAL_FUNCTIONS && (EXTERNAL_FUNCTIONS[f].type & FUNCADD_RANDOM_VALUED);
+}
+
+int find_external_function(const char * name){
+  for (int f=0; f<N_EXTERNAL_FUNCTIONS; f++){
+    if (strcmp(EXTERNAL_FUNCTIONS[f].name, name) == 0){
+      return f;
+    }
+  }
+  return -1;
+}
+
+void _external_addfunc(const char * name, ExternalFunc func, int type, int nargs, void * funcinfo, struct ExternalExports * ae){
+  add_external_function(name, func, type, nargs, funcinfo);
+}
+
+void _external_at_exit(struct ExternalExports * ae, void (* func)(void *), void * data){
+  _external_exit_callbacks = realloc(
+    _external_exit_callbacks,
+    (_n_external_exit_callbacks + 1) * sizeof(struct ExternalExitCallback)
+  );
+  _external_exit_callbacks[_n_external_exit_callbacks].func = func;
+  _external_exit_callbacks[_n_external_exit_callbacks].data = data;
+  _n_external_exit_callbacks += 1;
+}
+
+// Functions may keep a pointer to the exports, so there is one copy of them
+struct ExternalExports _EXTERNAL_EXPORTS;
+bool _external_exports_initialized = false;
+
+struct ExternalExports * _external_exports(){
+  if (_external_exports_initialized){
+    return &_EXTERNAL_EXPORTS;
+  }
+  struct ExternalExports ae = {
+    .StdErr = stderr,
+    .Addfunc = _external_addfunc,
+    .ASLdate = 20160307,
+    .FprintF = fprintf,
+    .PrintF = printf,
+    .SprintF = sprintf,
+    .VfprintF = vfprintf,
+    .VsprintF = vsprintf,
+    .Strtod = strtod,
+    .AtExit = _external_at_exit,
+    .AtReset = _external_at_exit,
+    .StdIn = stdin,
+    .StdOut = stdout,
+  };
+  _EXTERNAL_EXPORTS = ae;
+  _external_exports_initialized = true;
+  return &_EXTERNAL_EXPORTS;
+}
+
+int load_external_library(const char * path){
+  void * handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  if (handle == NULL){
+    printf("ERROR: Could not load %s: %s\n", path, dlerror());
+    return -1;
+  }
+  void (* funcadd)(struct ExternalExports *) = (void (*)(struct ExternalExports *))dlsym(handle, "funcadd_ASL");
+  if (funcadd == NULL){
+    funcadd = (void (*)(struct ExternalExports *))dlsym(handle, "funcadd");
+  }
+  if (funcadd == NULL){
+    printf("ERROR: %s does not define funcadd_ASL\n", path);
+    dlclose(handle);
+    return -1;
+  }
+  _external_libraries = realloc(_external_libraries, (_n_external_libraries + 1) * sizeof(void *));
+  _external_libraries[_n_external_libraries] = handle;
+  _n_external_libraries += 1;
+  int before = N_EXTERNAL_FUNCTIONS;
+  funcadd(_external_exports());
+  return N_EXTERNAL_FUNCTIONS - before;
+}
+
+void free_external_functions(){
+  for (int k=_n_external_exit_callbacks-1; k>=0; k--){
+    _external_exit_callbacks[k].func(_external_exit_callbacks[k].data);
+  }
+  free(_external_exit_callbacks);
+  _external_exit_callbacks = NULL;
+  _n_external_exit_callbacks = 0;
+  for (int f=0; f<N_EXTERNAL_FUNCTIONS; f++){free(EXTERNAL_FUNCTIONS[f].name);}
+  free(EXTERNAL_FUNCTIONS);
+  EXTERNAL_FUNCTIONS = NULL;
+  N_EXTERNAL_FUNCTIONS = 0;
+  for (int k=0; k<_n_external_libraries; k++){dlclose(_external_libraries[k]);}
+  free(_external_libraries);
+  _external_libraries = NULL;
+  _n_external_libraries = 0;
+}
+
+/*
+ * Cache of results at the current point
+ *
+ * Results are stored in entries, whose arguments, gradient and Hessian are
+ * at offsets in a single array of doubles, and found with an open
+ * addressing hash table of entry indices. Slots are stamped with the point
+ * they were filled at, so starting a new point is O(1).
+ */
+struct ExternalResult {
+  int func;
+  int nargs;
+  bool has_hessian;
+  double value;
+  // Offsets of the arguments, gradient and Hessian in the cache's data
+  long x;
+  long grad;
+  long hes;
+};
+
+struct ExternalCache {
+  unsigned int point;
+  // Hash table of entry indices. capacity is a power of 2.
+  int capacity;
+  int * slots;
+  unsigned int * slot_point;
+  int nresult;
+  int result_capacity;
+  struct ExternalResult * results;
+  long ndata;
+  long data_capacity;
+  double * data;
+  // Counts since the cache was created, for testing and profiling
+  long ncall;
+  long nhit;
+};
+
+_Thread_local struct ExternalCache EXTERNAL_CACHE = {.point = 1};
+
+// Free this thread's cache
+void free_external_cache();
+
+struct ExternalResult * _external_result(int f, int nargs, double * x, bool hessian, struct ExternalArgs * al);
+long _external_reserve(long n);
+unsigned long _external_hash(int f, int nargs, double * x);
+void _external_call(struct ExternalResult * r, struct ExternalArgs * al, bool hessian);
+struct ExternalArgs _external_arglist(int f, int nargs, int * at);
+
+void external_new_point(){
+  struct ExternalCache * cache = &EXTERNAL_CACHE;
+  cache->point += 1;
+  cache->nresult = 0;
+  cache->ndata = 0;
+}
+
+void free_external_cache(){
+  struct ExternalCache * cache = &EXTERNAL_CACHE;
+  free(cache->slots);
+  free(cache->slot_point);
+  free(cache->results);
+  free(cache->data);
+  struct ExternalCache empty = {.point = cache->point + 1};
+  *cache = empty;
+}
+
+unsigned long _external_hash(int f, int nargs, double * x){
+  // FNV-1a over the function index and the bits of the arguments
+  unsigned long h = 14695981039346656037ul;
+  h = (h ^ (unsigned long)f) * 1099511628211ul;
+  for (int i=0; i<nargs; i++){
+    unsigned long bits;
+    memcpy(&bits, &x[i], sizeof(double));
+    h = (h ^ bits) * 1099511628211ul;
+  }
+  return h ^ (h >> 29);
+}
+
+// Make room for n more doubles, and return the offset of the first
+long _external_reserve(long n){
+  struct ExternalCache * cache = &EXTERNAL_CACHE;
+  if (cache->ndata + n > cache->data_capacity){
+    long capacity = cache->data_capacity > 0 ? 2 * cache->data_capacity : 256;
+    while (capacity < cache->ndata + n){capacity *= 2;}
+    cache->data = realloc(cache->data, capacity * sizeof(double));
+    cache->data_capacity = capacity;
+  }
+  long offset = cache->ndata;
+  cache->ndata += n;
+  return offset;
+}
+
+struct ExternalArgs _external_arglist(int f, int nargs, int * at){
+  for (int i=0; i<nargs; i++){at[i] = i;}
+  struct ExternalArgs al = {
+    .n = nargs,
+    .nr = nargs,
+    .at = at,
+    .funcinfo = EXTERNAL_FUNCTIONS[f].funcinfo,
+    .AE = _external_exports(),
+    .nin = nargs,
+  };
+  return al;
+}
+
+void _external_call(struct ExternalResult * r, struct ExternalArgs * al, bool hessian){
+  struct ExternalCache * cache = &EXTERNAL_CACHE;
+  if (hessian){
+    r->hes = _external_reserve(r->nargs * (r->nargs + 1) / 2);
+  }
+  // The data may have moved while reserving
+  al->ra = cache->data + r->x;
+  al->derivs = cache->data + r->grad;
+  al->hes = hessian ? cache->data + r->hes : NULL;
+  al->Errmsg = NULL;
+  r->value = EXTERNAL_FUNCTIONS[r->func].func(al);
+  r->has_hessian = hessian;
+  cache->ncall += 1;
+  if (al->Errmsg != NULL){
+    r->value = NAN;
+    for (int i=0; i<r->nargs; i++){cache->data[r->grad + i] = NAN;}
+    if (hessian){
+      for (int k=0; k<r->nargs * (r->nargs + 1) / 2; k++){cache->data[r->hes + k] = NAN;}
+    }
+  }
+}
+
+// Find the result of a call, calling the function if necessary
+struct ExternalResult * _external_result(int f, int nargs, double * x, bool hessian, struct ExternalArgs * al){
+  struct ExternalCache * cache = &EXTERNAL_CACHE;
+  if (2 * (cache->nresult + 1) > cache->capacity){
+    // Grow the table, and re-insert this point's results
+    int capacity = cache->capacity > 0 ? 2 * cache->capacity : 64;
+    free(cache->slots);
+    free(cache->slot_point);
+    cache->slots = malloc(capacity * sizeof(int));
+    cache->slot_point = calloc(capacity, sizeof(unsigned int));
+    cache->capacity = capacity;
+    for (int k=0; k<cache->nresult; k++){
+      struct ExternalResult * r = &cache->results[k];
+      if (EXTERNAL_FUNCTIONS[r->func].type & FUNCADD_RANDOM_VALUED){
+        continue;
+      }
+      unsigned long h = _external_hash(r->func, r->nargs, cache->data + r->x) & (capacity - 1);
+      while (cache->slot_point[h] == cache->point){h = (h + 1) & (capacity - 1);}
+      cache->slots[h] = k;
+      cache->slot_point[h] = cache->point;
+    }
+  }
+  // Results of random functions get an entry, for the data, but no slot
+  bool random = EXTERNAL_FUNCTIONS[f].type & FUNCADD_RANDOM_VALUED;
+  unsigned long h = _external_hash(f, nargs, x) & (cache->capacity - 1);
+  while (!random && cache->slot_point[h] == cache->point){
+    struct ExternalResult * r = &cache->results[cache->slots[h]];
+    if (r->func == f && r->nargs == nargs && memcmp(cache->data + r->x, x, nargs * sizeof(double)) == 0){
+      if (hessian && !r->has_hessian){
+        _external_call(r, al, true);
+      }else{
+        cache->nhit += 1;
+      }
+      return r;
+    }
+    h = (h + 1) & (cache->capacity - 1);
+  }
+
+  if (cache->nresult == cache->result_capacity){
+    cache->result_capacity = cache->result_capacity > 0 ? 2 * cache->result_capacity : 32;
+    cache->results = realloc(cache->results, cache->result_capacity * sizeof(struct ExternalResult));
+  }
+  int k = cache->nresult;
+  cache->nresult += 1;
+  if (!random){
+    cache->slots[h] = k;
+    cache->slot_point[h] = cache->point;
+  }
+  struct ExternalResult * r = &cache->results[k];
+  r->func = f;
+  r->nargs = nargs;
+  r->x = _external_reserve(2 * nargs);
+  r->grad = r->x + nargs;
+  memcpy(cache->data + r->x, x, nargs * sizeof(double));
+  _external_call(r, al, hessian);
+  return r;
+}
+
+double external_evaluate(int f, int nargs, double * x, double * grad, double * hes){
+  int at[nargs > 0 ? nargs : 1];
+  struct ExternalArgs al = _external_arglist(f, nargs, at);
+  struct ExternalResult * r = _external_result(f, nargs, x, hes != NULL, &al);
+  double * data = EXTERNAL_CACHE.data;
+  if (grad != NULL){
+    memcpy(grad, data + r->grad, nargs * sizeof(double));
+  }
+  if (hes != NULL){
+    memcpy(hes, data + r->hes, nargs * (nargs + 1) / 2 * sizeof(double));
+  }
+  return r->value;
+}
+
+void external_evaluate_batch(int f, int nargs, int ncall, double * x, double * values, bool hessian){
+  int at[nargs > 0 ? nargs : 1];
+  struct ExternalArgs al = _external_arglist(f, nargs, at);
+  for (int k=0; k<ncall; k++){
+    values[k] = _external_result(f, nargs, x + (long)k * nargs, hessian, &al)->value;
+  }
+}
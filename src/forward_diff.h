@@ -24,6 +24,8 @@
  *
  *     Number of variables (total, not just in this expression).
  *
+ * Returns -1 if some operator was evaluated outside its domain (see
+ * op_derivs.h), in which case the affected values are NaN, and 0 otherwise.
  */
 // TODO: The linked list data structure is convenient for construction,
 // but not that easy to work with. Should I update this function to return
@@ -42,6 +44,8 @@ int _forward_diff_expression(struct Node expr, struct VarListNode * wrt, double
 int forward_diff(struct Node expr, struct VarListNode * wrt, double * values, int nvar){
   switch(expr.type){
     case CONST_NODE:
+    case PARAM_NODE:
+      // Parameters are constants as far as differentiation is concerned
       return _forward_diff_constant(expr, wrt, values, nvar);
     case VAR_NODE:
       return _forward_diff_variable(expr, wrt, values, nvar);
@@ -81,9 +85,14 @@ int _forward_diff_expression(struct Node expr, struct VarListNode * wrt, double
   double deriv_op[expr.data.expr->nargs];
   // Evaluate the derivative of the operator. This is a vector of multipliers
   // for the derivatives of each argument.
-  DIFF_OP[expr.data.expr->op](expr.data.expr->args, expr.data.expr->nargs, deriv_op);
+  int status = diff_operator(expr.data.expr->op, expr.data.expr->args, expr.data.expr->nargs, deriv_op);
 
   for (int i=0; i<expr.data.expr->nargs; i++){
+    if (deriv_op[i] == 0.0){
+      // E.g. the branch of an if-then-else that wasn't taken, which may
+      // not even be defined here
+      continue;
+    }
     // This is inefficient. I allocate an array of size nvar for every
     // argument of every expression.
     // This is forward differentiation. But presumably I could store these
@@ -91,13 +100,15 @@ int _forward_diff_expression(struct Node expr, struct VarListNode * wrt, double
     double arg_values[nvar];
     for (int j=0; j<nvar; j++){arg_values[j] = 0.0;}
 
-    forward_diff(expr.data.expr->args[i], wrt, arg_values, nvar);
+    if (forward_diff(expr.data.expr->args[i], wrt, arg_values, nvar) != 0){
+      status = -1;
+    }
 
     for (int j=0; j<nvar; j++){
       values[j] += deriv_op[i] * arg_values[j];
     }
   }
-  return 0;
+  return status;
 }
 
 /*
@@ -121,9 +132,9 @@ struct CSRMatrix forward_diff_expression(struct Node expr, int nvar){
   int ret = forward_diff(expr, varlist, deriv_values, nvar);
 
   // NOTE: These arrays will have to be freed later.
-  int * indices = malloc(sizeof(int) * nnz);
-  int * indptr = malloc(sizeof(int) * 2);
-  double * csr_values = malloc(sizeof(double) * nnz);
+  int * indices = mem_alloc(MEM_SPARSE, sizeof(int) * nnz);
+  int * indptr = mem_alloc(MEM_SPARSE, sizeof(int) * 2);
+  double * csr_values = mem_alloc(MEM_SPARSE, sizeof(double) * nnz);
 
   // We only have one row, so indptr is trivial
   indptr[0] = 0;
@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+
+/*
+ * Generate a synthetic .nl file, for benchmarks at sizes that model.py (and
+ * pyomo) can't easily produce.
+ *
+ * Usage: ./gen-nl FILE NCON [NVAR [DEPTH [DENSITY [MIX [SEED]]]]]
+ *
+ * - NVAR is the number of variables (default NCON)
+ * - DEPTH is the depth of each constraint's expression tree (default 3)
+ * - DENSITY is the number of variables in each constraint (default 3).
+ *   Constraint i uses variables near i * NVAR / NCON, so the Jacobian is
+ *   banded, as in most discretized models.
+ * - MIX is the fraction of operators that are nonlinear functions
+ *   (sin, cos, exp, division or square) rather than sums, differences and
+ *   products (default 0.5)
+ * - SEED seeds the random choices (default 1)
+ *
+ * The objective is the sum of squares of the variables, as in model.py. We
+ * write the same segments as AMPL: C and O expressions, then ranges (every
+ * constraint is = 0), bounds (every variable is free), Jacobian column
+ * counts, and the Jacobian and gradient structures with zero linear
+ * coefficients.
+ */
+
+unsigned int lcg_state = 1;
+unsigned int lcg(){
+  lcg_state = lcg_state * 1103515245u + 12345u;
+  return lcg_state >> 8;
+}
+
+double uniform(){
+  return (lcg() % 1000000) / 1000000.0;
+}
+
+// Write an expression of the given depth over the variables vars[0..nv)
+void write_expression(FILE * fp, int depth, int nv, int * vars, double mix){
+  if (depth == 0){
+    if (uniform() < 0.1){
+      fprintf(fp, "n%.3f\n", 0.5 + uniform());
+    }else{
+      fprintf(fp, "v%d\n", vars[lcg() % nv]);
+    }
+    return;
+  }
+  if (uniform() < mix){
+    switch(lcg() % 5){
+      case 0:
+        fprintf(fp, "o41\n");  // sin
+        write_expression(fp, depth-1, nv, vars, mix);
+        break;
+      case 1:
+        fprintf(fp, "o46\n");  // cos
+        write_expression(fp, depth-1, nv, vars, mix);
+        break;
+      case 2:
+        // exp(sin(.)), so values stay bounded at any depth
+        fprintf(fp, "o44\no41\n");
+        write_expression(fp, depth-1, nv, vars, mix);
+        break;
+      case 3:
+        // a / (1 + b^2), which is never a division by zero
+        fprintf(fp, "o3\n");
+        write_expression(fp, depth-1, nv, vars, mix);
+        fprintf(fp, "o0\nn1\no5\n");
+        write_expression(fp, depth-1, nv, vars, mix);
+        fprintf(fp, "n2\n");
+        break;
+      default:
+        fprintf(fp, "o5\n");  // square
+        write_expression(fp, depth-1, nv, vars, mix);
+        fprintf(fp, "n2\n");
+    }
+  }else{
+    fprintf(fp, "o%d\n", (int)(lcg() % 3));  // +, -, *
+    write_expression(fp, depth-1, nv, vars, mix);
+    write_expression(fp, depth-1, nv, vars, mix);
+  }
+}
+
+int main(int narg, char ** argv){
+  if (narg < 3){
+    printf("Usage: %s FILE NCON [NVAR [DEPTH [DENSITY [MIX [SEED]]]]]\n", argv[0]);
+    return -1;
+  }
+  int ncon = atoi(argv[2]);
+  int nvar = narg > 3 ? atoi(argv[3]) : ncon;
+  int depth = narg > 4 ? atoi(argv[4]) : 3;
+  int density = narg > 5 ? atoi(argv[5]) : 3;
+  double mix = narg > 6 ? atof(argv[6]) : 0.5;
+  lcg_state = narg > 7 ? atoi(argv[7]) : 1;
+  if (density > nvar){density = nvar;}
+
+  FILE * fp = fopen(argv[1], "w");
+  if (fp == NULL){
+    printf("ERROR: Could not open %s\n", argv[1]);
+    return -1;
+  }
+  // Each constraint's variables are distinct, so the Jacobian has
+  // ncon * density entries. A variable only appears in the Jacobian if it
+  // appears in the expression, so we put every variable in a final sum.
+  int * vars = malloc(density * sizeof(int));
+  long jnnz = (long)ncon * density;
+  fprintf(fp, "g3 1 1 0\t# problem synthetic\n");
+  fprintf(fp, " %d %d 1 0 %d\t# vars, constraints, objectives, ranges, eqns\n", nvar, ncon, ncon);
+  fprintf(fp, " %d 1\t# nonlinear constraints, objectives\n", ncon);
+  fprintf(fp, " 0 0\t# network constraints: nonlinear, linear\n");
+  fprintf(fp, " %d %d %d\t# nonlinear vars in constraints, objectives, both\n", nvar, nvar, nvar);
+  fprintf(fp, " 0 0 0 1\t# linear network variables; functions; arith, flags\n");
+  fprintf(fp, " 0 0 0 0 0\t# discrete variables: binary, integer, nonlinear (b,c,o)\n");
+  fprintf(fp, " %ld %d\t# nonzeros in Jacobian, gradients\n", jnnz, nvar);
+  fprintf(fp, " 0 0\t# max name lengths: constraints, variables\n");
+  fprintf(fp, " 0 0 0 0 0\t# common exprs: b,c,o,c1,o1\n");
+
+  for (int i=0; i<ncon; i++){
+    int first = (int)((long)i * nvar / ncon);
+    for (int k=0; k<density; k++){vars[k] = (first + k) % nvar;}
+    fprintf(fp, "C%d\n", i);
+    fprintf(fp, "o54\n%d\n", density + 1);
+    write_expression(fp, depth, density, vars, mix);
+    for (int k=0; k<density; k++){
+      fprintf(fp, "v%d\n", vars[k]);
+    }
+  }
+  fprintf(fp, "O0 0\n");
+  fprintf(fp, "o54\n%d\n", nvar);
+  for (int j=0; j<nvar; j++){fprintf(fp, "o5\nv%d\nn2\n", j);}
+
+  fprintf(fp, "x0\n");
+  fprintf(fp, "r\n");
+  for (int i=0; i<ncon; i++){fprintf(fp, "4 0\n");}
+  fprintf(fp, "b\n");
+  for (int j=0; j<nvar; j++){fprintf(fp, "3\n");}
+  // Cumulative Jacobian column counts, for all but the last column
+  long * col_count = calloc(nvar + 1, sizeof(long));
+  for (int i=0; i<ncon; i++){
+    int first = (int)((long)i * nvar / ncon);
+    for (int k=0; k<density; k++){col_count[(first + k) % nvar] += 1;}
+  }
+  fprintf(fp, "k%d\n", nvar - 1);
+  long cumulative = 0;
+  for (int j=0; j<nvar-1; j++){
+    cumulative += col_count[j];
+    fprintf(fp, "%ld\n", cumulative);
+  }
+  for (int i=0; i<ncon; i++){
+    int first = (int)((long)i * nvar / ncon);
+    // Variables in increasing order
+    int start = 0;
+    for (int k=0; k<density; k++){
+      vars[k] = (first + k) % nvar;
+      if (k > 0 && vars[k] < vars[k-1]){start = k;}
+    }
+    fprintf(fp, "J%d %d\n", i, density);
+    for (int k=0; k<density; k++){
+      fprintf(fp, "%d 0\n", vars[(start + k) % density]);
+    }
+  }
+  fprintf(fp, "G0 %d\n", nvar);
+  for (int j=0; j<nvar; j++){fprintf(fp, "%d 0\n", j);}
+
+  fclose(fp);
+  free(col_count);
+  free(vars);
+  return 0;
+}
@@ -0,0 +1,430 @@
+/*
+ * Hessian sparsity detection and compressed Hessians
+ *
+ * tape_hessian_structure assumes that every pair of variables in an
+ * expression interacts, and tape_hessian computes one Hessian-vector product
+ * per row. Both get expensive for large models: the Hessian of
+ * v0 * v1 + sin(v2) + v3 has two nonzeros, not ten, and a solver needs the
+ * structure up front to allocate its KKT matrix.
+ *
+ * hessian_sparsity finds the nonlinear interactions between variables from
+ * the Node trees. The Hessian of f(u_1, ..., u_n) is
+ *
+ *     sum_ij d2f/du_i du_j grad(u_i) grad(u_j)^T + sum_i df/du_i hess(u_i)
+ *
+ * so, if S_i is the set of variables in argument i, each operator adds the
+ * interactions of its arguments and
+ * - nothing for sums, subtractions and negations, which are linear
+ * - S_i x S_j, for i != j, for products
+ * - S_a x S_b and S_b x S_b for a / b
+ * - (union of S_i) x (union of S_i) for any other operator
+ * Shared OperatorNodes (see cse.h) are visited once per reference.
+ *
+ * The block of a nonlinear operator contains the blocks of its arguments,
+ * so in nested nonlinear operators, e.g. exp(sin(cos(v0 + v1))), the block
+ * is only added once, by the outermost one. Only the lower triangle of
+ * each block is added, and the entries are deduplicated whenever the
+ * buffer fills up, so it holds at most about twice as many entries as the
+ * structure.
+ *
+ * star_coloring colors the variables so that adjacent variables (in the
+ * graph of the Hessian) have different colors, and every path on four
+ * vertices uses at least three colors. With such a coloring, every entry of
+ * the Hessian can be read directly from the product of the Hessian with the
+ * sum of the unit vectors of one color. colored_hessian computes the
+ * Hessian with one Hessian-vector product per color, rather than one per
+ * variable, e.g. three for a tridiagonal Hessian of any size.
+ *
+ * Usage:
+ *
+ *     struct CSRMatrix hess = hessian_sparsity(constraints, ncon, nvar);
+ *     struct HessianColoring coloring = star_coloring(hess);
+ *     tape_evaluate(&tape, x, p, values);
+ *     colored_hessian(&tape, &coloring, values, lambda, dvalues, adjoints, dadjoints, hess.values);
+ */
+
+/*
+ * Return the lower triangle of the sparsity structure of the Hessian of the
+ * Lagrangian of the expressions, with indices sorted within each row.
+ */
+struct CSRMatrix hessian_sparsity(struct Node * exprs, int nexpr, int nvar);
+
+struct HessianColoring {
+  int nvar;
+  int ncolor;
+  // Color of each variable
+  int * colors;
+  // The product with the unit vectors of color c gives entries
+  // entries[entry_indptr[c]], ..., entries[entry_indptr[c+1]-1] of the
+  // Hessian structure, in rows source_rows[entry_indptr[c]], ...
+  int * entry_indptr;
+  int * entries;
+  int * source_rows;
+};
+
+/*
+ * Color the variables of a Hessian structure returned by hessian_sparsity
+ * (or tape_hessian_structure), and find where each entry can be recovered.
+ * We color greedily, in the order of the variables.
+ */
+struct HessianColoring star_coloring(struct CSRMatrix hess);
+void free_hessian_coloring(struct HessianColoring coloring);
+
+/*
+ * Compute the lower triangle of the Hessian of the Lagrangian, in the order
+ * of the structure that was colored, with one Hessian-vector product per
+ * color. dvalues, adjoints and dadjoints have length tape->nnode.
+ */
+int colored_hessian(
+  struct Tape * tape,
+  struct HessianColoring * coloring,
+  double * values,
+  double * lambda,
+  double * dvalues,
+  double * adjoints,
+  double * dadjoints,
+  double * hess_values
+);
+
+// Entries found so far, encoded as row * nvar + col (see csr_from_entries)
+struct SparsityBuilder {
+  int nvar;
+  long nkey;
+  long capacity;
+  long * keys;
+};
+
+void _sparsity_reserve(struct SparsityBuilder * sb, long n);
+void _sparsity_add_pairs(struct SparsityBuilder * sb, int n1, int * s1, int n2, int * s2);
+void _sparsity_add_block(struct SparsityBuilder * sb, int n, int * s);
+int _hessian_sparsity_node(struct Node expr, struct SparsityBuilder * sb, int ** vars, bool * block);
+
+// Make room for n more entries, first dropping duplicates if that frees
+// enough space
+void _sparsity_reserve(struct SparsityBuilder * sb, long n){
+  if (sb->nkey + n <= sb->capacity){
+    return;
+  }
+  if (sb->nkey > 1){
+    qsort(sb->keys, sb->nkey, sizeof(long), _compare_long);
+    long nunique = 0;
+    for (long k=0; k<sb->nkey; k++){
+      if (nunique == 0 || sb->keys[nunique-1] != sb->keys[k]){
+        sb->keys[nunique] = sb->keys[k];
+        nunique += 1;
+      }
+    }
+    sb->nkey = nunique;
+  }
+  if (sb->nkey + n > sb->capacity / 2){
+    while (sb->nkey + n > sb->capacity / 2){sb->capacity *= 2;}
+    sb->keys = realloc(sb->keys, sb->capacity * sizeof(long));
+  }
+}
+
+// Add s1 x s2, in the lower triangle
+void _sparsity_add_pairs(struct SparsityBuilder * sb, int n1, int * s1, int n2, int * s2){
+  _sparsity_reserve(sb, (long)n1 * n2);
+  for (int a=0; a<n1; a++){
+    for (int b=0; b<n2; b++){
+      int row = s1[a] > s2[b] ? s1[a] : s2[b];
+      int col = s1[a] > s2[b] ? s2[b] : s1[a];
+      sb->keys[sb->nkey] = (long)row * sb->nvar + col;
+      sb->nkey += 1;
+    }
+  }
+}
+
+// Add the lower triangle of s x s, for sorted s
+void _sparsity_add_block(struct SparsityBuilder * sb, int n, int * s){
+  _sparsity_reserve(sb, (long)n * (n + 1) / 2);
+  for (int a=0; a<n; a++){
+    for (int b=0; b<=a; b++){
+      sb->keys[sb->nkey] = (long)s[a] * sb->nvar + s[b];
+      sb->nkey += 1;
+    }
+  }
+}
+
+/*
+ * Add the interactions of expr to the builder, and return the (sorted)
+ * variables in expr in a new array, *vars. If *block is set, the
+ * interactions include vars x vars, which the caller has to add, unless
+ * it adds a block containing it.
+ */
+int _hessian_sparsity_node(struct Node expr, struct SparsityBuilder * sb, int ** vars, bool * block){
+  *block = false;
+  switch(expr.type){
+    case CONST_NODE:
+    case PARAM_NODE:
+      *vars = malloc(sizeof(int));
+      return 0;
+    case VAR_NODE:
+      *vars = malloc(sizeof(int));
+      (*vars)[0] = expr.data.var->index;
+      return 1;
+    case OP_NODE:
+      break;
+  }
+  struct OperatorNode * opnode = expr.data.expr;
+  int nargs = opnode->nargs;
+  int ** arg_vars = malloc(nargs * sizeof(int *));
+  int * arg_nvar = malloc(nargs * sizeof(int));
+  bool * arg_block = malloc(nargs * sizeof(bool));
+  int total = 0;
+  for (int i=0; i<nargs; i++){
+    arg_nvar[i] = _hessian_sparsity_node(opnode->args[i], sb, &arg_vars[i], &arg_block[i]);
+    total += arg_nvar[i];
+  }
+
+  // The union of the arguments' variables
+  int * all_vars = malloc((total + 1) * sizeof(int));
+  int n = 0;
+  for (int i=0; i<nargs; i++){
+    for (int k=0; k<arg_nvar[i]; k++){
+      all_vars[n] = arg_vars[i][k];
+      n += 1;
+    }
+  }
+  if (n > 1){
+    qsort(all_vars, n, sizeof(int), _compare_int);
+  }
+  int nvar = 0;
+  for (int k=0; k<n; k++){
+    if (nvar == 0 || all_vars[nvar-1] != all_vars[k]){
+      all_vars[nvar] = all_vars[k];
+      nvar += 1;
+    }
+  }
+
+  switch(opnode->op){
+    case PRODUCT:
+      for (int i=0; i<nargs; i++){
+        for (int j=i+1; j<nargs; j++){
+          _sparsity_add_pairs(sb, arg_nvar[i], arg_vars[i], arg_nvar[j], arg_vars[j]);
+        }
+      }
+      break;
+    case DIVISION:
+      _sparsity_add_pairs(sb, arg_nvar[0], arg_vars[0], arg_nvar[1], arg_vars[1]);
+      _sparsity_add_block(sb, arg_nvar[1], arg_vars[1]);
+      arg_block[1] = false;
+      break;
+    default:
+      // Operators whose second partials are all zero (e.g. sums, or
+      // piecewise linear operators like min) add no pairs of their own.
+      // Other operators leave their block to the caller, and it contains
+      // their arguments' blocks.
+      if (OPERATOR_DATA[opnode->op].deriv2 != NULL){
+        *block = true;
+      }
+  }
+  for (int i=0; i<nargs; i++){
+    if (arg_block[i] && !*block){
+      _sparsity_add_block(sb, arg_nvar[i], arg_vars[i]);
+    }
+  }
+
+  for (int i=0; i<nargs; i++){free(arg_vars[i]);}
+  free(arg_vars);
+  free(arg_nvar);
+  free(arg_block);
+  *vars = all_vars;
+  return nvar;
+}
+
+struct CSRMatrix hessian_sparsity(struct Node * exprs, int nexpr, int nvar){
+  TRACE_BEGIN("hessian_sparsity");
+  struct SparsityBuilder sb = {
+    .nvar = nvar,
+    .nkey = 0,
+    .capacity = 16,
+    .keys = malloc(16 * sizeof(long)),
+  };
+  for (int i=0; i<nexpr; i++){
+    int * vars;
+    bool block;
+    int n = _hessian_sparsity_node(exprs[i], &sb, &vars, &block);
+    if (block){
+      _sparsity_add_block(&sb, n, vars);
+    }
+    free(vars);
+  }
+  struct CSRMatrix hess = csr_from_entries(sb.keys, sb.nkey, nvar, nvar);
+  free(sb.keys);
+  TRACE_END("hessian_sparsity");
+  return hess;
+}
+
+struct HessianColoring star_coloring(struct CSRMatrix hess){
+  TRACE_BEGIN("star_coloring");
+  int nvar = hess.nrow;
+  // Adjacency lists of the graph, i.e. the off-diagonal entries of both
+  // triangles
+  int * adj_indptr = malloc((nvar + 1) * sizeof(int));
+  for (int l=0; l<=nvar; l++){adj_indptr[l] = 0;}
+  for (int l=0; l<nvar; l++){
+    for (int k=hess.indptr[l]; k<hess.indptr[l+1]; k++){
+      if (hess.indices[k] != l){
+        adj_indptr[l+1] += 1;
+        adj_indptr[hess.indices[k]+1] += 1;
+      }
+    }
+  }
+  for (int l=0; l<nvar; l++){adj_indptr[l+1] += adj_indptr[l];}
+  int * adj = malloc((adj_indptr[nvar] + 1) * sizeof(int));
+  int * next = malloc((nvar + 1) * sizeof(int));
+  for (int l=0; l<nvar; l++){next[l] = adj_indptr[l];}
+  for (int l=0; l<nvar; l++){
+    for (int k=hess.indptr[l]; k<hess.indptr[l+1]; k++){
+      int j = hess.indices[k];
+      if (j != l){
+        adj[next[l]] = j;
+        next[l] += 1;
+        adj[next[j]] = l;
+        next[j] += 1;
+      }
+    }
+  }
+
+  int * colors = malloc((nvar + 1) * sizeof(int));
+  for (int l=0; l<nvar; l++){colors[l] = -1;}
+  // forbidden[c] == v if vertex v can't have color c, and count[c] is the
+  // number of neighbors of v with color c, if count_stamp[c] == v
+  int * forbidden = malloc((nvar + 1) * sizeof(int));
+  int * count = malloc((nvar + 1) * sizeof(int));
+  int * count_stamp = malloc((nvar + 1) * sizeof(int));
+  for (int c=0; c<nvar; c++){
+    forbidden[c] = -1;
+    count_stamp[c] = -1;
+  }
+  int ncolor = 0;
+  for (int v=0; v<nvar; v++){
+    for (int k=adj_indptr[v]; k<adj_indptr[v+1]; k++){
+      int c = colors[adj[k]];
+      if (c >= 0){
+        forbidden[c] = v;
+        count[c] = count_stamp[c] == v ? count[c] + 1 : 1;
+        count_stamp[c] = v;
+      }
+    }
+    // Every path on four vertices is checked when its last vertex is
+    // colored. By symmetry, v is either the first or the second vertex.
+    for (int k=adj_indptr[v]; k<adj_indptr[v+1]; k++){
+      int w = adj[k];
+      if (colors[w] < 0){continue;}
+      for (int kx=adj_indptr[w]; kx<adj_indptr[w+1]; kx++){
+        int x = adj[kx];
+        if (x == v || colors[x] < 0 || forbidden[colors[x]] == v){continue;}
+        if (count[colors[w]] > 1){
+          // u - v - w - x, where u is another neighbor of v colored like w
+          forbidden[colors[x]] = v;
+          continue;
+        }
+        for (int ky=adj_indptr[x]; ky<adj_indptr[x+1]; ky++){
+          int y = adj[ky];
+          if (y != w && colors[y] == colors[w]){
+            // v - w - x - y
+            forbidden[colors[x]] = v;
+            break;
+          }
+        }
+      }
+    }
+    int c = 0;
+    while (forbidden[c] == v){c += 1;}
+    colors[v] = c;
+    if (c + 1 > ncolor){ncolor = c + 1;}
+  }
+
+  // Entry (l, j) is the only entry of row l (or row j) in the product with
+  // color colors[j] (or colors[l]) if j is the only neighbor of l with its
+  // color. A star coloring guarantees that one of the two is.
+  int * entry_color = malloc((hess.nnz + 1) * sizeof(int));
+  int * entry_row = malloc((hess.nnz + 1) * sizeof(int));
+  for (int l=0; l<nvar; l++){
+    for (int k=hess.indptr[l]; k<hess.indptr[l+1]; k++){
+      int j = hess.indices[k];
+      int nsame = 0;
+      for (int ka=adj_indptr[l]; ka<adj_indptr[l+1]; ka++){
+        if (colors[adj[ka]] == colors[j]){nsame += 1;}
+      }
+      if (j == l || nsame == 1){
+        entry_color[k] = colors[j];
+        entry_row[k] = l;
+      }else{
+        entry_color[k] = colors[l];
+        entry_row[k] = j;
+      }
+    }
+  }
+  struct HessianColoring coloring = {
+    .nvar = nvar,
+    .ncolor = ncolor,
+    .colors = colors,
+    .entry_indptr = malloc((ncolor + 1) * sizeof(int)),
+    .entries = malloc((hess.nnz + 1) * sizeof(int)),
+    .source_rows = malloc((hess.nnz + 1) * sizeof(int)),
+  };
+  for (int c=0; c<=ncolor; c++){coloring.entry_indptr[c] = 0;}
+  for (int k=0; k<hess.nnz; k++){coloring.entry_indptr[entry_color[k]+1] += 1;}
+  for (int c=0; c<ncolor; c++){
+    coloring.entry_indptr[c+1] += coloring.entry_indptr[c];
+    next[c] = coloring.entry_indptr[c];
+  }
+  for (int k=0; k<hess.nnz; k++){
+    int c = entry_color[k];
+    coloring.entries[next[c]] = k;
+    coloring.source_rows[next[c]] = entry_row[k];
+    next[c] += 1;
+  }
+
+  free(adj_indptr);
+  free(adj);
+  free(next);
+  free(forbidden);
+  free(count);
+  free(count_stamp);
+  free(entry_color);
+  free(entry_row);
+  TRACE_END("star_coloring");
+  return coloring;
+}
+
+void free_hessian_coloring(struct HessianColoring coloring){
+  free(coloring.colors);
+  free(coloring.entry_indptr);
+  free(coloring.entries);
+  free(coloring.source_rows);
+}
+
+int colored_hessian(
+  struct Tape * tape,
+  struct HessianColoring * coloring,
+  double * values,
+  double * lambda,
+  double * dvalues,
+  double * adjoints,
+  double * dadjoints,
+  double * hess_values
+){
+  TRACE_BEGIN("colored_hessian");
+  INSTRUMENT_START(hess_start);
+  long nsweep = 0;
+  for (int c=0; c<coloring->ncolor; c++){
+    if (coloring->entry_indptr[c] == coloring->entry_indptr[c+1]){
+      continue;
+    }
+    for (int j=0; j<tape->nvar; j++){
+      dvalues[j] = coloring->colors[j] == c ? 1.0 : 0.0;
+    }
+    _tape_second_order_sweep(tape, values, lambda, dvalues, adjoints, dadjoints);
+    nsweep += 1;
+    for (int k=coloring->entry_indptr[c]; k<coloring->entry_indptr[c+1]; k++){
+      hess_values[coloring->entries[k]] = dadjoints[coloring->source_rows[k]];
+    }
+  }
+  INSTRUMENT_STOP(INSTRUMENT_HESSIAN, hess_start, nsweep * tape->nnode);
+  TRACE_END("colored_hessian");
+  return 0;
+}
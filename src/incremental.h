@@ -0,0 +1,426 @@
+/*
+ * Incremental re-evaluation of constraints
+ *
+ * When only a few variables change between evaluations, most constraints
+ * (and most subexpressions of the constraints that do change) have the same
+ * value as before. Here we cache the value of every OperatorNode in
+ * OperatorNode.value. The dependency map numbers the operators so that
+ * arguments come first (like a tape) and records which operators use each
+ * variable and each operator, so we recompute only the nodes that depend on a
+ * changed variable, without walking the rest of their constraints.
+ *
+ * Usage:
+ *
+ *     struct DependencyMap depmap = build_dependency_map(cons, ncon, nvar);
+ *     evaluate_constraints_cached(cons, ncon, values);
+ *     // ... update variables[i].value for i in changed ...
+ *     reevaluate_constraints(cons, ncon, values, &depmap, changed, nchanged);
+ *
+ * Cached values are only valid if every change to a variable's value is
+ * reported to reevaluate_constraints. Parameter changes are not tracked,
+ * so evaluate_constraints_cached must be called after changing a parameter.
+ */
+
+struct DependencyMap {
+  int nvar;
+  int ncon;
+  // Constraints containing variable i are
+  // indices[indptr[i]], ..., indices[indptr[i+1]-1]
+  int * indptr;
+  int * indices;
+  // The distinct OperatorNodes of the constraints, numbered so that every
+  // node comes after its arguments (shared nodes appear once)
+  int nnode;
+  struct OperatorNode ** nodes;
+  // Nodes with node k as an argument are
+  // parents[parent_indptr[k]], ..., parents[parent_indptr[k+1]-1]
+  int * parent_indptr;
+  int * parents;
+  // Nodes with variable i as an argument are
+  // var_nodes[var_indptr[i]], ..., var_nodes[var_indptr[i+1]-1]
+  int * var_indptr;
+  int * var_nodes;
+  // Workspace used to avoid re-evaluating a node or a constraint more than
+  // once per call to reevaluate_constraints, and the list of dirty nodes.
+  bool * node_dirty;
+  bool * con_dirty;
+  int * worklist;
+};
+
+/*
+ * Construct the map from variables to the constraints and operators that
+ * contain them. The former is the transpose of the Jacobian sparsity
+ * structure.
+ */
+struct DependencyMap build_dependency_map(struct Node * exprs, int ncon, int nvar);
+void free_dependency_map(struct DependencyMap depmap);
+
+/*
+ * Evaluate an expression, storing the value of every OperatorNode in the
+ * tree in OperatorNode.value.
+ */
+double evaluate_and_cache(struct Node expr);
+
+/*
+ * Evaluate all constraints, caching subexpression values and storing
+ * the value of constraint i in values[i].
+ */
+int evaluate_constraints_cached(struct Node * exprs, int ncon, double * values);
+
+/*
+ * Update constraint values after the variables with indices in `changed`
+ * have changed. Only the operators with a changed variable below them are
+ * recomputed, in the order of depmap->nodes, so the cost is proportional to
+ * the number of these operators (and their arguments) rather than to the
+ * size of the constraints that contain a changed variable. Returns the
+ * number of constraints that were updated, or -1 (without updating
+ * anything) if a variable index is out of bounds.
+ */
+int reevaluate_constraints(
+  struct Node * exprs,
+  int ncon,
+  double * values,
+  struct DependencyMap * depmap,
+  int * changed,
+  int nchanged
+);
+
+// State for numbering the OperatorNodes in build_dependency_map
+struct DependencyBuilder {
+  int nnode;
+  struct OperatorNode ** nodes;
+  // Argument edges as (child, parent) and (variable, parent) pairs
+  int nedge;
+  int edge_capacity;
+  int * edge_child;
+  int * edge_parent;
+  int nvar_edge;
+  int var_edge_capacity;
+  int * var_edge_var;
+  int * var_edge_parent;
+  // Map from shared OperatorNodes to their number
+  int map_capacity;
+  struct OperatorNode ** map_keys;
+  int * map_values;
+};
+
+double _evaluate_from_arg_values(struct OperatorNode * expr, double * arg_values);
+int _depmap_count_nodes(struct Node expr);
+int _depmap_map_find(struct DependencyBuilder * db, struct OperatorNode * expr);
+int _depmap_number_node(struct Node expr, struct DependencyBuilder * db);
+void _depmap_transpose(int n, int nedge, int * from, int * to, int ** indptr, int ** indices);
+int _depmap_compare_int(const void * a, const void * b);
+double _cached_value(struct Node expr);
+
+int _depmap_count_nodes(struct Node expr){
+  if (expr.type != OP_NODE){
+    return 0;
+  }
+  int count = 1;
+  for (int i=0; i<expr.data.expr->nargs; i++){
+    count += _depmap_count_nodes(expr.data.expr->args[i]);
+  }
+  return count;
+}
+
+// Position of expr in the map, or of the empty slot where it should go. The
+// same open addressing as the tape compiler's map (see tape.h).
+int _depmap_map_find(struct DependencyBuilder * db, struct OperatorNode * expr){
+  int mask = db->map_capacity - 1;
+  int pos = (int)(((uintptr_t)expr >> 4) * 2654435761u) & mask;
+  while (db->map_keys[pos] && db->map_keys[pos] != expr){
+    pos = (pos + 1) & mask;
+  }
+  return pos;
+}
+
+/*
+ * Number expr after its arguments and record its argument edges. Returns
+ * its number, or -1 if it is not an operator.
+ */
+int _depmap_number_node(struct Node expr, struct DependencyBuilder * db){
+  if (expr.type != OP_NODE){
+    return -1;
+  }
+  struct OperatorNode * opnode = expr.data.expr;
+  int pos = -1;
+  if (opnode->nshared > 0){
+    pos = _depmap_map_find(db, opnode);
+    if (db->map_keys[pos]){
+      return db->map_values[pos];
+    }
+  }
+  int * children = malloc((opnode->nargs > 0 ? opnode->nargs : 1) * sizeof(int));
+  for (int i=0; i<opnode->nargs; i++){
+    children[i] = _depmap_number_node(opnode->args[i], db);
+  }
+  int id = db->nnode;
+  db->nodes[id] = opnode;
+  db->nnode += 1;
+  if (pos >= 0){
+    // Arguments may have been inserted since we looked
+    pos = _depmap_map_find(db, opnode);
+    db->map_keys[pos] = opnode;
+    db->map_values[pos] = id;
+  }
+  for (int i=0; i<opnode->nargs; i++){
+    if (children[i] >= 0){
+      if (db->nedge == db->edge_capacity){
+        db->edge_capacity *= 2;
+        db->edge_child = realloc(db->edge_child, db->edge_capacity * sizeof(int));
+        db->edge_parent = realloc(db->edge_parent, db->edge_capacity * sizeof(int));
+      }
+      db->edge_child[db->nedge] = children[i];
+      db->edge_parent[db->nedge] = id;
+      db->nedge += 1;
+    }else if (opnode->args[i].type == VAR_NODE){
+      if (db->nvar_edge == db->var_edge_capacity){
+        db->var_edge_capacity *= 2;
+        db->var_edge_var = realloc(db->var_edge_var, db->var_edge_capacity * sizeof(int));
+        db->var_edge_parent = realloc(db->var_edge_parent, db->var_edge_capacity * sizeof(int));
+      }
+      db->var_edge_var[db->nvar_edge] = opnode->args[i].data.var->index;
+      db->var_edge_parent[db->nvar_edge] = id;
+      db->nvar_edge += 1;
+    }
+  }
+  free(children);
+  return id;
+}
+
+// Group the pairs (from[k], to[k]) by from, as a CSR structure with n rows
+void _depmap_transpose(int n, int nedge, int * from, int * to, int ** indptr, int ** indices){
+  *indptr = malloc((n+1) * sizeof(int));
+  *indices = malloc((nedge > 0 ? nedge : 1) * sizeof(int));
+  for (int j=0; j<=n; j++){(*indptr)[j] = 0;}
+  for (int k=0; k<nedge; k++){(*indptr)[from[k]+1] += 1;}
+  for (int j=0; j<n; j++){(*indptr)[j+1] += (*indptr)[j];}
+  int * next = malloc((n > 0 ? n : 1) * sizeof(int));
+  for (int j=0; j<n; j++){next[j] = (*indptr)[j];}
+  for (int k=0; k<nedge; k++){
+    (*indices)[next[from[k]]] = to[k];
+    next[from[k]] += 1;
+  }
+  free(next);
+}
+
+int _depmap_compare_int(const void * a, const void * b){
+  int x = *(const int *)a;
+  int y = *(const int *)b;
+  return (x > y) - (x < y);
+}
+
+struct DependencyMap build_dependency_map(struct Node * exprs, int ncon, int nvar){
+  struct CSRMatrix jac = identify_jacobian_structure(exprs, ncon, nvar);
+
+  // Transpose the structure by counting the number of constraints that
+  // contain each variable.
+  int * indptr = malloc((nvar+1) * sizeof(int));
+  int * indices = malloc(jac.nnz * sizeof(int));
+  for (int j=0; j<=nvar; j++){indptr[j] = 0;}
+  for (int k=0; k<jac.nnz; k++){indptr[jac.indices[k]+1] += 1;}
+  for (int j=0; j<nvar; j++){indptr[j+1] += indptr[j];}
+  // Next insertion position for each variable
+  int * next = malloc(nvar * sizeof(int));
+  for (int j=0; j<nvar; j++){next[j] = indptr[j];}
+  for (int i=0; i<ncon; i++){
+    for (int k=jac.indptr[i]; k<jac.indptr[i+1]; k++){
+      int j = jac.indices[k];
+      indices[next[j]] = i;
+      next[j] += 1;
+    }
+  }
+  free(next);
+  free_csrmatrix(jac);
+
+  // Number the operators, children first. This over-counts shared nodes.
+  int max_nnode = 0;
+  for (int i=0; i<ncon; i++){max_nnode += _depmap_count_nodes(exprs[i]);}
+  struct DependencyBuilder db = {
+    .nnode = 0,
+    .nodes = malloc((max_nnode > 0 ? max_nnode : 1) * sizeof(struct OperatorNode *)),
+    .nedge = 0,
+    .edge_capacity = 16,
+    .edge_child = malloc(16 * sizeof(int)),
+    .edge_parent = malloc(16 * sizeof(int)),
+    .nvar_edge = 0,
+    .var_edge_capacity = 16,
+    .var_edge_var = malloc(16 * sizeof(int)),
+    .var_edge_parent = malloc(16 * sizeof(int)),
+    .map_capacity = 16,
+  };
+  // Keep the map's load factor below 1/2
+  while (db.map_capacity < 2 * max_nnode){db.map_capacity *= 2;}
+  db.map_keys = malloc(db.map_capacity * sizeof(struct OperatorNode *));
+  db.map_values = malloc(db.map_capacity * sizeof(int));
+  for (int k=0; k<db.map_capacity; k++){db.map_keys[k] = NULL;}
+  for (int i=0; i<ncon; i++){_depmap_number_node(exprs[i], &db);}
+
+  struct DependencyMap depmap = {
+    .nvar = nvar,
+    .ncon = ncon,
+    .indptr = indptr,
+    .indices = indices,
+    .nnode = db.nnode,
+    .nodes = db.nodes,
+    .node_dirty = malloc((db.nnode > 0 ? db.nnode : 1) * sizeof(bool)),
+    .con_dirty = malloc(ncon * sizeof(bool)),
+    .worklist = malloc((db.nnode > 0 ? db.nnode : 1) * sizeof(int)),
+  };
+  _depmap_transpose(db.nnode, db.nedge, db.edge_child, db.edge_parent, &depmap.parent_indptr, &depmap.parents);
+  _depmap_transpose(nvar, db.nvar_edge, db.var_edge_var, db.var_edge_parent, &depmap.var_indptr, &depmap.var_nodes);
+  free(db.edge_child);
+  free(db.edge_parent);
+  free(db.var_edge_var);
+  free(db.var_edge_parent);
+  free(db.map_keys);
+  free(db.map_values);
+  for (int k=0; k<db.nnode; k++){depmap.node_dirty[k] = false;}
+  for (int i=0; i<ncon; i++){depmap.con_dirty[i] = false;}
+  return depmap;
+}
+
+void free_dependency_map(struct DependencyMap depmap){
+  free(depmap.indptr);
+  free(depmap.indices);
+  free(depmap.nodes);
+  free(depmap.parent_indptr);
+  free(depmap.parents);
+  free(depmap.var_indptr);
+  free(depmap.var_nodes);
+  free(depmap.node_dirty);
+  free(depmap.con_dirty);
+  free(depmap.worklist);
+}
+
+// Apply an operator to already-computed argument values
+double _evaluate_from_arg_values(struct OperatorNode * expr, double * arg_values){
+  return OPERATOR_DATA[expr->op].value(expr->nargs, arg_values);
+}
+
+double evaluate_and_cache(struct Node expr){
+  switch(expr.type){
+    case CONST_NODE:
+      return expr.data.value;
+    case VAR_NODE:
+      return expr.data.var->value;
+    case PARAM_NODE:
+      return expr.data.param->value;
+    case OP_NODE:
+    {
+      struct OperatorNode * opnode = expr.data.expr;
+      double stack_values[MAX_STACK_NARGS];
+      double * arg_values = opnode->nargs <= MAX_STACK_NARGS ? stack_values : malloc(opnode->nargs * sizeof(double));
+      for (int i=0; i<opnode->nargs; i++){
+        arg_values[i] = evaluate_and_cache(opnode->args[i]);
+      }
+      opnode->value = _evaluate_from_arg_values(opnode, arg_values);
+      if (arg_values != stack_values){
+        free(arg_values);
+      }
+      return opnode->value;
+    }
+  }
+}
+
+int evaluate_constraints_cached(struct Node * exprs, int ncon, double * values){
+  for (int i=0; i<ncon; i++){
+    values[i] = evaluate_and_cache(exprs[i]);
+  }
+  return 0;
+}
+
+// Value of a node from the values cached by evaluate_and_cache
+double _cached_value(struct Node expr){
+  switch(expr.type){
+    case CONST_NODE:
+      return expr.data.value;
+    case VAR_NODE:
+      return expr.data.var->value;
+    case PARAM_NODE:
+      return expr.data.param->value;
+    case OP_NODE:
+      return expr.data.expr->value;
+  }
+  return 0.0;
+}
+
+int reevaluate_constraints(
+  struct Node * exprs,
+  int ncon,
+  double * values,
+  struct DependencyMap * depmap,
+  int * changed,
+  int nchanged
+){
+  // Mark the operators that use a changed variable, then their ancestors,
+  // using the worklist as a queue
+  for (int k=0; k<nchanged; k++){
+    if (changed[k] < 0 || changed[k] >= depmap->nvar){
+      printf("ERROR: Variable index %d out of bounds\n", changed[k]);
+      return -1;
+    }
+  }
+  int ndirty = 0;
+  for (int k=0; k<nchanged; k++){
+    int j = changed[k];
+    for (int kk=depmap->var_indptr[j]; kk<depmap->var_indptr[j+1]; kk++){
+      int node = depmap->var_nodes[kk];
+      if (!depmap->node_dirty[node]){
+        depmap->node_dirty[node] = true;
+        depmap->worklist[ndirty] = node;
+        ndirty += 1;
+      }
+    }
+  }
+  for (int w=0; w<ndirty; w++){
+    int node = depmap->worklist[w];
+    for (int kk=depmap->parent_indptr[node]; kk<depmap->parent_indptr[node+1]; kk++){
+      int parent = depmap->parents[kk];
+      if (!depmap->node_dirty[parent]){
+        depmap->node_dirty[parent] = true;
+        depmap->worklist[ndirty] = parent;
+        ndirty += 1;
+      }
+    }
+  }
+
+  // Recompute the dirty operators after their arguments
+  qsort(depmap->worklist, ndirty, sizeof(int), _depmap_compare_int);
+  for (int w=0; w<ndirty; w++){
+    struct OperatorNode * opnode = depmap->nodes[depmap->worklist[w]];
+    double stack_values[MAX_STACK_NARGS];
+    double * arg_values = opnode->nargs <= MAX_STACK_NARGS ? stack_values : malloc(opnode->nargs * sizeof(double));
+    for (int i=0; i<opnode->nargs; i++){
+      arg_values[i] = _cached_value(opnode->args[i]);
+    }
+    opnode->value = _evaluate_from_arg_values(opnode, arg_values);
+    if (arg_values != stack_values){
+      free(arg_values);
+    }
+    depmap->node_dirty[depmap->worklist[w]] = false;
+  }
+
+  int ncon_evaluated = 0;
+  for (int k=0; k<nchanged; k++){
+    int j = changed[k];
+    for (int kk=depmap->indptr[j]; kk<depmap->indptr[j+1]; kk++){
+      int i = depmap->indices[kk];
+      if (!depmap->con_dirty[i]){
+        depmap->con_dirty[i] = true;
+        values[i] = _cached_value(exprs[i]);
+        ncon_evaluated += 1;
+      }
+    }
+  }
+
+  // Reset the workspace for the next call. We only touch entries we set so
+  // this is proportional to the size of the change, not the model.
+  for (int k=0; k<nchanged; k++){
+    int j = changed[k];
+    for (int kk=depmap->indptr[j]; kk<depmap->indptr[j+1]; kk++){
+      depmap->con_dirty[depmap->indices[kk]] = false;
+    }
+  }
+  return ncon_evaluated;
+}
@@ -0,0 +1,243 @@
+#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+ * Optional counters for the time spent in each phase (parsing, tape
+ * compilation, evaluation, Jacobian, Hessian) and in each expression, so we
+ * can see what dominates a slow solve and which constraints are expensive.
+ *
+ * Counters are only compiled in with -DINSTRUMENT. Otherwise the macros
+ * below expand to nothing, and their arguments (e.g. node counts) are never
+ * evaluated, so the hot loops are unchanged.
+ *
+ * Usage (with -DINSTRUMENT):
+ *
+ *     instrument_init(ncon);
+ *     read_nl_constraints(fp, constraints, ncon, variables, nvar);
+ *     struct Evaluator ev = tape_evaluator(constraints, ncon, nvar);
+ *     ...
+ *     instrument_report(stdout, 10, constraints);
+ *     instrument_free();
+ *
+ * Per-expression counters are indexed by constraint index while parsing and
+ * by expression index on the tape, which are the same for a tape compiled
+ * from all the constraints. Without instrument_init, only the per-phase
+ * counters are kept.
+ *
+ * The counters are global and not thread-safe.
+ */
+
+// This header is included by both nl.h and tape.h, so unlike the others it
+// needs an include guard.
+
+enum InstrumentPhase {
+  INSTRUMENT_PARSE,
+  INSTRUMENT_COMPILE,
+  INSTRUMENT_EVAL,
+  INSTRUMENT_JACOBIAN,
+  INSTRUMENT_HESSIAN,
+  N_INSTRUMENT_PHASES,
+};
+
+const char * INSTRUMENT_PHASE_NAMES[N_INSTRUMENT_PHASES] = {
+  "parse",
+  "compile",
+  "eval",
+  "jacobian",
+  "hessian",
+};
+
+struct InstrumentCounter {
+  long calls;
+  // Expression nodes visited (or, while parsing, read)
+  long nodes;
+  uint64_t cycles;
+};
+
+struct Instrumentation {
+  struct InstrumentCounter phases[N_INSTRUMENT_PHASES];
+  // Counters for expression i are exprs[i * N_INSTRUMENT_PHASES + phase]
+  int nexpr;
+  struct InstrumentCounter * exprs;
+};
+
+struct Instrumentation INSTRUMENTATION = {.nexpr = 0, .exprs = NULL};
+
+// INSTRUMENT_START(t) declares a start time, t. INSTRUMENT_STOP adds the
+// time since t to a phase, along with nodes visited outside any expression,
+// and INSTRUMENT_STOP_EXPR adds it to an expression (within a phase).
+#ifdef INSTRUMENT
+#define INSTRUMENT_START(t) uint64_t t = instrument_cycles()
+#define INSTRUMENT_STOP(phase, t, nnode) _instrument_add((phase), -1, (t), (nnode))
+#define INSTRUMENT_STOP_EXPR(phase, iexpr, t, nnode) _instrument_add((phase), (iexpr), (t), (nnode))
+#else
+#define INSTRUMENT_START(t)
+#define INSTRUMENT_STOP(phase, t, nnode)
+#define INSTRUMENT_STOP_EXPR(phase, iexpr, t, nnode)
+#endif
+
+uint64_t instrument_cycles();
+void _instrument_add(enum InstrumentPhase phase, int iexpr, uint64_t start, long nnode);
+
+/*
+ * Allocate (zeroed) per-expression counters for nexpr expressions, and zero
+ * the per-phase counters.
+ */
+void instrument_init(int nexpr);
+void instrument_reset();
+void instrument_free();
+
+/*
+ * Print the per-phase counters, then the ntop expressions with the most
+ * cycles over all phases. If exprs is not NULL, each expression is printed
+ * (truncated) next to its counters.
+ */
+void instrument_report(FILE * fp, int ntop, struct Node * exprs);
+
+// Number of nodes in an expression tree, counting shared nodes each time
+long instrument_count_nodes(struct Node expr);
+
+/*
+ * Time stamp counter where we have one, which is cheap enough to read around
+ * every expression. Otherwise, nanoseconds.
+ */
+uint64_t instrument_cycles(){
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+void _instrument_add(enum InstrumentPhase phase, int iexpr, uint64_t start, long nnode){
+  uint64_t cycles = instrument_cycles() - start;
+  if (iexpr < 0){
+    INSTRUMENTATION.phases[phase].calls += 1;
+    INSTRUMENTATION.phases[phase].cycles += cycles;
+    INSTRUMENTATION.phases[phase].nodes += nnode;
+    return;
+  }
+  // Nodes of each expression count towards the phase, but calls and cycles
+  // are already counted around the whole phase.
+  INSTRUMENTATION.phases[phase].nodes += nnode;
+  if (iexpr < INSTRUMENTATION.nexpr){
+    struct InstrumentCounter * counter = &INSTRUMENTATION.exprs[(long)iexpr * N_INSTRUMENT_PHASES + phase];
+    counter->calls += 1;
+    counter->nodes += nnode;
+    counter->cycles += cycles;
+  }
+}
+
+void instrument_init(int nexpr){
+  free(INSTRUMENTATION.exprs);
+  INSTRUMENTATION.nexpr = nexpr;
+  INSTRUMENTATION.exprs = calloc((long)nexpr * N_INSTRUMENT_PHASES + 1, sizeof(struct InstrumentCounter));
+  instrument_reset();
+}
+
+void instrument_reset(){
+  for (int p=0; p<N_INSTRUMENT_PHASES; p++){
+    INSTRUMENTATION.phases[p].calls = 0;
+    INSTRUMENTATION.phases[p].nodes = 0;
+    INSTRUMENTATION.phases[p].cycles = 0;
+  }
+  long n = (long)INSTRUMENTATION.nexpr * N_INSTRUMENT_PHASES;
+  for (long k=0; k<n; k++){
+    INSTRUMENTATION.exprs[k].calls = 0;
+    INSTRUMENTATION.exprs[k].nodes = 0;
+    INSTRUMENTATION.exprs[k].cycles = 0;
+  }
+}
+
+void instrument_free(){
+  free(INSTRUMENTATION.exprs);
+  INSTRUMENTATION.exprs = NULL;
+  INSTRUMENTATION.nexpr = 0;
+}
+
+long instrument_count_nodes(struct Node expr){
+  if (expr.type != OP_NODE){
+    return 1;
+  }
+  long count = 1;
+  for (int i=0; i<expr.data.expr->nargs; i++){
+    count += instrument_count_nodes(expr.data.expr->args[i]);
+  }
+  return count;
+}
+
+uint64_t _instrument_expr_cycles(int iexpr){
+  uint64_t total = 0;
+  for (int p=0; p<N_INSTRUMENT_PHASES; p++){
+    total += INSTRUMENTATION.exprs[(long)iexpr * N_INSTRUMENT_PHASES + p].cycles;
+  }
+  return total;
+}
+
+int _instrument_compare_exprs(const void * a, const void * b){
+  uint64_t ca = _instrument_expr_cycles(*(int *)a);
+  uint64_t cb = _instrument_expr_cycles(*(int *)b);
+  // Decreasing order of cycles
+  return (ca < cb) - (ca > cb);
+}
+
+void instrument_report(FILE * fp, int ntop, struct Node * exprs){
+#ifndef INSTRUMENT
+  fprintf(fp, "Instrumentation is not compiled in (build with -DINSTRUMENT)\n");
+  return;
+#endif
+  uint64_t total = 0;
+  for (int p=0; p<N_INSTRUMENT_PHASES; p++){total += INSTRUMENTATION.phases[p].cycles;}
+  fprintf(fp, "%-10s %10s %14s %16s %12s %7s\n", "phase", "calls", "nodes", "cycles", "cycles/node", "share");
+  for (int p=0; p<N_INSTRUMENT_PHASES; p++){
+    struct InstrumentCounter c = INSTRUMENTATION.phases[p];
+    fprintf(
+      fp, "%-10s %10ld %14ld %16lu %12.1f %6.1f%%\n",
+      INSTRUMENT_PHASE_NAMES[p], c.calls, c.nodes, (unsigned long)c.cycles,
+      c.nodes > 0 ? (double)c.cycles / c.nodes : 0.0,
+      total > 0 ? 100.0 * c.cycles / total : 0.0
+    );
+  }
+
+  int nexpr = INSTRUMENTATION.nexpr;
+  if (nexpr == 0 || ntop <= 0){
+    return;
+  }
+  int * order = malloc(nexpr * sizeof(int));
+  for (int i=0; i<nexpr; i++){order[i] = i;}
+  qsort(order, nexpr, sizeof(int), _instrument_compare_exprs);
+  if (ntop > nexpr){ntop = nexpr;}
+  fprintf(fp, "\nTop %d expressions by cycles:\n", ntop);
+  fprintf(fp, "%8s %14s", "expr", "total");
+  for (int p=0; p<N_INSTRUMENT_PHASES; p++){fprintf(fp, " %12s", INSTRUMENT_PHASE_NAMES[p]);}
+  fprintf(fp, "\n");
+  for (int k=0; k<ntop; k++){
+    int i = order[k];
+    fprintf(fp, "%8d %14lu", i, (unsigned long)_instrument_expr_cycles(i));
+    for (int p=0; p<N_INSTRUMENT_PHASES; p++){
+      fprintf(fp, " %12lu", (unsigned long)INSTRUMENTATION.exprs[(long)i * N_INSTRUMENT_PHASES + p].cycles);
+    }
+    fprintf(fp, "\n");
+    if (exprs != NULL){
+      // to_string doesn't truncate safely, so give it room for the whole
+      // expression and truncate when printing.
+      long nnode = instrument_count_nodes(exprs[i]);
+      int bsize = (int)(nnode * 32 + 64);
+      char * buffer = malloc(bsize);
+      to_string(buffer, bsize, exprs[i]);
+      fprintf(fp, "         %.120s%s\n", buffer, strlen(buffer) > 120 ? " ..." : "");
+      free(buffer);
+    }
+  }
+  free(order);
+}
+
+#endif
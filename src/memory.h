@@ -0,0 +1,162 @@
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Accounting of the memory used by model data structures, by category, so
+ * we can see where the bytes go on a big model and check that changes
+ * meant to save memory actually do.
+ *
+ * Allocations in each category go through mem_alloc, mem_realloc and
+ * mem_free, which keep the current bytes and count of live allocations,
+ * and the peak bytes, for each category and in total. Bytes are the sizes
+ * that were requested. Each allocation starts with a small header holding
+ * its size, so mem_free doesn't need to know how big an array was (e.g.
+ * after simplify_expression has reduced nargs), and this works with any C
+ * library's malloc. The header (16 bytes on most platforms, to keep the
+ * block aligned) and the allocator's rounding are not counted.
+ *
+ * Anything allocated with mem_alloc in a category must be freed with
+ * mem_free in the same category, and vice versa. For OperatorNodes, use
+ * new_operator_node (see expr.h) and free_expression.
+ *
+ * Usage:
+ *
+ *     memory_reset_peak();
+ *     read_nl_constraints(fp, constraints, ncon, variables, nvar);
+ *     print_memory_usage(stdout);
+ *     long bytes = memory_usage(MEM_OPERATOR_NODES).bytes;
+ *
+ * Counters are updated with atomic operations, so allocating from several
+ * threads is fine.
+ */
+
+enum MemoryCategory {
+  // struct OperatorNode
+  MEM_OPERATOR_NODES,
+  // Arrays of struct Node that are arguments of OperatorNodes
+  MEM_ARGS,
+  // struct VarListNode (see identify_variables)
+  MEM_VARLISTS,
+  // Arrays of CSR, COO and CSC matrices
+  MEM_SPARSE,
+  // Buffers used while reading files
+  MEM_BUFFERS,
+  N_MEMORY_CATEGORIES,
+};
+
+const char * MEMORY_CATEGORY_NAMES[N_MEMORY_CATEGORIES] = {
+  "OperatorNode",
+  "args",
+  "VarListNode",
+  "sparse matrices",
+  "read buffers",
+};
+
+struct MemoryCounter {
+  // Bytes currently allocated
+  long bytes;
+  // Number of allocations currently live
+  long count;
+  // Maximum of bytes since the last memory_reset_peak
+  long peak;
+};
+
+// Counters for each category, and (in the last entry) in total
+struct MemoryCounter MEMORY_COUNTERS[N_MEMORY_CATEGORIES + 1];
+
+void * mem_alloc(enum MemoryCategory category, size_t size);
+void * mem_realloc(enum MemoryCategory category, void * ptr, size_t size);
+void mem_free(enum MemoryCategory category, void * ptr);
+
+// Counters of one category
+struct MemoryCounter memory_usage(enum MemoryCategory category);
+// Counters over all categories
+struct MemoryCounter memory_total();
+// Set the peak of each counter to its current bytes
+void memory_reset_peak();
+void print_memory_usage(FILE * fp);
+
+// Header before each block, which keeps the block aligned for any type
+union MemoryHeader {
+  size_t size;
+  max_align_t align;
+};
+
+void _memory_add(int counter, long bytes, long count);
+
+void _memory_add(int counter, long bytes, long count){
+  struct MemoryCounter * c = &MEMORY_COUNTERS[counter];
+  long current = __atomic_add_fetch(&c->bytes, bytes, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&c->count, count, __ATOMIC_RELAXED);
+  long peak = __atomic_load_n(&c->peak, __ATOMIC_RELAXED);
+  while (current > peak){
+    if (__atomic_compare_exchange_n(&c->peak, &peak, current, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+      break;
+    }
+  }
+}
+
+void * mem_alloc(enum MemoryCategory category, size_t size){
+  union MemoryHeader * header = malloc(sizeof(union MemoryHeader) + size);
+  if (header == NULL){
+    return NULL;
+  }
+  header->size = size;
+  _memory_add(category, size, 1);
+  _memory_add(N_MEMORY_CATEGORIES, size, 1);
+  return header + 1;
+}
+
+void * mem_realloc(enum MemoryCategory category, void * ptr, size_t size){
+  if (ptr == NULL){
+    return mem_alloc(category, size);
+  }
+  union MemoryHeader * header = (union MemoryHeader *)ptr - 1;
+  long old_bytes = header->size;
+  header = realloc(header, sizeof(union MemoryHeader) + size);
+  if (header == NULL){
+    // The old allocation is unchanged
+    return NULL;
+  }
+  header->size = size;
+  _memory_add(category, (long)size - old_bytes, 0);
+  _memory_add(N_MEMORY_CATEGORIES, (long)size - old_bytes, 0);
+  return header + 1;
+}
+
+void mem_free(enum MemoryCategory category, void * ptr){
+  if (ptr == NULL){
+    return;
+  }
+  union MemoryHeader * header = (union MemoryHeader *)ptr - 1;
+  long bytes = header->size;
+  _memory_add(category, -bytes, -1);
+  _memory_add(N_MEMORY_CATEGORIES, -bytes, -1);
+  free(header);
+}
+
+struct MemoryCounter memory_usage(enum MemoryCategory category){
+  return MEMORY_COUNTERS[category];
+}
+
+struct MemoryCounter memory_total(){
+  return MEMORY_COUNTERS[N_MEMORY_CATEGORIES];
+}
+
+void memory_reset_peak(){
+  for (int c=0; c<=N_MEMORY_CATEGORIES; c++){
+    MEMORY_COUNTERS[c].peak = MEMORY_COUNTERS[c].bytes;
+  }
+}
+
+void print_memory_usage(FILE * fp){
+  fprintf(fp, "%-16s %14s %12s %14s\n", "category", "bytes", "count", "peak bytes");
+  for (int c=0; c<=N_MEMORY_CATEGORIES; c++){
+    struct MemoryCounter counter = MEMORY_COUNTERS[c];
+    fprintf(
+      fp, "%-16s %14ld %12ld %14ld\n",
+      c < N_MEMORY_CATEGORIES ? MEMORY_CATEGORY_NAMES[c] : "total",
+      counter.bytes, counter.count, counter.peak
+    );
+  }
+}
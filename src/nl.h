@@ -1,4 +1,6 @@
 #include "nl_opcodes.h"
+#include "instrument.h"
+#include "trace.h"
 
 struct NLHeader {
   bool binary; // As opposed to ASCII. Should this be an enum instead?
@@ -8,15 +10,59 @@ struct NLHeader {
   int jnnz;
   int gnnz;
   int nexpr;
+  // Number of external functions (F segments)
+  int nfunc;
 };
 
 struct NLHeader read_nl_header(FILE * fp);
 int read_nl_variables(FILE * fp, struct Variable * variables, int nvar);
+int read_starting_point(FILE * fp, struct Variable * variables, int nvar, double * duals, int ncon);
+char * read_to_buffer(FILE * fp, long * bsize);
+int read_starting_point_buffer(char * buffer, long bsize, struct Variable * variables, int nvar, double * duals, int ncon);
+int _read_initial_value_segment(char ** pos, char * end, struct Variable * variables, double * values, int n);
+int _read_initial_value_lines(FILE * fp, char * header, struct Variable * variables, double * values, int n);
+int _store_initial_value(int idx, double value, struct Variable * variables, double * values, int n);
+bool _read_line(FILE * fp, char * line);
+/*
+ * Read the nonlinear part of each constraint (C segments). If an
+ * expression contains an operator we don't support, we print an error,
+ * replace the part of the expression we couldn't read with NaN, and carry
+ * on reading the rest of the file, then return -1.
+ */
 int read_nl_constraints(FILE * fp, struct Node * constraint_expressions, int ncon, struct Variable * variables, int nvar);
+/*
+ * Read constraints as read_nl_constraints does, but hand each expression
+ * to handler(index, expr, data) as soon as it has been read, rather than
+ * storing it. The handler owns the expression. (See pipeline.h.)
+ */
+int read_nl_constraints_stream(
+  FILE * fp,
+  struct Variable * variables,
+  int nvar,
+  void (* handler)(int, struct Node, void *),
+  void * data
+);
+void _nl_store_constraint(int cidx, struct Node expr, void * data);
+/*
+ * Read the nonlinear part of each objective (O segments) into objectives.
+ * sense[i] is 0 if objective i is minimized and 1 if it is maximized.
+ * Unsupported operators are handled as in read_nl_constraints.
+ */
+int read_nl_objectives(FILE * fp, struct Node * objectives, int * sense, int nobj, struct Variable * variables, int nvar);
+/*
+ * Look up the external functions declared in F segments, which must have
+ * been loaded (see external.h), and store the index of function i in
+ * funcs[i]. Expressions read after this use funcs, so it must stay
+ * allocated while reading them. Returns -1 if a function isn't loaded.
+ */
+int read_nl_functions(FILE * fp, int * funcs, int nfunc);
 struct Node read_nl_expression(FILE * fp, struct Variable * variables, int nvar);
 struct Node _read_nl_constant(FILE * fp, char * line, struct Variable * variables, int nvar);
 struct Node _read_nl_variable(FILE * fp, char * line, struct Variable * variables, int nvar);
 struct Node _read_nl_expression(FILE * fp, char * line, struct Variable * variables, int nvar);
+struct Node _read_nl_function_call(FILE * fp, char * line, struct Variable * variables, int nvar);
+struct Node _nl_undefined_node();
+void _nl_skip_expression(FILE * fp);
 int read_nl_header_line(FILE * fp, int * data, int ndata);
 int read_to_eol(FILE * fp);
 
@@ -43,7 +89,8 @@ int read_nl_header_line(FILE * fp, int * data, int ndata){
   // Construct a format string such as "%d %d %d"
   // TODO: Assert ndata <= 6
   int fmtlen = 3 * ndata - 1;
-  char * fmt = malloc(fmtlen * sizeof(char));
+  // calloc, so the string is terminated
+  char * fmt = calloc(fmtlen + 1, sizeof(char));
   for (int i = 0; i < ndata; i++){
     int fmtidx = 3 * i;
     fmt[fmtidx] = '%';
@@ -63,6 +110,7 @@ int read_nl_header_line(FILE * fp, int * data, int ndata){
 }
 
 struct NLHeader read_nl_header(FILE * fp){
+  TRACE_BEGIN("read_nl_header");
   int cint = fgetc(fp);
   // Is this the right way to convert the return code to a character
   char c;
@@ -120,11 +168,13 @@ struct NLHeader read_nl_header(FILE * fp){
   //printf("Line %2d: %d %d %d\n", linecount, data[0], data[1], data[2]);
   linecount += 1;
 
-  // Line 6: Linear network vars. We don't use this.
+  // Line 6: Linear network vars (which we don't use) and external functions
   read_nl_header_line(fp, data, 4);
   //printf("Line %2d: %d %d %d %d\n", linecount, data[0], data[1], data[2], data[3]);
   linecount += 1;
 
+  header.nfunc = data[1];
+
   // Line 7: Discrete variables. We don't use this (for now).
   read_nl_header_line(fp, data, 5);
   //printf("Line %2d: %d %d %d %d %d\n", linecount, data[0], data[1], data[2], data[3], data[4]);
@@ -151,12 +201,58 @@ struct NLHeader read_nl_header(FILE * fp){
   // These data are of a partition of subexpressions. We just sum them for now.
   header.nexpr = data[0] + data[1] + data[2] + data[3] + data[4];
 
+  TRACE_END("read_nl_header");
   return header;
 }
 
 const int MAX_LINELEN = 82;
 
+// Number of expressions we have failed to read since the last call to
+// read_nl_constraints or read_nl_objectives, and whether we are unwinding
+// from an unsupported operator in the current expression
+_Thread_local int _nl_expression_errors = 0;
+_Thread_local bool _nl_skipping_expression = false;
+// Indices of the file's external functions (see read_nl_functions)
+_Thread_local int * _nl_functions = NULL;
+_Thread_local int _nl_nfunc = 0;
+
+int read_nl_functions(FILE * fp, int * funcs, int nfunc){
+  TRACE_BEGIN("read_nl_functions (F segments)");
+  for (int i = 0; i < 10; i++){read_to_eol(fp);}
+  for (int i = 0; i < nfunc; i++){funcs[i] = -1;}
+  _nl_functions = funcs;
+  _nl_nfunc = nfunc;
+
+  int status = 0;
+  char line[MAX_LINELEN];
+  fgets(line, MAX_LINELEN, fp);
+  // Functions are declared before the expressions that use them, so we can
+  // stop at the first expression
+  while (!feof(fp) && line[0] != 'C' && line[0] != 'O'){
+    if (line[0] == 'F'){
+      int fidx;
+      int type;
+      int nargs;
+      char name[MAX_LINELEN];
+      if (sscanf(line+1, "%d %d %d %81s", &fidx, &type, &nargs, name) != 4 || fidx < 0 || fidx >= nfunc){
+        printf("ERROR: Invalid function declaration %s", line);
+        status = -1;
+      }else{
+        funcs[fidx] = find_external_function(name);
+        if (funcs[fidx] < 0){
+          printf("ERROR: External function %s has not been loaded\n", name);
+          status = -1;
+        }
+      }
+    }
+    fgets(line, MAX_LINELEN, fp);
+  }
+  TRACE_END("read_nl_functions (F segments)");
+  return status;
+}
+
 int read_nl_variables(FILE * fp, struct Variable * variables, int nvar){
+  TRACE_BEGIN("read_nl_variables (x segment)");
   // Read the first 10 lines (the header)
   for (int i = 0; i < 10; i++){read_to_eol(fp);}
 
@@ -185,19 +281,213 @@ int read_nl_variables(FILE * fp, struct Variable * variables, int nvar){
     variables[vidx].value = value;
   }
 
+  TRACE_END("read_nl_variables (x segment)");
   // Unclear what the return value from this function should be
   return 0;
 }
 
+/*
+ * Load new primal and dual starting points into an already-constructed model
+ * from the x (primal) and d (dual) initial value segments of an .nl file,
+ * without re-reading the rest of the file.
+ *
+ * The file may contain only these segments, e.g.
+ *
+ *     x2
+ *     0 1.5
+ *     3 -2.0
+ *     d1
+ *     0 0.1
+ *
+ * or be a complete .nl file, in which case other segments are skipped over
+ * without being parsed. Variables and duals not listed in a segment keep
+ * their current values. `duals` may be NULL, in which case d segments are
+ * ignored.
+ *
+ * Returns the number of values that were loaded.
+ */
+int read_starting_point(FILE * fp, struct Variable * variables, int nvar, double * duals, int ncon){
+  // The file may be a complete .nl file, so we read it a line at a time
+  // rather than into memory, and parse with strtod rather than fscanf.
+  TRACE_BEGIN("read_starting_point (x and d segments)");
+  char line[MAX_LINELEN];
+  int nloaded = 0;
+  while (_read_line(fp, line)){
+    int n = 0;
+    if (line[0] == 'x'){
+      n = _read_initial_value_lines(fp, line, variables, NULL, nvar);
+    }else if (line[0] == 'd' && duals){
+      n = _read_initial_value_lines(fp, line, NULL, duals, ncon);
+    }
+    if (n < 0){
+      nloaded = -1;
+      break;
+    }
+    nloaded += n;
+  }
+  TRACE_END("read_starting_point (x and d segments)");
+  return nloaded;
+}
+
+/*
+ * Read the next line of fp into line, which has room for MAX_LINELEN
+ * characters. The rest of a longer line is skipped, so the next call
+ * starts at the beginning of a line. Returns false at the end of the file.
+ */
+bool _read_line(FILE * fp, char * line){
+  if (fgets(line, MAX_LINELEN, fp) == NULL){
+    return false;
+  }
+  if (strchr(line, '\n') == NULL){
+    read_to_eol(fp);
+  }
+  return true;
+}
+
+/*
+ * Read the values of an initial value segment from fp, where header is the
+ * line starting the segment, e.g. "x2". Values are stored as in
+ * _read_initial_value_segment.
+ */
+int _read_initial_value_lines(FILE * fp, char * header, struct Variable * variables, double * values, int n){
+  int segment_n = strtol(header + 1, NULL, 10);
+  char line[MAX_LINELEN];
+  for (int k=0; k<segment_n; k++){
+    if (!_read_line(fp, line)){
+      printf("ERROR: Initial value segment ended after %d of %d values\n", k, segment_n);
+      return -1;
+    }
+    char * p;
+    int idx = strtol(line, &p, 10);
+    double value = strtod(p, NULL);
+    if (_store_initial_value(idx, value, variables, values, n) < 0){
+      return -1;
+    }
+  }
+  return segment_n;
+}
+
+// Store values[idx] or variables[idx].value, checking that idx is in range
+int _store_initial_value(int idx, double value, struct Variable * variables, double * values, int n){
+  if (idx < 0 || idx >= n){
+    printf("ERROR: Initial value index %d out of bounds\n", idx);
+    return -1;
+  }
+  if (variables){
+    variables[idx].value = value;
+  }else{
+    values[idx] = value;
+  }
+  return 0;
+}
+
+/*
+ * Read the remainder of a file into a null-terminated, heap-allocated buffer.
+ * The number of characters read (not including the terminator) is stored
+ * in bsize.
+ */
+char * read_to_buffer(FILE * fp, long * bsize){
+  long len = 0;
+  long capacity = 1 << 16;
+  char * buffer = mem_alloc(MEM_BUFFERS, capacity + 1);
+  size_t nread;
+  while ((nread = fread(buffer + len, sizeof(char), capacity - len, fp)) > 0){
+    len += nread;
+    if (len == capacity){
+      capacity *= 2;
+      buffer = mem_realloc(MEM_BUFFERS, buffer, capacity + 1);
+    }
+  }
+  buffer[len] = '\0';
+  *bsize = len;
+  return buffer;
+}
+
+/*
+ * Same as read_starting_point, but the segments are read from a buffer of
+ * bsize characters that is already in memory. The buffer does not need to be null-terminated, but
+ * buffer[bsize] must be readable (and not a digit), as strtod may look one
+ * character past the last number.
+ */
+int read_starting_point_buffer(char * buffer, long bsize, struct Variable * variables, int nvar, double * duals, int ncon){
+  char * pos = buffer;
+  char * end = buffer + bsize;
+  int nloaded = 0;
+  while (pos < end){
+    if (*pos == 'x'){
+      pos += 1;
+      int n = _read_initial_value_segment(&pos, end, variables, NULL, nvar);
+      if (n < 0){return -1;}
+      nloaded += n;
+    }else if (*pos == 'd' && duals){
+      pos += 1;
+      int n = _read_initial_value_segment(&pos, end, NULL, duals, ncon);
+      if (n < 0){return -1;}
+      nloaded += n;
+    }else{
+      // Skip to the next line
+      char * eol = memchr(pos, '\n', end - pos);
+      pos = eol ? eol + 1 : end;
+    }
+  }
+  return nloaded;
+}
+
+/*
+ * Parse an initial value segment, starting just after the segment's 'x' or
+ * 'd' character. The value for index i is stored in variables[i].value if
+ * variables is not NULL, and in values[i] otherwise. On return, pos points
+ * to the start of the line after the segment.
+ */
+int _read_initial_value_segment(char ** pos, char * end, struct Variable * variables, double * values, int n){
+  char * p = *pos;
+  int segment_n = strtol(p, &p, 10);
+  for (int k=0; k<segment_n; k++){
+    // Skip the rest of the previous line (e.g. a comment)
+    char * eol = memchr(p, '\n', end - p);
+    if (!eol){
+      printf("ERROR: Initial value segment ended after %d of %d values\n", k, segment_n);
+      return -1;
+    }
+    p = eol + 1;
+    int idx = strtol(p, &p, 10);
+    double value = strtod(p, &p);
+    if (_store_initial_value(idx, value, variables, values, n) < 0){
+      return -1;
+    }
+  }
+  char * eol = memchr(p, '\n', end - p);
+  *pos = eol ? eol + 1 : end;
+  return segment_n;
+}
+
 int read_nl_constraints(
   FILE * fp,
   struct Node * constraint_expressions,
   int ncon,
   struct Variable * variables,
   int nvar
+){
+  return read_nl_constraints_stream(fp, variables, nvar, _nl_store_constraint, constraint_expressions);
+}
+
+void _nl_store_constraint(int cidx, struct Node expr, void * data){
+  struct Node * constraint_expressions = data;
+  constraint_expressions[cidx] = expr;
+}
+
+int read_nl_constraints_stream(
+  FILE * fp,
+  struct Variable * variables,
+  int nvar,
+  void (* handler)(int, struct Node, void *),
+  void * data
 ){
   // TODO: Read the linear part of each constraint
   //
+  TRACE_BEGIN("read_nl_constraints (C segments)");
+  INSTRUMENT_START(parse_start);
+  _nl_expression_errors = 0;
   // Read first 10 lines (the header)
   for (int i = 0; i < 10; i++){read_to_eol(fp);}
 
@@ -223,10 +513,12 @@ int read_nl_constraints(
 
       // TODO: Potentially pass in the line number so we can print reasonable
       // debugging information.
+      INSTRUMENT_START(expr_start);
+      _nl_skipping_expression = false;
       struct Node exprnode = read_nl_expression(fp, variables, nvar);
+      INSTRUMENT_STOP_EXPR(INSTRUMENT_PARSE, cidx, expr_start, instrument_count_nodes(exprnode));
 
-      // Populate the constraint expression
-      constraint_expressions[cidx] = exprnode;
+      handler(cidx, exprnode, data);
     }
 
     if (!already_encountered_constraint){
@@ -238,7 +530,9 @@ int read_nl_constraints(
     already_encountered_constraint = 0;
 
   }
-  return 0;
+  INSTRUMENT_STOP(INSTRUMENT_PARSE, parse_start, 0);
+  TRACE_END("read_nl_constraints (C segments)");
+  return _nl_expression_errors > 0 ? -1 : 0;
 }
 
 /*
@@ -254,11 +548,65 @@ int read_nl_constraints(
  * (unless it is a variable or constant node) and all non-leaf subexpressions.
  *
  */
+int read_nl_objectives(
+  FILE * fp,
+  struct Node * objectives,
+  int * sense,
+  int nobj,
+  struct Variable * variables,
+  int nvar
+){
+  // TODO: Read the linear part of each objective (G segments)
+  TRACE_BEGIN("read_nl_objectives (O segments)");
+  _nl_expression_errors = 0;
+  for (int i = 0; i < 10; i++){read_to_eol(fp);}
+
+  char line[MAX_LINELEN];
+  fgets(line, MAX_LINELEN, fp);
+  // As in read_nl_constraints, we just look for lines starting with 'O'.
+  while (!feof(fp)){
+    if (line[0] == 'O'){
+      int oidx;
+      int osense;
+      if (sscanf(line+1, "%d %d", &oidx, &osense) != 2){
+        oidx = -1;
+      }
+      _nl_skipping_expression = false;
+      struct Node expr = read_nl_expression(fp, variables, nvar);
+      if (oidx < 0 || oidx >= nobj){
+        // Read past the expression, so the caller can carry on
+        printf("ERROR: Objective index %d out of bounds\n", oidx);
+        free_expression(expr);
+        _nl_expression_errors += 1;
+      }else{
+        objectives[oidx] = expr;
+        sense[oidx] = osense;
+      }
+    }
+    fgets(line, MAX_LINELEN, fp);
+  }
+  TRACE_END("read_nl_objectives (O segments)");
+  return _nl_expression_errors > 0 ? -1 : 0;
+}
+
 struct Node read_nl_expression(
   FILE * fp,
   struct Variable * variables,
   int nvar
 ){
+  // Look at the first character before reading the line, so that if the
+  // expression ends early (e.g. after an unsupported operator, see below)
+  // we leave the next segment for the caller.
+  int c = fgetc(fp);
+  if (c != 'n' && c != 'v' && c != 'o' && c != 'f'){
+    if (c != EOF){ungetc(c, fp);}
+    if (!_nl_skipping_expression){
+      printf("ERROR: Unexpected character %c at the start of an expression\n", c == EOF ? ' ' : c);
+      _nl_expression_errors += 1;
+    }
+    return _nl_undefined_node();
+  }
+  ungetc(c, fp);
   char line[MAX_LINELEN];
   fgets(line, MAX_LINELEN, fp);
 
@@ -267,13 +615,27 @@ struct Node read_nl_expression(
       return _read_nl_constant(fp, line, variables, nvar);
     case 'v':
       return _read_nl_variable(fp, line, variables, nvar);
-    case 'o':
-      return _read_nl_expression(fp, line, variables, nvar);
+    case 'f':
+      return _read_nl_function_call(fp, line, variables, nvar);
     default:
-      printf("ERROR: %s", line);
-      printf("ERROR: ^ Unexpected character %c\n", line[0]);
-      exit(-1);
+      return _read_nl_expression(fp, line, variables, nvar);
+  }
+}
+
+struct Node _nl_undefined_node(){
+  struct Node node = {.type = CONST_NODE, .data = {.value = NAN}};
+  return node;
+}
+
+void _nl_skip_expression(FILE * fp){
+  // Expression lines start with an operator, constant, variable, function
+  // call or string, or are the number of arguments of an n-ary operator
+  int c = fgetc(fp);
+  while (c != EOF && (strchr("onvfh-", c) != NULL || (c >= '0' && c <= '9'))){
+    read_to_eol(fp);
+    c = fgetc(fp);
   }
+  if (c != EOF){ungetc(c, fp);}
 }
 
 struct Node _read_nl_constant(FILE * fp, char * line, struct Variable * variables, int nvar){
@@ -295,30 +657,85 @@ struct Node _read_nl_variable(FILE * fp, char * line, struct Variable * variable
 struct Node _read_nl_expression(FILE * fp, char * line, struct Variable * variables, int nvar){
   int opnum;
   sscanf(line+1, "%d", &opnum);
-  int optype = OP_LOOKUP[opnum];
-  // TODO: Check that looking up this operator does not yield -1, our convention
-  // for a not-supported operator. Note that we don't attempt to guard against
-  // an out-of-bounds array access in OP_LOOKUP
+  bool list = false;
+  int optype = nl_operator(opnum, &list);
   if (optype == -1){
+    // We don't know how many arguments the operator has, so we skip the
+    // rest of the expression, and each operator we are in the middle of
+    // reading gets undefined arguments (see read_nl_expression). The
+    // expression evaluates to NaN, and the caller can carry on with the
+    // other expressions.
     printf("ERROR: Unsupported operator code o%d\n", opnum);
-    exit(-1);
+    _nl_expression_errors += 1;
+    _nl_skip_expression(fp);
+    _nl_skipping_expression = true;
+    return _nl_undefined_node();
   }
 
   // Look up the number of arguments expected by this operator
   int nargs = OPERATOR_DATA[optype].nargs;
-  struct Node * args = malloc(nargs*sizeof(struct Node));
+  if (list){
+    // E.g. sums with any number of arguments have the number on the next line
+    fgets(line, MAX_LINELEN, fp);
+    sscanf(line, "%d", &nargs);
+  }
+  // Heap-allocate this expression so we can access it outside of this function
+  struct OperatorNode * expr = new_operator_node(optype, nargs);
   for (int i=0; i<nargs; i++){
     // Read argument expressions/nodes from nl file
-    args[i] = read_nl_expression(fp, variables, nvar);
+    expr->args[i] = read_nl_expression(fp, variables, nvar);
   }
+  // Choose a cheaper operator for powers with a constant base or exponent,
+  // e.g. v0^2. This doesn't change the structure of the expression.
+  specialize_power_node(expr);
 
-  // Heap-allocate this expression so we can access it outside of this function
-  struct OperatorNode * expr = malloc(sizeof(struct OperatorNode));
-  expr->op = optype;
-  expr->nargs = nargs;
-  expr->args = args;
+  union NodeData nodedata = {.expr=expr};
+  struct Node node = {OP_NODE, nodedata};
+  return node;
+}
 
+struct Node _read_nl_function_call(FILE * fp, char * line, struct Variable * variables, int nvar){
+  int fidx;
+  int nargs;
+  sscanf(line+1, "%d %d", &fidx, &nargs);
+  int func = (fidx >= 0 && fidx < _nl_nfunc) ? _nl_functions[fidx] : -1;
+  if (func >= 0){
+    int expected = EXTERNAL_FUNCTIONS[func].nargs;
+    if ((expected >= 0 && nargs != expected) || (expected < 0 && nargs < -(expected + 1))){
+      printf("ERROR: Wrong number of arguments (%d) for %s\n", nargs, EXTERNAL_FUNCTIONS[func].name);
+      func = -1;
+    }
+  }else{
+    printf("ERROR: Unknown external function f%d (see read_nl_functions)\n", fidx);
+  }
+  if (func < 0){
+    _nl_expression_errors += 1;
+    _nl_skip_expression(fp);
+    _nl_skipping_expression = true;
+    return _nl_undefined_node();
+  }
+
+  struct OperatorNode * expr = new_operator_node(EXTERNAL, nargs + 1);
+  expr->args[0].type = CONST_NODE;
+  expr->args[0].data.value = func;
+  for (int i=0; i<nargs; i++){
+    int c = fgetc(fp);
+    if (c != EOF){ungetc(c, fp);}
+    if (c == 'h' && !_nl_skipping_expression){
+      printf("ERROR: String arguments of external functions are not supported\n");
+      _nl_expression_errors += 1;
+      _nl_skip_expression(fp);
+      _nl_skipping_expression = true;
+    }
+    expr->args[i+1] = read_nl_expression(fp, variables, nvar);
+  }
   union NodeData nodedata = {.expr=expr};
   struct Node node = {OP_NODE, nodedata};
+  if (_nl_skipping_expression){
+    // Some arguments are missing, and the function may not return NaN for
+    // NaN arguments, so the call is undefined
+    free_expression(node);
+    return _nl_undefined_node();
+  }
   return node;
 }
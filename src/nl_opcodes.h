@@ -1,63 +1,57 @@
 /*
- * From Table 6 in "Writing .nl files"
- * Many indices appear to not correspond to anything, or correspond to operators
- * we don't support.
+ * Operator codes from Table 6 in "Writing .nl files"
+ *
+ * The codes each operator is written with are in OPERATOR_DATA (see
+ * operators.h). Each thread builds a lookup table from them the first time
+ * it reads an expression. Codes of operators we don't support map to -1.
  */
-int OP_LOOKUP[56] = {
-  SUM,
-  SUBTRACTION,
-  PRODUCT,
-  DIVISION,
-  -1, // "rem". Remainder, presumably
-  POWER,
-  -1,
-  -1,
-  -1,
-  -1,
-  -1, // 10
-  -1,
-  -1,
-  -1,
-  -1,
-  -1, // 15
-  NEG,
-  -1,
-  -1,
-  -1,
-  -1, // 20
-  -1,
-  -1,
-  -1,
-  -1,
-  -1, // 25
-  -1,
-  -1,
-  -1,
-  -1,
-  -1, // 30
-  -1,
-  -1,
-  -1,
-  -1,
-  -1, // 35
-  -1,
-  -1,
-  TAN,
-  SQRT,
-  -1, // 40
-  SIN,
-  -1,
-  LOG,
-  EXP,
-  -1, // 45
-  COS,
-  -1,
-  -1,
-  -1,
-  -1, // 50
-  -1,
-  -1,
-  -1,
-  -1,
-  -1, // 55
-};
+#define N_NL_OPCODES 83
+
+_Thread_local int _nl_opcode_operator[N_NL_OPCODES];
+// Whether the number of arguments is on the line after the code, e.g. sumlist
+_Thread_local bool _nl_opcode_list[N_NL_OPCODES];
+_Thread_local bool _nl_opcodes_initialized = false;
+
+/*
+ * Returns the operator for an operator code, or -1 if we don't support it.
+ * Sets *list if the number of arguments follows on the next line.
+ */
+int nl_operator(int opcode, bool * list);
+void _nl_add_opcodes(const char * codes, int op, bool list);
+
+int nl_operator(int opcode, bool * list){
+  if (!_nl_opcodes_initialized){
+    for (int k=0; k<N_NL_OPCODES; k++){
+      _nl_opcode_operator[k] = -1;
+      _nl_opcode_list[k] = false;
+    }
+    for (int op=0; op<N_OPERATORS; op++){
+      _nl_add_opcodes(OPERATOR_DATA[op].opcodes, op, false);
+      _nl_add_opcodes(OPERATOR_DATA[op].list_opcodes, op, true);
+    }
+    _nl_opcodes_initialized = true;
+  }
+  if (opcode < 0 || opcode >= N_NL_OPCODES){
+    return -1;
+  }
+  *list = _nl_opcode_list[opcode];
+  return _nl_opcode_operator[opcode];
+}
+
+// Add codes written as "o5 o76 o78"
+void _nl_add_opcodes(const char * codes, int op, bool list){
+  if (codes == NULL){
+    return;
+  }
+  int code;
+  int len;
+  while (sscanf(codes, " o%d%n", &code, &len) == 1){
+    if (code < 0 || code >= N_NL_OPCODES || _nl_opcode_operator[code] != -1){
+      printf("ERROR: Invalid or repeated operator code o%d in OPERATOR_DATA\n", code);
+      exit(-1);
+    }
+    _nl_opcode_operator[code] = op;
+    _nl_opcode_list[code] = list;
+    codes += len;
+  }
+}
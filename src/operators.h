@@ -0,0 +1,1104 @@
+/*
+ * Operators
+ *
+ * Everything the rest of the code needs to know about an operator is in its
+ * entry in OPERATOR_DATA, which is indexed by OperatorType:
+ *
+ * - nargs and opstring, the number of arguments (-1 for any number) and the
+ *   symbol we print;
+ * - opcodes, its codes in .nl files ("o5 o76"), and list_opcodes, the codes
+ *   of forms whose number of arguments is on the next line ("o54");
+ * - value, deriv and deriv2, kernels computing its value, its partial
+ *   derivatives, and its second partial derivatives from the values of its
+ *   arguments, x. deriv2 writes the upper triangle of the Hessian by
+ *   columns, i.e. the second partial with respect to arguments i <= j is
+ *   hes[i + j*(j+1)/2], as for external functions (see external.h). It is
+ *   NULL if the second partials are all zero, e.g. for sums and for
+ *   piecewise linear operators like abs and min. deriv returns -1, with NaN
+ *   partials, outside the operator's domain;
+ * - constant_deriv, true if the partials don't depend on the arguments, so
+ *   deriv may be called with x == NULL;
+ * - variants, the cheaper operators we may replace it with once we know
+ *   which of its arguments are constant (see specialize_power_node);
+ * - c_value, c_deriv and c_deriv2, C expressions of its value and partials
+ *   for the code generator (see codegen.h), where $0, $1, $2 are the
+ *   arguments and $y is the value. A NULL partial is zero. c_value is NULL
+ *   if the code generator writes the operator's code itself.
+ *
+ * The tree functions (evaluate and diff_operator) and the tape's generic
+ * path use the kernels directly. The tape and the code generator also have
+ * their own fused code for the operators in most models (sums, products,
+ * powers, and so on). test-operators checks that the two agree.
+ *
+ * To add an operator, add it to OperatorType, write its kernels, and add
+ * its entry to OPERATOR_DATA. It is then read from .nl files, and works
+ * with every engine.
+ */
+
+// File-scope arrays with `const int` length appears to be an optional feature
+// of C99 compilers, supported by clang but not gcc-13.
+#define N_OPERATORS 44
+enum OperatorType {
+  SUM,
+  PRODUCT,
+  SUBTRACTION,
+  DIVISION,
+  POWER,
+  NEG,
+  SQRT,
+  EXP,
+  LOG,
+  SIN,
+  COS,
+  TAN,
+  // Specialized powers, chosen when a power is read from a .nl file (see
+  // specialize_power_node). The constant operand is kept as a CONST_NODE
+  // argument: the exponent (args[1]) for POW_CONST_INT and POW_CONST_REAL,
+  // and the base (args[0]) for EXP_CONST_BASE.
+  SQUARE,
+  POW_CONST_INT,
+  POW_CONST_REAL,
+  EXP_CONST_BASE,
+  // A call of an external function (see external.h). args[0] is a
+  // CONST_NODE, the index of the function, and the rest are its arguments.
+  EXTERNAL,
+  ABS,
+  MIN,
+  MAX,
+  FLOOR,
+  CEIL,
+  // The remainder of args[0] / args[1], as fmod
+  REM,
+  TANH,
+  SINH,
+  COSH,
+  LOG10,
+  ATAN,
+  // atan2(args[0], args[1])
+  ATAN2,
+  ASIN,
+  ACOS,
+  ASINH,
+  ACOSH,
+  ATANH,
+  // args[1] if args[0] is nonzero, otherwise args[2]
+  IF_THEN_ELSE,
+  // Comparisons and logical operators are 1.0 if true and 0.0 if false,
+  // and any nonzero argument is true
+  LESS_THAN,
+  LESS_EQUAL,
+  EQUAL,
+  GREATER_EQUAL,
+  GREATER_THAN,
+  NOT_EQUAL,
+  AND,
+  OR,
+  NOT,
+};
+
+struct OperatorData {
+  enum OperatorType optype;
+  int nargs;
+  char * opstring;
+  const char * opcodes;
+  const char * list_opcodes;
+  double (* value)(int nargs, double * x);
+  int (* deriv)(int nargs, double * x, double value, double * grad);
+  int (* deriv2)(int nargs, double * x, double value, double * hes);
+  bool constant_deriv;
+  int nvariant;
+  enum OperatorType variants[4];
+  char * c_value;
+  char * c_deriv[3];
+  char * c_deriv2[6];
+};
+
+// Position of the second partial with respect to arguments i and j in hes
+int hessian_index(int i, int j);
+double _pow_int(double x, int n);
+
+double _op_sum_value(int nargs, double * x);
+int _op_sum_deriv(int nargs, double * x, double value, double * grad);
+double _op_product_value(int nargs, double * x);
+int _op_product_deriv(int nargs, double * x, double value, double * grad);
+int _op_product_deriv2(int nargs, double * x, double value, double * hes);
+double _op_subtraction_value(int nargs, double * x);
+int _op_subtraction_deriv(int nargs, double * x, double value, double * grad);
+double _op_division_value(int nargs, double * x);
+int _op_division_deriv(int nargs, double * x, double value, double * grad);
+int _op_division_deriv2(int nargs, double * x, double value, double * hes);
+double _op_power_value(int nargs, double * x);
+int _op_power_deriv(int nargs, double * x, double value, double * grad);
+int _op_power_deriv2(int nargs, double * x, double value, double * hes);
+double _op_neg_value(int nargs, double * x);
+int _op_neg_deriv(int nargs, double * x, double value, double * grad);
+double _op_sqrt_value(int nargs, double * x);
+int _op_sqrt_deriv(int nargs, double * x, double value, double * grad);
+int _op_sqrt_deriv2(int nargs, double * x, double value, double * hes);
+double _op_exp_value(int nargs, double * x);
+int _op_exp_deriv(int nargs, double * x, double value, double * grad);
+int _op_exp_deriv2(int nargs, double * x, double value, double * hes);
+double _op_log_value(int nargs, double * x);
+int _op_log_deriv(int nargs, double * x, double value, double * grad);
+int _op_log_deriv2(int nargs, double * x, double value, double * hes);
+double _op_sin_value(int nargs, double * x);
+int _op_sin_deriv(int nargs, double * x, double value, double * grad);
+int _op_sin_deriv2(int nargs, double * x, double value, double * hes);
+double _op_cos_value(int nargs, double * x);
+int _op_cos_deriv(int nargs, double * x, double value, double * grad);
+int _op_cos_deriv2(int nargs, double * x, double value, double * hes);
+double _op_tan_value(int nargs, double * x);
+int _op_tan_deriv(int nargs, double * x, double value, double * grad);
+int _op_tan_deriv2(int nargs, double * x, double value, double * hes);
+double _op_square_value(int nargs, double * x);
+int _op_square_deriv(int nargs, double * x, double value, double * grad);
+int _op_square_deriv2(int nargs, double * x, double value, double * hes);
+double _op_pow_const_int_value(int nargs, double * x);
+int _op_pow_const_int_deriv(int nargs, double * x, double value, double * grad);
+int _op_pow_const_int_deriv2(int nargs, double * x, double value, double * hes);
+int _op_pow_const_real_deriv(int nargs, double * x, double value, double * grad);
+int _op_pow_const_real_deriv2(int nargs, double * x, double value, double * hes);
+int _op_exp_const_base_deriv(int nargs, double * x, double value, double * grad);
+int _op_exp_const_base_deriv2(int nargs, double * x, double value, double * hes);
+double _op_external_value(int nargs, double * x);
+int _op_external_deriv(int nargs, double * x, double value, double * grad);
+int _op_external_deriv2(int nargs, double * x, double value, double * hes);
+double _op_abs_value(int nargs, double * x);
+int _op_abs_deriv(int nargs, double * x, double value, double * grad);
+double _op_min_value(int nargs, double * x);
+double _op_max_value(int nargs, double * x);
+int _op_min_max_deriv(int nargs, double * x, double value, double * grad);
+double _op_floor_value(int nargs, double * x);
+double _op_ceil_value(int nargs, double * x);
+int _op_zero_deriv(int nargs, double * x, double value, double * grad);
+double _op_rem_value(int nargs, double * x);
+int _op_rem_deriv(int nargs, double * x, double value, double * grad);
+double _op_tanh_value(int nargs, double * x);
+int _op_tanh_deriv(int nargs, double * x, double value, double * grad);
+int _op_tanh_deriv2(int nargs, double * x, double value, double * hes);
+double _op_sinh_value(int nargs, double * x);
+int _op_sinh_deriv(int nargs, double * x, double value, double * grad);
+double _op_cosh_value(int nargs, double * x);
+int _op_cosh_deriv(int nargs, double * x, double value, double * grad);
+int _op_hyperbolic_deriv2(int nargs, double * x, double value, double * hes);
+double _op_log10_value(int nargs, double * x);
+int _op_log10_deriv(int nargs, double * x, double value, double * grad);
+int _op_log10_deriv2(int nargs, double * x, double value, double * hes);
+double _op_atan_value(int nargs, double * x);
+int _op_atan_deriv(int nargs, double * x, double value, double * grad);
+int _op_atan_deriv2(int nargs, double * x, double value, double * hes);
+double _op_atan2_value(int nargs, double * x);
+int _op_atan2_deriv(int nargs, double * x, double value, double * grad);
+int _op_atan2_deriv2(int nargs, double * x, double value, double * hes);
+double _op_asin_value(int nargs, double * x);
+int _op_asin_deriv(int nargs, double * x, double value, double * grad);
+int _op_asin_deriv2(int nargs, double * x, double value, double * hes);
+double _op_acos_value(int nargs, double * x);
+int _op_acos_deriv(int nargs, double * x, double value, double * grad);
+int _op_acos_deriv2(int nargs, double * x, double value, double * hes);
+double _op_asinh_value(int nargs, double * x);
+int _op_asinh_deriv(int nargs, double * x, double value, double * grad);
+int _op_asinh_deriv2(int nargs, double * x, double value, double * hes);
+double _op_acosh_value(int nargs, double * x);
+int _op_acosh_deriv(int nargs, double * x, double value, double * grad);
+int _op_acosh_deriv2(int nargs, double * x, double value, double * hes);
+double _op_atanh_value(int nargs, double * x);
+int _op_atanh_deriv(int nargs, double * x, double value, double * grad);
+int _op_atanh_deriv2(int nargs, double * x, double value, double * hes);
+double _op_if_then_else_value(int nargs, double * x);
+int _op_if_then_else_deriv(int nargs, double * x, double value, double * grad);
+double _op_less_than_value(int nargs, double * x);
+double _op_less_equal_value(int nargs, double * x);
+double _op_equal_value(int nargs, double * x);
+double _op_greater_equal_value(int nargs, double * x);
+double _op_greater_than_value(int nargs, double * x);
+double _op_not_equal_value(int nargs, double * x);
+double _op_and_value(int nargs, double * x);
+double _op_or_value(int nargs, double * x);
+double _op_not_value(int nargs, double * x);
+
+const struct OperatorData OPERATOR_DATA[N_OPERATORS] = {
+  [SUM] = {
+    .optype = SUM, .nargs = 2, .opstring = "+", .opcodes = "o0", .list_opcodes = "o54",
+    .value = _op_sum_value, .deriv = _op_sum_deriv, .constant_deriv = true,
+  },
+  [PRODUCT] = {
+    .optype = PRODUCT, .nargs = 2, .opstring = "*", .opcodes = "o2",
+    .value = _op_product_value, .deriv = _op_product_deriv, .deriv2 = _op_product_deriv2,
+  },
+  [SUBTRACTION] = {
+    .optype = SUBTRACTION, .nargs = 2, .opstring = "-", .opcodes = "o1",
+    .value = _op_subtraction_value, .deriv = _op_subtraction_deriv, .constant_deriv = true,
+  },
+  [DIVISION] = {
+    .optype = DIVISION, .nargs = 2, .opstring = "/", .opcodes = "o3",
+    .value = _op_division_value, .deriv = _op_division_deriv, .deriv2 = _op_division_deriv2,
+  },
+  // AMPL writes x^c as o76 and c^x as o78 (and x^2 as o77, below). We read
+  // these as generic powers, and specialize them once we have their
+  // arguments.
+  [POWER] = {
+    .optype = POWER, .nargs = 2, .opstring = "^", .opcodes = "o5 o76 o78",
+    .value = _op_power_value, .deriv = _op_power_deriv, .deriv2 = _op_power_deriv2,
+    .nvariant = 4, .variants = {SQUARE, POW_CONST_INT, POW_CONST_REAL, EXP_CONST_BASE},
+  },
+  [NEG] = {
+    .optype = NEG, .nargs = 1, .opstring = "-", .opcodes = "o16",
+    .value = _op_neg_value, .deriv = _op_neg_deriv, .constant_deriv = true,
+    .c_value = "-$0", .c_deriv = {"-1.0"},
+  },
+  [SQRT] = {
+    .optype = SQRT, .nargs = 1, .opstring = "sqrt", .opcodes = "o39",
+    .value = _op_sqrt_value, .deriv = _op_sqrt_deriv, .deriv2 = _op_sqrt_deriv2,
+    .c_value = "sqrt($0)", .c_deriv = {"(0.5 / $y)"}, .c_deriv2 = {"(-0.25 / ($y * $0))"},
+  },
+  [EXP] = {
+    .optype = EXP, .nargs = 1, .opstring = "exp", .opcodes = "o44",
+    .value = _op_exp_value, .deriv = _op_exp_deriv, .deriv2 = _op_exp_deriv2,
+    .c_value = "exp($0)", .c_deriv = {"$y"}, .c_deriv2 = {"$y"},
+  },
+  [LOG] = {
+    .optype = LOG, .nargs = 1, .opstring = "log", .opcodes = "o43",
+    .value = _op_log_value, .deriv = _op_log_deriv, .deriv2 = _op_log_deriv2,
+    .c_value = "log($0)", .c_deriv = {"(1.0 / $0)"}, .c_deriv2 = {"(-1.0 / ($0 * $0))"},
+  },
+  [SIN] = {
+    .optype = SIN, .nargs = 1, .opstring = "sin", .opcodes = "o41",
+    .value = _op_sin_value, .deriv = _op_sin_deriv, .deriv2 = _op_sin_deriv2,
+    .c_value = "sin($0)", .c_deriv = {"cos($0)"}, .c_deriv2 = {"(-$y)"},
+  },
+  [COS] = {
+    .optype = COS, .nargs = 1, .opstring = "cos", .opcodes = "o46",
+    .value = _op_cos_value, .deriv = _op_cos_deriv, .deriv2 = _op_cos_deriv2,
+    .c_value = "cos($0)", .c_deriv = {"(-sin($0))"}, .c_deriv2 = {"(-$y)"},
+  },
+  [TAN] = {
+    .optype = TAN, .nargs = 1, .opstring = "tan", .opcodes = "o38",
+    .value = _op_tan_value, .deriv = _op_tan_deriv, .deriv2 = _op_tan_deriv2,
+    .c_value = "tan($0)", .c_deriv = {"(1.0 + $y * $y)"}, .c_deriv2 = {"(2.0 * $y * (1.0 + $y * $y))"},
+  },
+  [SQUARE] = {
+    .optype = SQUARE, .nargs = 1, .opstring = "sq", .opcodes = "o77",
+    .value = _op_square_value, .deriv = _op_square_deriv, .deriv2 = _op_square_deriv2,
+    .c_value = "$0 * $0", .c_deriv = {"(2.0 * $0)"}, .c_deriv2 = {"2.0"},
+  },
+  [POW_CONST_INT] = {
+    .optype = POW_CONST_INT, .nargs = 2, .opstring = "^",
+    .value = _op_pow_const_int_value, .deriv = _op_pow_const_int_deriv, .deriv2 = _op_pow_const_int_deriv2,
+  },
+  [POW_CONST_REAL] = {
+    .optype = POW_CONST_REAL, .nargs = 2, .opstring = "^",
+    .value = _op_power_value, .deriv = _op_pow_const_real_deriv, .deriv2 = _op_pow_const_real_deriv2,
+  },
+  [EXP_CONST_BASE] = {
+    .optype = EXP_CONST_BASE, .nargs = 2, .opstring = "^",
+    .value = _op_power_value, .deriv = _op_exp_const_base_deriv, .deriv2 = _op_exp_const_base_deriv2,
+  },
+  // Calls are read from `f` lines (see _read_nl_function_call)
+  [EXTERNAL] = {
+    .optype = EXTERNAL, .nargs = -1, .opstring = "f",
+    .value = _op_external_value, .deriv = _op_external_deriv, .deriv2 = _op_external_deriv2,
+  },
+  [ABS] = {
+    .optype = ABS, .nargs = 1, .opstring = "abs", .opcodes = "o15",
+    .value = _op_abs_value, .deriv = _op_abs_deriv,
+    .c_value = "fabs($0)", .c_deriv = {"($0 > 0.0 ? 1.0 : ($0 < 0.0 ? -1.0 : 0.0))"},
+  },
+  [MIN] = {
+    .optype = MIN, .nargs = -1, .opstring = "min", .list_opcodes = "o11",
+    .value = _op_min_value, .deriv = _op_min_max_deriv,
+  },
+  [MAX] = {
+    .optype = MAX, .nargs = -1, .opstring = "max", .list_opcodes = "o12",
+    .value = _op_max_value, .deriv = _op_min_max_deriv,
+  },
+  [FLOOR] = {
+    .optype = FLOOR, .nargs = 1, .opstring = "floor", .opcodes = "o13",
+    .value = _op_floor_value, .deriv = _op_zero_deriv, .constant_deriv = true,
+    .c_value = "floor($0)",
+  },
+  [CEIL] = {
+    .optype = CEIL, .nargs = 1, .opstring = "ceil", .opcodes = "o14",
+    .value = _op_ceil_value, .deriv = _op_zero_deriv, .constant_deriv = true,
+    .c_value = "ceil($0)",
+  },
+  [REM] = {
+    .optype = REM, .nargs = 2, .opstring = "mod", .opcodes = "o4",
+    .value = _op_rem_value, .deriv = _op_rem_deriv,
+    .c_value = "fmod($0, $1)", .c_deriv = {"1.0", "(-trunc($0 / $1))"},
+  },
+  [TANH] = {
+    .optype = TANH, .nargs = 1, .opstring = "tanh", .opcodes = "o37",
+    .value = _op_tanh_value, .deriv = _op_tanh_deriv, .deriv2 = _op_tanh_deriv2,
+    .c_value = "tanh($0)", .c_deriv = {"(1.0 - $y * $y)"}, .c_deriv2 = {"(-2.0 * $y * (1.0 - $y * $y))"},
+  },
+  [SINH] = {
+    .optype = SINH, .nargs = 1, .opstring = "sinh", .opcodes = "o40",
+    .value = _op_sinh_value, .deriv = _op_sinh_deriv, .deriv2 = _op_hyperbolic_deriv2,
+    .c_value = "sinh($0)", .c_deriv = {"cosh($0)"}, .c_deriv2 = {"$y"},
+  },
+  [COSH] = {
+    .optype = COSH, .nargs = 1, .opstring = "cosh", .opcodes = "o45",
+    .value = _op_cosh_value, .deriv = _op_cosh_deriv, .deriv2 = _op_hyperbolic_deriv2,
+    .c_value = "cosh($0)", .c_deriv = {"sinh($0)"}, .c_deriv2 = {"$y"},
+  },
+  [LOG10] = {
+    .optype = LOG10, .nargs = 1, .opstring = "log10", .opcodes = "o42",
+    .value = _op_log10_value, .deriv = _op_log10_deriv, .deriv2 = _op_log10_deriv2,
+    .c_value = "log10($0)", .c_deriv = {"(1.0 / ($0 * 2.302585092994046))"}, .c_deriv2 = {"(-1.0 / ($0 * $0 * 2.302585092994046))"},
+  },
+  [ATAN] = {
+    .optype = ATAN, .nargs = 1, .opstring = "atan", .opcodes = "o49",
+    .value = _op_atan_value, .deriv = _op_atan_deriv, .deriv2 = _op_atan_deriv2,
+    .c_value = "atan($0)", .c_deriv = {"(1.0 / (1.0 + $0 * $0))"},
+    .c_deriv2 = {"(-2.0 * $0 / ((1.0 + $0 * $0) * (1.0 + $0 * $0)))"},
+  },
+  [ATAN2] = {
+    .optype = ATAN2, .nargs = 2, .opstring = "atan2", .opcodes = "o48",
+    .value = _op_atan2_value, .deriv = _op_atan2_deriv, .deriv2 = _op_atan2_deriv2,
+    .c_value = "atan2($0, $1)",
+    .c_deriv = {"($1 / ($0 * $0 + $1 * $1))", "(-$0 / ($0 * $0 + $1 * $1))"},
+    .c_deriv2 = {
+      "(-2.0 * $0 * $1 / (($0 * $0 + $1 * $1) * ($0 * $0 + $1 * $1)))",
+      "(($0 * $0 - $1 * $1) / (($0 * $0 + $1 * $1) * ($0 * $0 + $1 * $1)))",
+      "(2.0 * $0 * $1 / (($0 * $0 + $1 * $1) * ($0 * $0 + $1 * $1)))",
+    },
+  },
+  [ASIN] = {
+    .optype = ASIN, .nargs = 1, .opstring = "asin", .opcodes = "o51",
+    .value = _op_asin_value, .deriv = _op_asin_deriv, .deriv2 = _op_asin_deriv2,
+    .c_value = "asin($0)", .c_deriv = {"(1.0 / sqrt(1.0 - $0 * $0))"},
+    .c_deriv2 = {"($0 / ((1.0 - $0 * $0) * sqrt(1.0 - $0 * $0)))"},
+  },
+  [ACOS] = {
+    .optype = ACOS, .nargs = 1, .opstring = "acos", .opcodes = "o53",
+    .value = _op_acos_value, .deriv = _op_acos_deriv, .deriv2 = _op_acos_deriv2,
+    .c_value = "acos($0)", .c_deriv = {"(-1.0 / sqrt(1.0 - $0 * $0))"},
+    .c_deriv2 = {"(-$0 / ((1.0 - $0 * $0) * sqrt(1.0 - $0 * $0)))"},
+  },
+  [ASINH] = {
+    .optype = ASINH, .nargs = 1, .opstring = "asinh", .opcodes = "o50",
+    .value = _op_asinh_value, .deriv = _op_asinh_deriv, .deriv2 = _op_asinh_deriv2,
+    .c_value = "asinh($0)", .c_deriv = {"(1.0 / sqrt($0 * $0 + 1.0))"},
+    .c_deriv2 = {"(-$0 / (($0 * $0 + 1.0) * sqrt($0 * $0 + 1.0)))"},
+  },
+  [ACOSH] = {
+    .optype = ACOSH, .nargs = 1, .opstring = "acosh", .opcodes = "o52",
+    .value = _op_acosh_value, .deriv = _op_acosh_deriv, .deriv2 = _op_acosh_deriv2,
+    .c_value = "acosh($0)", .c_deriv = {"(1.0 / sqrt($0 * $0 - 1.0))"},
+    .c_deriv2 = {"(-$0 / (($0 * $0 - 1.0) * sqrt($0 * $0 - 1.0)))"},
+  },
+  [ATANH] = {
+    .optype = ATANH, .nargs = 1, .opstring = "atanh", .opcodes = "o47",
+    .value = _op_atanh_value, .deriv = _op_atanh_deriv, .deriv2 = _op_atanh_deriv2,
+    .c_value = "atanh($0)", .c_deriv = {"(1.0 / (1.0 - $0 * $0))"},
+    .c_deriv2 = {"(2.0 * $0 / ((1.0 - $0 * $0) * (1.0 - $0 * $0)))"},
+  },
+  [IF_THEN_ELSE] = {
+    .optype = IF_THEN_ELSE, .nargs = 3, .opstring = "if", .opcodes = "o35",
+    .value = _op_if_then_else_value, .deriv = _op_if_then_else_deriv,
+  },
+  [LESS_THAN] = {
+    .optype = LESS_THAN, .nargs = 2, .opstring = "<", .opcodes = "o22",
+    .value = _op_less_than_value, .deriv = _op_zero_deriv, .constant_deriv = true,
+    .c_value = "($0 < $1 ? 1.0 : 0.0)",
+  },
+  [LESS_EQUAL] = {
+    .optype = LESS_EQUAL, .nargs = 2, .opstring = "<=", .opcodes = "o23",
+    .value = _op_less_equal_value, .deriv = _op_zero_deriv, .constant_deriv = true,
+    .c_value = "($0 <= $1 ? 1.0 : 0.0)",
+  },
+  [EQUAL] = {
+    .optype = EQUAL, .nargs = 2, .opstring = "==", .opcodes = "o24",
+    .value = _op_equal_value, .deriv = _op_zero_deriv, .constant_deriv = true,
+    .c_value = "($0 == $1 ? 1.0 : 0.0)",
+  },
+  [GREATER_EQUAL] = {
+    .optype = GREATER_EQUAL, .nargs = 2, .opstring = ">=", .opcodes = "o28",
+    .value = _op_greater_equal_value, .deriv = _op_zero_deriv, .constant_deriv = true,
+    .c_value = "($0 >= $1 ? 1.0 : 0.0)",
+  },
+  [GREATER_THAN] = {
+    .optype = GREATER_THAN, .nargs = 2, .opstring = ">", .opcodes = "o29",
+    .value = _op_greater_than_value, .deriv = _op_zero_deriv, .constant_deriv = true,
+    .c_value = "($0 > $1 ? 1.0 : 0.0)",
+  },
+  [NOT_EQUAL] = {
+    .optype = NOT_EQUAL, .nargs = 2, .opstring = "!=", .opcodes = "o30",
+    .value = _op_not_equal_value, .deriv = _op_zero_deriv, .constant_deriv = true,
+    .c_value = "($0 != $1 ? 1.0 : 0.0)",
+  },
+  [AND] = {
+    .optype = AND, .nargs = 2, .opstring = "&&", .opcodes = "o21", .list_opcodes = "o70",
+    .value = _op_and_value, .deriv = _op_zero_deriv, .constant_deriv = true,
+  },
+  [OR] = {
+    .optype = OR, .nargs = 2, .opstring = "||", .opcodes = "o20", .list_opcodes = "o71",
+    .value = _op_or_value, .deriv = _op_zero_deriv, .constant_deriv = true,
+  },
+  [NOT] = {
+    .optype = NOT, .nargs = 1, .opstring = "!", .opcodes = "o34",
+    .value = _op_not_value, .deriv = _op_zero_deriv, .constant_deriv = true,
+    .c_value = "($0 == 0.0 ? 1.0 : 0.0)",
+  },
+};
+
+int hessian_index(int i, int j){
+  return i <= j ? i + j * (j + 1) / 2 : j + i * (i + 1) / 2;
+}
+
+/*
+ * x^n for integer n, by repeated squaring. This needs at most 2*log2(n)
+ * multiplications, and is much cheaper than pow for the small exponents
+ * that appear in most models.
+ */
+double _pow_int(double x, int n){
+  if (n < 0){
+    // n > INT_MIN, as specialize_power_node only accepts |n| <= INT_MAX
+    return 1.0 / _pow_int(x, -n);
+  }
+  double result = 1.0;
+  while (n > 0){
+    if (n & 1){
+      result *= x;
+    }
+    x *= x;
+    n >>= 1;
+  }
+  return result;
+}
+
+// Arithmetic
+
+double _op_sum_value(int nargs, double * x){
+  double sum = 0.0;
+  for (int i=0; i<nargs; i++){sum += x[i];}
+  return sum;
+}
+
+int _op_sum_deriv(int nargs, double * x, double value, double * grad){
+  for (int i=0; i<nargs; i++){grad[i] = 1.0;}
+  return 0;
+}
+
+double _op_product_value(int nargs, double * x){
+  double prod = 1.0;
+  for (int i=0; i<nargs; i++){prod *= x[i];}
+  return prod;
+}
+
+int _op_product_deriv(int nargs, double * x, double value, double * grad){
+  // The product of the arguments before i, times the product of those
+  // after i, so we never divide by an argument that may be zero. The
+  // products after i are computed once, backwards, into grad.
+  if (nargs == 0){
+    return 0;
+  }
+  grad[nargs-1] = 1.0;
+  for (int i=nargs-1; i>0; i--){grad[i-1] = grad[i] * x[i];}
+  double before = 1.0;
+  for (int i=0; i<nargs; i++){
+    grad[i] *= before;
+    before *= x[i];
+  }
+  return 0;
+}
+
+int _op_product_deriv2(int nargs, double * x, double value, double * hes){
+  // Entry (i, j), i < j, is the product of the arguments before i, those
+  // between i and j, and those after j. before[i] is the product of x[0],
+  // ..., x[i-1] and after[j] the product of x[j], ..., x[nargs-1], and we
+  // accumulate the products between i and j going up each column.
+  double before[nargs + 1];
+  double after[nargs + 1];
+  before[0] = 1.0;
+  for (int i=0; i<nargs; i++){before[i+1] = before[i] * x[i];}
+  after[nargs] = 1.0;
+  for (int j=nargs-1; j>=0; j--){after[j] = after[j+1] * x[j];}
+  for (int j=0; j<nargs; j++){
+    hes[hessian_index(j, j)] = 0.0;
+    double between = 1.0;
+    for (int i=j-1; i>=0; i--){
+      hes[hessian_index(i, j)] = before[i] * between * after[j+1];
+      between *= x[i];
+    }
+  }
+  return 0;
+}
+
+double _op_subtraction_value(int nargs, double * x){
+  return x[0] - x[1];
+}
+
+int _op_subtraction_deriv(int nargs, double * x, double value, double * grad){
+  grad[0] = 1.0;
+  grad[1] = -1.0;
+  return 0;
+}
+
+double _op_division_value(int nargs, double * x){
+  return x[0] / x[1];
+}
+
+int _op_division_deriv(int nargs, double * x, double value, double * grad){
+  if (x[1] == 0.0){
+    // Let the caller decide what to do, e.g. a line search can backtrack
+    grad[0] = NAN;
+    grad[1] = NAN;
+    return -1;
+  }
+  grad[0] = 1.0 / x[1];
+  grad[1] = -x[0] / (x[1] * x[1]);
+  return 0;
+}
+
+int _op_division_deriv2(int nargs, double * x, double value, double * hes){
+  hes[0] = 0.0;
+  hes[1] = -1.0 / (x[1] * x[1]);
+  hes[2] = 2.0 * x[0] / (x[1] * x[1] * x[1]);
+  return 0;
+}
+
+double _op_power_value(int nargs, double * x){
+  return pow(x[0], x[1]);
+}
+
+int _op_power_deriv(int nargs, double * x, double value, double * grad){
+  if (x[0] < 0.0 && x[1] != floor(x[1])){
+    // The power is not real here, so neither are its derivatives
+    grad[0] = NAN;
+    grad[1] = NAN;
+    return -1;
+  }
+  grad[0] = x[1] * pow(x[0], x[1] - 1.0);
+  // A negative base only has a power for integer exponents, so like a zero
+  // base we treat the exponent as a constant
+  grad[1] = x[0] <= 0.0 ? 0.0 : value * log(x[0]);
+  return 0;
+}
+
+int _op_power_deriv2(int nargs, double * x, double value, double * hes){
+  if (x[0] < 0.0 && x[1] != floor(x[1])){
+    hes[0] = NAN;
+    hes[1] = NAN;
+    hes[2] = NAN;
+    return -1;
+  }
+  hes[0] = x[1] * (x[1] - 1.0) * pow(x[0], x[1] - 2.0);
+  if (x[0] <= 0.0){
+    // As in _op_power_deriv, we ignore the exponent
+    hes[1] = 0.0;
+    hes[2] = 0.0;
+    return 0;
+  }
+  double logx = log(x[0]);
+  hes[1] = pow(x[0], x[1] - 1.0) * (1.0 + x[1] * logx);
+  hes[2] = value * logx * logx;
+  return 0;
+}
+
+double _op_neg_value(int nargs, double * x){
+  return -x[0];
+}
+
+int _op_neg_deriv(int nargs, double * x, double value, double * grad){
+  grad[0] = -1.0;
+  return 0;
+}
+
+// The constant operand of the specialized powers has a zero partial
+
+double _op_square_value(int nargs, double * x){
+  return x[0] * x[0];
+}
+
+int _op_square_deriv(int nargs, double * x, double value, double * grad){
+  grad[0] = 2.0 * x[0];
+  return 0;
+}
+
+int _op_square_deriv2(int nargs, double * x, double value, double * hes){
+  hes[0] = 2.0;
+  return 0;
+}
+
+double _op_pow_const_int_value(int nargs, double * x){
+  return _pow_int(x[0], (int)x[1]);
+}
+
+int _op_pow_const_int_deriv(int nargs, double * x, double value, double * grad){
+  int n = (int)x[1];
+  grad[0] = n * _pow_int(x[0], n - 1);
+  grad[1] = 0.0;
+  return 0;
+}
+
+int _op_pow_const_int_deriv2(int nargs, double * x, double value, double * hes){
+  int n = (int)x[1];
+  hes[0] = (double)n * (n - 1) * _pow_int(x[0], n - 2);
+  hes[1] = 0.0;
+  hes[2] = 0.0;
+  return 0;
+}
+
+int _op_pow_const_real_deriv(int nargs, double * x, double value, double * grad){
+  grad[0] = x[1] * pow(x[0], x[1] - 1.0);
+  grad[1] = 0.0;
+  return 0;
+}
+
+int _op_pow_const_real_deriv2(int nargs, double * x, double value, double * hes){
+  hes[0] = x[1] * (x[1] - 1.0) * pow(x[0], x[1] - 2.0);
+  hes[1] = 0.0;
+  hes[2] = 0.0;
+  return 0;
+}
+
+int _op_exp_const_base_deriv(int nargs, double * x, double value, double * grad){
+  grad[0] = 0.0;
+  grad[1] = value * log(x[0]);
+  return 0;
+}
+
+int _op_exp_const_base_deriv2(int nargs, double * x, double value, double * hes){
+  double logc = log(x[0]);
+  hes[0] = 0.0;
+  hes[1] = 0.0;
+  hes[2] = value * logc * logc;
+  return 0;
+}
+
+// x[0] is the function's index, and the function's arguments follow
+
+double _op_external_value(int nargs, double * x){
+  return external_evaluate((int)x[0], nargs - 1, x + 1, NULL, NULL);
+}
+
+int _op_external_deriv(int nargs, double * x, double value, double * grad){
+  grad[0] = 0.0;
+  value = external_evaluate((int)x[0], nargs - 1, x + 1, grad + 1, NULL);
+  return isnan(value) ? -1 : 0;
+}
+
+int _op_external_deriv2(int nargs, double * x, double value, double * hes){
+  int n = nargs - 1;
+  double grad[n > 0 ? n : 1];
+  double sub[n * (n + 1) / 2 + 1];
+  value = external_evaluate((int)x[0], n, x + 1, grad, sub);
+  for (int j=0; j<nargs; j++){
+    for (int i=0; i<=j; i++){
+      hes[hessian_index(i, j)] = i == 0 ? 0.0 : sub[hessian_index(i-1, j-1)];
+    }
+  }
+  return isnan(value) ? -1 : 0;
+}
+
+// Elementary functions
+
+double _op_sqrt_value(int nargs, double * x){
+  return sqrt(x[0]);
+}
+
+int _op_sqrt_deriv(int nargs, double * x, double value, double * grad){
+  if (x[0] < 0.0){
+    grad[0] = NAN;
+    return -1;
+  }
+  grad[0] = 0.5 / value;
+  return 0;
+}
+
+int _op_sqrt_deriv2(int nargs, double * x, double value, double * hes){
+  hes[0] = -0.25 / (value * x[0]);
+  return 0;
+}
+
+double _op_exp_value(int nargs, double * x){
+  return exp(x[0]);
+}
+
+int _op_exp_deriv(int nargs, double * x, double value, double * grad){
+  grad[0] = value;
+  return 0;
+}
+
+int _op_exp_deriv2(int nargs, double * x, double value, double * hes){
+  hes[0] = value;
+  return 0;
+}
+
+double _op_log_value(int nargs, double * x){
+  return log(x[0]);
+}
+
+int _op_log_deriv(int nargs, double * x, double value, double * grad){
+  if (x[0] <= 0.0){
+    grad[0] = NAN;
+    return -1;
+  }
+  grad[0] = 1.0 / x[0];
+  return 0;
+}
+
+int _op_log_deriv2(int nargs, double * x, double value, double * hes){
+  hes[0] = -1.0 / (x[0] * x[0]);
+  return 0;
+}
+
+double _op_log10_value(int nargs, double * x){
+  return log10(x[0]);
+}
+
+int _op_log10_deriv(int nargs, double * x, double value, double * grad){
+  if (x[0] <= 0.0){
+    grad[0] = NAN;
+    return -1;
+  }
+  grad[0] = 1.0 / (x[0] * M_LN10);
+  return 0;
+}
+
+int _op_log10_deriv2(int nargs, double * x, double value, double * hes){
+  hes[0] = -1.0 / (x[0] * x[0] * M_LN10);
+  return 0;
+}
+
+double _op_sin_value(int nargs, double * x){
+  return sin(x[0]);
+}
+
+int _op_sin_deriv(int nargs, double * x, double value, double * grad){
+  grad[0] = cos(x[0]);
+  return 0;
+}
+
+int _op_sin_deriv2(int nargs, double * x, double value, double * hes){
+  hes[0] = -value;
+  return 0;
+}
+
+double _op_cos_value(int nargs, double * x){
+  return cos(x[0]);
+}
+
+int _op_cos_deriv(int nargs, double * x, double value, double * grad){
+  grad[0] = -sin(x[0]);
+  return 0;
+}
+
+int _op_cos_deriv2(int nargs, double * x, double value, double * hes){
+  hes[0] = -value;
+  return 0;
+}
+
+double _op_tan_value(int nargs, double * x){
+  return tan(x[0]);
+}
+
+// d/dx tan(x) = 1 / cos(x)^2 = 1 + tan(x)^2
+int _op_tan_deriv(int nargs, double * x, double value, double * grad){
+  grad[0] = 1.0 + value * value;
+  return 0;
+}
+
+int _op_tan_deriv2(int nargs, double * x, double value, double * hes){
+  hes[0] = 2.0 * value * (1.0 + value * value);
+  return 0;
+}
+
+double _op_tanh_value(int nargs, double * x){
+  return tanh(x[0]);
+}
+
+int _op_tanh_deriv(int nargs, double * x, double value, double * grad){
+  grad[0] = 1.0 - value * value;
+  return 0;
+}
+
+int _op_tanh_deriv2(int nargs, double * x, double value, double * hes){
+  hes[0] = -2.0 * value * (1.0 - value * value);
+  return 0;
+}
+
+double _op_sinh_value(int nargs, double * x){
+  return sinh(x[0]);
+}
+
+int _op_sinh_deriv(int nargs, double * x, double value, double * grad){
+  grad[0] = cosh(x[0]);
+  return 0;
+}
+
+double _op_cosh_value(int nargs, double * x){
+  return cosh(x[0]);
+}
+
+int _op_cosh_deriv(int nargs, double * x, double value, double * grad){
+  grad[0] = sinh(x[0]);
+  return 0;
+}
+
+// The second derivative of sinh is sinh, and of cosh is cosh
+int _op_hyperbolic_deriv2(int nargs, double * x, double value, double * hes){
+  hes[0] = value;
+  return 0;
+}
+
+double _op_atan_value(int nargs, double * x){
+  return atan(x[0]);
+}
+
+int _op_atan_deriv(int nargs, double * x, double value, double * grad){
+  grad[0] = 1.0 / (1.0 + x[0] * x[0]);
+  return 0;
+}
+
+int _op_atan_deriv2(int nargs, double * x, double value, double * hes){
+  double d = 1.0 + x[0] * x[0];
+  hes[0] = -2.0 * x[0] / (d * d);
+  return 0;
+}
+
+double _op_atan2_value(int nargs, double * x){
+  return atan2(x[0], x[1]);
+}
+
+int _op_atan2_deriv(int nargs, double * x, double value, double * grad){
+  double r2 = x[0] * x[0] + x[1] * x[1];
+  if (r2 == 0.0){
+    grad[0] = NAN;
+    grad[1] = NAN;
+    return -1;
+  }
+  grad[0] = x[1] / r2;
+  grad[1] = -x[0] / r2;
+  return 0;
+}
+
+int _op_atan2_deriv2(int nargs, double * x, double value, double * hes){
+  double r2 = x[0] * x[0] + x[1] * x[1];
+  double r4 = r2 * r2;
+  hes[0] = -2.0 * x[0] * x[1] / r4;
+  hes[1] = (x[0] * x[0] - x[1] * x[1]) / r4;
+  hes[2] = 2.0 * x[0] * x[1] / r4;
+  return 0;
+}
+
+double _op_asin_value(int nargs, double * x){
+  return asin(x[0]);
+}
+
+int _op_asin_deriv(int nargs, double * x, double value, double * grad){
+  if (fabs(x[0]) > 1.0){
+    grad[0] = NAN;
+    return -1;
+  }
+  grad[0] = 1.0 / sqrt(1.0 - x[0] * x[0]);
+  return 0;
+}
+
+int _op_asin_deriv2(int nargs, double * x, double value, double * hes){
+  double d = 1.0 - x[0] * x[0];
+  hes[0] = x[0] / (d * sqrt(d));
+  return 0;
+}
+
+double _op_acos_value(int nargs, double * x){
+  return acos(x[0]);
+}
+
+int _op_acos_deriv(int nargs, double * x, double value, double * grad){
+  int status = _op_asin_deriv(nargs, x, value, grad);
+  grad[0] = -grad[0];
+  return status;
+}
+
+int _op_acos_deriv2(int nargs, double * x, double value, double * hes){
+  _op_asin_deriv2(nargs, x, value, hes);
+  hes[0] = -hes[0];
+  return 0;
+}
+
+double _op_asinh_value(int nargs, double * x){
+  return asinh(x[0]);
+}
+
+int _op_asinh_deriv(int nargs, double * x, double value, double * grad){
+  grad[0] = 1.0 / sqrt(x[0] * x[0] + 1.0);
+  return 0;
+}
+
+int _op_asinh_deriv2(int nargs, double * x, double value, double * hes){
+  double d = x[0] * x[0] + 1.0;
+  hes[0] = -x[0] / (d * sqrt(d));
+  return 0;
+}
+
+double _op_acosh_value(int nargs, double * x){
+  return acosh(x[0]);
+}
+
+int _op_acosh_deriv(int nargs, double * x, double value, double * grad){
+  if (x[0] < 1.0){
+    grad[0] = NAN;
+    return -1;
+  }
+  grad[0] = 1.0 / sqrt(x[0] * x[0] - 1.0);
+  return 0;
+}
+
+int _op_acosh_deriv2(int nargs, double * x, double value, double * hes){
+  double d = x[0] * x[0] - 1.0;
+  hes[0] = -x[0] / (d * sqrt(d));
+  return 0;
+}
+
+double _op_atanh_value(int nargs, double * x){
+  return atanh(x[0]);
+}
+
+int _op_atanh_deriv(int nargs, double * x, double value, double * grad){
+  if (fabs(x[0]) > 1.0){
+    grad[0] = NAN;
+    return -1;
+  }
+  grad[0] = 1.0 / (1.0 - x[0] * x[0]);
+  return 0;
+}
+
+int _op_atanh_deriv2(int nargs, double * x, double value, double * hes){
+  double d = 1.0 - x[0] * x[0];
+  hes[0] = 2.0 * x[0] / (d * d);
+  return 0;
+}
+
+// Piecewise operators. Their derivatives are those of the piece we are on.
+
+double _op_abs_value(int nargs, double * x){
+  return fabs(x[0]);
+}
+
+int _op_abs_deriv(int nargs, double * x, double value, double * grad){
+  grad[0] = x[0] > 0.0 ? 1.0 : (x[0] < 0.0 ? -1.0 : 0.0);
+  return 0;
+}
+
+double _op_min_value(int nargs, double * x){
+  double m = x[0];
+  for (int i=1; i<nargs; i++){
+    if (x[i] < m){m = x[i];}
+  }
+  return m;
+}
+
+double _op_max_value(int nargs, double * x){
+  double m = x[0];
+  for (int i=1; i<nargs; i++){
+    if (x[i] > m){m = x[i];}
+  }
+  return m;
+}
+
+double _op_if_then_else_value(int nargs, double * x){
+  return x[0] != 0.0 ? x[1] : x[2];
+}
+
+/*
+ * Operators whose value is one of their arguments have a partial of 1 with
+ * respect to that argument, and 0 for the others. For min and max, if
+ * several arguments have the value, we choose the first.
+ */
+int _op_min_max_deriv(int nargs, double * x, double value, double * grad){
+  int k = nargs;
+  for (int i=0; i<nargs; i++){
+    grad[i] = 0.0;
+    if (k == nargs && x[i] == value){k = i;}
+  }
+  if (k == nargs){
+    // NaN arguments
+    for (int i=0; i<nargs; i++){grad[i] = NAN;}
+    return -1;
+  }
+  grad[k] = 1.0;
+  return 0;
+}
+
+int _op_if_then_else_deriv(int nargs, double * x, double value, double * grad){
+  grad[0] = 0.0;
+  grad[1] = x[0] != 0.0 ? 1.0 : 0.0;
+  grad[2] = x[0] != 0.0 ? 0.0 : 1.0;
+  return 0;
+}
+
+double _op_floor_value(int nargs, double * x){
+  return floor(x[0]);
+}
+
+double _op_ceil_value(int nargs, double * x){
+  return ceil(x[0]);
+}
+
+double _op_rem_value(int nargs, double * x){
+  return fmod(x[0], x[1]);
+}
+
+int _op_rem_deriv(int nargs, double * x, double value, double * grad){
+  if (x[1] == 0.0){
+    grad[0] = NAN;
+    grad[1] = NAN;
+    return -1;
+  }
+  grad[0] = 1.0;
+  grad[1] = -trunc(x[0] / x[1]);
+  return 0;
+}
+
+// Comparisons and logical operators
+
+double _op_less_than_value(int nargs, double * x){
+  return x[0] < x[1] ? 1.0 : 0.0;
+}
+
+double _op_less_equal_value(int nargs, double * x){
+  return x[0] <= x[1] ? 1.0 : 0.0;
+}
+
+double _op_equal_value(int nargs, double * x){
+  return x[0] == x[1] ? 1.0 : 0.0;
+}
+
+double _op_greater_equal_value(int nargs, double * x){
+  return x[0] >= x[1] ? 1.0 : 0.0;
+}
+
+double _op_greater_than_value(int nargs, double * x){
+  return x[0] > x[1] ? 1.0 : 0.0;
+}
+
+double _op_not_equal_value(int nargs, double * x){
+  return x[0] != x[1] ? 1.0 : 0.0;
+}
+
+double _op_and_value(int nargs, double * x){
+  for (int i=0; i<nargs; i++){
+    if (x[i] == 0.0){return 0.0;}
+  }
+  return 1.0;
+}
+
+double _op_or_value(int nargs, double * x){
+  for (int i=0; i<nargs; i++){
+    if (x[i] != 0.0){return 1.0;}
+  }
+  return 0.0;
+}
+
+double _op_not_value(int nargs, double * x){
+  return x[0] == 0.0 ? 1.0 : 0.0;
+}
+
+// Operators that are piecewise constant
+int _op_zero_deriv(int nargs, double * x, double value, double * grad){
+  for (int i=0; i<nargs; i++){grad[i] = 0.0;}
+  return 0;
+}
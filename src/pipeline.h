@@ -0,0 +1,287 @@
+#include <pthread.h>
+
+/*
+ * Pipelined loading
+ *
+ * For one-shot jobs on a big model, e.g. checking the feasibility of the
+ * starting point, we don't need every constraint in memory at once. The
+ * parser hands each constraint to a pool of worker threads as soon as it
+ * has been read (see read_nl_constraints_stream), so evaluating and
+ * differentiating overlaps with reading the rest of the file. Each worker
+ * evaluates the expression at the current values of the variables,
+ * computes its Jacobian row with reverse_diff_expression, and frees the
+ * expression.
+ *
+ * Expressions wait for a worker in a queue of fixed capacity. The parser
+ * waits while the queue is full, so at most capacity + nworker + 1
+ * expressions are in memory at a time, however big the file is.
+ *
+ * Results are handed to the caller's handler in constraint order, whatever
+ * order the workers finish in. A result that finishes early waits until
+ * the ones before it are done, in a reorder window of capacity + nworker
+ * slots, so memory doesn't grow with the number of constraints either. The
+ * parser also waits while a constraint is too far ahead of the next one to
+ * hand over. (If the file lists constraints so far out of order that the
+ * next one hasn't been read yet, this is an error rather than a deadlock.)
+ * Handlers are called one at a time, from whichever worker completes the
+ * next constraint, so they don't need to be thread-safe. The Jacobian row
+ * is freed after the handler returns.
+ *
+ * Usage:
+ *
+ *     read_starting_point(fp, variables, nvar, NULL, 0);
+ *     ...
+ *     pipeline_nl_constraints(fp, ncon, variables, nvar, 4, 64, handler, data);
+ *
+ * Workers read the variables, and external functions (see external.h) use
+ * a cache per worker, so nothing else needs to be shared.
+ */
+
+struct ConstraintResult {
+  int index;
+  double value;
+  // The gradient of the constraint, as a 1 x nvar matrix
+  struct CSRMatrix jac;
+  // -1 if the value or a derivative is undefined, otherwise 0
+  int status;
+};
+
+/*
+ * Read the constraints in fp, evaluating and differentiating them on
+ * nworker threads, and call handler(result, data) for each constraint in
+ * order. Returns -1 if a constraint couldn't be read (as in
+ * read_nl_constraints) or is missing, otherwise 0.
+ */
+int pipeline_nl_constraints(
+  FILE * fp,
+  int ncon,
+  struct Variable * variables,
+  int nvar,
+  int nworker,
+  int capacity,
+  void (* handler)(struct ConstraintResult *, void *),
+  void * data
+);
+
+// The state of a slot in the reorder window
+enum PipelineState {
+  PIPELINE_FREE,
+  PIPELINE_QUEUED,
+  PIPELINE_DONE,
+};
+
+struct Pipeline {
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  pthread_cond_t window_open;
+  // Ring buffer of expressions waiting for a worker
+  int capacity;
+  int head;
+  int count;
+  int * queue_index;
+  struct Node * queue_expr;
+  // Set when the parser has finished
+  bool done;
+  int nvar;
+  // Reorder window: constraint i is in slot i % window while it is queued,
+  // in progress or waiting to be handed over. next is the index of the next
+  // constraint to hand to the handler. One worker at a time is emitting.
+  int ncon;
+  int window;
+  int * slot_index;
+  struct ConstraintResult * results;
+  enum PipelineState * state;
+  int next;
+  bool emitting;
+  void (* handler)(struct ConstraintResult *, void *);
+  void * data;
+  int status;
+};
+
+void _pipeline_push(int cidx, struct Node expr, void * data);
+void * _pipeline_worker(void * arg);
+void _pipeline_finish(struct Pipeline * pl, struct ConstraintResult result);
+
+int pipeline_nl_constraints(
+  FILE * fp,
+  int ncon,
+  struct Variable * variables,
+  int nvar,
+  int nworker,
+  int capacity,
+  void (* handler)(struct ConstraintResult *, void *),
+  void * data
+){
+  TRACE_BEGIN("pipeline_nl_constraints");
+  if (nworker < 1){nworker = 1;}
+  if (capacity < 1){capacity = 1;}
+  struct Pipeline pl = {
+    .capacity = capacity,
+    .queue_index = malloc(capacity * sizeof(int)),
+    .queue_expr = malloc(capacity * sizeof(struct Node)),
+    .nvar = nvar,
+    .ncon = ncon,
+    .window = capacity + nworker,
+    .slot_index = malloc((capacity + nworker) * sizeof(int)),
+    .results = malloc((capacity + nworker) * sizeof(struct ConstraintResult)),
+    .state = malloc((capacity + nworker) * sizeof(enum PipelineState)),
+    .handler = handler,
+    .data = data,
+  };
+  for (int k=0; k<pl.window; k++){
+    pl.slot_index[k] = -1;
+    pl.state[k] = PIPELINE_FREE;
+  }
+  pthread_mutex_init(&pl.lock, NULL);
+  pthread_cond_init(&pl.not_empty, NULL);
+  pthread_cond_init(&pl.not_full, NULL);
+  pthread_cond_init(&pl.window_open, NULL);
+
+  pthread_t * workers = malloc(nworker * sizeof(pthread_t));
+  for (int k=0; k<nworker; k++){
+    pthread_create(&workers[k], NULL, _pipeline_worker, &pl);
+  }
+  int status = read_nl_constraints_stream(fp, variables, nvar, _pipeline_push, &pl);
+  pthread_mutex_lock(&pl.lock);
+  pl.done = true;
+  pthread_cond_broadcast(&pl.not_empty);
+  pthread_mutex_unlock(&pl.lock);
+  for (int k=0; k<nworker; k++){
+    pthread_join(workers[k], NULL);
+  }
+
+  if (pl.next < ncon){
+    // Results after the missing constraint were never emitted
+    printf("ERROR: Constraint %d is missing\n", pl.next);
+    for (int k=0; k<pl.window; k++){
+      if (pl.state[k] == PIPELINE_DONE){free_csrmatrix(pl.results[k].jac);}
+    }
+    status = -1;
+  }
+  if (pl.status != 0){
+    status = -1;
+  }
+  pthread_cond_destroy(&pl.window_open);
+  pthread_cond_destroy(&pl.not_full);
+  pthread_cond_destroy(&pl.not_empty);
+  pthread_mutex_destroy(&pl.lock);
+  free(workers);
+  free(pl.queue_index);
+  free(pl.queue_expr);
+  free(pl.slot_index);
+  free(pl.results);
+  free(pl.state);
+  TRACE_END("pipeline_nl_constraints");
+  return status;
+}
+
+// Called by the parser with each expression it reads
+void _pipeline_push(int cidx, struct Node expr, void * data){
+  struct Pipeline * pl = data;
+  pthread_mutex_lock(&pl->lock);
+  // Wait for cidx to fit in the window, as long as the next constraint has
+  // been read, so it will be handed over
+  while (
+    cidx >= pl->next + pl->window
+    && pl->slot_index[pl->next % pl->window] == pl->next
+    && pl->state[pl->next % pl->window] != PIPELINE_FREE
+  ){
+    pthread_cond_wait(&pl->window_open, &pl->lock);
+  }
+  // Constraints before next have been handed over, and a slot that still
+  // holds cidx means it was read before
+  int slot = cidx >= 0 ? cidx % pl->window : 0;
+  if (
+    cidx < pl->next || cidx >= pl->ncon
+    || (pl->slot_index[slot] == cidx && pl->state[slot] != PIPELINE_FREE)
+  ){
+    printf("ERROR: Invalid or repeated constraint index %d\n", cidx);
+    pl->status = -1;
+    pthread_mutex_unlock(&pl->lock);
+    free_expression(expr);
+    return;
+  }
+  if (cidx >= pl->next + pl->window){
+    printf(
+      "ERROR: Constraint %d is more than %d ahead of constraint %d\n",
+      cidx, pl->window, pl->next
+    );
+    pl->status = -1;
+    pthread_mutex_unlock(&pl->lock);
+    free_expression(expr);
+    return;
+  }
+  pl->slot_index[slot] = cidx;
+  pl->state[slot] = PIPELINE_QUEUED;
+  while (pl->count == pl->capacity){
+    pthread_cond_wait(&pl->not_full, &pl->lock);
+  }
+  int tail = (pl->head + pl->count) % pl->capacity;
+  pl->queue_index[tail] = cidx;
+  pl->queue_expr[tail] = expr;
+  pl->count += 1;
+  pthread_cond_signal(&pl->not_empty);
+  pthread_mutex_unlock(&pl->lock);
+}
+
+void * _pipeline_worker(void * arg){
+  struct Pipeline * pl = arg;
+  while (true){
+    pthread_mutex_lock(&pl->lock);
+    while (pl->count == 0 && !pl->done){
+      pthread_cond_wait(&pl->not_empty, &pl->lock);
+    }
+    if (pl->count == 0){
+      pthread_mutex_unlock(&pl->lock);
+      break;
+    }
+    int cidx = pl->queue_index[pl->head];
+    struct Node expr = pl->queue_expr[pl->head];
+    pl->head = (pl->head + 1) % pl->capacity;
+    pl->count -= 1;
+    pthread_cond_signal(&pl->not_full);
+    pthread_mutex_unlock(&pl->lock);
+
+    TRACE_BEGIN("pipeline constraint");
+    struct ConstraintResult result = {.index = cidx, .status = 0};
+    result.value = evaluate(expr);
+    result.jac = reverse_diff_expression(expr, pl->nvar);
+    free_expression(expr);
+    if (!isfinite(result.value)){result.status = -1;}
+    for (int k=0; k<result.jac.nnz; k++){
+      if (!isfinite(result.jac.values[k])){result.status = -1;}
+    }
+    TRACE_END("pipeline constraint");
+    _pipeline_finish(pl, result);
+  }
+  free_external_cache();
+  return NULL;
+}
+
+// Store a result, and emit every result that is now next in order, unless
+// another worker is already doing so
+void _pipeline_finish(struct Pipeline * pl, struct ConstraintResult result){
+  pthread_mutex_lock(&pl->lock);
+  int slot = result.index % pl->window;
+  pl->results[slot] = result;
+  pl->state[slot] = PIPELINE_DONE;
+  if (!pl->emitting){
+    pl->emitting = true;
+    while (pl->next < pl->ncon && pl->state[pl->next % pl->window] == PIPELINE_DONE){
+      // Slots are reused in order, so this holds constraint next
+      struct ConstraintResult r = pl->results[pl->next % pl->window];
+      pl->state[pl->next % pl->window] = PIPELINE_FREE;
+      pl->next += 1;
+      pthread_cond_signal(&pl->window_open);
+      // Other workers can store results while we call the handler. Since we
+      // check for the next result with the lock held, none are missed.
+      pthread_mutex_unlock(&pl->lock);
+      pl->handler(&r, pl->data);
+      free_csrmatrix(r.jac);
+      pthread_mutex_lock(&pl->lock);
+    }
+    pl->emitting = false;
+  }
+  pthread_mutex_unlock(&pl->lock);
+}
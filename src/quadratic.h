@@ -0,0 +1,752 @@
+/*
+ * Linear and quadratic structure detection
+ *
+ * Many constraints and objectives are linear or quadratic, e.g. the
+ * sum of squares objective in model.nl. Evaluating these with the tape (or
+ * the tree) means re-evaluating and re-differentiating every operator at
+ * every point, and computing a Hessian that is actually constant.
+ *
+ * classify_expression tags an expression as linear, quadratic or
+ * (general) nonlinear. For linear and quadratic expressions, it extracts the
+ * coefficients once, as a QuadraticForm:
+ *
+ *     f(x) = constant + sum_k lin[k].coef * x[lin[k].var]
+ *                     + sum_k quad[k].coef * x[quad[k].row] * x[quad[k].col]
+ *
+ * The gradient of f is an affine function of x, which we store as a
+ * constant vector plus a sparse matrix, so a Jacobian row is an SpMV, and
+ * the Hessian of f is constant: 2 * quad[k].coef on the diagonal and
+ * quad[k].coef below it.
+ *
+ * An expression is quadratic if it is built from variables and constants
+ * with sums, subtractions, negations, products (of total degree at most 2),
+ * divisions by constants, and constant powers 0, 1 and 2. Subtrees without
+ * variables are evaluated once. Expressions with parameters are treated as
+ * nonlinear, as their coefficients would change with the parameter values.
+ * Terms that cancel within an argument are dropped before checking the
+ * degree of a product, so (v0 - v0) * v1 * v2 is linear (it is 0), but
+ * otherwise this is a syntactic check, e.g. v0 * v1 / v1 is nonlinear.
+ *
+ * quadratic_evaluator implements the Evaluator interface (see evaluator.h),
+ * using the tape only for the nonlinear constraints.
+ *
+ * Usage:
+ *
+ *     struct QuadraticForm form;
+ *     if (classify_expression(expr, &form) != NONLINEAR_EXPRESSION){
+ *       double value = quadratic_value(&form, x);
+ *       // grad[r] is the derivative with respect to x[form.vars[r]]
+ *       quadratic_gradient(&form, x, grad);
+ *       free_quadratic_form(form);
+ *     }
+ */
+
+enum ExpressionClass {
+  LINEAR_EXPRESSION,
+  QUADRATIC_EXPRESSION,
+  NONLINEAR_EXPRESSION,
+};
+
+struct LinearTerm {
+  int var;
+  double coef;
+};
+
+struct QuadraticTerm {
+  // row >= col
+  int row;
+  int col;
+  double coef;
+};
+
+struct QuadraticForm {
+  double constant;
+  // Sorted by variable, without duplicates
+  int nlin;
+  struct LinearTerm * lin;
+  // Sorted by (row, col), without duplicates
+  int nquad;
+  struct QuadraticTerm * quad;
+  // The (sorted) variables that appear in the expression. Entry r of the
+  // gradient, grad_constant + grad_matrix * x, is the derivative with respect
+  // to x[vars[r]].
+  int nvar;
+  int * vars;
+  double * grad_constant;
+  struct CSRMatrix grad_matrix;
+};
+
+/*
+ * Classify an expression. If it is linear or quadratic, and form is not
+ * NULL, its coefficients are stored in form, which should be freed with
+ * free_quadratic_form.
+ */
+enum ExpressionClass classify_expression(struct Node expr, struct QuadraticForm * form);
+void free_quadratic_form(struct QuadraticForm form);
+double quadratic_value(struct QuadraticForm * form, double * x);
+int quadratic_gradient(struct QuadraticForm * form, double * x, double * grad);
+
+/*
+ * Construct an evaluator that evaluates linear and quadratic constraints
+ * from their coefficients, and the remaining constraints with a tape.
+ * The Jacobian rows of linear and quadratic constraints have sorted
+ * variables, and their Hessian entries only include the quadratic terms.
+ */
+struct Evaluator quadratic_evaluator(struct Node * exprs, int ncon, int nvar);
+
+struct QuadraticEvaluatorData {
+  int ncon;
+  enum ExpressionClass * classes;
+  // forms[i] is only set for linear and quadratic constraints
+  struct QuadraticForm * forms;
+  // Row offsets of the Jacobian
+  int * jac_indptr;
+  // Nonlinear constraint nonlinear[r] is expression r of the tape
+  int nnonlinear;
+  int * nonlinear;
+  struct Tape tape;
+  struct CSRMatrix tape_hessian;
+  struct HessianColoring tape_coloring;
+  // Position of each entry of tape_hessian in the evaluator's Hessian
+  int * tape_hess_pos;
+  // Constant Hessian entries of quadratic constraints. We add
+  // lambda[const_hess_con[k]] * const_hess_values[k] to entry const_hess_pos[k].
+  int nconst_hess;
+  int * const_hess_con;
+  int * const_hess_pos;
+  double * const_hess_values;
+  // Workspaces for the tape
+  double * tape_g;
+  double * tape_jac;
+  double * tape_lambda;
+  double * tape_hess;
+  double * values;
+  double * adjoints;
+  double * dvalues;
+  double * dadjoints;
+};
+
+struct QuadraticForm _qf_constant(double value);
+int _qf_degree(struct QuadraticForm * form);
+struct QuadraticForm _qf_combine(struct QuadraticForm * a, double sa, struct QuadraticForm * b, double sb);
+struct QuadraticForm _qf_multiply(struct QuadraticForm * a, struct QuadraticForm * b);
+void _qf_canonicalize(struct QuadraticForm * form);
+void _qf_build_gradient(struct QuadraticForm * form);
+bool _quadratic_form(struct Node expr, struct QuadraticForm * form);
+int _compare_linear_term(const void * a, const void * b);
+int _compare_quadratic_term(const void * a, const void * b);
+int _quadratic_eval_g(void * data, double * x, double * p, double * g);
+int _quadratic_eval_jac(void * data, double * x, double * p, double * jac_values);
+int _quadratic_eval_hess(void * data, double * x, double * p, double * lambda, double * hess_values);
+void _quadratic_free_data(void * data);
+
+int _compare_linear_term(const void * a, const void * b){
+  const struct LinearTerm * x = a;
+  const struct LinearTerm * y = b;
+  return (x->var > y->var) - (x->var < y->var);
+}
+
+int _compare_quadratic_term(const void * a, const void * b){
+  const struct QuadraticTerm * x = a;
+  const struct QuadraticTerm * y = b;
+  if (x->row != y->row){
+    return (x->row > y->row) - (x->row < y->row);
+  }
+  return (x->col > y->col) - (x->col < y->col);
+}
+
+struct QuadraticForm _qf_constant(double value){
+  struct QuadraticForm form = {.constant = value};
+  return form;
+}
+
+int _qf_degree(struct QuadraticForm * form){
+  if (form->nquad > 0){
+    return 2;
+  }
+  return form->nlin > 0 ? 1 : 0;
+}
+
+// sa * a + sb * b. Terms are concatenated, so the result should be
+// canonicalized.
+struct QuadraticForm _qf_combine(struct QuadraticForm * a, double sa, struct QuadraticForm * b, double sb){
+  struct QuadraticForm form = {
+    .constant = sa * a->constant + sb * b->constant,
+    .nlin = a->nlin + b->nlin,
+    .lin = malloc((a->nlin + b->nlin + 1) * sizeof(struct LinearTerm)),
+    .nquad = a->nquad + b->nquad,
+    .quad = malloc((a->nquad + b->nquad + 1) * sizeof(struct QuadraticTerm)),
+  };
+  for (int k=0; k<a->nlin; k++){
+    form.lin[k] = a->lin[k];
+    form.lin[k].coef *= sa;
+  }
+  for (int k=0; k<b->nlin; k++){
+    form.lin[a->nlin + k] = b->lin[k];
+    form.lin[a->nlin + k].coef *= sb;
+  }
+  for (int k=0; k<a->nquad; k++){
+    form.quad[k] = a->quad[k];
+    form.quad[k].coef *= sa;
+  }
+  for (int k=0; k<b->nquad; k++){
+    form.quad[a->nquad + k] = b->quad[k];
+    form.quad[a->nquad + k].coef *= sb;
+  }
+  return form;
+}
+
+// a * b, which the caller has checked has degree at most 2. As with
+// _qf_combine, the result should be canonicalized.
+struct QuadraticForm _qf_multiply(struct QuadraticForm * a, struct QuadraticForm * b){
+  int nquad = a->nquad + b->nquad + a->nlin * b->nlin;
+  struct QuadraticForm form = {
+    .constant = a->constant * b->constant,
+    .nlin = a->nlin + b->nlin,
+    .lin = malloc((a->nlin + b->nlin + 1) * sizeof(struct LinearTerm)),
+    .nquad = nquad,
+    .quad = malloc((nquad + 1) * sizeof(struct QuadraticTerm)),
+  };
+  int k = 0;
+  for (int ka=0; ka<a->nlin; ka++){
+    form.lin[k] = a->lin[ka];
+    form.lin[k].coef *= b->constant;
+    k += 1;
+  }
+  for (int kb=0; kb<b->nlin; kb++){
+    form.lin[k] = b->lin[kb];
+    form.lin[k].coef *= a->constant;
+    k += 1;
+  }
+  k = 0;
+  for (int ka=0; ka<a->nquad; ka++){
+    form.quad[k] = a->quad[ka];
+    form.quad[k].coef *= b->constant;
+    k += 1;
+  }
+  for (int kb=0; kb<b->nquad; kb++){
+    form.quad[k] = b->quad[kb];
+    form.quad[k].coef *= a->constant;
+    k += 1;
+  }
+  for (int ka=0; ka<a->nlin; ka++){
+    for (int kb=0; kb<b->nlin; kb++){
+      int i = a->lin[ka].var;
+      int j = b->lin[kb].var;
+      form.quad[k].row = i > j ? i : j;
+      form.quad[k].col = i > j ? j : i;
+      form.quad[k].coef = a->lin[ka].coef * b->lin[kb].coef;
+      k += 1;
+    }
+  }
+  return form;
+}
+
+// Sort the terms, merge duplicates and drop terms that cancel out
+void _qf_canonicalize(struct QuadraticForm * form){
+  if (form->nlin > 1){
+    qsort(form->lin, form->nlin, sizeof(struct LinearTerm), _compare_linear_term);
+  }
+  int n = 0;
+  for (int k=0; k<form->nlin; k++){
+    if (n > 0 && form->lin[n-1].var == form->lin[k].var){
+      form->lin[n-1].coef += form->lin[k].coef;
+    }else{
+      form->lin[n] = form->lin[k];
+      n += 1;
+    }
+  }
+  int nlin = 0;
+  for (int k=0; k<n; k++){
+    if (form->lin[k].coef != 0.0){
+      form->lin[nlin] = form->lin[k];
+      nlin += 1;
+    }
+  }
+  form->nlin = nlin;
+
+  if (form->nquad > 1){
+    qsort(form->quad, form->nquad, sizeof(struct QuadraticTerm), _compare_quadratic_term);
+  }
+  n = 0;
+  for (int k=0; k<form->nquad; k++){
+    if (n > 0 && _compare_quadratic_term(&form->quad[n-1], &form->quad[k]) == 0){
+      form->quad[n-1].coef += form->quad[k].coef;
+    }else{
+      form->quad[n] = form->quad[k];
+      n += 1;
+    }
+  }
+  int nquad = 0;
+  for (int k=0; k<n; k++){
+    if (form->quad[k].coef != 0.0){
+      form->quad[nquad] = form->quad[k];
+      nquad += 1;
+    }
+  }
+  form->nquad = nquad;
+}
+
+/*
+ * Compute the coefficients of the form from an expression with no
+ * parameters. Returns false (and leaves form unset) if the expression is not
+ * linear or quadratic.
+ */
+bool _quadratic_form(struct Node expr, struct QuadraticForm * form){
+  switch(expr.type){
+    case CONST_NODE:
+      *form = _qf_constant(expr.data.value);
+      return true;
+    case PARAM_NODE:
+      return false;
+    case VAR_NODE:
+      *form = _qf_constant(0.0);
+      form->nlin = 1;
+      form->lin = malloc(sizeof(struct LinearTerm));
+      form->lin[0].var = expr.data.var->index;
+      form->lin[0].coef = 1.0;
+      return true;
+    case OP_NODE:
+      break;
+  }
+  struct OperatorNode * opnode = expr.data.expr;
+  int nargs = opnode->nargs;
+  struct QuadraticForm * args = malloc(nargs * sizeof(struct QuadraticForm));
+  bool all_constant = true;
+  for (int i=0; i<nargs; i++){
+    if (!_quadratic_form(opnode->args[i], &args[i])){
+      for (int j=0; j<i; j++){free_quadratic_form(args[j]);}
+      free(args);
+      return false;
+    }
+    _qf_canonicalize(&args[i]);
+    all_constant = all_constant && _qf_degree(&args[i]) == 0;
+  }
+
+  bool success = true;
+  struct QuadraticForm zero = _qf_constant(0.0);
+  if (all_constant){
+    // Evaluate the operator once, on the constant values of its arguments
+    double * const_args = malloc(nargs * sizeof(double));
+    for (int i=0; i<nargs; i++){
+      const_args[i] = args[i].constant;
+    }
+    *form = _qf_constant(OPERATOR_DATA[opnode->op].value(nargs, const_args));
+    free(const_args);
+  }else{
+    switch(opnode->op){
+      case SUM:
+      {
+        *form = _qf_constant(0.0);
+        for (int i=0; i<nargs; i++){
+          struct QuadraticForm sum = _qf_combine(form, 1.0, &args[i], 1.0);
+          free_quadratic_form(*form);
+          *form = sum;
+        }
+        break;
+      }
+      case SUBTRACTION:
+        *form = _qf_combine(&args[0], 1.0, &args[1], -1.0);
+        break;
+      case NEG:
+        *form = _qf_combine(&args[0], -1.0, &zero, 0.0);
+        break;
+      case PRODUCT:
+      {
+        *form = _qf_constant(1.0);
+        int degree = 0;
+        for (int i=0; i<nargs && success; i++){
+          degree += _qf_degree(&args[i]);
+          if (degree > 2){
+            success = false;
+          }else{
+            struct QuadraticForm product = _qf_multiply(form, &args[i]);
+            free_quadratic_form(*form);
+            *form = product;
+          }
+        }
+        if (!success){free_quadratic_form(*form);}
+        break;
+      }
+      case DIVISION:
+        if (_qf_degree(&args[1]) == 0){
+          *form = _qf_combine(&args[0], 1.0 / args[1].constant, &zero, 0.0);
+        }else{
+          success = false;
+        }
+        break;
+      case SQUARE:
+        if (_qf_degree(&args[0]) <= 1){
+          *form = _qf_multiply(&args[0], &args[0]);
+        }else{
+          success = false;
+        }
+        break;
+      case POWER:
+      case POW_CONST_INT:
+      case POW_CONST_REAL:
+      {
+        double exponent = args[1].constant;
+        if (_qf_degree(&args[1]) != 0){
+          success = false;
+        }else if (exponent == 0.0){
+          // pow(x, 0) is 1 for any x
+          *form = _qf_constant(1.0);
+        }else if (exponent == 1.0){
+          *form = _qf_combine(&args[0], 1.0, &zero, 0.0);
+        }else if (exponent == 2.0 && _qf_degree(&args[0]) <= 1){
+          *form = _qf_multiply(&args[0], &args[0]);
+        }else{
+          success = false;
+        }
+        break;
+      }
+      default:
+        // Any other operator of a non-constant argument is nonlinear
+        success = false;
+    }
+  }
+  for (int i=0; i<nargs; i++){free_quadratic_form(args[i]);}
+  free(args);
+  return success;
+}
+
+// Construct vars, grad_constant and grad_matrix from the (canonical) terms
+void _qf_build_gradient(struct QuadraticForm * form){
+  int nterm = form->nlin + 2 * form->nquad;
+  int * vars = malloc((nterm + 1) * sizeof(int));
+  for (int k=0; k<form->nlin; k++){vars[k] = form->lin[k].var;}
+  for (int k=0; k<form->nquad; k++){
+    vars[form->nlin + 2*k] = form->quad[k].row;
+    vars[form->nlin + 2*k + 1] = form->quad[k].col;
+  }
+  qsort(vars, nterm, sizeof(int), _compare_int);
+  int nvar = 0;
+  for (int k=0; k<nterm; k++){
+    if (nvar == 0 || vars[nvar-1] != vars[k]){
+      vars[nvar] = vars[k];
+      nvar += 1;
+    }
+  }
+  form->nvar = nvar;
+  form->vars = vars;
+
+  form->grad_constant = malloc((nvar + 1) * sizeof(double));
+  for (int r=0; r<nvar; r++){form->grad_constant[r] = 0.0;}
+  // vars and lin are both sorted, so we can merge them
+  int r = 0;
+  for (int k=0; k<form->nlin; k++){
+    while (vars[r] != form->lin[k].var){r += 1;}
+    form->grad_constant[r] = form->lin[k].coef;
+  }
+
+  // The derivative of c * x[i] * x[j] is c * x[j] in row i and c * x[i]
+  // in row j, or 2 * c * x[i] if i == j. Each unordered pair appears in one
+  // term, so the entries of the matrix are distinct.
+  struct CSRMatrix grad = {.nrow = nvar};
+  struct QuadraticTerm * entries = malloc((2 * form->nquad + 1) * sizeof(struct QuadraticTerm));
+  int nnz = 0;
+  for (int k=0; k<form->nquad; k++){
+    struct QuadraticTerm term = form->quad[k];
+    if (term.row == term.col){
+      entries[nnz] = term;
+      entries[nnz].coef = 2.0 * term.coef;
+      nnz += 1;
+    }else{
+      entries[nnz] = term;
+      entries[nnz+1].row = term.col;
+      entries[nnz+1].col = term.row;
+      entries[nnz+1].coef = term.coef;
+      nnz += 2;
+    }
+  }
+  qsort(entries, nnz, sizeof(struct QuadraticTerm), _compare_quadratic_term);
+  grad.nnz = nnz;
+  grad.indptr = mem_alloc(MEM_SPARSE, (nvar + 1) * sizeof(int));
+  grad.indices = mem_alloc(MEM_SPARSE, (nnz + 1) * sizeof(int));
+  grad.values = mem_alloc(MEM_SPARSE, (nnz + 1) * sizeof(double));
+  r = 0;
+  grad.indptr[0] = 0;
+  for (int k=0; k<nnz; k++){
+    while (vars[r] != entries[k].row){
+      r += 1;
+      grad.indptr[r] = k;
+    }
+    grad.indices[k] = entries[k].col;
+    grad.values[k] = entries[k].coef;
+  }
+  while (r < nvar){
+    r += 1;
+    grad.indptr[r] = nnz;
+  }
+  free(entries);
+  form->grad_matrix = grad;
+}
+
+enum ExpressionClass classify_expression(struct Node expr, struct QuadraticForm * form){
+  struct QuadraticForm result;
+  if (!_quadratic_form(expr, &result)){
+    return NONLINEAR_EXPRESSION;
+  }
+  _qf_canonicalize(&result);
+  enum ExpressionClass class = result.nquad > 0 ? QUADRATIC_EXPRESSION : LINEAR_EXPRESSION;
+  if (form){
+    _qf_build_gradient(&result);
+    *form = result;
+  }else{
+    free_quadratic_form(result);
+  }
+  return class;
+}
+
+void free_quadratic_form(struct QuadraticForm form){
+  free(form.lin);
+  free(form.quad);
+  if (form.vars){
+    free(form.vars);
+    free(form.grad_constant);
+    free_csrmatrix(form.grad_matrix);
+  }
+}
+
+double quadratic_value(struct QuadraticForm * form, double * x){
+  double value = form->constant;
+  for (int k=0; k<form->nlin; k++){
+    value += form->lin[k].coef * x[form->lin[k].var];
+  }
+  for (int k=0; k<form->nquad; k++){
+    value += form->quad[k].coef * x[form->quad[k].row] * x[form->quad[k].col];
+  }
+  return value;
+}
+
+int quadratic_gradient(struct QuadraticForm * form, double * x, double * grad){
+  struct CSRMatrix gm = form->grad_matrix;
+  for (int r=0; r<form->nvar; r++){
+    double value = form->grad_constant[r];
+    for (int k=gm.indptr[r]; k<gm.indptr[r+1]; k++){
+      value += gm.values[k] * x[gm.indices[k]];
+    }
+    grad[r] = value;
+  }
+  return 0;
+}
+
+struct Evaluator quadratic_evaluator(struct Node * exprs, int ncon, int nvar){
+  struct QuadraticEvaluatorData * data = malloc(sizeof(struct QuadraticEvaluatorData));
+  data->ncon = ncon;
+  data->classes = malloc((ncon + 1) * sizeof(enum ExpressionClass));
+  data->forms = malloc((ncon + 1) * sizeof(struct QuadraticForm));
+  data->nonlinear = malloc((ncon + 1) * sizeof(int));
+  struct Node * nonlinear_exprs = malloc((ncon + 1) * sizeof(struct Node));
+  data->nnonlinear = 0;
+  int nquad = 0;
+  for (int i=0; i<ncon; i++){
+    data->classes[i] = classify_expression(exprs[i], &data->forms[i]);
+    if (data->classes[i] == NONLINEAR_EXPRESSION){
+      data->nonlinear[data->nnonlinear] = i;
+      nonlinear_exprs[data->nnonlinear] = exprs[i];
+      data->nnonlinear += 1;
+    }else{
+      nquad += data->forms[i].nquad;
+    }
+  }
+  data->tape = compile_tape(nonlinear_exprs, data->nnonlinear, nvar);
+  data->tape_hessian = hessian_sparsity(nonlinear_exprs, data->nnonlinear, nvar);
+  data->tape_coloring = star_coloring(data->tape_hessian);
+  free(nonlinear_exprs);
+  struct Tape * tape = &data->tape;
+  int nnode = tape->nnode;
+  data->values = malloc(nnode * sizeof(double));
+  data->adjoints = malloc(nnode * sizeof(double));
+  data->dvalues = malloc(nnode * sizeof(double));
+  data->dadjoints = malloc(nnode * sizeof(double));
+  data->tape_g = malloc((data->nnonlinear + 1) * sizeof(double));
+  data->tape_lambda = malloc((data->nnonlinear + 1) * sizeof(double));
+  data->tape_jac = malloc((tape->jac_nnz + 1) * sizeof(double));
+  data->tape_hess = malloc((data->tape_hessian.nnz + 1) * sizeof(double));
+
+  // Jacobian structure, in constraint order
+  int * row_nnz = malloc((ncon + 1) * sizeof(int));
+  for (int i=0; i<ncon; i++){row_nnz[i] = 0;}
+  for (int i=0; i<ncon; i++){
+    if (data->classes[i] != NONLINEAR_EXPRESSION){row_nnz[i] = data->forms[i].nvar;}
+  }
+  for (int r=0; r<data->nnonlinear; r++){
+    row_nnz[data->nonlinear[r]] = tape->jac_indptr[r+1] - tape->jac_indptr[r];
+  }
+  struct CSRMatrix jac = {.nrow = ncon, .ncol = nvar};
+  jac.indptr = mem_alloc(MEM_SPARSE, (ncon + 1) * sizeof(int));
+  jac.indptr[0] = 0;
+  for (int i=0; i<ncon; i++){jac.indptr[i+1] = jac.indptr[i] + row_nnz[i];}
+  free(row_nnz);
+  jac.nnz = jac.indptr[ncon];
+  jac.indices = mem_alloc(MEM_SPARSE, (jac.nnz + 1) * sizeof(int));
+  jac.values = mem_alloc(MEM_SPARSE, (jac.nnz + 1) * sizeof(double));
+  for (int k=0; k<jac.nnz; k++){jac.values[k] = 0.0;}
+  for (int i=0; i<ncon; i++){
+    if (data->classes[i] != NONLINEAR_EXPRESSION){
+      for (int r=0; r<data->forms[i].nvar; r++){
+        jac.indices[jac.indptr[i] + r] = data->forms[i].vars[r];
+      }
+    }
+  }
+  for (int r=0; r<data->nnonlinear; r++){
+    int start = jac.indptr[data->nonlinear[r]];
+    for (int k=tape->jac_indptr[r]; k<tape->jac_indptr[r+1]; k++){
+      jac.indices[start + k - tape->jac_indptr[r]] = tape->jac_vars[k];
+    }
+  }
+  data->jac_indptr = malloc((ncon + 1) * sizeof(int));
+  for (int i=0; i<=ncon; i++){data->jac_indptr[i] = jac.indptr[i];}
+
+  // Hessian structure: the union of the tape's structure and the quadratic
+  // terms
+  int nentry = data->tape_hessian.nnz + nquad;
+  long * keys = malloc((nentry + 1) * sizeof(long));
+  int nkey = 0;
+  for (int l=0; l<nvar; l++){
+    for (int k=data->tape_hessian.indptr[l]; k<data->tape_hessian.indptr[l+1]; k++){
+      keys[nkey] = (long)l * nvar + data->tape_hessian.indices[k];
+      nkey += 1;
+    }
+  }
+  for (int i=0; i<ncon; i++){
+    if (data->classes[i] == NONLINEAR_EXPRESSION){continue;}
+    for (int k=0; k<data->forms[i].nquad; k++){
+      keys[nkey] = (long)data->forms[i].quad[k].row * nvar + data->forms[i].quad[k].col;
+      nkey += 1;
+    }
+  }
+  struct CSRMatrix hess = csr_from_entries(keys, nkey, nvar, nvar);
+  free(keys);
+
+  // Positions of the tape's entries and the constant entries
+  data->tape_hess_pos = malloc((data->tape_hessian.nnz + 1) * sizeof(int));
+  for (int l=0; l<nvar; l++){
+    for (int k=data->tape_hessian.indptr[l]; k<data->tape_hessian.indptr[l+1]; k++){
+      data->tape_hess_pos[k] = csr_find_entry(hess, l, data->tape_hessian.indices[k]);
+    }
+  }
+  data->nconst_hess = nquad;
+  data->const_hess_con = malloc((nquad + 1) * sizeof(int));
+  data->const_hess_pos = malloc((nquad + 1) * sizeof(int));
+  data->const_hess_values = malloc((nquad + 1) * sizeof(double));
+  int kc = 0;
+  for (int i=0; i<ncon; i++){
+    if (data->classes[i] == NONLINEAR_EXPRESSION){continue;}
+    for (int k=0; k<data->forms[i].nquad; k++){
+      struct QuadraticTerm term = data->forms[i].quad[k];
+      data->const_hess_con[kc] = i;
+      data->const_hess_pos[kc] = csr_find_entry(hess, term.row, term.col);
+      data->const_hess_values[kc] = term.row == term.col ? 2.0 * term.coef : term.coef;
+      kc += 1;
+    }
+  }
+
+  struct Evaluator ev = {
+    .nvar = nvar,
+    .ncon = ncon,
+    .jacobian = jac,
+    .hessian = hess,
+    .data = data,
+    .eval_g = _quadratic_eval_g,
+    .eval_jac = _quadratic_eval_jac,
+    .eval_hess = _quadratic_eval_hess,
+    .free_data = _quadratic_free_data,
+  };
+  return ev;
+}
+
+int _quadratic_eval_g(void * data, double * x, double * p, double * g){
+  struct QuadraticEvaluatorData * qd = data;
+  for (int i=0; i<qd->ncon; i++){
+    if (qd->classes[i] != NONLINEAR_EXPRESSION){
+      g[i] = quadratic_value(&qd->forms[i], x);
+    }
+  }
+  if (qd->nnonlinear > 0){
+    tape_evaluate(&qd->tape, x, p, qd->values);
+    tape_expression_values(&qd->tape, qd->values, qd->tape_g);
+    for (int r=0; r<qd->nnonlinear; r++){g[qd->nonlinear[r]] = qd->tape_g[r];}
+  }
+  return check_finite(g, qd->ncon);
+}
+
+int _quadratic_eval_jac(void * data, double * x, double * p, double * jac_values){
+  struct QuadraticEvaluatorData * qd = data;
+  for (int i=0; i<qd->ncon; i++){
+    if (qd->classes[i] != NONLINEAR_EXPRESSION){
+      quadratic_gradient(&qd->forms[i], x, jac_values + qd->jac_indptr[i]);
+    }
+  }
+  if (qd->nnonlinear > 0){
+    struct Tape * tape = &qd->tape;
+    tape_evaluate(tape, x, p, qd->values);
+    tape_jacobian(tape, qd->values, qd->adjoints, qd->tape_jac);
+    for (int r=0; r<qd->nnonlinear; r++){
+      int start = qd->jac_indptr[qd->nonlinear[r]];
+      for (int k=tape->jac_indptr[r]; k<tape->jac_indptr[r+1]; k++){
+        jac_values[start + k - tape->jac_indptr[r]] = qd->tape_jac[k];
+      }
+    }
+  }
+  return check_finite(jac_values, qd->jac_indptr[qd->ncon]);
+}
+
+int _quadratic_eval_hess(void * data, double * x, double * p, double * lambda, double * hess_values){
+  struct QuadraticEvaluatorData * qd = data;
+  // The Hessian structure isn't stored in the data, but every entry is
+  // either a tape entry or a constant entry, so we clear those.
+  for (int k=0; k<qd->tape_hessian.nnz; k++){hess_values[qd->tape_hess_pos[k]] = 0.0;}
+  for (int k=0; k<qd->nconst_hess; k++){hess_values[qd->const_hess_pos[k]] = 0.0;}
+  if (qd->nnonlinear > 0){
+    for (int r=0; r<qd->nnonlinear; r++){qd->tape_lambda[r] = lambda[qd->nonlinear[r]];}
+    tape_evaluate(&qd->tape, x, p, qd->values);
+    colored_hessian(
+      &qd->tape,
+      &qd->tape_coloring,
+      qd->values,
+      qd->tape_lambda,
+      qd->dvalues,
+      qd->adjoints,
+      qd->dadjoints,
+      qd->tape_hess
+    );
+    for (int k=0; k<qd->tape_hessian.nnz; k++){
+      hess_values[qd->tape_hess_pos[k]] = qd->tape_hess[k];
+    }
+  }
+  for (int k=0; k<qd->nconst_hess; k++){
+    hess_values[qd->const_hess_pos[k]] += lambda[qd->const_hess_con[k]] * qd->const_hess_values[k];
+  }
+  // Only the tape's entries can be undefined, as the rest are quadratic
+  return check_finite(qd->tape_hess, qd->nnonlinear > 0 ? qd->tape_hessian.nnz : 0);
+}
+
+void _quadratic_free_data(void * data){
+  struct QuadraticEvaluatorData * qd = data;
+  for (int i=0; i<qd->ncon; i++){
+    if (qd->classes[i] != NONLINEAR_EXPRESSION){free_quadratic_form(qd->forms[i]);}
+  }
+  free(qd->classes);
+  free(qd->forms);
+  free(qd->jac_indptr);
+  free(qd->nonlinear);
+  free_tape(qd->tape);
+  free_csrmatrix(qd->tape_hessian);
+  free_hessian_coloring(qd->tape_coloring);
+  free(qd->tape_hess_pos);
+  free(qd->const_hess_con);
+  free(qd->const_hess_pos);
+  free(qd->const_hess_values);
+  free(qd->tape_g);
+  free(qd->tape_jac);
+  free(qd->tape_lambda);
+  free(qd->tape_hess);
+  free(qd->values);
+  free(qd->adjoints);
+  free(qd->dvalues);
+  free(qd->dadjoints);
+  free(qd);
+}
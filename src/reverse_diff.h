@@ -3,7 +3,8 @@
 /*
  * Differentiate expression using reverse mode differentiation. Results
  * are returned in a CSR matrix. The number of variables is required
- * so we know how many columns to give the returned matrix.
+ * so we know how many columns to give the returned matrix. Where the
+ * derivative is undefined, the values are NaN.
  */
 struct CSRMatrix reverse_diff_expression(struct Node expr, int nvar);
 
@@ -11,6 +12,8 @@ struct CSRMatrix reverse_diff_expression(struct Node expr, int nvar);
  * Differentiate expression with respect to provided variables. Store
  * the derivative values in `values`. The variable's position in
  * `wrt` corresponds to its derivative's position in `values`.
+ * Returns -1 if a derivative is undefined at the current point, and those
+ * values are NaN.
  */
 int reverse_diff(struct Node expr, int nnz, int * wrt, double * values);
 
@@ -29,8 +32,8 @@ struct CSRMatrix reverse_diff_expression(struct Node expr, int nvar){
 
   // We'll use an array of int to indicate the indices of variables
   // that appear in this constraint.
-  int * wrt = malloc(sizeof(int) * nnz);
-  double * deriv_values = malloc(sizeof(double) * nnz);
+  int * wrt = mem_alloc(MEM_SPARSE, sizeof(int) * nnz);
+  double * deriv_values = mem_alloc(MEM_SPARSE, sizeof(double) * nnz);
   struct VarListNode * tmp = varlist;
   for (int i=0; i<nnz; i++){
     wrt[i] = tmp->variable->index;
@@ -45,7 +48,7 @@ struct CSRMatrix reverse_diff_expression(struct Node expr, int nvar){
   expr.adjoint = 1.0;
   reverse_diff(expr, nnz, wrt, deriv_values);
 
-  int * indptr = malloc(sizeof(int) * 2);
+  int * indptr = mem_alloc(MEM_SPARSE, sizeof(int) * 2);
   indptr[0] = 0;
   indptr[1] = nnz;
 
@@ -63,6 +66,8 @@ struct CSRMatrix reverse_diff_expression(struct Node expr, int nvar){
 int reverse_diff(struct Node expr, int nnz, int * wrt, double * values){
   switch(expr.type){
     case CONST_NODE:
+    case PARAM_NODE:
+      // Parameters are constants as far as differentiation is concerned
       return _reverse_diff_constant(expr, nnz, wrt, values);
     case VAR_NODE:
       return _reverse_diff_variable(expr, nnz, wrt, values);
@@ -89,17 +94,26 @@ int _reverse_diff_operator(struct Node expr, int nnz, int * wrt, double * values
   // This computes the local derivatives of the operator with respect to each
   // operand.
   double deriv_op[expr.data.expr->nargs];
-  DIFF_OP[expr.data.expr->op](expr.data.expr->args, expr.data.expr->nargs, deriv_op);
+  int status = diff_operator(expr.data.expr->op, expr.data.expr->args, expr.data.expr->nargs, deriv_op);
 
   // Update the adjoints for subexpressions
   for (int i=0; i<expr.data.expr->nargs; i++){
-    // I assume expressions are not reused, so I can override any existing
-    // adjoint. When/if I handle common subexpressions, I will need to
-    // (a) initialize all adjoints to zero and (b) update adjoints with +=
+    if (deriv_op[i] == 0.0){
+      // Nothing to propagate, e.g. to the arguments min didn't choose
+      continue;
+    }
+    // We propagate adjoints along one path from the root at a time, and
+    // differentiate each argument immediately, so we can override any
+    // existing adjoint. This is correct even if an OperatorNode is shared
+    // (see cse.h), although a shared subexpression is then differentiated
+    // once per path. The tape (see tape.h) differentiates each node once,
+    // accumulating adjoints with +=.
     expr.data.expr->args[i].adjoint = deriv_op[i] * expr.adjoint;
     // Recursively differentiate arguments, updating derivative values when
     // we get to the leaves.
-    reverse_diff(expr.data.expr->args[i], nnz, wrt, values);
+    if (reverse_diff(expr.data.expr->args[i], nnz, wrt, values) != 0){
+      status = -1;
+    }
   }
-  return 0;
+  return status;
 }
@@ -0,0 +1,365 @@
+/*
+ * Partially separable functions
+ *
+ * Large objectives, like the sum of squares in model.py, are usually sums of
+ * many element functions that each depend on only a few variables. Treated
+ * as one expression, the objective has a dense-looking Hessian structure and
+ * each Hessian-vector product sweeps the whole expression.
+ *
+ * separable_function splits an expression at its top-level sums (and
+ * subtractions and negations) into elements, and compiles each element into
+ * its own small tape, with the element's variables renumbered 0, ..., n-1.
+ * Then the gradient and Hessian of each element are small and dense: the
+ * gradient takes one reverse sweep over the element, and the Hessian one
+ * Hessian-vector product per element variable. Each element is evaluated
+ * independently, into its own workspaces (in parallel, if compiled with
+ * OpenMP), and the results are scattered into the global gradient and
+ * Hessian afterwards.
+ *
+ * The Hessian structure is the union of the (lower triangles of the) dense
+ * element blocks, and elements without variables or parameters are added to
+ * a constant. Parameters keep their global indices on the element tapes, so
+ * every element is evaluated at the same parameter values p, as gathered by
+ * gather_parameter_values (p may be NULL if there are no parameters).
+ *
+ * Usage:
+ *
+ *     struct SeparableFunction sf = separable_function(objective, nvar);
+ *     double f = separable_value(&sf, x, p);
+ *     separable_gradient(&sf, x, p, grad);
+ *     separable_hessian(&sf, x, p, obj_factor, hess_values);
+ *     free_separable_function(sf);
+ */
+
+struct ElementFunction {
+  // +1 or -1, depending on how the element appears in the sum
+  double sign;
+  // Global indices of the element's variables, sorted. Local variable a is
+  // global variable vars[a].
+  int nvar;
+  int * vars;
+  struct Tape tape;
+  // Position in the global Hessian of local entry (a, b), a >= b, which is
+  // stored at a * (a + 1) / 2 + b in hess
+  int * hess_pos;
+  // Workspaces. x, grad, direction and hv have length nvar, hess has length
+  // nvar * (nvar + 1) / 2 and the others have length tape.nnode.
+  double value;
+  double * x;
+  double * grad;
+  double * hess;
+  double * direction;
+  double * hv;
+  double * values;
+  double * adjoints;
+  double * dvalues;
+  double * dadjoints;
+};
+
+struct SeparableFunction {
+  int nvar;
+  double constant;
+  int nelement;
+  struct ElementFunction * elements;
+  // Lower triangle of the Hessian, with sorted rows
+  struct CSRMatrix hessian;
+};
+
+/*
+ * Split expr into element functions. expr is not modified, and may be freed
+ * afterwards.
+ */
+struct SeparableFunction separable_function(struct Node expr, int nvar);
+void free_separable_function(struct SeparableFunction sf);
+double separable_value(struct SeparableFunction * sf, double * x, double * p);
+// grad is dense, with length nvar
+int separable_gradient(struct SeparableFunction * sf, double * x, double * p, double * grad);
+// Values of scale times the Hessian, in the order of sf->hessian
+int separable_hessian(struct SeparableFunction * sf, double * x, double * p, double scale, double * hess_values);
+
+int _collect_elements(struct Node expr, double sign, struct Node ** elements, double ** signs, int * nelement, int * capacity);
+int _collect_variables(struct Node expr, int ** vars, int * nvar, int * capacity, bool * has_param);
+struct Node _copy_with_local_variables(struct Node expr, int nvar, int * vars, struct Variable * local);
+void _element_evaluate(struct ElementFunction * el, double * x, double * p, int order);
+
+// Append the elements of expr, a term of the sum with the given sign
+int _collect_elements(struct Node expr, double sign, struct Node ** elements, double ** signs, int * nelement, int * capacity){
+  if (expr.type == OP_NODE){
+    struct OperatorNode * opnode = expr.data.expr;
+    switch(opnode->op){
+      case SUM:
+        for (int i=0; i<opnode->nargs; i++){
+          _collect_elements(opnode->args[i], sign, elements, signs, nelement, capacity);
+        }
+        return 0;
+      case SUBTRACTION:
+        _collect_elements(opnode->args[0], sign, elements, signs, nelement, capacity);
+        _collect_elements(opnode->args[1], -sign, elements, signs, nelement, capacity);
+        return 0;
+      case NEG:
+        _collect_elements(opnode->args[0], -sign, elements, signs, nelement, capacity);
+        return 0;
+      default:
+        break;
+    }
+  }
+  if (*nelement == *capacity){
+    *capacity *= 2;
+    *elements = realloc(*elements, *capacity * sizeof(struct Node));
+    *signs = realloc(*signs, *capacity * sizeof(double));
+  }
+  (*elements)[*nelement] = expr;
+  (*signs)[*nelement] = sign;
+  *nelement += 1;
+  return 0;
+}
+
+// Append the indices of the variables in expr, with duplicates, and note
+// whether expr has any parameters
+int _collect_variables(struct Node expr, int ** vars, int * nvar, int * capacity, bool * has_param){
+  switch(expr.type){
+    case CONST_NODE:
+      return 0;
+    case PARAM_NODE:
+      *has_param = true;
+      return 0;
+    case VAR_NODE:
+      if (*nvar == *capacity){
+        *capacity *= 2;
+        *vars = realloc(*vars, *capacity * sizeof(int));
+      }
+      (*vars)[*nvar] = expr.data.var->index;
+      *nvar += 1;
+      return 0;
+    case OP_NODE:
+      for (int i=0; i<expr.data.expr->nargs; i++){
+        _collect_variables(expr.data.expr->args[i], vars, nvar, capacity, has_param);
+      }
+      return 0;
+  }
+  return 0;
+}
+
+// Copy expr, replacing global variable vars[a] with local[a]
+struct Node _copy_with_local_variables(struct Node expr, int nvar, int * vars, struct Variable * local){
+  struct Node copy = expr;
+  if (expr.type == VAR_NODE){
+    int * pos = bsearch(&expr.data.var->index, vars, nvar, sizeof(int), _compare_int);
+    copy.data.var = &local[pos - vars];
+  }else if (expr.type == OP_NODE){
+    struct OperatorNode * opnode = expr.data.expr;
+    struct OperatorNode * opcopy = new_operator_node(opnode->op, opnode->nargs);
+    for (int i=0; i<opnode->nargs; i++){
+      opcopy->args[i] = _copy_with_local_variables(opnode->args[i], nvar, vars, local);
+    }
+    copy.data.expr = opcopy;
+  }
+  return copy;
+}
+
+struct SeparableFunction separable_function(struct Node expr, int nvar){
+  int capacity = 16;
+  int nterm = 0;
+  struct Node * terms = malloc(capacity * sizeof(struct Node));
+  double * signs = malloc(capacity * sizeof(double));
+  _collect_elements(expr, 1.0, &terms, &signs, &nterm, &capacity);
+
+  struct SeparableFunction sf = {
+    .nvar = nvar,
+    .constant = 0.0,
+    .nelement = 0,
+    .elements = malloc((nterm + 1) * sizeof(struct ElementFunction)),
+  };
+  int var_capacity = 16;
+  int * term_vars = malloc(var_capacity * sizeof(int));
+  // Hessian entries of all elements, encoded as in csr_from_entries
+  int key_capacity = 16;
+  int nkey = 0;
+  long * keys = malloc(key_capacity * sizeof(long));
+  for (int t=0; t<nterm; t++){
+    int n = 0;
+    bool has_param = false;
+    _collect_variables(terms[t], &term_vars, &n, &var_capacity, &has_param);
+    if (n == 0 && !has_param){
+      sf.constant += signs[t] * evaluate(terms[t]);
+      continue;
+    }
+    // Terms with parameters but no variables become elements without
+    // variables, so they follow changes to the parameter values
+    qsort(term_vars, n, sizeof(int), _compare_int);
+    int nev = 0;
+    for (int k=0; k<n; k++){
+      if (nev == 0 || term_vars[nev-1] != term_vars[k]){
+        term_vars[nev] = term_vars[k];
+        nev += 1;
+      }
+    }
+
+    struct ElementFunction * el = &sf.elements[sf.nelement];
+    sf.nelement += 1;
+    el->sign = signs[t];
+    el->nvar = nev;
+    el->vars = malloc(nev * sizeof(int));
+    for (int a=0; a<nev; a++){el->vars[a] = term_vars[a];}
+    struct Variable * local = malloc(nev * sizeof(struct Variable));
+    for (int a=0; a<nev; a++){local[a].index = a;}
+    struct Node local_expr = _copy_with_local_variables(terms[t], nev, el->vars, local);
+    el->tape = compile_tape(&local_expr, 1, nev);
+    free_expression(local_expr);
+    free(local);
+
+    int nhess = nev * (nev + 1) / 2;
+    el->hess_pos = malloc(nhess * sizeof(int));
+    el->x = malloc(nev * sizeof(double));
+    el->grad = malloc(nev * sizeof(double));
+    el->hess = malloc(nhess * sizeof(double));
+    el->direction = malloc(nev * sizeof(double));
+    el->hv = malloc(nev * sizeof(double));
+    int nnode = el->tape.nnode;
+    el->values = malloc(nnode * sizeof(double));
+    el->adjoints = malloc(nnode * sizeof(double));
+    el->dvalues = malloc(nnode * sizeof(double));
+    el->dadjoints = malloc(nnode * sizeof(double));
+
+    if (nkey + nhess > key_capacity){
+      while (nkey + nhess > key_capacity){key_capacity *= 2;}
+      keys = realloc(keys, key_capacity * sizeof(long));
+    }
+    for (int a=0; a<nev; a++){
+      for (int b=0; b<=a; b++){
+        keys[nkey] = (long)el->vars[a] * nvar + el->vars[b];
+        nkey += 1;
+      }
+    }
+  }
+  sf.hessian = csr_from_entries(keys, nkey, nvar, nvar);
+  for (int e=0; e<sf.nelement; e++){
+    struct ElementFunction * el = &sf.elements[e];
+    for (int a=0; a<el->nvar; a++){
+      for (int b=0; b<=a; b++){
+        el->hess_pos[a * (a + 1) / 2 + b] = csr_find_entry(sf.hessian, el->vars[a], el->vars[b]);
+      }
+    }
+  }
+
+  free(keys);
+  free(term_vars);
+  free(terms);
+  free(signs);
+  return sf;
+}
+
+void free_separable_function(struct SeparableFunction sf){
+  for (int e=0; e<sf.nelement; e++){
+    struct ElementFunction * el = &sf.elements[e];
+    free(el->vars);
+    free_tape(el->tape);
+    free(el->hess_pos);
+    free(el->x);
+    free(el->grad);
+    free(el->hess);
+    free(el->direction);
+    free(el->hv);
+    free(el->values);
+    free(el->adjoints);
+    free(el->dvalues);
+    free(el->dadjoints);
+  }
+  free(sf.elements);
+  free_csrmatrix(sf.hessian);
+}
+
+/*
+ * Evaluate an element (order 0), and its gradient (order 1) and Hessian
+ * (order 2), into the element's workspaces. This only touches the
+ * element's own data, so elements can be evaluated in parallel.
+ */
+void _element_evaluate(struct ElementFunction * el, double * x, double * p, int order){
+  int nev = el->nvar;
+  for (int a=0; a<nev; a++){el->x[a] = x[el->vars[a]];}
+  tape_evaluate(&el->tape, el->x, p, el->values);
+  tape_expression_values(&el->tape, el->values, &el->value);
+  if (order >= 1){
+    tape_reverse(&el->tape, 0, el->values, el->adjoints);
+    for (int a=0; a<nev; a++){el->grad[a] = el->adjoints[a];}
+  }
+  if (order >= 2){
+    double lambda = 1.0;
+    for (int a=0; a<nev; a++){el->direction[a] = 0.0;}
+    for (int a=0; a<nev; a++){
+      el->direction[a] = 1.0;
+      tape_hessian_vector_product(
+        &el->tape,
+        el->values,
+        &lambda,
+        el->direction,
+        el->dvalues,
+        el->adjoints,
+        el->dadjoints,
+        el->hv
+      );
+      el->direction[a] = 0.0;
+      // Column a of the Hessian. We store entries (a, b) for b <= a.
+      for (int b=0; b<=a; b++){el->hess[a * (a + 1) / 2 + b] = el->hv[b];}
+    }
+  }
+}
+
+double separable_value(struct SeparableFunction * sf, double * x, double * p){
+  #pragma omp parallel
+  {
+    // One batch of elements per thread, so traces show each thread's share
+    TRACE_BEGIN("separable_value (elements)");
+    #pragma omp for schedule(dynamic, 16) nowait
+    for (int e=0; e<sf->nelement; e++){
+      _element_evaluate(&sf->elements[e], x, p, 0);
+    }
+    TRACE_END("separable_value (elements)");
+  }
+  double value = sf->constant;
+  for (int e=0; e<sf->nelement; e++){
+    value += sf->elements[e].sign * sf->elements[e].value;
+  }
+  return value;
+}
+
+int separable_gradient(struct SeparableFunction * sf, double * x, double * p, double * grad){
+  #pragma omp parallel
+  {
+    TRACE_BEGIN("separable_gradient (elements)");
+    #pragma omp for schedule(dynamic, 16) nowait
+    for (int e=0; e<sf->nelement; e++){
+      _element_evaluate(&sf->elements[e], x, p, 1);
+    }
+    TRACE_END("separable_gradient (elements)");
+  }
+  for (int j=0; j<sf->nvar; j++){grad[j] = 0.0;}
+  for (int e=0; e<sf->nelement; e++){
+    struct ElementFunction * el = &sf->elements[e];
+    for (int a=0; a<el->nvar; a++){
+      grad[el->vars[a]] += el->sign * el->grad[a];
+    }
+  }
+  return 0;
+}
+
+int separable_hessian(struct SeparableFunction * sf, double * x, double * p, double scale, double * hess_values){
+  #pragma omp parallel
+  {
+    TRACE_BEGIN("separable_hessian (elements)");
+    #pragma omp for schedule(dynamic, 16) nowait
+    for (int e=0; e<sf->nelement; e++){
+      _element_evaluate(&sf->elements[e], x, p, 2);
+    }
+    TRACE_END("separable_hessian (elements)");
+  }
+  for (int k=0; k<sf->hessian.nnz; k++){hess_values[k] = 0.0;}
+  for (int e=0; e<sf->nelement; e++){
+    struct ElementFunction * el = &sf->elements[e];
+    int nhess = el->nvar * (el->nvar + 1) / 2;
+    for (int k=0; k<nhess; k++){
+      hess_values[el->hess_pos[k]] += scale * el->sign * el->hess[k];
+    }
+  }
+  return 0;
+}
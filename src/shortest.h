@@ -0,0 +1,325 @@
+#include <stdint.h>
+
+/*
+ * Shortest round-trip formatting of doubles
+ *
+ * shortest_decimal finds the decimal with the fewest significant digits
+ * that strtod reads back as exactly the same double (and of those, the one
+ * closest to the double). This is Ryu, from Adams, "Ryu: fast float-to-string
+ * conversion" (PLDI 2018): the bounds of the interval of reals that round to
+ * the double are multiplied by a power of ten, using 128-bit approximations
+ * of powers of five, then digits are dropped while the interval still
+ * contains a shorter decimal. Everything is integer arithmetic, and there
+ * are no calls into printf.
+ *
+ * The tables of powers of five are computed exactly, with a small bignum,
+ * the first time a thread formats a number, rather than written out here.
+ *
+ * Usage:
+ *
+ *     char buffer[SHORTEST_MAXLEN];
+ *     int len = format_shortest(buffer, 0.1);   // "0.1"
+ */
+
+// Longest string written by format_shortest, including the null
+// terminator, e.g. "-2.2250738585072014e-308"
+#define SHORTEST_MAXLEN 32
+
+#define SHORTEST_POW5_BITCOUNT 125
+#define SHORTEST_POW5_INV_BITCOUNT 125
+#define SHORTEST_POW5_TABLE_SIZE 326
+#define SHORTEST_POW5_INV_TABLE_SIZE 342
+// 32-bit limbs of the bignums used to build the tables. 5^341 has 793 bits.
+#define SHORTEST_NLIMB 26
+
+// 5^i, shifted to have exactly 125 bits, as {low, high} words
+_Thread_local uint64_t _shortest_pow5[SHORTEST_POW5_TABLE_SIZE][2];
+// floor(2^(bitlength(5^i) - 1 + 125) / 5^i) + 1
+_Thread_local uint64_t _shortest_pow5_inv[SHORTEST_POW5_INV_TABLE_SIZE][2];
+_Thread_local bool _shortest_initialized = false;
+
+/*
+ * Write the shortest decimal representation of a positive, finite double
+ * as digits * 10^exponent. digits has at most 17 decimal digits.
+ */
+int shortest_decimal(double value, uint64_t * digits, int * exponent);
+
+/*
+ * Format a double into buffer (which must have room for SHORTEST_MAXLEN
+ * characters) with shortest_decimal. Numbers between 1e-4 and 1e17 are
+ * written without an exponent, as "%g" would. Returns the number of
+ * characters written, not including the null terminator.
+ */
+int format_shortest(char * buffer, double value);
+
+void _shortest_init();
+int _shortest_bitlength(uint32_t * a);
+uint64_t _shortest_mul_shift(uint64_t m, const uint64_t * mul, int j);
+bool _shortest_multiple_of_pow5(uint64_t value, int p);
+
+int _shortest_bitlength(uint32_t * a){
+  for (int k=SHORTEST_NLIMB-1; k>=0; k--){
+    if (a[k] != 0){
+      int len = 32 * k;
+      for (uint32_t w=a[k]; w>0; w>>=1){len++;}
+      return len;
+    }
+  }
+  return 0;
+}
+
+void _shortest_init(){
+  uint32_t pow5[SHORTEST_NLIMB] = {1};
+  uint32_t rem[SHORTEST_NLIMB];
+  for (int i=0; i<SHORTEST_POW5_INV_TABLE_SIZE; i++){
+    int len = _shortest_bitlength(pow5);
+    if (i < SHORTEST_POW5_TABLE_SIZE){
+      // The top 125 bits of 5^i, padded with zeros if it has fewer
+      __uint128_t split = 0;
+      for (int b=len-1; b>=len-SHORTEST_POW5_BITCOUNT; b--){
+        split = (split << 1) | (b >= 0 ? (pow5[b / 32] >> (b % 32)) & 1 : 0);
+      }
+      _shortest_pow5[i][0] = (uint64_t)split;
+      _shortest_pow5[i][1] = (uint64_t)(split >> 64);
+    }
+    // Long division of 2^(len + 124) by 5^i. The quotient has at most 126
+    // bits, so start from 2^(len - 2), which is less than 5^i.
+    __uint128_t inv = 0;
+    if (i == 0){
+      inv = (__uint128_t)1 << SHORTEST_POW5_INV_BITCOUNT;
+    }else{
+      for (int k=0; k<SHORTEST_NLIMB; k++){rem[k] = 0;}
+      rem[(len - 2) / 32] = 1u << ((len - 2) % 32);
+      for (int b=0; b<126; b++){
+        uint32_t carry = 0;
+        for (int k=0; k<SHORTEST_NLIMB; k++){
+          uint32_t next = rem[k] >> 31;
+          rem[k] = (rem[k] << 1) | carry;
+          carry = next;
+        }
+        int cmp = 0;
+        for (int k=SHORTEST_NLIMB-1; k>=0 && cmp==0; k--){
+          cmp = (rem[k] > pow5[k]) - (rem[k] < pow5[k]);
+        }
+        inv <<= 1;
+        if (cmp >= 0){
+          uint64_t borrow = 0;
+          for (int k=0; k<SHORTEST_NLIMB; k++){
+            uint64_t diff = (uint64_t)rem[k] - pow5[k] - borrow;
+            rem[k] = (uint32_t)diff;
+            borrow = (diff >> 32) & 1;
+          }
+          inv |= 1;
+        }
+      }
+    }
+    inv += 1;
+    _shortest_pow5_inv[i][0] = (uint64_t)inv;
+    _shortest_pow5_inv[i][1] = (uint64_t)(inv >> 64);
+    // pow5 *= 5
+    uint64_t carry = 0;
+    for (int k=0; k<SHORTEST_NLIMB; k++){
+      uint64_t product = 5 * (uint64_t)pow5[k] + carry;
+      pow5[k] = (uint32_t)product;
+      carry = product >> 32;
+    }
+  }
+  _shortest_initialized = true;
+}
+
+// (m * mul) >> j, for m with at most 55 bits and j >= 64
+uint64_t _shortest_mul_shift(uint64_t m, const uint64_t * mul, int j){
+  __uint128_t low = (__uint128_t)m * mul[0];
+  __uint128_t high = (__uint128_t)m * mul[1];
+  return (uint64_t)(((low >> 64) + high) >> (j - 64));
+}
+
+bool _shortest_multiple_of_pow5(uint64_t value, int p){
+  int count = 0;
+  while (value > 0 && value % 5 == 0){
+    value /= 5;
+    count++;
+  }
+  return count >= p;
+}
+
+int shortest_decimal(double value, uint64_t * digits, int * exponent){
+  if (!_shortest_initialized){
+    _shortest_init();
+  }
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(double));
+  uint64_t ieee_mantissa = bits & ((1ull << 52) - 1);
+  int ieee_exponent = (int)((bits >> 52) & 0x7ff);
+
+  // value = m2 * 2^e2, with 2 extra bits so the bounds are integers too
+  int e2;
+  uint64_t m2;
+  if (ieee_exponent == 0){
+    e2 = 1 - 1023 - 52 - 2;
+    m2 = ieee_mantissa;
+  }else{
+    e2 = ieee_exponent - 1023 - 52 - 2;
+    m2 = (1ull << 52) | ieee_mantissa;
+  }
+  // With an even mantissa, the bounds of the interval round to the double
+  bool accept_bounds = (m2 & 1) == 0;
+  // The interval is [mv - mm_shift - 1, mv + 2] (times 2^e2). It is
+  // narrower below powers of two.
+  uint64_t mv = 4 * m2;
+  int mm_shift = ieee_mantissa != 0 || ieee_exponent <= 1;
+
+  // Scale the interval and value by a power of ten, as vm, vr, vp
+  uint64_t vr, vp, vm;
+  int e10;
+  bool vm_trailing_zeros = false;
+  bool vr_trailing_zeros = false;
+  if (e2 >= 0){
+    int q = ((e2 * 78913) >> 18) - (e2 > 3);
+    e10 = q;
+    int k = SHORTEST_POW5_INV_BITCOUNT + ((q * 1217359) >> 19);
+    int i = -e2 + q + k;
+    vr = _shortest_mul_shift(4 * m2, _shortest_pow5_inv[q], i);
+    vp = _shortest_mul_shift(4 * m2 + 2, _shortest_pow5_inv[q], i);
+    vm = _shortest_mul_shift(4 * m2 - 1 - mm_shift, _shortest_pow5_inv[q], i);
+    if (q <= 21){
+      // Only then can the values be exact multiples of 10^q
+      if (mv % 5 == 0){
+        vr_trailing_zeros = _shortest_multiple_of_pow5(mv, q);
+      }else if (accept_bounds){
+        vm_trailing_zeros = _shortest_multiple_of_pow5(mv - 1 - mm_shift, q);
+      }else{
+        vp -= _shortest_multiple_of_pow5(mv + 2, q);
+      }
+    }
+  }else{
+    int q = ((-e2 * 732923) >> 20) - (-e2 > 1);
+    e10 = q + e2;
+    int i = -e2 - q;
+    int k = ((i * 1217359) >> 19) + 1 - SHORTEST_POW5_BITCOUNT;
+    int j = q - k;
+    vr = _shortest_mul_shift(4 * m2, _shortest_pow5[i], j);
+    vp = _shortest_mul_shift(4 * m2 + 2, _shortest_pow5[i], j);
+    vm = _shortest_mul_shift(4 * m2 - 1 - mm_shift, _shortest_pow5[i], j);
+    if (q <= 1){
+      // mv has at least q trailing zero bits, so the values are exact
+      vr_trailing_zeros = true;
+      if (accept_bounds){
+        vm_trailing_zeros = mm_shift == 1;
+      }else{
+        vp -= 1;
+      }
+    }else if (q < 63){
+      vr_trailing_zeros = (mv & ((1ull << q) - 1)) == 0;
+    }
+  }
+
+  // Drop digits while the interval still contains a shorter decimal
+  int removed = 0;
+  int last_removed = 0;
+  uint64_t output;
+  if (vm_trailing_zeros || vr_trailing_zeros){
+    // The rare case, where we need to know if the dropped digits of vm and
+    // vr were all zero, to get the bounds and ties right
+    while (vp / 10 > vm / 10){
+      vm_trailing_zeros &= vm % 10 == 0;
+      vr_trailing_zeros &= last_removed == 0;
+      last_removed = vr % 10;
+      vr /= 10;
+      vp /= 10;
+      vm /= 10;
+      removed++;
+    }
+    if (vm_trailing_zeros){
+      while (vm % 10 == 0){
+        vr_trailing_zeros &= last_removed == 0;
+        last_removed = vr % 10;
+        vr /= 10;
+        vp /= 10;
+        vm /= 10;
+        removed++;
+      }
+    }
+    if (vr_trailing_zeros && last_removed == 5 && vr % 2 == 0){
+      // Exactly halfway, so round to even
+      last_removed = 4;
+    }
+    output = vr + ((vr == vm && (!accept_bounds || !vm_trailing_zeros)) || last_removed >= 5);
+  }else{
+    bool round_up = false;
+    while (vp / 10 > vm / 10){
+      round_up = vr % 10 >= 5;
+      vr /= 10;
+      vp /= 10;
+      vm /= 10;
+      removed++;
+    }
+    output = vr + (vr == vm || round_up);
+  }
+  *digits = output;
+  *exponent = e10 + removed;
+  return 0;
+}
+
+int format_shortest(char * buffer, double value){
+  int len = 0;
+  if (value != value){
+    memcpy(buffer, "nan", 4);
+    return 3;
+  }
+  if (signbit(value)){
+    buffer[len] = '-';
+    len++;
+  }
+  if (isinf(value)){
+    memcpy(buffer + len, "inf", 4);
+    return len + 3;
+  }
+  if (value == 0.0){
+    memcpy(buffer + len, "0", 2);
+    return len + 1;
+  }
+  uint64_t digits;
+  int exponent;
+  shortest_decimal(fabs(value), &digits, &exponent);
+  char d[20];
+  int nd = 0;
+  while (digits > 0){
+    d[nd] = '0' + digits % 10;
+    digits /= 10;
+    nd++;
+  }
+  // Digits were generated least-significant first. Drop trailing zeros.
+  int last = 0;
+  while (last < nd - 1 && d[last] == '0'){last++;}
+  // Decimal exponent of the leading digit
+  int lead = exponent + nd - 1;
+  if (lead >= -4 && lead < 17){
+    if (lead < 0){
+      buffer[len++] = '0';
+      buffer[len++] = '.';
+      for (int k=0; k<-lead-1; k++){buffer[len++] = '0';}
+      for (int k=nd-1; k>=last; k--){buffer[len++] = d[k];}
+    }else{
+      // Digit p has exponent lead - p. Pad the integer part with zeros.
+      for (int p=0; p<=lead || nd-1-p >= last; p++){
+        if (p == lead + 1){buffer[len++] = '.';}
+        buffer[len++] = nd-1-p >= 0 ? d[nd-1-p] : '0';
+      }
+    }
+  }else{
+    buffer[len++] = d[nd-1];
+    if (nd - 1 > last){
+      buffer[len++] = '.';
+      for (int k=nd-2; k>=last; k--){buffer[len++] = d[k];}
+    }
+    buffer[len++] = 'e';
+    buffer[len++] = lead < 0 ? '-' : '+';
+    int e = lead < 0 ? -lead : lead;
+    if (e >= 100){buffer[len++] = '0' + e / 100;}
+    buffer[len++] = '0' + (e / 10) % 10;
+    buffer[len++] = '0' + e % 10;
+  }
+  buffer[len] = '\0';
+  return len;
+}
@@ -0,0 +1,201 @@
+/*
+ * Constant folding and algebraic simplification
+ *
+ * The .nl file is written by AMPL (or Pyomo) without much simplification,
+ * so expressions may contain constant subtrees, e.g. (2 + 3) * v0, identity
+ * operations, e.g. v0 * 1 or v0 - 0, and generic powers with constant
+ * exponents, e.g. v0^2. Each of these is an OperatorNode that is re-evaluated
+ * (and differentiated) every time we evaluate the expression.
+ *
+ * simplify_expression rewrites an expression, from the leaves up, as follows:
+ * - An operator whose arguments are all constants is replaced by its value
+ * - Constant arguments of sums and products are combined into one, which is
+ *   removed if it is 0 (for sums) or 1 (for products)
+ * - x - 0, x / 1, x^1 and -(-x) become x, 0 - x becomes -x and x^0 becomes 1
+ * - Powers with one constant operand become specialized powers, e.g.
+ *   x^2 becomes SQUARE(x) (see specialize_power_node)
+ *
+ * Parameters are never folded, as their values may change. Combining
+ * constants in a sum may change the rounding of the sum, but otherwise
+ * simplified expressions evaluate to the same values (including NaN and
+ * inf) as the originals. In particular, we don't replace x * 0 with 0, as
+ * x may be inf or NaN.
+ *
+ * Shared OperatorNodes (see cse.h) are handled correctly, but sharing may
+ * miss subexpressions that only become identical after simplification, so
+ * expressions should be simplified before they are shared.
+ *
+ * Usage, right after reading constraints:
+ *
+ *     int nsimplified = simplify_expressions(constraints, ncon);
+ */
+
+/*
+ * Simplify the expression in place. Returns the number of rewrites made.
+ */
+int simplify_expression(struct Node * expr);
+int simplify_expressions(struct Node * exprs, int nexpr);
+
+bool _is_constant(struct Node node, double value);
+void _replace_with_constant(struct Node * node, double value);
+void _replace_with_arg(struct Node * node, int iarg);
+int _combine_constant_args(struct OperatorNode * expr);
+int _simplify_operator(struct Node * node);
+
+int simplify_expressions(struct Node * exprs, int nexpr){
+  int count = 0;
+  for (int i=0; i<nexpr; i++){
+    count += simplify_expression(&exprs[i]);
+  }
+  return count;
+}
+
+bool _is_constant(struct Node node, double value){
+  return node.type == CONST_NODE && node.data.value == value;
+}
+
+// Replace the (operator) node with a constant, releasing our reference to
+// the operator.
+void _replace_with_constant(struct Node * node, double value){
+  free_expression(*node);
+  node->type = CONST_NODE;
+  node->data.value = value;
+}
+
+// Replace the (operator) node with one of its arguments, releasing our
+// reference to the operator.
+void _replace_with_arg(struct Node * node, int iarg){
+  struct Node arg = node->data.expr->args[iarg];
+  if (arg.type == OP_NODE){
+    // Take a reference to the argument, so it isn't freed with the operator.
+    // If the operator is shared, its other references still use the argument.
+    arg.data.expr->nshared += 1;
+  }
+  free_expression(*node);
+  *node = arg;
+}
+
+/*
+ * Combine the constant arguments of a sum or product into a single constant,
+ * which is removed if it doesn't change the result. This modifies the
+ * OperatorNode, which is fine even if it is shared, as its value doesn't
+ * change. Returns 1 if the arguments changed, 0 otherwise.
+ */
+int _combine_constant_args(struct OperatorNode * expr){
+  double identity = expr->op == SUM ? 0.0 : 1.0;
+  double combined = identity;
+  int nconst = 0;
+  for (int i=0; i<expr->nargs; i++){
+    if (expr->args[i].type == CONST_NODE){
+      if (expr->op == SUM){
+        combined += expr->args[i].data.value;
+      }else{
+        combined *= expr->args[i].data.value;
+      }
+      nconst += 1;
+    }
+  }
+  if (nconst == 0 || (nconst == 1 && combined != identity)){
+    // Nothing to combine or remove
+    return 0;
+  }
+  // Move the non-constant arguments to the front. Constants are not
+  // allocated separately, so we can just overwrite them.
+  int nargs = 0;
+  for (int i=0; i<expr->nargs; i++){
+    if (expr->args[i].type != CONST_NODE){
+      expr->args[nargs] = expr->args[i];
+      nargs += 1;
+    }
+  }
+  if (combined != identity){
+    expr->args[nargs].type = CONST_NODE;
+    expr->args[nargs].data.value = combined;
+    nargs += 1;
+  }
+  expr->nargs = nargs;
+  return 1;
+}
+
+int simplify_expression(struct Node * expr){
+  if (expr->type != OP_NODE){
+    return 0;
+  }
+  struct OperatorNode * opnode = expr->data.expr;
+  int count = 0;
+  for (int i=0; i<opnode->nargs; i++){
+    count += simplify_expression(&opnode->args[i]);
+  }
+
+  // External functions may be expensive, or return a different value on
+  // each call (see external.h), so we leave their calls to evaluation
+  bool all_constant = opnode->op != EXTERNAL;
+  for (int i=0; i<opnode->nargs; i++){
+    if (opnode->args[i].type != CONST_NODE){
+      all_constant = false;
+      break;
+    }
+  }
+  if (all_constant){
+    _replace_with_constant(expr, evaluate(*expr));
+    return count + 1;
+  }
+  return count + _simplify_operator(expr);
+}
+
+// Apply identities to an operator with at least one non-constant argument
+int _simplify_operator(struct Node * node){
+  struct OperatorNode * expr = node->data.expr;
+  struct Node * args = expr->args;
+  switch(expr->op){
+    case SUM:
+    case PRODUCT:
+    {
+      int count = _combine_constant_args(expr);
+      if (expr->nargs == 1){
+        _replace_with_arg(node, 0);
+        count += 1;
+      }
+      return count;
+    }
+    case SUBTRACTION:
+      if (_is_constant(args[1], 0.0)){
+        _replace_with_arg(node, 0);
+        return 1;
+      }else if (_is_constant(args[0], 0.0)){
+        expr->op = NEG;
+        expr->nargs = 1;
+        args[0] = args[1];
+        return 1;
+      }
+      return 0;
+    case DIVISION:
+      if (_is_constant(args[1], 1.0)){
+        _replace_with_arg(node, 0);
+        return 1;
+      }
+      return 0;
+    case POWER:
+    case POW_CONST_INT:
+    case POW_CONST_REAL:
+      if (_is_constant(args[1], 1.0)){
+        _replace_with_arg(node, 0);
+        return 1;
+      }else if (_is_constant(args[1], 0.0)){
+        // pow(x, 0) is 1 for any x, even NaN
+        _replace_with_constant(node, 1.0);
+        return 1;
+      }
+      return specialize_power_node(expr);
+    case NEG:
+      if (args[0].type == OP_NODE && args[0].data.expr->op == NEG){
+        // Replace with the negation, then with its argument
+        _replace_with_arg(node, 0);
+        _replace_with_arg(node, 0);
+        return 1;
+      }
+      return 0;
+    default:
+      return 0;
+  }
+}
@@ -0,0 +1,498 @@
+/*
+ * Reading and writing .sol files
+ *
+ * The ASCII .sol format (see "Hooking Your Solver to AMPL") is:
+ *
+ *     <message, one or more lines>
+ *     <blank line>
+ *     Options
+ *     <nopts>
+ *     <opts, one per line>
+ *     <ncon>
+ *     <ndual>
+ *     <nvar>
+ *     <nprimal>
+ *     <dual values, one per line>
+ *     <primal values, one per line>
+ *     objno <objno> <solve_result_num>
+ *
+ * The binary format contains the same sections, but each section is written
+ * as a Fortran-style unformatted record, i.e. the bytes of the record are
+ * preceded and followed by their length as an int. The sections are: one
+ * record per message line, an empty record ending the message, one record of
+ * ints {nopts, opts..., ncon, ndual, nvar, nprimal}, one record of dual
+ * values, one record of primal values, and one record of ints
+ * {objno, solve_result_num}.
+ *
+ * Values are written straight from the model arrays into a large buffer,
+ * which is flushed with fwrite when it fills up. For models with millions of
+ * variables, calling fprintf for every value is a significant fraction of the
+ * time spent writing. Values are formatted with the shortest decimal that
+ * reads back exactly (see shortest.h), which also keeps the files small.
+ */
+#include "shortest.h"
+
+// Size of the buffer we format values into before writing them to the file.
+#define SOL_BUFSIZE (1 << 20)
+// Longest string written by _format_double, including the null terminator
+#define SOL_DOUBLE_MAXLEN SHORTEST_MAXLEN
+
+struct SolWriter {
+  FILE * fp;
+  bool binary;
+  char * buffer;
+  int bsize;
+  // Offset at which the next character will be written
+  int bidx;
+  // -1 once a write has failed. Later writes are skipped.
+  int status;
+};
+
+/*
+ * Write a .sol file containing primal values from `variables` and
+ * (optionally) dual values from `duals`.
+ *
+ * FILE * fp:
+ *
+ *     File to write to. Should be opened in "wb" mode if `binary` is true.
+ *
+ * char * message:
+ *
+ *     Solver message. May contain multiple lines. Must not contain blank
+ *     lines, as a blank line terminates the message.
+ *
+ * struct Variable * variables:
+ *
+ *     Array of variables. Values are written in the order of this array,
+ *     which we assume is the order of the variables' indices.
+ *
+ * double * duals:
+ *
+ *     Array of ncon constraint multipliers. If NULL, no duals are written.
+ *
+ * int solve_result:
+ *
+ *     AMPL solve_result_num, e.g. 0 for "solved" or 200 for "infeasible".
+ *
+ * Returns 0, or -1 if writing to fp failed.
+ *
+ */
+int write_sol(
+  FILE * fp,
+  char * message,
+  struct Variable * variables,
+  int nvar,
+  double * duals,
+  int ncon,
+  int solve_result,
+  bool binary
+);
+
+/*
+ * Read primal and dual values from a .sol file (e.g. written by write_sol
+ * or by another solver) into an already-constructed model. This is
+ * useful for warm-starting a solve without re-reading the .nl file.
+ * The numbers of primal and dual values in the file must match nvar and
+ * ncon. If duals is NULL, dual values are skipped.
+ *
+ * Returns the solve_result_num in the file, or -1 if the file could not
+ * be read.
+ */
+int read_sol(
+  FILE * fp,
+  struct Variable * variables,
+  int nvar,
+  double * duals,
+  int ncon,
+  bool binary
+);
+int _read_sol_ascii(char * buffer, long bsize, struct Variable * variables, int nvar, double * duals, int ncon);
+int _read_sol_binary(FILE * fp, struct Variable * variables, int nvar, double * duals, int ncon);
+int _read_sol_record(FILE * fp, char * data, int maxlen);
+char * _sol_next_line(char * pos, char * end);
+int _sol_write_message(struct SolWriter * sw, char * message);
+int _sol_write_ints(struct SolWriter * sw, int * data, int n);
+int _sol_write_duals(struct SolWriter * sw, double * duals, int ndual);
+int _sol_write_primals(struct SolWriter * sw, struct Variable * variables, int nvar);
+int _sol_put(struct SolWriter * sw, char * data, int len);
+int _sol_flush(struct SolWriter * sw);
+int _format_double(char * buffer, double value);
+
+int _sol_flush(struct SolWriter * sw){
+  if (sw->bidx > 0 && sw->status == 0){
+    size_t nwritten = fwrite(sw->buffer, sizeof(char), sw->bidx, sw->fp);
+    if (nwritten != (size_t)sw->bidx){
+      printf("ERROR: Could not write .sol file\n");
+      sw->status = -1;
+    }
+  }
+  sw->bidx = 0;
+  return sw->status;
+}
+
+int _sol_put(struct SolWriter * sw, char * data, int len){
+  if (len == 0){
+    return 0;
+  }
+  if (len > sw->bsize - sw->bidx && _sol_flush(sw) != 0){
+    return -1;
+  }
+  if (len > sw->bsize){
+    // This will never fit in the buffer. Write it directly.
+    if (fwrite(data, sizeof(char), len, sw->fp) != (size_t)len){
+      printf("ERROR: Could not write .sol file\n");
+      sw->status = -1;
+      return -1;
+    }
+    return len;
+  }
+  memcpy(sw->buffer + sw->bidx, data, len);
+  sw->bidx += len;
+  return len;
+}
+
+/*
+ * Format a double into buffer (which must have room for SOL_DOUBLE_MAXLEN
+ * characters) such that strtod recovers exactly the same value. Returns the
+ * number of characters written, not including the null terminator.
+ *
+ * Integer values are common in initial points and bounds, and are written
+ * out in full. Everything else gets its shortest round-trip representation.
+ */
+int _format_double(char * buffer, double value){
+  // 2^53. Every integer with smaller magnitude is exactly representable.
+  if (value == value && value > -9007199254740992.0 && value < 9007199254740992.0){
+    long long ival = (long long)value;
+    if ((double)ival == value && !(value == 0.0 && signbit(value))){
+      char digits[20];
+      int ndigit = 0;
+      int len = 0;
+      unsigned long long uval = ival < 0 ? -ival : ival;
+      do {
+        digits[ndigit] = '0' + (uval % 10);
+        uval /= 10;
+        ndigit += 1;
+      } while (uval > 0);
+      if (ival < 0){
+        buffer[len] = '-';
+        len += 1;
+      }
+      // Digits were generated least-significant first
+      while (ndigit > 0){
+        ndigit -= 1;
+        buffer[len] = digits[ndigit];
+        len += 1;
+      }
+      buffer[len] = '\0';
+      return len;
+    }
+  }
+  return format_shortest(buffer, value);
+}
+
+int _sol_write_message(struct SolWriter * sw, char * message){
+  int start = 0;
+  int i = 0;
+  // Write each line of the message separately so the binary format gets one
+  // record per line.
+  while (true){
+    if (message[i] == '\n' || message[i] == '\0'){
+      int len = i - start;
+      if (len > 0){
+        if (sw->binary){
+          _sol_put(sw, (char *)&len, sizeof(int));
+          _sol_put(sw, message + start, len);
+          _sol_put(sw, (char *)&len, sizeof(int));
+        }else{
+          _sol_put(sw, message + start, len);
+          _sol_put(sw, "\n", 1);
+        }
+      }
+      if (message[i] == '\0'){
+        break;
+      }
+      start = i + 1;
+    }
+    i += 1;
+  }
+  // Terminate the message with an empty line/record
+  if (sw->binary){
+    int zero = 0;
+    _sol_put(sw, (char *)&zero, sizeof(int));
+    _sol_put(sw, (char *)&zero, sizeof(int));
+  }else{
+    _sol_put(sw, "\n", 1);
+  }
+  return 0;
+}
+
+// Write a section of integers. In ASCII, these are written one per line.
+int _sol_write_ints(struct SolWriter * sw, int * data, int n){
+  if (sw->binary){
+    int len = n * sizeof(int);
+    _sol_put(sw, (char *)&len, sizeof(int));
+    _sol_put(sw, (char *)data, len);
+    _sol_put(sw, (char *)&len, sizeof(int));
+  }else{
+    char numstr[SOL_DOUBLE_MAXLEN];
+    for (int i=0; i<n; i++){
+      int len = snprintf(numstr, SOL_DOUBLE_MAXLEN, "%d\n", data[i]);
+      _sol_put(sw, numstr, len);
+    }
+  }
+  return 0;
+}
+
+int _sol_write_duals(struct SolWriter * sw, double * duals, int ndual){
+  if (sw->binary){
+    int len = ndual * sizeof(double);
+    _sol_put(sw, (char *)&len, sizeof(int));
+    _sol_put(sw, (char *)duals, len);
+    _sol_put(sw, (char *)&len, sizeof(int));
+    return 0;
+  }
+  for (int i=0; i<ndual; i++){
+    if (sw->bsize - sw->bidx < SOL_DOUBLE_MAXLEN + 1){
+      _sol_flush(sw);
+    }
+    // Format directly into the buffer to avoid a copy
+    sw->bidx += _format_double(sw->buffer + sw->bidx, duals[i]);
+    sw->buffer[sw->bidx] = '\n';
+    sw->bidx += 1;
+  }
+  return 0;
+}
+
+int _sol_write_primals(struct SolWriter * sw, struct Variable * variables, int nvar){
+  if (sw->binary){
+    // Variable values are not contiguous in memory, so we stage them in
+    // the buffer before writing.
+    int len = nvar * sizeof(double);
+    _sol_put(sw, (char *)&len, sizeof(int));
+    for (int i=0; i<nvar; i++){
+      _sol_put(sw, (char *)&variables[i].value, sizeof(double));
+    }
+    _sol_put(sw, (char *)&len, sizeof(int));
+    return 0;
+  }
+  for (int i=0; i<nvar; i++){
+    if (sw->bsize - sw->bidx < SOL_DOUBLE_MAXLEN + 1){
+      _sol_flush(sw);
+    }
+    sw->bidx += _format_double(sw->buffer + sw->bidx, variables[i].value);
+    sw->buffer[sw->bidx] = '\n';
+    sw->bidx += 1;
+  }
+  return 0;
+}
+
+int write_sol(
+  FILE * fp,
+  char * message,
+  struct Variable * variables,
+  int nvar,
+  double * duals,
+  int ncon,
+  int solve_result,
+  bool binary
+){
+  struct SolWriter sw = {
+    .fp = fp,
+    .binary = binary,
+    .buffer = malloc(SOL_BUFSIZE * sizeof(char)),
+    .bsize = SOL_BUFSIZE,
+    .bidx = 0,
+    .status = 0,
+  };
+
+  _sol_write_message(&sw, message);
+
+  // We don't have any AMPL options to report, so we write the same default
+  // options as other non-AMPL solvers: three options, 1, 1, and 0.
+  if (!binary){
+    _sol_put(&sw, "Options\n", 8);
+  }
+  int ndual = duals ? ncon : 0;
+  int optdata[8] = {3, 1, 1, 0, ncon, ndual, nvar, nvar};
+  _sol_write_ints(&sw, optdata, 8);
+
+  _sol_write_duals(&sw, duals, ndual);
+  _sol_write_primals(&sw, variables, nvar);
+
+  if (binary){
+    int objdata[2] = {0, solve_result};
+    _sol_write_ints(&sw, objdata, 2);
+  }else{
+    char objstr[SOL_DOUBLE_MAXLEN];
+    int len = snprintf(objstr, SOL_DOUBLE_MAXLEN, "objno 0 %d\n", solve_result);
+    _sol_put(&sw, objstr, len);
+  }
+
+  _sol_flush(&sw);
+  free(sw.buffer);
+  return sw.status;
+}
+
+int read_sol(
+  FILE * fp,
+  struct Variable * variables,
+  int nvar,
+  double * duals,
+  int ncon,
+  bool binary
+){
+  if (binary){
+    return _read_sol_binary(fp, variables, nvar, duals, ncon);
+  }
+  long bsize;
+  char * buffer = read_to_buffer(fp, &bsize);
+  int solve_result = _read_sol_ascii(buffer, bsize, variables, nvar, duals, ncon);
+  mem_free(MEM_BUFFERS, buffer);
+  return solve_result;
+}
+
+// Return a pointer to the start of the line after the one containing pos
+char * _sol_next_line(char * pos, char * end){
+  char * eol = memchr(pos, '\n', end - pos);
+  return eol ? eol + 1 : end;
+}
+
+int _read_sol_ascii(char * buffer, long bsize, struct Variable * variables, int nvar, double * duals, int ncon){
+  char * pos = buffer;
+  char * end = buffer + bsize;
+
+  // Skip the message, which is terminated by a blank line
+  while (pos < end && !(*pos == '\n' || (*pos == '\r' && pos[1] == '\n'))){
+    pos = _sol_next_line(pos, end);
+  }
+  pos = _sol_next_line(pos, end);
+
+  if (strncmp(pos, "Options", 7) != 0){
+    printf("ERROR: Expected Options section in .sol file\n");
+    return -1;
+  }
+  pos = _sol_next_line(pos, end);
+  int nopts = strtol(pos, &pos, 10);
+  // Following other .sol readers, more than four options indicates that the
+  // last two options are followed by a variable bound tolerance.
+  bool need_vbtol = false;
+  if (nopts > 4){
+    nopts -= 2;
+    need_vbtol = true;
+  }
+  // Skip the options
+  for (int i=0; i<nopts; i++){
+    strtol(pos, &pos, 10);
+  }
+  int ncon_file = strtol(pos, &pos, 10);
+  int ndual = strtol(pos, &pos, 10);
+  int nvar_file = strtol(pos, &pos, 10);
+  int nprimal = strtol(pos, &pos, 10);
+  if (need_vbtol){
+    strtod(pos, &pos);
+  }
+  if (ncon_file != ncon || nvar_file != nvar || (ndual != ncon && ndual != 0) || nprimal != nvar){
+    printf("ERROR: .sol file has %d constraints and %d variables. Expected %d and %d.\n",
+      ncon_file, nvar_file, ncon, nvar);
+    return -1;
+  }
+
+  for (int i=0; i<ndual; i++){
+    double value = strtod(pos, &pos);
+    if (duals){
+      duals[i] = value;
+    }
+  }
+  for (int i=0; i<nprimal; i++){
+    variables[i].value = strtod(pos, &pos);
+  }
+
+  // The objno line is preceded by the newline ending the last value
+  while (pos < end && (*pos == '\n' || *pos == '\r')){pos += 1;}
+  int objno;
+  int solve_result;
+  if (sscanf(pos, "objno %d %d", &objno, &solve_result) != 2){
+    printf("ERROR: Expected objno line in .sol file\n");
+    return -1;
+  }
+  return solve_result;
+}
+
+/*
+ * Read a Fortran-style unformatted record of at most maxlen bytes into data.
+ * Returns the length of the record, or -1 if it could not be read.
+ */
+int _read_sol_record(FILE * fp, char * data, int maxlen){
+  int len;
+  int endlen;
+  if (fread(&len, sizeof(int), 1, fp) != 1 || len < 0 || len > maxlen){
+    return -1;
+  }
+  if (len > 0 && fread(data, sizeof(char), len, fp) != (size_t)len){
+    return -1;
+  }
+  if (fread(&endlen, sizeof(int), 1, fp) != 1 || endlen != len){
+    return -1;
+  }
+  return len;
+}
+
+int _read_sol_binary(FILE * fp, struct Variable * variables, int nvar, double * duals, int ncon){
+  // Skip message records until we hit the empty record
+  int len;
+  while (true){
+    if (fread(&len, sizeof(int), 1, fp) != 1 || len < 0){
+      printf("ERROR: Could not read message in binary .sol file\n");
+      return -1;
+    }
+    // Skip the record contents and trailing length
+    fseek(fp, len + sizeof(int), SEEK_CUR);
+    if (len == 0){
+      break;
+    }
+  }
+
+  // Options record: {nopts, opts..., ncon, ndual, nvar, nprimal}
+  int optdata[32];
+  int optlen = _read_sol_record(fp, (char *)optdata, sizeof(optdata));
+  if (optlen < (int)(5 * sizeof(int)) || optlen != (optdata[0] + 5) * (int)sizeof(int)){
+    printf("ERROR: Could not read options in binary .sol file\n");
+    return -1;
+  }
+  int nopts = optdata[0];
+  int ncon_file = optdata[nopts+1];
+  int ndual = optdata[nopts+2];
+  int nvar_file = optdata[nopts+3];
+  int nprimal = optdata[nopts+4];
+  if (ncon_file != ncon || nvar_file != nvar || (ndual != ncon && ndual != 0) || nprimal != nvar){
+    printf("ERROR: .sol file has %d constraints and %d variables. Expected %d and %d.\n",
+      ncon_file, nvar_file, ncon, nvar);
+    return -1;
+  }
+
+  double * values = malloc((ndual > nprimal ? ndual : nprimal) * sizeof(double) + 1);
+  if (_read_sol_record(fp, (char *)values, ndual * sizeof(double)) != ndual * (int)sizeof(double)){
+    printf("ERROR: Could not read duals in binary .sol file\n");
+    free(values);
+    return -1;
+  }
+  if (duals){
+    memcpy(duals, values, ndual * sizeof(double));
+  }
+  if (_read_sol_record(fp, (char *)values, nprimal * sizeof(double)) != nprimal * (int)sizeof(double)){
+    printf("ERROR: Could not read primals in binary .sol file\n");
+    free(values);
+    return -1;
+  }
+  for (int i=0; i<nprimal; i++){
+    variables[i].value = values[i];
+  }
+  free(values);
+
+  int objdata[2];
+  if (_read_sol_record(fp, (char *)objdata, sizeof(objdata)) != sizeof(objdata)){
+    printf("ERROR: Could not read objno in binary .sol file\n");
+    return -1;
+  }
+  return objdata[1];
+}
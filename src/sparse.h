@@ -12,6 +12,26 @@ struct CSRMatrix {
   double * values;
 };
 
+// Triplet form, e.g. for IPOPT. Entries may be in any order.
+struct COOMatrix {
+  int nnz;
+  int nrow;
+  int ncol;
+  int * rows;
+  int * cols;
+  double * values;
+};
+
+// Column i contains row indices indices[indptr[i]], ..., indices[indptr[i+1]-1]
+struct CSCMatrix {
+  int nnz;
+  int nrow;
+  int ncol;
+  int * indptr;
+  int * indices;
+  double * values;
+};
+
 /*
  * Identify variables that participate in an expression.
  * Store the resulting variables in a linked list.
@@ -42,6 +62,13 @@ struct CSRMatrix {
  *
  */
 int identify_variables(struct Node expr, int eidx, int * in_expr, int nvar, struct VarListNode ** head);
+
+/*
+ * Construct the sparsity structure of the Jacobian of a group of expressions.
+ * Row i of the returned matrix contains the variables that participate in
+ * exprs[i]. Values are initialized to zero.
+ */
+struct CSRMatrix identify_jacobian_structure(struct Node * exprs, int nexpr, int nvar);
 // Why does this accept VarListNode**? It seems VarListNode* would be sufficient.
 // TODO: Update this.
 void free_varlist(struct VarListNode ** head);
@@ -50,6 +77,64 @@ void free_varlist(struct VarListNode ** head);
 // contents of the arrays.
 void free_csrmatrix(struct CSRMatrix csr);
 void print_csrmatrix(struct CSRMatrix);
+/*
+ * Find the position of entry (row, col) in a matrix whose rows have sorted
+ * indices. Returns -1 if the entry is not in the structure.
+ */
+int csr_find_entry(struct CSRMatrix csr, int row, int col);
+/*
+ * Construct the structure of a matrix, with sorted rows, from a list of
+ * entries encoded as row * ncol + col. Duplicate entries are merged, and
+ * values are initialized to zero. This sorts the keys in place.
+ */
+struct CSRMatrix csr_from_entries(long * keys, long nkey, int nrow, int ncol);
+int _compare_long(const void * a, const void * b);
+
+/*
+ * Conversions between formats
+ *
+ * A Jacobian or Hessian has a fixed structure, and only its values change
+ * between evaluations. Each conversion copies the values, and if perm is
+ * not NULL, it also fills perm (of length nnz) so that entry k of the result
+ * is entry perm[k] of the input. Afterwards, new values can be converted
+ * with permute_values, without converting the structure again.
+ *
+ * CSR and CSC results have sorted indices. Duplicate COO entries are kept.
+ */
+struct COOMatrix csr_to_coo(struct CSRMatrix csr);
+struct CSRMatrix coo_to_csr(struct COOMatrix coo, int * perm);
+struct CSCMatrix csr_to_csc(struct CSRMatrix csr, int * perm);
+struct CSRMatrix csc_to_csr(struct CSCMatrix csc, int * perm);
+// dst[k] = src[perm[k]]
+void permute_values(int nnz, int * perm, double * src, double * dst);
+void free_coomatrix(struct COOMatrix coo);
+void free_cscmatrix(struct CSCMatrix csc);
+
+/*
+ * Sparse matrix-vector products
+ *
+ * csr_matvec computes y = A x one row at a time. Rows are independent, so
+ * they are split between threads if we are compiled with OpenMP.
+ * csr_matvec_transpose computes y = A^T x by scattering each row into y,
+ * which is serial. For a threaded A^T x, convert the structure to CSC once,
+ * and use csc_matvec_transpose, which gathers one column at a time.
+ */
+int csr_matvec(struct CSRMatrix a, double * x, double * y);
+int csr_matvec_transpose(struct CSRMatrix a, double * x, double * y);
+int csc_matvec_transpose(struct CSCMatrix a, double * x, double * y);
+
+void _compress_transpose(
+  int nrow,
+  int ncol,
+  int nnz,
+  int * indptr,
+  int * indices,
+  double * values,
+  int ** t_indptr,
+  int ** t_indices,
+  double ** t_values,
+  int * perm
+);
 
 int identify_variables(
   struct Node expr,
@@ -60,6 +145,7 @@ int identify_variables(
 ){
   switch(expr.type){
     case CONST_NODE:
+    case PARAM_NODE:
       return 0;
     case VAR_NODE:
     {
@@ -74,7 +160,7 @@ int identify_variables(
         // Mark that the variable was encountered in this constraint.
         in_expr[expr.data.var->index] = eidx;
         // Allocate a new node.
-        struct VarListNode * newvarnode = malloc(sizeof(struct VarListNode));
+        struct VarListNode * newvarnode = mem_alloc(MEM_VARLISTS, sizeof(struct VarListNode));
         newvarnode->variable = expr.data.var;
         if (*head){
           // If we already have a nodelist, insert this variable at the
@@ -107,12 +193,57 @@ int identify_variables(
   }
 }
 
+struct CSRMatrix identify_jacobian_structure(struct Node * exprs, int nexpr, int nvar){
+  // Array containing the index of the last expression each variable appeared
+  // in. Initialize to -1, i.e. the var has not appeared anywhere yet.
+  int * in_expr = malloc(nvar * sizeof(int));
+  for (int i=0; i<nvar; i++){in_expr[i] = -1;}
+
+  struct VarListNode ** varlists = malloc(nexpr * sizeof(struct VarListNode *));
+  int nnz = 0;
+  for (int i=0; i<nexpr; i++){
+    varlists[i] = NULL;
+    nnz += identify_variables(exprs[i], i, in_expr, nvar, &varlists[i]);
+  }
+
+  int * indptr = mem_alloc(MEM_SPARSE, (nexpr+1) * sizeof(int));
+  int * indices = mem_alloc(MEM_SPARSE, nnz * sizeof(int));
+  double * values = mem_alloc(MEM_SPARSE, nnz * sizeof(double));
+  int k = 0; // k is the nnz index
+  for (int i=0; i<nexpr; i++){
+    // indptr[i] stores the index of the first nz in row i
+    indptr[i] = k;
+    struct VarListNode * varnode = varlists[i];
+    while (varnode){
+      indices[k] = varnode->variable->index;
+      values[k] = 0.0;
+      k += 1;
+      varnode = varnode->next;
+    }
+    free_varlist(&varlists[i]);
+  }
+  indptr[nexpr] = k;
+
+  free(varlists);
+  free(in_expr);
+
+  struct CSRMatrix csr = {
+    .nnz = nnz,
+    .nrow = nexpr,
+    .ncol = nvar,
+    .indptr = indptr,
+    .indices = indices,
+    .values = values,
+  };
+  return csr;
+}
+
 void free_varlist(struct VarListNode ** head){
   struct VarListNode * node = *head;
   struct VarListNode * next;
   while(node){
     next = node->next;
-    free(node);
+    mem_free(MEM_VARLISTS, node);
     node = next;
   }
 }
@@ -135,8 +266,230 @@ void print_csrmatrix(struct CSRMatrix csr){
   printf("==========\n");
 }
 
+int csr_find_entry(struct CSRMatrix csr, int row, int col){
+  int lo = csr.indptr[row];
+  int hi = csr.indptr[row+1] - 1;
+  while (lo <= hi){
+    int mid = (lo + hi) / 2;
+    if (csr.indices[mid] == col){
+      return mid;
+    }else if (csr.indices[mid] < col){
+      lo = mid + 1;
+    }else{
+      hi = mid - 1;
+    }
+  }
+  return -1;
+}
+
+int _compare_long(const void * a, const void * b){
+  long x = *(const long *)a;
+  long y = *(const long *)b;
+  return (x > y) - (x < y);
+}
+
+struct CSRMatrix csr_from_entries(long * keys, long nkey, int nrow, int ncol){
+  if (nkey > 1){
+    qsort(keys, nkey, sizeof(long), _compare_long);
+  }
+  int nnz = 0;
+  for (long k=0; k<nkey; k++){
+    if (nnz == 0 || keys[nnz-1] != keys[k]){
+      keys[nnz] = keys[k];
+      nnz += 1;
+    }
+  }
+  struct CSRMatrix csr = {.nnz = nnz, .nrow = nrow, .ncol = ncol};
+  csr.indptr = mem_alloc(MEM_SPARSE, (nrow + 1) * sizeof(int));
+  csr.indices = mem_alloc(MEM_SPARSE, (nnz + 1) * sizeof(int));
+  csr.values = mem_alloc(MEM_SPARSE, (nnz + 1) * sizeof(double));
+  for (int i=0; i<=nrow; i++){csr.indptr[i] = 0;}
+  for (int k=0; k<nnz; k++){
+    csr.indptr[keys[k] / ncol + 1] += 1;
+    csr.indices[k] = keys[k] % ncol;
+    csr.values[k] = 0.0;
+  }
+  for (int i=0; i<nrow; i++){csr.indptr[i+1] += csr.indptr[i];}
+  return csr;
+}
+
 void free_csrmatrix(struct CSRMatrix csr){
-  free(csr.indptr);
-  free(csr.indices);
-  free(csr.values);
+  mem_free(MEM_SPARSE, csr.indptr);
+  mem_free(MEM_SPARSE, csr.indices);
+  mem_free(MEM_SPARSE, csr.values);
+}
+
+void free_coomatrix(struct COOMatrix coo){
+  mem_free(MEM_SPARSE, coo.rows);
+  mem_free(MEM_SPARSE, coo.cols);
+  mem_free(MEM_SPARSE, coo.values);
+}
+
+void free_cscmatrix(struct CSCMatrix csc){
+  mem_free(MEM_SPARSE, csc.indptr);
+  mem_free(MEM_SPARSE, csc.indices);
+  mem_free(MEM_SPARSE, csc.values);
+}
+
+struct COOMatrix csr_to_coo(struct CSRMatrix csr){
+  struct COOMatrix coo = {
+    .nnz = csr.nnz,
+    .nrow = csr.nrow,
+    .ncol = csr.ncol,
+    .rows = mem_alloc(MEM_SPARSE, (csr.nnz + 1) * sizeof(int)),
+    .cols = mem_alloc(MEM_SPARSE, (csr.nnz + 1) * sizeof(int)),
+    .values = mem_alloc(MEM_SPARSE, (csr.nnz + 1) * sizeof(double)),
+  };
+  for (int i=0; i<csr.nrow; i++){
+    for (int k=csr.indptr[i]; k<csr.indptr[i+1]; k++){
+      coo.rows[k] = i;
+      coo.cols[k] = csr.indices[k];
+      coo.values[k] = csr.values[k];
+    }
+  }
+  return coo;
+}
+
+/*
+ * Compress the transpose of a compressed (CSR or CSC) matrix with a
+ * counting sort. Entries are visited in order, so the indices of the result
+ * are sorted.
+ */
+void _compress_transpose(
+  int nrow,
+  int ncol,
+  int nnz,
+  int * indptr,
+  int * indices,
+  double * values,
+  int ** t_indptr,
+  int ** t_indices,
+  double ** t_values,
+  int * perm
+){
+  int * tp = mem_alloc(MEM_SPARSE, (ncol + 1) * sizeof(int));
+  int * ti = mem_alloc(MEM_SPARSE, (nnz + 1) * sizeof(int));
+  double * tv = mem_alloc(MEM_SPARSE, (nnz + 1) * sizeof(double));
+  int * next = malloc((ncol + 1) * sizeof(int));
+  for (int j=0; j<=ncol; j++){tp[j] = 0;}
+  for (int k=0; k<nnz; k++){tp[indices[k]+1] += 1;}
+  for (int j=0; j<ncol; j++){
+    tp[j+1] += tp[j];
+    next[j] = tp[j];
+  }
+  for (int i=0; i<nrow; i++){
+    for (int k=indptr[i]; k<indptr[i+1]; k++){
+      int kt = next[indices[k]];
+      next[indices[k]] += 1;
+      ti[kt] = i;
+      tv[kt] = values[k];
+      if (perm){perm[kt] = k;}
+    }
+  }
+  free(next);
+  *t_indptr = tp;
+  *t_indices = ti;
+  *t_values = tv;
+}
+
+struct CSCMatrix csr_to_csc(struct CSRMatrix csr, int * perm){
+  struct CSCMatrix csc = {.nnz = csr.nnz, .nrow = csr.nrow, .ncol = csr.ncol};
+  _compress_transpose(
+    csr.nrow, csr.ncol, csr.nnz, csr.indptr, csr.indices, csr.values,
+    &csc.indptr, &csc.indices, &csc.values, perm
+  );
+  return csc;
+}
+
+struct CSRMatrix csc_to_csr(struct CSCMatrix csc, int * perm){
+  struct CSRMatrix csr = {.nnz = csc.nnz, .nrow = csc.nrow, .ncol = csc.ncol};
+  _compress_transpose(
+    csc.ncol, csc.nrow, csc.nnz, csc.indptr, csc.indices, csc.values,
+    &csr.indptr, &csr.indices, &csr.values, perm
+  );
+  return csr;
+}
+
+struct CSRMatrix coo_to_csr(struct COOMatrix coo, int * perm){
+  // Sort the entries by column, then (stably) by row, with counting sorts
+  int * by_col = malloc((coo.nnz + 1) * sizeof(int));
+  int * next = malloc(((coo.nrow > coo.ncol ? coo.nrow : coo.ncol) + 1) * sizeof(int));
+  for (int j=0; j<=coo.ncol; j++){next[j] = 0;}
+  for (int k=0; k<coo.nnz; k++){next[coo.cols[k]+1] += 1;}
+  for (int j=0; j<coo.ncol; j++){next[j+1] += next[j];}
+  for (int k=0; k<coo.nnz; k++){
+    by_col[next[coo.cols[k]]] = k;
+    next[coo.cols[k]] += 1;
+  }
+
+  struct CSRMatrix csr = {.nnz = coo.nnz, .nrow = coo.nrow, .ncol = coo.ncol};
+  csr.indptr = mem_alloc(MEM_SPARSE, (coo.nrow + 1) * sizeof(int));
+  csr.indices = mem_alloc(MEM_SPARSE, (coo.nnz + 1) * sizeof(int));
+  csr.values = mem_alloc(MEM_SPARSE, (coo.nnz + 1) * sizeof(double));
+  for (int i=0; i<=coo.nrow; i++){csr.indptr[i] = 0;}
+  for (int k=0; k<coo.nnz; k++){csr.indptr[coo.rows[k]+1] += 1;}
+  for (int i=0; i<coo.nrow; i++){
+    csr.indptr[i+1] += csr.indptr[i];
+    next[i] = csr.indptr[i];
+  }
+  for (int kk=0; kk<coo.nnz; kk++){
+    int k = by_col[kk];
+    int kr = next[coo.rows[k]];
+    next[coo.rows[k]] += 1;
+    csr.indices[kr] = coo.cols[k];
+    csr.values[kr] = coo.values[k];
+    if (perm){perm[kr] = k;}
+  }
+  free(by_col);
+  free(next);
+  return csr;
+}
+
+void permute_values(int nnz, int * perm, double * src, double * dst){
+  for (int k=0; k<nnz; k++){
+    dst[k] = src[perm[k]];
+  }
+}
+
+int csr_matvec(struct CSRMatrix a, double * x, double * y){
+  int * indptr = a.indptr;
+  int * indices = a.indices;
+  double * values = a.values;
+  #pragma omp parallel for schedule(static) if(a.nnz > 100000)
+  for (int i=0; i<a.nrow; i++){
+    double sum = 0.0;
+    #pragma omp simd reduction(+:sum)
+    for (int k=indptr[i]; k<indptr[i+1]; k++){
+      sum += values[k] * x[indices[k]];
+    }
+    y[i] = sum;
+  }
+  return 0;
+}
+
+int csr_matvec_transpose(struct CSRMatrix a, double * x, double * y){
+  for (int j=0; j<a.ncol; j++){y[j] = 0.0;}
+  for (int i=0; i<a.nrow; i++){
+    double xi = x[i];
+    for (int k=a.indptr[i]; k<a.indptr[i+1]; k++){
+      y[a.indices[k]] += a.values[k] * xi;
+    }
+  }
+  return 0;
+}
+
+int csc_matvec_transpose(struct CSCMatrix a, double * x, double * y){
+  int * indptr = a.indptr;
+  int * indices = a.indices;
+  double * values = a.values;
+  #pragma omp parallel for schedule(static) if(a.nnz > 100000)
+  for (int j=0; j<a.ncol; j++){
+    double sum = 0.0;
+    #pragma omp simd reduction(+:sum)
+    for (int k=indptr[j]; k<indptr[j+1]; k++){
+      sum += values[k] * x[indices[k]];
+    }
+    y[j] = sum;
+  }
+  return 0;
 }
@@ -0,0 +1,1367 @@
+#include <stdint.h>
+
+#include "instrument.h"
+#include "trace.h"
+
+/*
+ * Compiled expression tapes
+ *
+ * A Node tree is convenient to construct, print, and manipulate, but not to
+ * evaluate repeatedly. Each Node is 24 bytes (most of which is padding and
+ * an adjoint that is only used in reverse mode), each OperatorNode is a
+ * separate allocation, and traversing a tree means chasing pointers all
+ * over the heap.
+ *
+ * A Tape stores the nodes of a group of expressions in a single array of
+ * 16-byte TapeNodes, ordered so that every node comes after its arguments.
+ * Arguments are referenced by 32-bit indices into this array. Values and
+ * adjoints are not stored on the tape, but in separate arrays (of length
+ * nnode) provided by the caller, so evaluation is a single forward sweep
+ * over the tape and reverse-mode differentiation is a single backward sweep.
+ * As the tape is never modified after it is compiled, it can be shared by
+ * any number of evaluations.
+ *
+ * The first nvar nodes of the tape are the variables, so each variable has a
+ * single node, and after a reverse sweep the adjoint of node j is the
+ * derivative with respect to variable j. The remaining nodes of each
+ * expression occupy a contiguous segment of the tape. If expressions share
+ * OperatorNodes (see cse.h), each shared node is compiled once, in the
+ * segment of the first expression that uses it, and later expressions record
+ * the nodes outside their own segment that they depend on. This way, values
+ * of shared subexpressions are computed once per evaluation, and the
+ * reverse sweep for an expression only visits the nodes it depends on.
+ */
+
+struct TapeNode {
+  // NodeType
+  uint16_t type;
+  // OperatorType, for operator nodes
+  uint16_t op;
+  // Number of arguments, for operator nodes
+  uint32_t nargs;
+  union {
+    // Value of a constant
+    double value;
+    // Index of a variable or parameter, or, for operators, offset of the
+    // first argument in Tape.args
+    uint32_t index;
+  } data;
+};
+
+struct Tape {
+  // Nodes 0, ..., nvar-1 are the variables
+  int nvar;
+  int nnode;
+  struct TapeNode * nodes;
+  // Indices of the arguments of operator nodes
+  int narg;
+  uint32_t * args;
+  // The segment of expression i is nodes expr_start[i], ..., expr_start[i+1]-1
+  // and its root is node roots[i]. The root is usually the last node of the
+  // segment, but may be a variable or a node shared with an earlier expression.
+  int nexpr;
+  int * expr_start;
+  uint32_t * roots;
+  // Nodes before expression i's segment (other than variables) that
+  // expression i depends on, in increasing order, are
+  // ext_nodes[ext_indptr[i]], ..., ext_nodes[ext_indptr[i+1]-1]
+  int next;
+  int * ext_indptr;
+  uint32_t * ext_nodes;
+  // Jacobian structure: the variables in expression i are
+  // jac_vars[jac_indptr[i]], ..., jac_vars[jac_indptr[i+1]-1]
+  int jac_nnz;
+  int * jac_indptr;
+  uint32_t * jac_vars;
+  // Calls of external functions (see external.h). If there are any, nodes
+  // are evaluated in passes rather than in tape order, so calls can be
+  // batched. Pass k evaluates nodes order[pass_start[2k]], ...,
+  // order[pass_start[2k+1]-1] one at a time, then the calls
+  // order[pass_start[2k+1]], ..., order[pass_start[2k+2]-1], which don't
+  // depend on each other, in batches of the same function.
+  int ncall;
+  int npass;
+  int * pass_start;
+  uint32_t * order;
+};
+
+/*
+ * Compile expressions into a tape. The expressions are not modified, and
+ * may be freed after compiling.
+ */
+struct Tape compile_tape(struct Node * exprs, int nexpr, int nvar);
+void free_tape(struct Tape tape);
+
+/*
+ * Copy the values of an array of Variables into a contiguous array, x,
+ * which is what we evaluate tapes at.
+ */
+int gather_variable_values(struct Variable * variables, int nvar, double * x);
+int gather_parameter_values(struct Parameter * parameters, int nparam, double * p);
+
+/*
+ * Compute the value of every node on the tape, at variable values x and
+ * parameter values p. values must have length tape->nnode.
+ */
+int tape_evaluate(struct Tape * tape, double * x, double * p, double * values);
+
+/*
+ * Copy the value of each expression (after tape_evaluate) into expr_values,
+ * which has length tape->nexpr.
+ */
+int tape_expression_values(struct Tape * tape, double * values, double * expr_values);
+
+/*
+ * Compute the adjoint of every node in expression iexpr, i.e. the derivative
+ * of the expression with respect to the node. Only adjoints of nodes that
+ * the expression depends on are modified. Requires node values
+ * computed by tape_evaluate.
+ */
+int tape_reverse(struct Tape * tape, int iexpr, double * values, double * adjoints);
+
+/*
+ * Return the Jacobian sparsity structure of the tape's expressions. Row i
+ * contains the variables in expression i, in the order used by tape_jacobian.
+ */
+struct CSRMatrix tape_jacobian_structure(struct Tape * tape);
+
+/*
+ * Compute the Jacobian of the tape's expressions with reverse mode, one
+ * expression at a time. jac_values is in the order of
+ * tape_jacobian_structure. Requires node values computed by tape_evaluate.
+ */
+int tape_jacobian(struct Tape * tape, double * values, double * adjoints, double * jac_values);
+
+/*
+ * Matrix-free Jacobian products, which never form the Jacobian:
+ *
+ * tape_jacobian_vector_product computes jv = J v (length nexpr) with one
+ * forward (tangent) sweep over the whole tape, with dvalues[j] = v[j] for
+ * the variables.
+ *
+ * tape_jacobian_transpose_product computes jtw = J^T w (length nvar) with
+ * one reverse sweep over the whole tape, with the adjoint of each root
+ * seeded with w[i]. This is the gradient of sum_i w[i] * expression i.
+ *
+ * Both require node values computed by tape_evaluate. dvalues and adjoints
+ * have length nnode.
+ */
+int tape_jacobian_vector_product(struct Tape * tape, double * values, double * v, double * dvalues, double * jv);
+int tape_jacobian_transpose_product(struct Tape * tape, double * values, double * w, double * adjoints, double * jtw);
+
+/*
+ * Second-order derivatives
+ *
+ * We compute Hessian-vector products of the Lagrangian, i.e. the sum of
+ * lambda[i] times expression i, with forward-over-reverse mode: a forward
+ * (tangent) sweep computes the directional derivative, dvalues, of every
+ * node, then a reverse sweep over the whole tape computes the adjoint of
+ * every node along with its directional derivative, dadjoints. The
+ * directional derivatives of the variable nodes' adjoints are the product
+ * of the Hessian with the direction.
+ *
+ * As variable j is node j, the direction is just dvalues[0], ...,
+ * dvalues[nvar-1], and the Hessian-vector product is dadjoints[0], ...,
+ * dadjoints[nvar-1]. dvalues, adjoints and dadjoints have length nnode.
+ */
+int tape_hessian_vector_product(
+  struct Tape * tape,
+  double * values,
+  double * lambda,
+  double * direction,
+  double * dvalues,
+  double * adjoints,
+  double * dadjoints,
+  double * hv
+);
+
+/*
+ * Return the sparsity structure of the lower triangle of the Hessian of the
+ * Lagrangian, i.e. every pair of variables that appear in the same
+ * expression, with indices sorted within each row.
+ */
+struct CSRMatrix tape_hessian_structure(struct Tape * tape);
+
+/*
+ * Compute the lower triangle of the Hessian of the Lagrangian, in the order
+ * of `hess`, which was returned by tape_hessian_structure. This computes
+ * one Hessian-vector product for each nonempty row.
+ */
+int tape_hessian(
+  struct Tape * tape,
+  double * values,
+  double * lambda,
+  struct CSRMatrix hess,
+  double * dvalues,
+  double * adjoints,
+  double * dadjoints,
+  double * hess_values
+);
+
+// State used while compiling a tape
+struct TapeCompiler {
+  struct Tape * tape;
+  // Next free position in tape->args
+  int argpos;
+  // Capacities of tape->ext_nodes and tape->jac_vars, which grow as needed
+  int ext_capacity;
+  int jac_capacity;
+  // node_stamp[i] == stamp if node i is known to be used by the current
+  // expression
+  int * node_stamp;
+  int stamp;
+  // Map from shared OperatorNodes to their node on the tape
+  int map_capacity;
+  struct OperatorNode ** map_keys;
+  uint32_t * map_values;
+};
+
+int _tape_count_nodes(struct Node expr, int * narg);
+uint32_t _tape_compile_node(struct Node expr, struct TapeCompiler * tc);
+void _tape_use_variable(struct TapeCompiler * tc, uint32_t j);
+void _tape_use_external(struct TapeCompiler * tc, uint32_t inode);
+int _tape_map_find(struct TapeCompiler * tc, struct OperatorNode * expr);
+void _tape_map_insert(struct TapeCompiler * tc, struct OperatorNode * expr, uint32_t inode);
+int _compare_uint32(const void * a, const void * b);
+int _compare_int(const void * a, const void * b);
+void _tape_evaluate_nodes(struct Tape * tape, double * x, double * p, double * values, int start, int end);
+double _tape_node_value(struct Tape * tape, double * x, double * p, double * values, int i);
+void _tape_schedule_calls(struct Tape * tape);
+void _tape_evaluate_passes(struct Tape * tape, double * x, double * p, double * values);
+void _tape_evaluate_calls(struct Tape * tape, double * values, int start, int end, bool hessian, double * xbuf, double * vbuf);
+double _tape_op_value(int op, int nargs, uint32_t * a, double * v);
+void _tape_op_reverse(int op, int nargs, uint32_t * a, double * v, double value, double w, double * adj);
+double _tape_op_tangent(int op, int nargs, uint32_t * a, double * v, double * dv, double value);
+void _tape_op_reverse2(int op, int nargs, uint32_t * a, double * v, double * dv, double value, double w, double dw, double * adj, double * dadj);
+double _tape_generic_value(int op, int nargs, uint32_t * a, double * v);
+void _tape_generic_reverse(int op, int nargs, uint32_t * a, double * v, double value, double w, double * adj);
+double _tape_generic_tangent(int op, int nargs, uint32_t * a, double * v, double * dv, double value);
+void _tape_generic_reverse2(int op, int nargs, uint32_t * a, double * v, double * dv, double value, double w, double dw, double * adj, double * dadj);
+void _tape_second_order_sweep(struct Tape * tape, double * values, double * lambda, double * dvalues, double * adjoints, double * dadjoints);
+
+int _tape_count_nodes(struct Node expr, int * narg){
+  if (expr.type != OP_NODE){
+    return 1;
+  }
+  int count = 1;
+  *narg += expr.data.expr->nargs;
+  for (int i=0; i<expr.data.expr->nargs; i++){
+    count += _tape_count_nodes(expr.data.expr->args[i], narg);
+  }
+  return count;
+}
+
+int _compare_uint32(const void * a, const void * b){
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+int _compare_int(const void * a, const void * b){
+  int x = *(const int *)a;
+  int y = *(const int *)b;
+  return (x > y) - (x < y);
+}
+
+// Returns the position of expr in the map, or of the empty slot where it
+// should be inserted.
+int _tape_map_find(struct TapeCompiler * tc, struct OperatorNode * expr){
+  int mask = tc->map_capacity - 1;
+  int pos = (int)(((uintptr_t)expr >> 4) * 2654435761u) & mask;
+  while (tc->map_keys[pos] && tc->map_keys[pos] != expr){
+    pos = (pos + 1) & mask;
+  }
+  return pos;
+}
+
+void _tape_map_insert(struct TapeCompiler * tc, struct OperatorNode * expr, uint32_t inode){
+  int pos = _tape_map_find(tc, expr);
+  tc->map_keys[pos] = expr;
+  tc->map_values[pos] = inode;
+}
+
+// Record that the current expression depends on variable j
+void _tape_use_variable(struct TapeCompiler * tc, uint32_t j){
+  struct Tape * tape = tc->tape;
+  if (tc->node_stamp[j] == tc->stamp){
+    return;
+  }
+  tc->node_stamp[j] = tc->stamp;
+  if (tape->jac_nnz == tc->jac_capacity){
+    tc->jac_capacity *= 2;
+    tape->jac_vars = realloc(tape->jac_vars, tc->jac_capacity * sizeof(uint32_t));
+  }
+  tape->jac_vars[tape->jac_nnz] = j;
+  tape->jac_nnz += 1;
+}
+
+// Record that the current expression depends on node inode, which was
+// compiled before the current expression's segment, and on everything
+// inode depends on.
+void _tape_use_external(struct TapeCompiler * tc, uint32_t inode){
+  struct Tape * tape = tc->tape;
+  struct TapeNode node = tape->nodes[inode];
+  if (node.type == VAR_NODE){
+    _tape_use_variable(tc, inode);
+    return;
+  }
+  if (tc->node_stamp[inode] == tc->stamp){
+    return;
+  }
+  tc->node_stamp[inode] = tc->stamp;
+  if (tape->next == tc->ext_capacity){
+    tc->ext_capacity *= 2;
+    tape->ext_nodes = realloc(tape->ext_nodes, tc->ext_capacity * sizeof(uint32_t));
+  }
+  tape->ext_nodes[tape->next] = inode;
+  tape->next += 1;
+  if (node.type == OP_NODE){
+    for (int k=0; k<node.nargs; k++){
+      _tape_use_external(tc, tape->args[node.data.index + k]);
+    }
+  }
+}
+
+/*
+ * Append expr (after its arguments) to the tape and return the index of
+ * its node.
+ */
+uint32_t _tape_compile_node(struct Node expr, struct TapeCompiler * tc){
+  struct Tape * tape = tc->tape;
+  struct TapeNode node = {.type = expr.type, .op = 0, .nargs = 0};
+  switch(expr.type){
+    case CONST_NODE:
+      node.data.value = expr.data.value;
+      break;
+    case PARAM_NODE:
+      node.data.index = expr.data.param->index;
+      break;
+    case VAR_NODE:
+      _tape_use_variable(tc, expr.data.var->index);
+      return expr.data.var->index;
+    case OP_NODE:
+    {
+      struct OperatorNode * opnode = expr.data.expr;
+      if (opnode->nshared > 0){
+        int pos = _tape_map_find(tc, opnode);
+        if (tc->map_keys[pos]){
+          uint32_t inode = tc->map_values[pos];
+          if (inode < (uint32_t)tape->expr_start[tc->stamp]){
+            // Compiled as part of an earlier expression
+            _tape_use_external(tc, inode);
+          }
+          return inode;
+        }
+      }
+      // Reserve space for the arguments before compiling them, as they
+      // will reserve space for their own arguments.
+      int first_arg = tc->argpos;
+      tc->argpos += opnode->nargs;
+      for (int i=0; i<opnode->nargs; i++){
+        tape->args[first_arg + i] = _tape_compile_node(opnode->args[i], tc);
+      }
+      node.op = opnode->op;
+      node.nargs = opnode->nargs;
+      node.data.index = first_arg;
+      if (opnode->nshared > 0){
+        _tape_map_insert(tc, opnode, tape->nnode);
+      }
+      break;
+    }
+  }
+  tape->nodes[tape->nnode] = node;
+  tape->nnode += 1;
+  return tape->nnode - 1;
+}
+
+struct Tape compile_tape(struct Node * exprs, int nexpr, int nvar){
+  // Count nodes and arguments so we can allocate the tape's arrays once.
+  // This over-counts, as variables and shared nodes appear only once on
+  // the tape.
+  int max_nnode = nvar;
+  int max_narg = 0;
+  TRACE_BEGIN("compile_tape");
+  INSTRUMENT_START(compile_start);
+  for (int i=0; i<nexpr; i++){
+    max_nnode += _tape_count_nodes(exprs[i], &max_narg);
+  }
+
+  struct Tape tape = {
+    .nvar = nvar,
+    .nnode = 0,
+    .nodes = malloc(max_nnode * sizeof(struct TapeNode)),
+    .narg = 0,
+    .args = malloc((max_narg > 0 ? max_narg : 1) * sizeof(uint32_t)),
+    .nexpr = nexpr,
+    .expr_start = malloc((nexpr + 1) * sizeof(int)),
+    .roots = malloc((nexpr > 0 ? nexpr : 1) * sizeof(uint32_t)),
+    .next = 0,
+    .ext_indptr = malloc((nexpr + 1) * sizeof(int)),
+    .ext_nodes = malloc(16 * sizeof(uint32_t)),
+    .jac_nnz = 0,
+    .jac_indptr = malloc((nexpr + 1) * sizeof(int)),
+    .jac_vars = malloc(16 * sizeof(uint32_t)),
+  };
+
+  struct TapeCompiler tc = {
+    .tape = &tape,
+    .argpos = 0,
+    .ext_capacity = 16,
+    .jac_capacity = 16,
+    .node_stamp = malloc(max_nnode * sizeof(int)),
+    .stamp = 0,
+    .map_capacity = 16,
+  };
+  for (int i=0; i<max_nnode; i++){tc.node_stamp[i] = -1;}
+  // The map only holds shared nodes, of which there are fewer than
+  // max_nnode. Keep its load factor below 1/2.
+  while (tc.map_capacity < 2 * max_nnode){tc.map_capacity *= 2;}
+  tc.map_keys = malloc(tc.map_capacity * sizeof(struct OperatorNode *));
+  tc.map_values = malloc(tc.map_capacity * sizeof(uint32_t));
+  for (int i=0; i<tc.map_capacity; i++){tc.map_keys[i] = NULL;}
+
+  for (int j=0; j<nvar; j++){
+    struct TapeNode node = {.type = VAR_NODE, .op = 0, .nargs = 0};
+    node.data.index = j;
+    tape.nodes[j] = node;
+  }
+  tape.nnode = nvar;
+
+  for (int i=0; i<nexpr; i++){
+    tape.expr_start[i] = tape.nnode;
+    tape.ext_indptr[i] = tape.next;
+    tape.jac_indptr[i] = tape.jac_nnz;
+    // Use the expression index as the stamp, so we know which nodes
+    // have already been recorded for this expression.
+    tc.stamp = i;
+    tape.roots[i] = _tape_compile_node(exprs[i], &tc);
+    // The reverse sweep visits external nodes in decreasing order
+    qsort(tape.ext_nodes + tape.ext_indptr[i], tape.next - tape.ext_indptr[i], sizeof(uint32_t), _compare_uint32);
+  }
+  tape.expr_start[nexpr] = tape.nnode;
+  tape.ext_indptr[nexpr] = tape.next;
+  tape.jac_indptr[nexpr] = tape.jac_nnz;
+  tape.narg = tc.argpos;
+
+  // Release the space we over-allocated
+  tape.nodes = realloc(tape.nodes, (tape.nnode > 0 ? tape.nnode : 1) * sizeof(struct TapeNode));
+  tape.args = realloc(tape.args, (tape.narg > 0 ? tape.narg : 1) * sizeof(uint32_t));
+
+  free(tc.node_stamp);
+  free(tc.map_keys);
+  free(tc.map_values);
+  _tape_schedule_calls(&tape);
+  INSTRUMENT_STOP(INSTRUMENT_COMPILE, compile_start, tape.nnode);
+  TRACE_END("compile_tape");
+  return tape;
+}
+
+void free_tape(struct Tape tape){
+  free(tape.nodes);
+  free(tape.args);
+  free(tape.expr_start);
+  free(tape.roots);
+  free(tape.ext_indptr);
+  free(tape.ext_nodes);
+  free(tape.jac_indptr);
+  free(tape.jac_vars);
+  free(tape.pass_start);
+  free(tape.order);
+}
+
+// A call, for sorting the calls of a pass by function
+struct TapeCall {
+  int func;
+  uint32_t node;
+};
+
+int _compare_tape_call(const void * a, const void * b){
+  const struct TapeCall * x = a;
+  const struct TapeCall * y = b;
+  if (x->func != y->func){
+    return (x->func > y->func) - (x->func < y->func);
+  }
+  return (x->node > y->node) - (x->node < y->node);
+}
+
+void _tape_schedule_calls(struct Tape * tape){
+  struct TapeNode * nodes = tape->nodes;
+  tape->ncall = 0;
+  for (int i=tape->nvar; i<tape->nnode; i++){
+    if (nodes[i].type == OP_NODE && nodes[i].op == EXTERNAL){tape->ncall += 1;}
+  }
+  if (tape->ncall == 0){
+    return;
+  }
+  // A node is evaluated in pass k, where k is the largest number of calls
+  // on a path from the node to a leaf, not counting the node itself. A
+  // call in pass k only depends on calls in earlier passes.
+  int nnode = tape->nnode;
+  int * pass = calloc(nnode, sizeof(int));
+  int npass = 1;
+  for (int i=tape->nvar; i<nnode; i++){
+    if (nodes[i].type != OP_NODE){continue;}
+    uint32_t * a = tape->args + nodes[i].data.index;
+    for (int k=0; k<nodes[i].nargs; k++){
+      int pa = pass[a[k]] + (nodes[a[k]].type == OP_NODE && nodes[a[k]].op == EXTERNAL ? 1 : 0);
+      if (pa > pass[i]){pass[i] = pa;}
+    }
+    if (pass[i] + 1 > npass){npass = pass[i] + 1;}
+  }
+  // Counting sort of the nodes after the variables by (pass, is a call),
+  // which keeps them in tape order within each group
+  tape->npass = npass;
+  tape->pass_start = calloc(2 * npass + 1, sizeof(int));
+  tape->order = malloc((nnode - tape->nvar > 0 ? nnode - tape->nvar : 1) * sizeof(uint32_t));
+  for (int i=tape->nvar; i<nnode; i++){
+    int is_call = nodes[i].type == OP_NODE && nodes[i].op == EXTERNAL;
+    tape->pass_start[2 * pass[i] + is_call + 1] += 1;
+  }
+  for (int g=0; g<2*npass; g++){tape->pass_start[g+1] += tape->pass_start[g];}
+  int * pos = malloc(2 * npass * sizeof(int));
+  for (int g=0; g<2*npass; g++){pos[g] = tape->pass_start[g];}
+  for (int i=tape->nvar; i<nnode; i++){
+    int is_call = nodes[i].type == OP_NODE && nodes[i].op == EXTERNAL;
+    tape->order[pos[2 * pass[i] + is_call]++] = i;
+  }
+  // Group the calls of each pass by function
+  struct TapeCall * calls = malloc(tape->ncall * sizeof(struct TapeCall));
+  for (int k=0; k<npass; k++){
+    int start = tape->pass_start[2*k+1];
+    int end = tape->pass_start[2*k+2];
+    for (int c=start; c<end; c++){
+      uint32_t i = tape->order[c];
+      calls[c-start].func = (int)nodes[tape->args[nodes[i].data.index]].data.value;
+      calls[c-start].node = i;
+    }
+    qsort(calls, end - start, sizeof(struct TapeCall), _compare_tape_call);
+    for (int c=start; c<end; c++){tape->order[c] = calls[c-start].node;}
+  }
+  free(calls);
+  free(pos);
+  free(pass);
+}
+
+int gather_variable_values(struct Variable * variables, int nvar, double * x){
+  for (int i=0; i<nvar; i++){
+    x[variables[i].index] = variables[i].value;
+  }
+  return 0;
+}
+
+int gather_parameter_values(struct Parameter * parameters, int nparam, double * p){
+  for (int i=0; i<nparam; i++){
+    p[parameters[i].index] = parameters[i].value;
+  }
+  return 0;
+}
+
+/*
+ * Value of an operator whose arguments have values v[a[0]], ..., v[a[nargs-1]].
+ *
+ * Unlike the evaluation functions in expr.h, these functions don't check for
+ * domain errors, and return whatever the C math library returns (e.g. NaN
+ * for the log of a negative number).
+ *
+ * The common operators have their kernels written out here, so the compiler
+ * can inline them. Other operators call their kernels in OPERATOR_DATA (see
+ * the _tape_generic functions).
+ */
+double _tape_op_value(int op, int nargs, uint32_t * a, double * v){
+  switch(op){
+    case SUM:
+    {
+      double sum = 0.0;
+      for (int k=0; k<nargs; k++){sum += v[a[k]];}
+      return sum;
+    }
+    case PRODUCT:
+    {
+      double prod = 1.0;
+      for (int k=0; k<nargs; k++){prod *= v[a[k]];}
+      return prod;
+    }
+    case SUBTRACTION:
+      return v[a[0]] - v[a[1]];
+    case DIVISION:
+      return v[a[0]] / v[a[1]];
+    case POWER:
+      return pow(v[a[0]], v[a[1]]);
+    case NEG:
+      return -v[a[0]];
+    case SQRT:
+      return sqrt(v[a[0]]);
+    case EXP:
+      return exp(v[a[0]]);
+    case LOG:
+      return log(v[a[0]]);
+    case SIN:
+      return sin(v[a[0]]);
+    case COS:
+      return cos(v[a[0]]);
+    case TAN:
+      return tan(v[a[0]]);
+    case SQUARE:
+      return v[a[0]] * v[a[0]];
+    case POW_CONST_INT:
+      return _pow_int(v[a[0]], (int)v[a[1]]);
+    case POW_CONST_REAL:
+    case EXP_CONST_BASE:
+      return pow(v[a[0]], v[a[1]]);
+    default:
+      return _tape_generic_value(op, nargs, a, v);
+  }
+}
+
+/*
+ * Propagate the adjoint w of an operator node (whose value is `value`) to the
+ * adjoints of its arguments. Adjoints are accumulated with +=, as an argument
+ * (e.g. a variable) may be used by several operators.
+ */
+void _tape_op_reverse(int op, int nargs, uint32_t * a, double * v, double value, double w, double * adj){
+  switch(op){
+    case SUM:
+      for (int k=0; k<nargs; k++){adj[a[k]] += w;}
+      return;
+    case PRODUCT:
+      if (nargs == 2){
+        adj[a[0]] += w * v[a[1]];
+        adj[a[1]] += w * v[a[0]];
+      }else{
+        // The derivative with respect to argument k is the product of all
+        // other arguments. We compute this as (product of arguments before k)
+        // times (product of arguments after k) so we never divide by an
+        // argument that may be zero. The products after each k are computed
+        // once, backwards, and the products before k as we go.
+        double after[nargs];
+        after[nargs-1] = 1.0;
+        for (int k=nargs-1; k>0; k--){after[k-1] = after[k] * v[a[k]];}
+        double before = 1.0;
+        for (int k=0; k<nargs; k++){
+          adj[a[k]] += w * before * after[k];
+          before *= v[a[k]];
+        }
+      }
+      return;
+    case SUBTRACTION:
+      adj[a[0]] += w;
+      adj[a[1]] -= w;
+      return;
+    case DIVISION:
+      adj[a[0]] += w / v[a[1]];
+      adj[a[1]] -= w * value / v[a[1]];
+      return;
+    case POWER:
+    {
+      double base = v[a[0]];
+      double exponent = v[a[1]];
+      adj[a[0]] += w * exponent * pow(base, exponent - 1.0);
+      if (base != 0.0){
+        adj[a[1]] += w * value * log(base);
+      }
+      return;
+    }
+    case NEG:
+      adj[a[0]] -= w;
+      return;
+    case SQRT:
+      adj[a[0]] += w / (2.0 * value);
+      return;
+    case EXP:
+      adj[a[0]] += w * value;
+      return;
+    case LOG:
+      adj[a[0]] += w / v[a[0]];
+      return;
+    case SIN:
+      adj[a[0]] += w * cos(v[a[0]]);
+      return;
+    case COS:
+      adj[a[0]] -= w * sin(v[a[0]]);
+      return;
+    case TAN:
+      // d/dx tan(x) = 1 / cos(x)^2 = 1 + tan(x)^2
+      adj[a[0]] += w * (1.0 + value * value);
+      return;
+    case SQUARE:
+      adj[a[0]] += w * 2.0 * v[a[0]];
+      return;
+    // For the specialized powers, the adjoint of the constant operand is
+    // never needed
+    case POW_CONST_INT:
+    {
+      int n = (int)v[a[1]];
+      adj[a[0]] += w * n * _pow_int(v[a[0]], n - 1);
+      return;
+    }
+    case POW_CONST_REAL:
+      adj[a[0]] += w * v[a[1]] * pow(v[a[0]], v[a[1]] - 1.0);
+      return;
+    case EXP_CONST_BASE:
+      adj[a[1]] += w * value * log(v[a[0]]);
+      return;
+    default:
+      // For external calls, the gradient was cached when we computed the
+      // value
+      _tape_generic_reverse(op, nargs, a, v, value, w, adj);
+      return;
+  }
+}
+
+int tape_evaluate(struct Tape * tape, double * x, double * p, double * values){
+  TRACE_BEGIN("tape_evaluate");
+  if (tape->ncall > 0){
+    _tape_evaluate_passes(tape, x, p, values);
+    TRACE_END("tape_evaluate");
+    return 0;
+  }
+  INSTRUMENT_START(eval_start);
+  // The variables, then each expression's segment, so we can time
+  // expressions separately if we want to
+  _tape_evaluate_nodes(tape, x, p, values, 0, tape->expr_start[0]);
+  for (int iexpr=0; iexpr<tape->nexpr; iexpr++){
+    INSTRUMENT_START(expr_start);
+    _tape_evaluate_nodes(tape, x, p, values, tape->expr_start[iexpr], tape->expr_start[iexpr+1]);
+    INSTRUMENT_STOP_EXPR(INSTRUMENT_EVAL, iexpr, expr_start, tape->expr_start[iexpr+1] - tape->expr_start[iexpr]);
+  }
+  INSTRUMENT_STOP(INSTRUMENT_EVAL, eval_start, tape->expr_start[0]);
+  TRACE_END("tape_evaluate");
+  return 0;
+}
+
+void _tape_evaluate_nodes(struct Tape * tape, double * x, double * p, double * values, int start, int end){
+  for (int i=start; i<end; i++){
+    values[i] = _tape_node_value(tape, x, p, values, i);
+  }
+}
+
+double _tape_node_value(struct Tape * tape, double * x, double * p, double * values, int i){
+  struct TapeNode * nodes = tape->nodes;
+  switch(nodes[i].type){
+    case CONST_NODE:
+      return nodes[i].data.value;
+    case VAR_NODE:
+      return x[nodes[i].data.index];
+    case PARAM_NODE:
+      return p[nodes[i].data.index];
+    default:
+      return _tape_op_value(nodes[i].op, nodes[i].nargs, tape->args + nodes[i].data.index, values);
+  }
+}
+
+// Evaluate a tape with external calls (see _tape_schedule_calls)
+void _tape_evaluate_passes(struct Tape * tape, double * x, double * p, double * values){
+  external_new_point();
+  double * xbuf = malloc((tape->narg > 0 ? tape->narg : 1) * sizeof(double));
+  double * vbuf = malloc(tape->ncall * sizeof(double));
+  _tape_evaluate_nodes(tape, x, p, values, 0, tape->nvar);
+  for (int k=0; k<tape->npass; k++){
+    for (int c=tape->pass_start[2*k]; c<tape->pass_start[2*k+1]; c++){
+      uint32_t i = tape->order[c];
+      values[i] = _tape_node_value(tape, x, p, values, i);
+    }
+    _tape_evaluate_calls(tape, values, tape->pass_start[2*k+1], tape->pass_start[2*k+2], false, xbuf, vbuf);
+  }
+  free(xbuf);
+  free(vbuf);
+}
+
+/*
+ * Evaluate the calls order[start], ..., order[end-1], whose arguments have
+ * been evaluated, one batch per run of calls of the same function. xbuf and
+ * vbuf have room for the arguments and values of all the calls.
+ */
+void _tape_evaluate_calls(struct Tape * tape, double * values, int start, int end, bool hessian, double * xbuf, double * vbuf){
+  struct TapeNode * nodes = tape->nodes;
+  int c = start;
+  while (c < end){
+    int func = (int)values[tape->args[nodes[tape->order[c]].data.index]];
+    int nargs = nodes[tape->order[c]].nargs - 1;
+    int ncall = 0;
+    // Calls of a function with a variable number of arguments may have
+    // different numbers of arguments, so a batch also has the same nargs
+    while (c + ncall < end){
+      struct TapeNode node = nodes[tape->order[c + ncall]];
+      if ((int)values[tape->args[node.data.index]] != func || node.nargs - 1 != nargs){
+        break;
+      }
+      uint32_t * a = tape->args + node.data.index;
+      for (int k=0; k<nargs; k++){xbuf[ncall * nargs + k] = values[a[k+1]];}
+      ncall += 1;
+    }
+    external_evaluate_batch(func, nargs, ncall, xbuf, vbuf, hessian);
+    for (int k=0; k<ncall; k++){values[tape->order[c + k]] = vbuf[k];}
+    c += ncall;
+  }
+}
+
+int tape_expression_values(struct Tape * tape, double * values, double * expr_values){
+  for (int i=0; i<tape->nexpr; i++){
+    expr_values[i] = values[tape->roots[i]];
+  }
+  return 0;
+}
+
+int tape_reverse(struct Tape * tape, int iexpr, double * values, double * adjoints){
+  int start = tape->expr_start[iexpr];
+  int end = tape->expr_start[iexpr+1];
+  uint32_t * ext = tape->ext_nodes + tape->ext_indptr[iexpr];
+  int next = tape->ext_indptr[iexpr+1] - tape->ext_indptr[iexpr];
+  uint32_t * vars = tape->jac_vars + tape->jac_indptr[iexpr];
+  int nvar = tape->jac_indptr[iexpr+1] - tape->jac_indptr[iexpr];
+
+  // Zero the adjoints of every node this expression depends on
+  for (int i=start; i<end; i++){adjoints[i] = 0.0;}
+  for (int k=0; k<next; k++){adjoints[ext[k]] = 0.0;}
+  for (int k=0; k<nvar; k++){adjoints[vars[k]] = 0.0;}
+  adjoints[tape->roots[iexpr]] = 1.0;
+
+  // Nodes in this expression's segment come after all external nodes, so
+  // sweeping the segment, then the external nodes, in decreasing order
+  // visits every node after all the nodes that use it.
+  struct TapeNode * nodes = tape->nodes;
+  for (int i=end-1; i>=start; i--){
+    if (nodes[i].type == OP_NODE && adjoints[i] != 0.0){
+      _tape_op_reverse(
+        nodes[i].op,
+        nodes[i].nargs,
+        tape->args + nodes[i].data.index,
+        values,
+        values[i],
+        adjoints[i],
+        adjoints
+      );
+    }
+  }
+  for (int k=next-1; k>=0; k--){
+    uint32_t i = ext[k];
+    if (nodes[i].type == OP_NODE && adjoints[i] != 0.0){
+      _tape_op_reverse(
+        nodes[i].op,
+        nodes[i].nargs,
+        tape->args + nodes[i].data.index,
+        values,
+        values[i],
+        adjoints[i],
+        adjoints
+      );
+    }
+  }
+  return 0;
+}
+
+struct CSRMatrix tape_jacobian_structure(struct Tape * tape){
+  int * indptr = mem_alloc(MEM_SPARSE, (tape->nexpr + 1) * sizeof(int));
+  int * indices = mem_alloc(MEM_SPARSE, tape->jac_nnz * sizeof(int));
+  double * values = mem_alloc(MEM_SPARSE, tape->jac_nnz * sizeof(double));
+  for (int i=0; i<=tape->nexpr; i++){
+    indptr[i] = tape->jac_indptr[i];
+  }
+  for (int k=0; k<tape->jac_nnz; k++){
+    indices[k] = tape->jac_vars[k];
+    values[k] = 0.0;
+  }
+  struct CSRMatrix csr = {
+    .nnz = tape->jac_nnz,
+    .nrow = tape->nexpr,
+    .ncol = tape->nvar,
+    .indptr = indptr,
+    .indices = indices,
+    .values = values,
+  };
+  return csr;
+}
+
+int tape_jacobian(struct Tape * tape, double * values, double * adjoints, double * jac_values){
+  TRACE_BEGIN("tape_jacobian");
+  INSTRUMENT_START(jac_start);
+  for (int i=0; i<tape->nexpr; i++){
+    INSTRUMENT_START(expr_start);
+    tape_reverse(tape, i, values, adjoints);
+    INSTRUMENT_STOP_EXPR(
+      INSTRUMENT_JACOBIAN, i, expr_start,
+      tape->expr_start[i+1] - tape->expr_start[i] + tape->ext_indptr[i+1] - tape->ext_indptr[i]
+    );
+    for (int k=tape->jac_indptr[i]; k<tape->jac_indptr[i+1]; k++){
+      jac_values[k] = adjoints[tape->jac_vars[k]];
+    }
+  }
+  INSTRUMENT_STOP(INSTRUMENT_JACOBIAN, jac_start, 0);
+  TRACE_END("tape_jacobian");
+  return 0;
+}
+
+int tape_jacobian_vector_product(struct Tape * tape, double * values, double * v, double * dvalues, double * jv){
+  struct TapeNode * nodes = tape->nodes;
+  for (int j=0; j<tape->nvar; j++){dvalues[j] = v[j];}
+  for (int i=tape->nvar; i<tape->nnode; i++){
+    if (nodes[i].type == OP_NODE){
+      dvalues[i] = _tape_op_tangent(nodes[i].op, nodes[i].nargs, tape->args + nodes[i].data.index, values, dvalues, values[i]);
+    }else{
+      dvalues[i] = 0.0;
+    }
+  }
+  for (int i=0; i<tape->nexpr; i++){
+    jv[i] = dvalues[tape->roots[i]];
+  }
+  return 0;
+}
+
+int tape_jacobian_transpose_product(struct Tape * tape, double * values, double * w, double * adjoints, double * jtw){
+  struct TapeNode * nodes = tape->nodes;
+  for (int i=0; i<tape->nnode; i++){adjoints[i] = 0.0;}
+  // Expressions may share roots, so we accumulate
+  for (int i=0; i<tape->nexpr; i++){
+    adjoints[tape->roots[i]] += w[i];
+  }
+  for (int i=tape->nnode-1; i>=tape->nvar; i--){
+    if (nodes[i].type == OP_NODE && adjoints[i] != 0.0){
+      _tape_op_reverse(nodes[i].op, nodes[i].nargs, tape->args + nodes[i].data.index, values, values[i], adjoints[i], adjoints);
+    }
+  }
+  for (int j=0; j<tape->nvar; j++){jtw[j] = adjoints[j];}
+  return 0;
+}
+
+/*
+ * Directional derivative of an operator node, given the directional
+ * derivatives dv of its arguments.
+ */
+double _tape_op_tangent(int op, int nargs, uint32_t * a, double * v, double * dv, double value){
+  switch(op){
+    case SUM:
+    {
+      double sum = 0.0;
+      for (int k=0; k<nargs; k++){sum += dv[a[k]];}
+      return sum;
+    }
+    case PRODUCT:
+    {
+      // Product rule, accumulated one argument at a time
+      double prod = 1.0;
+      double dprod = 0.0;
+      for (int k=0; k<nargs; k++){
+        dprod = dprod * v[a[k]] + prod * dv[a[k]];
+        prod *= v[a[k]];
+      }
+      return dprod;
+    }
+    case SUBTRACTION:
+      return dv[a[0]] - dv[a[1]];
+    case DIVISION:
+      return (dv[a[0]] - value * dv[a[1]]) / v[a[1]];
+    case POWER:
+    {
+      double base = v[a[0]];
+      double exponent = v[a[1]];
+      double d = exponent * pow(base, exponent - 1.0) * dv[a[0]];
+      if (base != 0.0){
+        d += value * log(base) * dv[a[1]];
+      }
+      return d;
+    }
+    case NEG:
+      return -dv[a[0]];
+    case SQRT:
+      return dv[a[0]] / (2.0 * value);
+    case EXP:
+      return value * dv[a[0]];
+    case LOG:
+      return dv[a[0]] / v[a[0]];
+    case SIN:
+      return cos(v[a[0]]) * dv[a[0]];
+    case COS:
+      return -sin(v[a[0]]) * dv[a[0]];
+    case TAN:
+      return (1.0 + value * value) * dv[a[0]];
+    case SQUARE:
+      return 2.0 * v[a[0]] * dv[a[0]];
+    case POW_CONST_INT:
+    {
+      int n = (int)v[a[1]];
+      return n * _pow_int(v[a[0]], n - 1) * dv[a[0]];
+    }
+    case POW_CONST_REAL:
+      return v[a[1]] * pow(v[a[0]], v[a[1]] - 1.0) * dv[a[0]];
+    case EXP_CONST_BASE:
+      return value * log(v[a[0]]) * dv[a[1]];
+    default:
+      return _tape_generic_tangent(op, nargs, a, v, dv, value);
+  }
+}
+
+/*
+ * Propagate the adjoint w of an operator node, and its directional
+ * derivative dw, to its arguments. If f_i is the derivative of the operator
+ * with respect to argument i, this computes
+ *
+ *     adj[a[i]] += w * f_i
+ *     dadj[a[i]] += dw * f_i + w * (sum over j of d(f_i)/d(arg j) * dv[a[j]])
+ */
+void _tape_op_reverse2(int op, int nargs, uint32_t * a, double * v, double * dv, double value, double w, double dw, double * adj, double * dadj){
+  // First and second derivatives of unary operators
+  double f1;
+  double f2;
+  int iarg = 0;
+  switch(op){
+    case SUM:
+      for (int k=0; k<nargs; k++){
+        adj[a[k]] += w;
+        dadj[a[k]] += dw;
+      }
+      return;
+    case PRODUCT:
+    {
+      // The derivative with respect to argument k is the product of the
+      // other arguments. As in _tape_op_reverse, we multiply the product
+      // before and after k, along with their directional derivatives.
+      double after[nargs];
+      double dafter[nargs];
+      after[nargs-1] = 1.0;
+      dafter[nargs-1] = 0.0;
+      for (int k=nargs-1; k>0; k--){
+        after[k-1] = after[k] * v[a[k]];
+        dafter[k-1] = dafter[k] * v[a[k]] + after[k] * dv[a[k]];
+      }
+      double before = 1.0;
+      double dbefore = 0.0;
+      for (int k=0; k<nargs; k++){
+        double fk = before * after[k];
+        double dfk = dbefore * after[k] + before * dafter[k];
+        adj[a[k]] += w * fk;
+        dadj[a[k]] += dw * fk + w * dfk;
+        dbefore = dbefore * v[a[k]] + before * dv[a[k]];
+        before *= v[a[k]];
+      }
+      return;
+    }
+    case SUBTRACTION:
+      adj[a[0]] += w;
+      adj[a[1]] -= w;
+      dadj[a[0]] += dw;
+      dadj[a[1]] -= dw;
+      return;
+    case DIVISION:
+    {
+      // f = x / y
+      double x = v[a[0]];
+      double y = v[a[1]];
+      double fx = 1.0 / y;
+      double fy = -x / (y * y);
+      double fxy = -1.0 / (y * y);
+      double fyy = 2.0 * x / (y * y * y);
+      adj[a[0]] += w * fx;
+      adj[a[1]] += w * fy;
+      dadj[a[0]] += dw * fx + w * fxy * dv[a[1]];
+      dadj[a[1]] += dw * fy + w * (fxy * dv[a[0]] + fyy * dv[a[1]]);
+      return;
+    }
+    case POWER:
+    {
+      // f = x^y
+      double x = v[a[0]];
+      double y = v[a[1]];
+      double fx = y * pow(x, y - 1.0);
+      double fxx = y * (y - 1.0) * pow(x, y - 2.0);
+      adj[a[0]] += w * fx;
+      if (x == 0.0){
+        // As in _tape_op_reverse, we ignore the exponent
+        dadj[a[0]] += dw * fx + w * fxx * dv[a[0]];
+        return;
+      }
+      double logx = log(x);
+      double fy = value * logx;
+      double fxy = pow(x, y - 1.0) * (1.0 + y * logx);
+      double fyy = fy * logx;
+      adj[a[1]] += w * fy;
+      dadj[a[0]] += dw * fx + w * (fxx * dv[a[0]] + fxy * dv[a[1]]);
+      dadj[a[1]] += dw * fy + w * (fxy * dv[a[0]] + fyy * dv[a[1]]);
+      return;
+    }
+    case NEG:
+      f1 = -1.0;
+      f2 = 0.0;
+      break;
+    case SQRT:
+      f1 = 0.5 / value;
+      f2 = -0.25 / (value * v[a[0]]);
+      break;
+    case EXP:
+      f1 = value;
+      f2 = value;
+      break;
+    case LOG:
+      f1 = 1.0 / v[a[0]];
+      f2 = -f1 * f1;
+      break;
+    case SIN:
+      f1 = cos(v[a[0]]);
+      f2 = -value;
+      break;
+    case COS:
+      f1 = -sin(v[a[0]]);
+      f2 = -value;
+      break;
+    case TAN:
+      f1 = 1.0 + value * value;
+      f2 = 2.0 * value * f1;
+      break;
+    case SQUARE:
+      f1 = 2.0 * v[a[0]];
+      f2 = 2.0;
+      break;
+    case POW_CONST_INT:
+    {
+      int n = (int)v[a[1]];
+      f1 = n * _pow_int(v[a[0]], n - 1);
+      f2 = (double)n * (n - 1) * _pow_int(v[a[0]], n - 2);
+      break;
+    }
+    case POW_CONST_REAL:
+    {
+      double c = v[a[1]];
+      f1 = c * pow(v[a[0]], c - 1.0);
+      f2 = c * (c - 1.0) * pow(v[a[0]], c - 2.0);
+      break;
+    }
+    case EXP_CONST_BASE:
+    {
+      // The variable operand is the exponent
+      double logc = log(v[a[0]]);
+      iarg = 1;
+      f1 = value * logc;
+      f2 = f1 * logc;
+      break;
+    }
+    default:
+      _tape_generic_reverse2(op, nargs, a, v, dv, value, w, dw, adj, dadj);
+      return;
+  }
+  adj[a[iarg]] += w * f1;
+  dadj[a[iarg]] += dw * f1 + w * f2 * dv[a[iarg]];
+}
+
+/*
+ * Operators without their own case in the functions above, through their
+ * kernels in OPERATOR_DATA. Zero partials are skipped, so e.g. the branch
+ * of an if-then-else that wasn't taken gets no adjoint, even if it is NaN.
+ */
+double _tape_generic_value(int op, int nargs, uint32_t * a, double * v){
+  double x[nargs];
+  for (int k=0; k<nargs; k++){x[k] = v[a[k]];}
+  return OPERATOR_DATA[op].value(nargs, x);
+}
+
+void _tape_generic_reverse(int op, int nargs, uint32_t * a, double * v, double value, double w, double * adj){
+  double x[nargs];
+  double grad[nargs];
+  for (int k=0; k<nargs; k++){x[k] = v[a[k]];}
+  OPERATOR_DATA[op].deriv(nargs, x, value, grad);
+  for (int k=0; k<nargs; k++){
+    if (grad[k] != 0.0){adj[a[k]] += w * grad[k];}
+  }
+}
+
+double _tape_generic_tangent(int op, int nargs, uint32_t * a, double * v, double * dv, double value){
+  double x[nargs];
+  double grad[nargs];
+  for (int k=0; k<nargs; k++){x[k] = v[a[k]];}
+  OPERATOR_DATA[op].deriv(nargs, x, value, grad);
+  double d = 0.0;
+  for (int k=0; k<nargs; k++){
+    if (grad[k] != 0.0){d += grad[k] * dv[a[k]];}
+  }
+  return d;
+}
+
+void _tape_generic_reverse2(int op, int nargs, uint32_t * a, double * v, double * dv, double value, double w, double dw, double * adj, double * dadj){
+  const struct OperatorData * data = &OPERATOR_DATA[op];
+  double x[nargs];
+  double grad[nargs];
+  for (int k=0; k<nargs; k++){x[k] = v[a[k]];}
+  data->deriv(nargs, x, value, grad);
+  if (data->deriv2 == NULL){
+    // Piecewise linear, so only the first-order terms
+    for (int k=0; k<nargs; k++){
+      if (grad[k] != 0.0){
+        adj[a[k]] += w * grad[k];
+        dadj[a[k]] += dw * grad[k];
+      }
+    }
+    return;
+  }
+  double hes[nargs * (nargs + 1) / 2];
+  data->deriv2(nargs, x, value, hes);
+  for (int i=0; i<nargs; i++){
+    double dfi = 0.0;
+    for (int j=0; j<nargs; j++){
+      double h = hes[hessian_index(i, j)];
+      if (h != 0.0){dfi += h * dv[a[j]];}
+    }
+    if (grad[i] != 0.0){adj[a[i]] += w * grad[i];}
+    if (grad[i] != 0.0 || dfi != 0.0){dadj[a[i]] += dw * grad[i] + w * dfi;}
+  }
+}
+
+/*
+ * Given node values and the direction in dvalues[0], ..., dvalues[nvar-1],
+ * compute the directional derivatives of all nodes, then the adjoints (with
+ * respect to the Lagrangian) of all nodes and their directional derivatives.
+ */
+void _tape_second_order_sweep(struct Tape * tape, double * values, double * lambda, double * dvalues, double * adjoints, double * dadjoints){
+  struct TapeNode * nodes = tape->nodes;
+  if (tape->ncall > 0){
+    // Compute the Hessians of all calls in batches, rather than one at a
+    // time in the reverse sweep. After the first sweep at a point, these
+    // are all in the cache.
+    double * xbuf = malloc((tape->narg > 0 ? tape->narg : 1) * sizeof(double));
+    double * vbuf = malloc(tape->ncall * sizeof(double));
+    for (int k=0; k<tape->npass; k++){
+      _tape_evaluate_calls(tape, values, tape->pass_start[2*k+1], tape->pass_start[2*k+2], true, xbuf, vbuf);
+    }
+    free(xbuf);
+    free(vbuf);
+  }
+  for (int i=tape->nvar; i<tape->nnode; i++){
+    if (nodes[i].type == OP_NODE){
+      dvalues[i] = _tape_op_tangent(nodes[i].op, nodes[i].nargs, tape->args + nodes[i].data.index, values, dvalues, values[i]);
+    }else{
+      dvalues[i] = 0.0;
+    }
+  }
+  for (int i=0; i<tape->nnode; i++){
+    adjoints[i] = 0.0;
+    dadjoints[i] = 0.0;
+  }
+  // Expressions may share roots, so we accumulate
+  for (int i=0; i<tape->nexpr; i++){
+    adjoints[tape->roots[i]] += lambda[i];
+  }
+  for (int i=tape->nnode-1; i>=tape->nvar; i--){
+    if (nodes[i].type == OP_NODE && (adjoints[i] != 0.0 || dadjoints[i] != 0.0)){
+      _tape_op_reverse2(
+        nodes[i].op,
+        nodes[i].nargs,
+        tape->args + nodes[i].data.index,
+        values,
+        dvalues,
+        values[i],
+        adjoints[i],
+        dadjoints[i],
+        adjoints,
+        dadjoints
+      );
+    }
+  }
+}
+
+int tape_hessian_vector_product(
+  struct Tape * tape,
+  double * values,
+  double * lambda,
+  double * direction,
+  double * dvalues,
+  double * adjoints,
+  double * dadjoints,
+  double * hv
+){
+  for (int j=0; j<tape->nvar; j++){dvalues[j] = direction[j];}
+  _tape_second_order_sweep(tape, values, lambda, dvalues, adjoints, dadjoints);
+  for (int j=0; j<tape->nvar; j++){hv[j] = dadjoints[j];}
+  return 0;
+}
+
+struct CSRMatrix tape_hessian_structure(struct Tape * tape){
+  int nvar = tape->nvar;
+  // Transpose the Jacobian structure, so we can find the expressions that
+  // contain each variable
+  int * var_indptr = malloc((nvar + 1) * sizeof(int));
+  int * var_exprs = malloc((tape->jac_nnz > 0 ? tape->jac_nnz : 1) * sizeof(int));
+  int * next = malloc((nvar > 0 ? nvar : 1) * sizeof(int));
+  for (int j=0; j<=nvar; j++){var_indptr[j] = 0;}
+  for (int k=0; k<tape->jac_nnz; k++){var_indptr[tape->jac_vars[k] + 1] += 1;}
+  for (int j=0; j<nvar; j++){var_indptr[j+1] += var_indptr[j];}
+  for (int j=0; j<nvar; j++){next[j] = var_indptr[j];}
+  for (int i=0; i<tape->nexpr; i++){
+    for (int k=tape->jac_indptr[i]; k<tape->jac_indptr[i+1]; k++){
+      int j = tape->jac_vars[k];
+      var_exprs[next[j]] = i;
+      next[j] += 1;
+    }
+  }
+
+  // Row l contains every variable j <= l that appears in an expression with
+  // l. We use `next` to mark the variables already in the current row.
+  for (int j=0; j<nvar; j++){next[j] = -1;}
+  int capacity = 16;
+  int nnz = 0;
+  int * indptr = mem_alloc(MEM_SPARSE, (nvar + 1) * sizeof(int));
+  int * indices = mem_alloc(MEM_SPARSE, capacity * sizeof(int));
+  indptr[0] = 0;
+  for (int l=0; l<nvar; l++){
+    for (int kl=var_indptr[l]; kl<var_indptr[l+1]; kl++){
+      int i = var_exprs[kl];
+      for (int k=tape->jac_indptr[i]; k<tape->jac_indptr[i+1]; k++){
+        int j = tape->jac_vars[k];
+        if (j <= l && next[j] != l){
+          next[j] = l;
+          if (nnz == capacity){
+            capacity *= 2;
+            indices = mem_realloc(MEM_SPARSE, indices, capacity * sizeof(int));
+          }
+          indices[nnz] = j;
+          nnz += 1;
+        }
+      }
+    }
+    qsort(indices + indptr[l], nnz - indptr[l], sizeof(int), _compare_int);
+    indptr[l+1] = nnz;
+  }
+  free(var_indptr);
+  free(var_exprs);
+  free(next);
+
+  double * values = mem_alloc(MEM_SPARSE, (nnz > 0 ? nnz : 1) * sizeof(double));
+  for (int k=0; k<nnz; k++){values[k] = 0.0;}
+  struct CSRMatrix csr = {
+    .nnz = nnz,
+    .nrow = nvar,
+    .ncol = nvar,
+    .indptr = indptr,
+    .indices = indices,
+    .values = values,
+  };
+  return csr;
+}
+
+int tape_hessian(
+  struct Tape * tape,
+  double * values,
+  double * lambda,
+  struct CSRMatrix hess,
+  double * dvalues,
+  double * adjoints,
+  double * dadjoints,
+  double * hess_values
+){
+  TRACE_BEGIN("tape_hessian");
+  INSTRUMENT_START(hess_start);
+  long nsweep = 0;
+  for (int j=0; j<tape->nvar; j++){dvalues[j] = 0.0;}
+  for (int l=0; l<tape->nvar; l++){
+    if (hess.indptr[l] == hess.indptr[l+1]){
+      continue;
+    }
+    // H e_l is column l of the Hessian, which (by symmetry) is row l
+    dvalues[l] = 1.0;
+    _tape_second_order_sweep(tape, values, lambda, dvalues, adjoints, dadjoints);
+    nsweep += 1;
+    dvalues[l] = 0.0;
+    for (int k=hess.indptr[l]; k<hess.indptr[l+1]; k++){
+      hess_values[k] = dadjoints[hess.indices[k]];
+    }
+  }
+  INSTRUMENT_STOP(INSTRUMENT_HESSIAN, hess_start, nsweep * tape->nnode);
+  TRACE_END("tape_hessian");
+  return 0;
+}
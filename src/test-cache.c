@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#include "expr.h"
+#include "nl.h"
+#include "sparse.h"
+#include "op_derivs.h"
+#include "tape.h"
+#include "hessian.h"
+#include "evaluator.h"
+#include "cache.h"
+
+/*
+ * Copy a cache file, overwrite len bytes at offset (or truncate the copy
+ * to offset bytes, if data is NULL), and check that the copy is rejected.
+ */
+void check_corrupt(char * fname, uint64_t hash, long offset, void * data, int len){
+  FILE * fp = fopen(fname, "rb");
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  char * contents = malloc(size);
+  assert(fread(contents, 1, size, fp) == (size_t)size);
+  fclose(fp);
+  if (data != NULL){
+    memcpy(contents + offset, data, len);
+  }else{
+    size = offset;
+  }
+  char * corrupt_fname = "test-cache-corrupt.nlc";
+  fp = fopen(corrupt_fname, "wb");
+  assert(fwrite(contents, 1, size, fp) == (size_t)size);
+  fclose(fp);
+  struct CachedModel cached;
+  assert(read_model_cache(corrupt_fname, hash, &cached) == -1);
+  unlink(corrupt_fname);
+  free(contents);
+}
+
+int main(int narg, char ** argv){
+  if (narg < 2){
+    printf("No file provided. Please provide an nl file.\n");
+    return -1;
+  }
+
+  FILE * fp = fopen(argv[1], "r");
+  uint64_t hash = hash_nl_file(fp);
+  fclose(fp);
+  char cache_fname[256];
+  model_cache_path(cache_fname, 256, ".", hash);
+  printf("Cache file for %s: %s\n", argv[1], cache_fname);
+
+  // Parse and compile the model the usual way
+  fp = fopen(argv[1], "r");
+  struct NLHeader header = read_nl_header(fp);
+  fclose(fp);
+  int nvar = header.nvar;
+  int ncon = header.ncon;
+  struct Variable * variables = malloc(nvar * sizeof(struct Variable));
+  for (int i=0; i<nvar; i++){variables[i].index = i;}
+  fp = fopen(argv[1], "r");
+  read_nl_variables(fp, variables, nvar);
+  fclose(fp);
+  struct Node * constraints = malloc(ncon * sizeof(struct Node));
+  fp = fopen(argv[1], "r");
+  read_nl_constraints(fp, constraints, ncon, variables, nvar);
+  fclose(fp);
+  // Make the exponent in v2^3 a parameter, so we test caching parameters
+  struct Parameter parameter = {0, 3.0};
+  assert(bind_parameter(constraints, ncon, 3.0, &parameter) == 1);
+  struct CompiledModel model = compile_model(constraints, ncon, nvar);
+
+  // A stale cache should not be accepted
+  struct CachedModel cached;
+  unlink(cache_fname);
+  assert(read_model_cache(cache_fname, hash, &cached) == -1);
+
+  assert(write_model_cache(cache_fname, hash, variables, nvar, &parameter, 1, &model) == 0);
+  assert(read_model_cache(cache_fname, hash + 1, &cached) == -1);
+  assert(read_model_cache(cache_fname, hash, &cached) == 0);
+
+  assert(cached.nvar == nvar && cached.ncon == ncon);
+  assert(cached.nparam == 1 && cached.parameters[0].value == 3.0);
+  for (int i=0; i<nvar; i++){
+    assert(cached.variables[i].value == variables[i].value);
+  }
+  struct Tape * tape = &model.tape;
+  struct Tape * ctape = &cached.model.tape;
+  assert(ctape->nnode == tape->nnode && ctape->narg == tape->narg && ctape->next == tape->next);
+  assert(memcmp(ctape->nodes, tape->nodes, tape->nnode * sizeof(struct TapeNode)) == 0);
+  assert(memcmp(ctape->args, tape->args, tape->narg * sizeof(uint32_t)) == 0);
+  assert(memcmp(ctape->roots, tape->roots, ncon * sizeof(uint32_t)) == 0);
+  struct CSRMatrix jac = cached.model.jacobian;
+  struct CSRMatrix hess = cached.model.hessian;
+  assert(jac.nnz == model.jacobian.nnz && hess.nnz == model.hessian.nnz);
+  for (int i=0; i<=ncon; i++){assert(jac.indptr[i] == model.jacobian.indptr[i]);}
+  for (int k=0; k<jac.nnz; k++){assert(jac.indices[k] == model.jacobian.indices[k]);}
+  for (int l=0; l<=nvar; l++){assert(hess.indptr[l] == model.hessian.indptr[l]);}
+  for (int k=0; k<hess.nnz; k++){assert(hess.indices[k] == model.hessian.indices[k]);}
+  assert(cached.model.coloring.ncolor == model.coloring.ncolor);
+  printf(
+    "Cached tape has %d nodes, Jacobian nnz = %d, Hessian nnz = %d, %d colors\n",
+    ctape->nnode, jac.nnz, hess.nnz, cached.model.coloring.ncolor
+  );
+
+  // The cached model is evaluated in place, and gives the same results
+  double * x = malloc(nvar * sizeof(double));
+  double p[1];
+  gather_variable_values(cached.variables, nvar, x);
+  gather_parameter_values(cached.parameters, 1, p);
+  double * lambda = malloc(ncon * sizeof(double));
+  for (int i=0; i<ncon; i++){lambda[i] = 1.0 + i;}
+  struct EvalContext ctx = new_eval_context(&model);
+  struct EvalContext cctx = new_eval_context(&cached.model);
+  double * g = malloc(2 * ncon * sizeof(double));
+  double * jac_values = malloc(2 * jac.nnz * sizeof(double));
+  double * hess_values = malloc(2 * (hess.nnz + 1) * sizeof(double));
+  context_eval_g(&ctx, x, p, g);
+  context_eval_g(&cctx, x, p, g + ncon);
+  context_eval_jac(&ctx, x, p, jac_values);
+  context_eval_jac(&cctx, x, p, jac_values + jac.nnz);
+  context_eval_hess(&ctx, x, p, lambda, hess_values);
+  context_eval_hess(&cctx, x, p, lambda, hess_values + hess.nnz);
+  for (int i=0; i<ncon; i++){
+    printf("Constraint %2d: cached value = %f\n", i, g[ncon + i]);
+    assert(g[i] == g[ncon + i]);
+  }
+  for (int k=0; k<jac.nnz; k++){assert(jac_values[k] == jac_values[jac.nnz + k]);}
+  for (int k=0; k<hess.nnz; k++){assert(hess_values[k] == hess_values[hess.nnz + k]);}
+  printf("Cached model matches compiled model\n");
+  free_eval_context(ctx);
+  free_eval_context(cctx);
+
+  // Corrupted files are rejected, wherever the bad index is
+  struct CacheHeader * cheader = (struct CacheHeader *)cached.data;
+  long size = cached.size;
+  uint32_t bad = tape->nnode;
+  int last = tape->nnode - 1;
+  assert(tape->nodes[last].type == OP_NODE);
+  check_corrupt(cache_fname, hash, size - 8, NULL, 0);
+  check_corrupt(cache_fname, hash, cheader->offsets[CACHE_TAPE_ARGS] + 4 * tape->nodes[last].data.index, &bad, 4);
+  check_corrupt(cache_fname, hash, cheader->offsets[CACHE_ROOTS], &bad, 4);
+  uint16_t bad_op = N_OPERATORS;
+  check_corrupt(cache_fname, hash, cheader->offsets[CACHE_TAPE_NODES] + 16 * last + 2, &bad_op, 2);
+  int32_t bad_var = nvar;
+  check_corrupt(cache_fname, hash, cheader->offsets[CACHE_JAC_VARS], &bad_var, 4);
+  check_corrupt(cache_fname, hash, cheader->offsets[CACHE_HESS_INDICES], &bad_var, 4);
+  int32_t bad_entry = hess.nnz;
+  check_corrupt(cache_fname, hash, cheader->offsets[CACHE_COLOR_ENTRIES], &bad_entry, 4);
+  int64_t bad_offset = size;
+  check_corrupt(cache_fname, hash, (char *)&cheader->offsets[CACHE_COLOR_ROWS] - cached.data, &bad_offset, 8);
+  printf("Corrupted cache files are rejected\n");
+
+  free_cached_model(cached);
+  free_compiled_model(model);
+  free(x);
+  free(lambda);
+  free(g);
+  free(jac_values);
+  free(hess_values);
+  for (int i=0; i<ncon; i++){free_expression(constraints[i]);}
+  free(constraints);
+  free(variables);
+  unlink(cache_fname);
+  return 0;
+}
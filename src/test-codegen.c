@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#include "expr.h"
+#include "nl.h"
+#include "sparse.h"
+#include "op_derivs.h"
+#include "tape.h"
+#include "cse.h"
+#include "hessian.h"
+#include "evaluator.h"
+#include "codegen.h"
+
+bool isclose(double a, double b, double rtol){
+  return fabs(a - b) <= rtol * fmax(1.0, fmax(fabs(a), fabs(b)));
+}
+
+// Entry (row, col) of a symmetric matrix stored as a lower triangle
+double symmetric_entry(struct CSRMatrix lower, double * values, int row, int col){
+  if (row < col){
+    int tmp = row;
+    row = col;
+    col = tmp;
+  }
+  for (int k=lower.indptr[row]; k<lower.indptr[row+1]; k++){
+    if (lower.indices[k] == col){
+      return values[k];
+    }
+  }
+  return 0.0;
+}
+
+// Helpers for constructing expressions by hand
+struct Node constant(double value){
+  struct Node node = {.type = CONST_NODE, .data = {.value = value}};
+  return node;
+}
+
+struct Node variable(struct Variable * var){
+  struct Node node = {.type = VAR_NODE, .data = {.var = var}};
+  return node;
+}
+
+struct Node operator(enum OperatorType op, int nargs, struct Node * args){
+  struct OperatorNode * expr = new_operator_node(op, nargs);
+  for (int i=0; i<nargs; i++){expr->args[i] = args[i];}
+  specialize_power_node(expr);
+  struct Node node = {.type = OP_NODE, .data = {.expr = expr}};
+  return node;
+}
+
+/*
+ * Check that the compiled evaluator matches the tape evaluator, and that the
+ * Hessian matches central differences of the gradient of the Lagrangian,
+ * J^T lambda.
+ */
+void check_evaluators(struct Node * constraints, int ncon, int nvar){
+  struct Evaluator tape_ev = tape_evaluator(constraints, ncon, nvar);
+  struct Evaluator native_ev;
+  // The compiler is run without a shell, so the name needs no quoting
+  int ret = compiled_evaluator(&native_ev, constraints, ncon, nvar, "test-codegen 'model'");
+  assert(ret == 0);
+  printf("Compiled model: Jacobian nnz = %d, Hessian nnz = %d\n", native_ev.jacobian.nnz, native_ev.hessian.nnz);
+  assert(native_ev.jacobian.nnz == tape_ev.jacobian.nnz);
+  // The compiled Hessian has the same structure as the tape evaluator's
+  assert(native_ev.hessian.nnz == tape_ev.hessian.nnz);
+  for (int l=0; l<=nvar; l++){assert(native_ev.hessian.indptr[l] == tape_ev.hessian.indptr[l]);}
+  for (int k=0; k<tape_ev.hessian.nnz; k++){assert(native_ev.hessian.indices[k] == tape_ev.hessian.indices[k]);}
+
+  double * x = malloc(nvar * sizeof(double));
+  double * lambda = malloc(ncon * sizeof(double));
+  for (int j=0; j<nvar; j++){x[j] = 1.0 + (j+1) / 10.0;}
+  for (int i=0; i<ncon; i++){lambda[i] = (i % 2 == 0 ? 1.0 : -1.0) * (i + 1) / 2.0;}
+  double * g_tape = malloc(ncon * sizeof(double));
+  double * g_native = malloc(ncon * sizeof(double));
+  double * jac_tape = malloc(tape_ev.jacobian.nnz * sizeof(double));
+  double * jac_native = malloc(native_ev.jacobian.nnz * sizeof(double));
+  double * hess_tape = malloc(tape_ev.hessian.nnz * sizeof(double));
+  double * hess_native = malloc(native_ev.hessian.nnz * sizeof(double));
+
+  tape_ev.eval_g(tape_ev.data, x, NULL, g_tape);
+  native_ev.eval_g(native_ev.data, x, NULL, g_native);
+  for (int i=0; i<ncon; i++){assert(isclose(g_tape[i], g_native[i], 1e-12));}
+  tape_ev.eval_jac(tape_ev.data, x, NULL, jac_tape);
+  native_ev.eval_jac(native_ev.data, x, NULL, jac_native);
+  for (int k=0; k<tape_ev.jacobian.nnz; k++){assert(isclose(jac_tape[k], jac_native[k], 1e-12));}
+  tape_ev.eval_hess(tape_ev.data, x, NULL, lambda, hess_tape);
+  native_ev.eval_hess(native_ev.data, x, NULL, lambda, hess_native);
+  for (int l=0; l<nvar; l++){
+    for (int j=0; j<=l; j++){
+      double tape_value = symmetric_entry(tape_ev.hessian, hess_tape, l, j);
+      double native_value = symmetric_entry(native_ev.hessian, hess_native, l, j);
+      assert(isclose(tape_value, native_value, 1e-12));
+    }
+  }
+  printf("Compiled model matches the tape\n");
+
+  double h = 1e-6;
+  double * grad_plus = malloc(nvar * sizeof(double));
+  double * grad_minus = malloc(nvar * sizeof(double));
+  for (int j=0; j<nvar; j++){
+    double * grads[2] = {grad_plus, grad_minus};
+    double steps[2] = {h, -h};
+    for (int s=0; s<2; s++){
+      double xj = x[j];
+      x[j] = xj + steps[s];
+      tape_ev.eval_jac(tape_ev.data, x, NULL, jac_tape);
+      x[j] = xj;
+      for (int l=0; l<nvar; l++){grads[s][l] = 0.0;}
+      for (int i=0; i<ncon; i++){
+        for (int k=tape_ev.jacobian.indptr[i]; k<tape_ev.jacobian.indptr[i+1]; k++){
+          grads[s][tape_ev.jacobian.indices[k]] += lambda[i] * jac_tape[k];
+        }
+      }
+    }
+    for (int l=0; l<nvar; l++){
+      double fd = (grad_plus[l] - grad_minus[l]) / (2.0 * h);
+      double exact = symmetric_entry(tape_ev.hessian, hess_tape, l, j);
+      assert(isclose(exact, fd, 1e-5));
+    }
+  }
+  printf("Hessian matches finite differences\n");
+
+  free(x);
+  free(lambda);
+  free(g_tape);
+  free(g_native);
+  free(jac_tape);
+  free(jac_native);
+  free(hess_tape);
+  free(hess_native);
+  free(grad_plus);
+  free(grad_minus);
+  free_evaluator(tape_ev);
+  free_evaluator(native_ev);
+  remove("test-codegen 'model'.c");
+  remove("test-codegen 'model'.so");
+}
+
+// Non-finite constants are written as C expressions, so the source compiles
+void check_nonfinite_constants(struct Variable * variables, int nvar){
+  struct Node e0[2] = {variable(&variables[0]), constant(INFINITY)};
+  struct Node e1[2] = {variable(&variables[1]), constant(-INFINITY)};
+  struct Node e2[2] = {variable(&variables[2]), constant(NAN)};
+  struct Node exprs[3] = {operator(SUM, 2, e0), operator(SUM, 2, e1), operator(PRODUCT, 2, e2)};
+  struct Evaluator ev;
+  assert(compiled_evaluator(&ev, exprs, 3, nvar, "test-codegen-nonfinite") == 0);
+  double * x = calloc(nvar, sizeof(double));
+  double g[3];
+  // Non-finite outputs are reported, and written anyway
+  assert(ev.eval_g(ev.data, x, NULL, g) == -1);
+  assert(g[0] == INFINITY && g[1] == -INFINITY && isnan(g[2]));
+  printf("Compiled model handles non-finite constants\n");
+  free(x);
+  free_evaluator(ev);
+  for (int i=0; i<3; i++){free_expression(exprs[i]);}
+  remove("test-codegen-nonfinite.c");
+  remove("test-codegen-nonfinite.so");
+}
+
+int main(int narg, char ** argv){
+  if (narg < 2){
+    printf("No file provided. Please provide an nl file.\n");
+    return -1;
+  }
+
+  FILE * fp = fopen(argv[1], "r");
+  struct NLHeader header = read_nl_header(fp);
+  fclose(fp);
+  int nvar = header.nvar;
+  int ncon = header.ncon;
+  struct Variable * variables = malloc(nvar * sizeof(struct Variable));
+  for (int i=0; i<nvar; i++){variables[i].index = i;}
+  // As in test-tape, read the constraints twice and share the copies, so
+  // the second half of the constraints only uses shared nodes.
+  struct Node * constraints = malloc(2 * ncon * sizeof(struct Node));
+  fp = fopen(argv[1], "r");
+  read_nl_constraints(fp, constraints, ncon, variables, nvar);
+  fclose(fp);
+  fp = fopen(argv[1], "r");
+  read_nl_constraints(fp, constraints + ncon, ncon, variables, nvar);
+  fclose(fp);
+  share_common_subexpressions(constraints, 2 * ncon);
+  check_evaluators(constraints, 2 * ncon, nvar);
+  for (int i=0; i<2*ncon; i++){free_expression(constraints[i]);}
+  free(constraints);
+
+  // Operators that don't appear in the .nl file: v0^v1, v2^0.5, 2^v3,
+  // v0*v1*v2 and v1^-3 / (v2 + v3 + v0)
+  struct Node e0[2] = {variable(&variables[0]), variable(&variables[1])};
+  struct Node e1[2] = {variable(&variables[2]), constant(0.5)};
+  struct Node e2[2] = {constant(2.0), variable(&variables[3])};
+  struct Node e3[3] = {variable(&variables[0]), variable(&variables[1]), variable(&variables[2])};
+  struct Node e4_num[2] = {variable(&variables[1]), constant(-3.0)};
+  struct Node e4_den[3] = {variable(&variables[2]), variable(&variables[3]), variable(&variables[0])};
+  struct Node e4[2] = {operator(POWER, 2, e4_num), operator(SUM, 3, e4_den)};
+  struct Node handmade[5] = {
+    operator(POWER, 2, e0),
+    operator(POWER, 2, e1),
+    operator(POWER, 2, e2),
+    operator(PRODUCT, 3, e3),
+    operator(DIVISION, 2, e4),
+  };
+  assert(handmade[1].data.expr->op == POW_CONST_REAL);
+  assert(handmade[2].data.expr->op == EXP_CONST_BASE);
+  assert(e4[0].data.expr->op == POW_CONST_INT);
+  check_evaluators(handmade, 5, nvar);
+  for (int i=0; i<5; i++){free_expression(handmade[i]);}
+  check_nonfinite_constants(variables, nvar);
+
+  free(variables);
+  return 0;
+}
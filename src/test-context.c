@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <omp.h>
+
+#include "expr.h"
+#include "nl.h"
+#include "sparse.h"
+#include "op_derivs.h"
+#include "tape.h"
+#include "cse.h"
+#include "hessian.h"
+#include "evaluator.h"
+
+#define NPOINT 64
+
+/*
+ * Evaluate one compiled model at many points from several threads, each with
+ * its own context, and check that every thread gets exactly what a single
+ * context gets evaluating the points one after another.
+ */
+
+// A point in the domain of the model, different for each k
+void fill_point(int k, int nvar, double * x, double * lambda, int ncon){
+  for (int j=0; j<nvar; j++){x[j] = 1.0 + 0.01 * ((j * 7 + k * 13) % 50);}
+  for (int i=0; i<ncon; i++){lambda[i] = 1.0 + 0.1 * ((i + k) % 5);}
+}
+
+int main(int narg, char ** argv){
+  if (narg < 2){
+    printf("No file provided. Please provide an nl file.\n");
+    return -1;
+  }
+
+  FILE * fp = fopen(argv[1], "r");
+  struct NLHeader header = read_nl_header(fp);
+  fclose(fp);
+  int nvar = header.nvar;
+  int ncon = header.ncon;
+  struct Variable * variables = malloc(nvar * sizeof(struct Variable));
+  for (int i=0; i<nvar; i++){variables[i].index = i;}
+  struct Node * constraints = malloc(ncon * sizeof(struct Node));
+  fp = fopen(argv[1], "r");
+  read_nl_constraints(fp, constraints, ncon, variables, nvar);
+  fclose(fp);
+
+  struct CompiledModel model = compile_model(constraints, ncon, nvar);
+  // The model doesn't refer to the expressions once it's compiled
+  for (int i=0; i<ncon; i++){free_expression(constraints[i]);}
+  free(constraints);
+  free(variables);
+
+  int jnnz = model.jacobian.nnz;
+  int hnnz = model.hessian.nnz;
+  double * g = malloc(NPOINT * ncon * sizeof(double));
+  double * jac = malloc(NPOINT * jnnz * sizeof(double));
+  double * hess = malloc(NPOINT * hnnz * sizeof(double));
+  double * g_serial = malloc(NPOINT * ncon * sizeof(double));
+  double * jac_serial = malloc(NPOINT * jnnz * sizeof(double));
+  double * hess_serial = malloc(NPOINT * hnnz * sizeof(double));
+
+  struct EvalContext serial = new_eval_context(&model);
+  double * x = malloc(nvar * sizeof(double));
+  double * lambda = malloc(ncon * sizeof(double));
+  for (int k=0; k<NPOINT; k++){
+    fill_point(k, nvar, x, lambda, ncon);
+    context_eval_g(&serial, x, NULL, g_serial + k * ncon);
+    context_eval_jac(&serial, x, NULL, jac_serial + k * jnnz);
+    context_eval_hess(&serial, x, NULL, lambda, hess_serial + k * hnnz);
+  }
+  free_eval_context(serial);
+  free(x);
+  free(lambda);
+
+  // Each thread interleaves its points, so contexts are in different states
+  // at the same time
+  int nthread = 0;
+  #pragma omp parallel num_threads(4)
+  {
+    #pragma omp single
+    nthread = omp_get_num_threads();
+    struct EvalContext ctx = new_eval_context(&model);
+    double * x = malloc(nvar * sizeof(double));
+    double * lambda = malloc(ncon * sizeof(double));
+    #pragma omp for schedule(dynamic, 1)
+    for (int k=0; k<NPOINT; k++){
+      fill_point(k, nvar, x, lambda, ncon);
+      context_eval_hess(&ctx, x, NULL, lambda, hess + k * hnnz);
+      context_eval_g(&ctx, x, NULL, g + k * ncon);
+      context_eval_jac(&ctx, x, NULL, jac + k * jnnz);
+    }
+    free(x);
+    free(lambda);
+    free_eval_context(ctx);
+  }
+  printf("Evaluated %d points on %d threads\n", NPOINT, nthread);
+
+  assert(memcmp(g, g_serial, NPOINT * ncon * sizeof(double)) == 0);
+  assert(memcmp(jac, jac_serial, NPOINT * jnnz * sizeof(double)) == 0);
+  assert(memcmp(hess, hess_serial, NPOINT * hnnz * sizeof(double)) == 0);
+  // Different points give different values
+  bool differ = false;
+  for (int i=0; i<ncon; i++){differ = differ || g[i] != g[ncon + i];}
+  assert(differ || ncon == 0);
+
+  free(g);
+  free(jac);
+  free(hess);
+  free(g_serial);
+  free(jac_serial);
+  free(hess_serial);
+  free_compiled_model(model);
+  printf("OK\n");
+  return 0;
+}
@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#include "expr.h"
+#include "nl.h"
+#include "sparse.h"
+#include "op_derivs.h"
+#include "reverse_diff.h"
+#include "tape.h"
+#include "hessian.h"
+#include "evaluator.h"
+
+/*
+ * Evaluating outside the domain of an operator, and reading operators we
+ * don't support, should give NaN and an error status rather than exiting.
+ */
+
+struct Node constant(double value){
+  struct Node node = {.type = CONST_NODE, .data = {.value = value}};
+  return node;
+}
+
+struct Node variable(struct Variable * var){
+  struct Node node = {.type = VAR_NODE, .data = {.var = var}};
+  return node;
+}
+
+struct Node operator(enum OperatorType op, int nargs, struct Node * args){
+  struct OperatorNode * expr = new_operator_node(op, nargs);
+  for (int i=0; i<nargs; i++){expr->args[i] = args[i];}
+  struct Node node = {.type = OP_NODE, .data = {.expr = expr}};
+  return node;
+}
+
+void test_diff_op(struct Variable * variables){
+  struct Node args[2] = {variable(&variables[0]), variable(&variables[1])};
+  double deriv[2];
+  variables[0].value = 1.0;
+  variables[1].value = 0.0;
+  assert(diff_operator(DIVISION, args, 2, deriv) == -1);
+  assert(isnan(deriv[0]) && isnan(deriv[1]));
+  variables[1].value = 2.0;
+  assert(diff_operator(DIVISION, args, 2, deriv) == 0);
+  assert(deriv[0] == 0.5 && deriv[1] == -0.25);
+
+  variables[0].value = -1.0;
+  assert(diff_operator(SQRT, args, 1, deriv) == -1 && isnan(deriv[0]));
+  assert(diff_operator(LOG, args, 1, deriv) == -1 && isnan(deriv[0]));
+  variables[0].value = 0.0;
+  assert(diff_operator(LOG, args, 1, deriv) == -1 && isnan(deriv[0]));
+  variables[0].value = 4.0;
+  assert(diff_operator(SQRT, args, 1, deriv) == 0 && deriv[0] == 0.25);
+  assert(diff_operator(LOG, args, 1, deriv) == 0 && deriv[0] == 0.25);
+
+  // A negative base only has a power for integer exponents
+  variables[0].value = -2.0;
+  variables[1].value = 0.5;
+  assert(diff_operator(POWER, args, 2, deriv) == -1);
+  assert(isnan(deriv[0]) && isnan(deriv[1]));
+  variables[1].value = 3.0;
+  assert(diff_operator(POWER, args, 2, deriv) == 0);
+  assert(deriv[0] == 12.0 && deriv[1] == 0.0);
+}
+
+void test_reverse_diff(struct Variable * variables){
+  // log(v0) + v1
+  struct Node log_args[1] = {variable(&variables[0])};
+  struct Node sum_args[2] = {operator(LOG, 1, log_args), variable(&variables[1])};
+  struct Node expr = operator(SUM, 2, sum_args);
+  variables[0].value = -1.0;
+  variables[1].value = 1.0;
+  assert(isnan(evaluate(expr)));
+  struct CSRMatrix deriv = reverse_diff_expression(expr, 2);
+  assert(deriv.nnz == 2);
+  // Only the path through the log is undefined
+  for (int k=0; k<deriv.nnz; k++){
+    if (deriv.indices[k] == 0){
+      assert(isnan(deriv.values[k]));
+    }else{
+      assert(deriv.values[k] == 1.0);
+    }
+  }
+  free_csrmatrix(deriv);
+  free_expression(expr);
+}
+
+void test_evaluator(struct Variable * variables){
+  // g0 = sqrt(v0) + v1, g1 = v1 / v2, g2 = v1 * v2
+  struct Node sqrt_args[1] = {variable(&variables[0])};
+  struct Node sum_args[2] = {operator(SQRT, 1, sqrt_args), variable(&variables[1])};
+  struct Node div_args[2] = {variable(&variables[1]), variable(&variables[2])};
+  struct Node prod_args[2] = {variable(&variables[1]), variable(&variables[2])};
+  struct Node exprs[3] = {
+    operator(SUM, 2, sum_args),
+    operator(DIVISION, 2, div_args),
+    operator(PRODUCT, 2, prod_args),
+  };
+  struct Evaluator ev = tape_evaluator(exprs, 3, 3);
+  double g[3];
+  double lambda[3] = {1.0, 1.0, 1.0};
+  double * jac = malloc(ev.jacobian.nnz * sizeof(double));
+  double * hess = malloc(ev.hessian.nnz * sizeof(double));
+
+  double x[3] = {4.0, 1.0, 2.0};
+  assert(ev.eval_g(ev.data, x, NULL, g) == 0);
+  assert(g[0] == 3.0 && g[1] == 0.5 && g[2] == 2.0);
+  assert(ev.eval_jac(ev.data, x, NULL, jac) == 0);
+  assert(ev.eval_hess(ev.data, x, NULL, lambda, hess) == 0);
+
+  // A trial point outside the domain, e.g. from a line search
+  double bad_sqrt[3] = {-1.0, 1.0, 2.0};
+  assert(ev.eval_g(ev.data, bad_sqrt, NULL, g) == -1);
+  assert(isnan(g[0]) && g[1] == 0.5 && g[2] == 2.0);
+  assert(ev.eval_jac(ev.data, bad_sqrt, NULL, jac) == -1);
+  assert(ev.eval_hess(ev.data, bad_sqrt, NULL, lambda, hess) == -1);
+  double bad_div[3] = {4.0, 1.0, 0.0};
+  assert(ev.eval_g(ev.data, bad_div, NULL, g) == -1);
+  assert(isinf(g[1]));
+  assert(ev.eval_jac(ev.data, bad_div, NULL, jac) == -1);
+
+  // Backtracking works as if nothing happened
+  assert(ev.eval_g(ev.data, x, NULL, g) == 0);
+  assert(g[0] == 3.0 && g[1] == 0.5 && g[2] == 2.0);
+  assert(ev.eval_hess(ev.data, x, NULL, lambda, hess) == 0);
+
+  free(jac);
+  free(hess);
+  free_evaluator(ev);
+  for (int i=0; i<3; i++){free_expression(exprs[i]);}
+}
+
+void write_nl(const char * filename){
+  FILE * fp = fopen(filename, "w");
+  fprintf(fp, "g3 1 1 0\t# problem errors\n");
+  fprintf(fp, " 2 3 1 0 3\t# vars, constraints, objectives, ranges, eqns\n");
+  fprintf(fp, " 3 1\t# nonlinear constraints, objectives\n");
+  fprintf(fp, " 0 0\t# network constraints: nonlinear, linear\n");
+  fprintf(fp, " 2 2 2\t# nonlinear vars in constraints, objectives, both\n");
+  fprintf(fp, " 0 0 0 1\t# linear network variables; functions; arith, flags\n");
+  fprintf(fp, " 0 0 0 0 0\t# discrete variables: binary, integer, nonlinear (b,c,o)\n");
+  fprintf(fp, " 5 2\t# nonzeros in Jacobian, gradients\n");
+  fprintf(fp, " 0 0\t# max name lengths: constraints, variables\n");
+  fprintf(fp, " 0 0 0 0 0\t# common exprs: b,c,o,c1,o1\n");
+  // v0 * trunc(v1 + 2), then a sum with alldiff(v0, v1) as its middle
+  // argument. We don't support trunc (o58) or alldiff (o74).
+  fprintf(fp, "C0\no2\nv0\no58\no0\nv1\nn2\n");
+  fprintf(fp, "C1\no54\n3\nv0\no74\n2\nv0\nv1\nn1.5\n");
+  fprintf(fp, "C2\no2\nv0\nv1\n");
+  fprintf(fp, "O0 0\no5\nv0\nn2\n");
+  fprintf(fp, "x2\n0 3.0\n1 -4.0\n");
+  fclose(fp);
+}
+
+void test_unsupported_operators(){
+  const char * filename = "test-errors.nl";
+  write_nl(filename);
+  struct Variable variables[2] = {{.index = 0, .value = 3.0}, {.index = 1, .value = -4.0}};
+  struct Node constraints[3];
+  FILE * fp = fopen(filename, "r");
+  assert(read_nl_constraints(fp, constraints, 3, variables, 2) == -1);
+  fclose(fp);
+  assert(isnan(evaluate(constraints[0])));
+  assert(isnan(evaluate(constraints[1])));
+  // The constraint after the ones we couldn't read is intact
+  assert(evaluate(constraints[2]) == -12.0);
+
+  struct Node objective;
+  int sense;
+  fp = fopen(filename, "r");
+  assert(read_nl_objectives(fp, &objective, &sense, 1, variables, 2) == 0);
+  fclose(fp);
+  assert(evaluate(objective) == 9.0);
+
+  for (int i=0; i<3; i++){free_expression(constraints[i]);}
+  free_expression(objective);
+  remove(filename);
+}
+
+int main(int narg, char ** argv){
+  struct Variable variables[3] = {{.index = 0}, {.index = 1}, {.index = 2}};
+  test_diff_op(variables);
+  test_reverse_diff(variables);
+  test_evaluator(variables);
+  test_unsupported_operators();
+  // Everything we allocated has been freed, including the parts of the
+  // expressions we couldn't read
+  assert(memory_total().bytes == 0);
+  printf("OK\n");
+  return 0;
+}
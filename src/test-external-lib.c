@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "external.h"
+
+/*
+ * A funcadd library for test-external, written the way a library compiled
+ * against AMPL's funcadd.h would be.
+ */
+
+// cubic(x, y) = x^2 y + sin(x)
+double cubic(struct ExternalArgs * al){
+  double x = al->ra[0];
+  double y = al->ra[1];
+  if (al->derivs != NULL){
+    al->derivs[0] = 2.0 * x * y + cos(x);
+    al->derivs[1] = x * x;
+    if (al->hes != NULL){
+      al->hes[0] = 2.0 * y - sin(x);
+      al->hes[1] = 2.0 * x;
+      al->hes[2] = 0.0;
+    }
+  }
+  return x * x * y + sin(x);
+}
+
+// root(x) = sqrt(x), which reports an error for x < 0
+double root(struct ExternalArgs * al){
+  double x = al->ra[0];
+  if (x < 0.0){
+    al->Errmsg = "root: argument is negative";
+    return 0.0;
+  }
+  if (al->derivs != NULL){
+    al->derivs[0] = 0.5 / sqrt(x);
+    if (al->hes != NULL){
+      al->hes[0] = -0.25 / (x * sqrt(x));
+    }
+  }
+  return sqrt(x);
+}
+
+int nexit = 0;
+
+void at_exit(void * data){
+  *(int *)data += 1;
+}
+
+void funcadd_ASL(struct ExternalExports * ae){
+  ae->Addfunc("cubic", cubic, FUNCADD_REAL_VALUED, 2, NULL, ae);
+  ae->Addfunc("root", root, FUNCADD_REAL_VALUED, 1, NULL, ae);
+  ae->AtExit(ae, at_exit, &nexit);
+}
@@ -0,0 +1,321 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#include "expr.h"
+#include "nl.h"
+#include "sparse.h"
+#include "op_derivs.h"
+#include "tape.h"
+#include "hessian.h"
+#include "evaluator.h"
+#include "codegen.h"
+#include "cse.h"
+#include "simplify.h"
+
+/*
+ * External functions, from a funcadd library (test-external-lib.c), in
+ * every engine. Each model is also written with our own operators, and the
+ * results compared.
+ */
+
+struct Node constant(double value){
+  struct Node node = {.type = CONST_NODE, .data = {.value = value}};
+  return node;
+}
+
+struct Node variable(struct Variable * var){
+  struct Node node = {.type = VAR_NODE, .data = {.var = var}};
+  return node;
+}
+
+struct Node operator(enum OperatorType op, int nargs, struct Node * args){
+  struct OperatorNode * expr = new_operator_node(op, nargs);
+  for (int i=0; i<nargs; i++){expr->args[i] = args[i];}
+  struct Node node = {.type = OP_NODE, .data = {.expr = expr}};
+  return node;
+}
+
+// A call of f with one or two arguments
+struct Node call(int f, int nargs, struct Node x, struct Node y){
+  struct Node args[3] = {constant(f), x, y};
+  return operator(EXTERNAL, nargs + 1, args);
+}
+
+// x^2 y + sin(x), like cubic. x appears twice, so pass two copies of it.
+struct Node native_cubic(struct Node x, struct Node y, struct Node x_copy){
+  struct Node x2[2] = {x, constant(2.0)};
+  struct Node sin_x[1] = {x_copy};
+  struct Node prod[2] = {operator(POW_CONST_INT, 2, x2), y};
+  struct Node sum[2] = {operator(PRODUCT, 2, prod), operator(SIN, 1, sin_x)};
+  return operator(SUM, 2, sum);
+}
+
+/*
+ * g0 = cubic(v0, v1) + cubic(v0, v1)
+ * g1 = cubic(cubic(v0, v1), v2)
+ * g2 = v2 * root(v0)
+ */
+void build_model(int cubic, int root, struct Variable * variables, struct Node * exprs, bool native){
+  struct Node v0 = variable(&variables[0]);
+  struct Node v1 = variable(&variables[1]);
+  struct Node v2 = variable(&variables[2]);
+  if (native){
+    struct Node sum[2] = {native_cubic(v0, v1, v0), native_cubic(v0, v1, v0)};
+    exprs[0] = operator(SUM, 2, sum);
+    exprs[1] = native_cubic(native_cubic(v0, v1, v0), v2, native_cubic(v0, v1, v0));
+    struct Node root_args[1] = {v0};
+    struct Node prod[2] = {v2, operator(SQRT, 1, root_args)};
+    exprs[2] = operator(PRODUCT, 2, prod);
+  }else{
+    struct Node sum[2] = {call(cubic, 2, v0, v1), call(cubic, 2, v0, v1)};
+    exprs[0] = operator(SUM, 2, sum);
+    exprs[1] = call(cubic, 2, call(cubic, 2, v0, v1), v2);
+    struct Node prod[2] = {v2, call(root, 1, v0, v0)};
+    exprs[2] = operator(PRODUCT, 2, prod);
+  }
+}
+
+// Entry (i, j) of a sparse matrix, or 0 if it isn't in the structure
+double entry(struct CSRMatrix m, double * values, int i, int j){
+  for (int k=m.indptr[i]; k<m.indptr[i+1]; k++){
+    if (m.indices[k] == j){return values[k];}
+  }
+  return 0.0;
+}
+
+void assert_close(double a, double b){
+  assert(fabs(a - b) <= 1e-12 * (1.0 + fabs(b)));
+}
+
+void test_tree(int cubic, struct Variable * variables){
+  external_new_point();
+  variables[0].value = 0.5;
+  variables[1].value = 2.0;
+  struct Node expr = call(cubic, 2, variable(&variables[0]), variable(&variables[1]));
+  struct Node native = native_cubic(variable(&variables[0]), variable(&variables[1]), variable(&variables[0]));
+  assert_close(evaluate(expr), evaluate(native));
+  double deriv[3];
+  assert(diff_operator(EXTERNAL, expr.data.expr->args, 3, deriv) == 0);
+  assert(deriv[0] == 0.0);
+  assert_close(deriv[1], 2.0 * 0.5 * 2.0 + cos(0.5));
+  assert_close(deriv[2], 0.25);
+  free_expression(expr);
+  free_expression(native);
+}
+
+void test_evaluator(int cubic, int root, struct Variable * variables){
+  struct Node exprs[3];
+  struct Node native[3];
+  build_model(cubic, root, variables, exprs, false);
+  build_model(cubic, root, variables, native, true);
+  struct Evaluator ev = tape_evaluator(exprs, 3, 3);
+  struct Evaluator nev = tape_evaluator(native, 3, 3);
+  struct TapeEvaluatorData * td = ev.data;
+  // The outer call of g1 depends on the inner one
+  assert(td->model.tape.ncall == 5);
+  assert(td->model.tape.npass == 2);
+
+  double x[3] = {0.5, 2.0, -1.5};
+  double lambda[3] = {1.0, 0.5, 2.0};
+  double g[3], ng[3];
+  double * jac = malloc(ev.jacobian.nnz * sizeof(double));
+  double * njac = malloc(nev.jacobian.nnz * sizeof(double));
+  double * hess = malloc(ev.hessian.nnz * sizeof(double));
+  double * nhess = malloc(nev.hessian.nnz * sizeof(double));
+
+  // The two calls cubic(v0, v1) in g0 and the inner call in g1 are one call
+  long ncall = EXTERNAL_CACHE.ncall;
+  long nhit = EXTERNAL_CACHE.nhit;
+  assert(ev.eval_g(ev.data, x, NULL, g) == 0);
+  assert(EXTERNAL_CACHE.ncall - ncall == 3);
+  assert(EXTERNAL_CACHE.nhit - nhit == 2);
+  assert(nev.eval_g(nev.data, x, NULL, ng) == 0);
+  for (int i=0; i<3; i++){assert_close(g[i], ng[i]);}
+
+  // The reverse sweeps use the gradients computed with the values
+  ncall = EXTERNAL_CACHE.ncall;
+  assert(ev.eval_jac(ev.data, x, NULL, jac) == 0);
+  assert(EXTERNAL_CACHE.ncall - ncall == 3);
+  assert(nev.eval_jac(nev.data, x, NULL, njac) == 0);
+  for (int i=0; i<3; i++){
+    for (int j=0; j<3; j++){
+      assert_close(entry(ev.jacobian, jac, i, j), entry(nev.jacobian, njac, i, j));
+    }
+  }
+
+  assert(ev.eval_hess(ev.data, x, NULL, lambda, hess) == 0);
+  assert(nev.eval_hess(nev.data, x, NULL, lambda, nhess) == 0);
+  for (int i=0; i<3; i++){
+    for (int j=0; j<=i; j++){
+      assert_close(entry(ev.hessian, hess, i, j), entry(nev.hessian, nhess, i, j));
+    }
+  }
+
+  // root reports an error outside its domain
+  x[0] = -0.5;
+  assert(ev.eval_g(ev.data, x, NULL, g) == -1);
+  assert(!isnan(g[0]) && isnan(g[2]));
+  assert(ev.eval_jac(ev.data, x, NULL, jac) == -1);
+
+  free(jac);
+  free(njac);
+  free(hess);
+  free(nhess);
+  free_evaluator(ev);
+  free_evaluator(nev);
+  for (int i=0; i<3; i++){
+    free_expression(exprs[i]);
+    free_expression(native[i]);
+  }
+}
+
+void test_codegen(int cubic, struct Variable * variables){
+  struct Node expr = call(cubic, 2, variable(&variables[0]), variable(&variables[1]));
+  struct Evaluator ev;
+  assert(compiled_evaluator(&ev, &expr, 1, 2, "test_external") == -1);
+  free_expression(expr);
+}
+
+void write_nl(const char * filename){
+  FILE * fp = fopen(filename, "w");
+  fprintf(fp, "g3 1 1 0\t# problem external\n");
+  fprintf(fp, " 2 2 1 0 2\t# vars, constraints, objectives, ranges, eqns\n");
+  fprintf(fp, " 2 1\t# nonlinear constraints, objectives\n");
+  fprintf(fp, " 0 0\t# network constraints: nonlinear, linear\n");
+  fprintf(fp, " 2 2 2\t# nonlinear vars in constraints, objectives, both\n");
+  fprintf(fp, " 0 2 0 1\t# linear network variables; functions; arith, flags\n");
+  fprintf(fp, " 0 0 0 0 0\t# discrete variables: binary, integer, nonlinear (b,c,o)\n");
+  fprintf(fp, " 4 2\t# nonzeros in Jacobian, gradients\n");
+  fprintf(fp, " 0 0\t# max name lengths: constraints, variables\n");
+  fprintf(fp, " 0 0 0 0 0\t# common exprs: b,c,o,c1,o1\n");
+  fprintf(fp, "F0 1 2 cubic\n");
+  fprintf(fp, "F1 1 1 root\n");
+  // cubic(v0, 3) - root(v1), and cubic with a string argument
+  fprintf(fp, "C0\no1\nf0 2\nv0\nn3\nf1 1\nv1\n");
+  fprintf(fp, "C1\no0\nf0 2\nh5:steam\nv1\nv0\n");
+  fprintf(fp, "O0 0\nf0 2\nv1\nv0\n");
+  fprintf(fp, "x2\n0 0.5\n1 4.0\n");
+  fclose(fp);
+}
+
+void test_parse(struct Variable * variables){
+  const char * filename = "test-external.nl";
+  write_nl(filename);
+  FILE * fp = fopen(filename, "r");
+  struct NLHeader header = read_nl_header(fp);
+  fclose(fp);
+  assert(header.nfunc == 2);
+
+  int funcs[2];
+  fp = fopen(filename, "r");
+  assert(read_nl_functions(fp, funcs, 2) == 0);
+  fclose(fp);
+  assert(funcs[0] == find_external_function("cubic"));
+  assert(funcs[1] == find_external_function("root"));
+
+  variables[0].value = 0.5;
+  variables[1].value = 4.0;
+  external_new_point();
+  struct Node constraints[2];
+  fp = fopen(filename, "r");
+  assert(read_nl_constraints(fp, constraints, 2, variables, 2) == -1);
+  fclose(fp);
+  assert_close(evaluate(constraints[0]), 0.75 + sin(0.5) - 2.0);
+  assert(isnan(evaluate(constraints[1])));
+
+  struct Node objective;
+  int sense;
+  fp = fopen(filename, "r");
+  assert(read_nl_objectives(fp, &objective, &sense, 1, variables, 2) == 0);
+  fclose(fp);
+  assert_close(evaluate(objective), 8.0 + sin(4.0));
+
+  for (int i=0; i<2; i++){free_expression(constraints[i]);}
+  free_expression(objective);
+  remove(filename);
+}
+
+// Returns a different value each time, like a random number generator
+double counter(struct ExternalArgs * al){
+  static double count = 0.0;
+  count += 1.0;
+  if (al->derivs != NULL){al->derivs[0] = 0.0;}
+  if (al->hes != NULL){al->hes[0] = 0.0;}
+  return al->ra[0] + count;
+}
+
+void test_random(){
+  int random = add_external_function("random", counter, FUNCADD_RANDOM_VALUED, 1, NULL);
+  int cached = add_external_function("cached", counter, FUNCADD_REAL_VALUED, 1, NULL);
+  double x = 0.5;
+  external_new_point();
+  long ncall = EXTERNAL_CACHE.ncall;
+  long nhit = EXTERNAL_CACHE.nhit;
+  // Random functions are called every time, even once the table has grown
+  double value = external_evaluate(cached, 1, &x, NULL, NULL);
+  double last = external_evaluate(random, 1, &x, NULL, NULL);
+  for (int k=0; k<100; k++){
+    double next = external_evaluate(random, 1, &x, NULL, NULL);
+    assert(next != last);
+    last = next;
+  }
+  assert(EXTERNAL_CACHE.ncall - ncall == 102);
+  assert(EXTERNAL_CACHE.nhit == nhit);
+  assert(external_evaluate(cached, 1, &x, NULL, NULL) == value);
+  assert(EXTERNAL_CACHE.nhit - nhit == 1);
+
+  // random(0.5) + random(0.5) is two draws, even after sharing common
+  // subexpressions and simplifying, but cached(0.5) + cached(0.5) is one call
+  struct Node exprs[2];
+  int funcs[2] = {random, cached};
+  for (int e=0; e<2; e++){
+    struct Node arg[2] = {constant(funcs[e]), constant(x)};
+    struct Node sum[2] = {operator(EXTERNAL, 2, arg), operator(EXTERNAL, 2, arg)};
+    exprs[e] = operator(SUM, 2, sum);
+  }
+  assert(share_common_subexpressions(exprs, 2) == 1);
+  assert(simplify_expression(&exprs[0]) == 0);
+  struct Node * args = exprs[0].data.expr->args;
+  assert(args[0].type == OP_NODE && args[1].type == OP_NODE);
+  assert(args[0].data.expr != args[1].data.expr);
+  assert(exprs[1].data.expr->args[0].data.expr == exprs[1].data.expr->args[1].data.expr);
+  ncall = EXTERNAL_CACHE.ncall;
+  double first = evaluate(exprs[0]);
+  assert(EXTERNAL_CACHE.ncall - ncall == 2);
+  assert(evaluate(exprs[0]) != first);
+  for (int e=0; e<2; e++){free_expression(exprs[e]);}
+}
+
+int main(int narg, char ** argv){
+  assert(load_external_library("./no-such-library.so") == -1);
+  assert(load_external_library("./test-external.so") == 2);
+  int cubic = find_external_function("cubic");
+  int root = find_external_function("root");
+  assert(cubic >= 0 && root >= 0);
+
+  struct Variable variables[3] = {{.index = 0}, {.index = 1}, {.index = 2}};
+  test_tree(cubic, variables);
+  test_evaluator(cubic, root, variables);
+  test_codegen(cubic, variables);
+  test_parse(variables);
+  test_random();
+
+  // Functions the model uses have to be loaded before reading it
+  free_external_functions();
+  assert(N_EXTERNAL_FUNCTIONS == 0);
+  int funcs[2];
+  write_nl("test-external.nl");
+  FILE * fp = fopen("test-external.nl", "r");
+  assert(read_nl_functions(fp, funcs, 2) == -1);
+  fclose(fp);
+  remove("test-external.nl");
+
+  free_external_cache();
+  assert(memory_total().bytes == 0);
+  printf("OK\n");
+  return 0;
+}
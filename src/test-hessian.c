@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#include "expr.h"
+#include "nl.h"
+#include "sparse.h"
+#include "op_derivs.h"
+#include "tape.h"
+#include "hessian.h"
+
+const double RTOL = 1e-12;
+
+bool isclose(double a, double b){
+  return fabs(a - b) <= RTOL * fmax(1.0, fmax(fabs(a), fabs(b)));
+}
+
+// Helpers for constructing expressions by hand
+struct Node variable(struct Variable * var){
+  struct Node node = {.type = VAR_NODE, .data = {.var = var}};
+  return node;
+}
+
+struct Node operator(enum OperatorType op, int nargs, struct Node * args){
+  struct OperatorNode * expr = new_operator_node(op, nargs);
+  for (int i=0; i<nargs; i++){expr->args[i] = args[i];}
+  struct Node node = {.type = OP_NODE, .data = {.expr = expr}};
+  return node;
+}
+
+// Check that entries (rows[k], cols[k]) are exactly the structure of hess
+void check_structure(struct CSRMatrix hess, int nnz, int * rows, int * cols){
+  assert(hess.nnz == nnz);
+  for (int k=0; k<nnz; k++){
+    assert(csr_find_entry(hess, rows[k], cols[k]) >= 0);
+  }
+}
+
+/*
+ * Compare the colored Hessian against tape_hessian, which uses one
+ * Hessian-vector product per row. Returns the number of colors.
+ */
+int check_colored_hessian(struct Node * exprs, int nexpr, int nvar){
+  struct Tape tape = compile_tape(exprs, nexpr, nvar);
+  struct CSRMatrix full = tape_hessian_structure(&tape);
+  struct CSRMatrix sparse = hessian_sparsity(exprs, nexpr, nvar);
+  struct HessianColoring coloring = star_coloring(sparse);
+  printf(
+    "%d variables: %d entries with every pair in an expression, %d nonlinear interactions, %d colors\n",
+    nvar, full.nnz, sparse.nnz, coloring.ncolor
+  );
+
+  double * x = malloc(nvar * sizeof(double));
+  double * lambda = malloc(nexpr * sizeof(double));
+  for (int j=0; j<nvar; j++){x[j] = 1.0 + (j % 7) / 10.0;}
+  for (int i=0; i<nexpr; i++){lambda[i] = (i % 2 == 0 ? 1.0 : -1.0) * (i % 5 + 1) / 2.0;}
+  double * values = malloc(tape.nnode * sizeof(double));
+  double * dvalues = malloc(tape.nnode * sizeof(double));
+  double * adjoints = malloc(tape.nnode * sizeof(double));
+  double * dadjoints = malloc(tape.nnode * sizeof(double));
+  tape_evaluate(&tape, x, NULL, values);
+  tape_hessian(&tape, values, lambda, full, dvalues, adjoints, dadjoints, full.values);
+  colored_hessian(&tape, &coloring, values, lambda, dvalues, adjoints, dadjoints, sparse.values);
+
+  // The nonlinear interactions are a subset of the full structure, and
+  // entries of the full structure that are not interactions are zero
+  for (int l=0; l<nvar; l++){
+    for (int k=full.indptr[l]; k<full.indptr[l+1]; k++){
+      int ks = csr_find_entry(sparse, l, full.indices[k]);
+      assert(isclose(full.values[k], ks >= 0 ? sparse.values[ks] : 0.0));
+    }
+    for (int k=sparse.indptr[l]; k<sparse.indptr[l+1]; k++){
+      assert(csr_find_entry(full, l, sparse.indices[k]) >= 0);
+    }
+  }
+
+  int ncolor = coloring.ncolor;
+  free(x);
+  free(lambda);
+  free(values);
+  free(dvalues);
+  free(adjoints);
+  free(dadjoints);
+  free_hessian_coloring(coloring);
+  free_csrmatrix(sparse);
+  free_csrmatrix(full);
+  free_tape(tape);
+  return ncolor;
+}
+
+/*
+ * Check the gradient and Hessian of the product of n variables, one of which
+ * is zero, against the products of the other arguments.
+ */
+void check_product(int n){
+  struct Variable * variables = malloc(n * sizeof(struct Variable));
+  struct Node * args = malloc(n * sizeof(struct Node));
+  for (int i=0; i<n; i++){
+    variables[i].index = i;
+    args[i] = variable(&variables[i]);
+  }
+  struct Node expr = operator(PRODUCT, n, args);
+  struct Tape tape = compile_tape(&expr, 1, n);
+  struct CSRMatrix full = tape_hessian_structure(&tape);
+  double * x = malloc(n * sizeof(double));
+  for (int j=0; j<n; j++){x[j] = j == 2 ? 0.0 : 1.0 + j / 10.0;}
+  double lambda = 1.0;
+  double * values = malloc(tape.nnode * sizeof(double));
+  double * dvalues = malloc(tape.nnode * sizeof(double));
+  double * adjoints = malloc(tape.nnode * sizeof(double));
+  double * dadjoints = malloc(tape.nnode * sizeof(double));
+  tape_evaluate(&tape, x, NULL, values);
+  for (int k=0; k<tape.nnode; k++){adjoints[k] = 0.0;}
+  tape_reverse(&tape, 0, values, adjoints);
+  for (int j=0; j<n; j++){
+    double expected = 1.0;
+    for (int q=0; q<n; q++){if (q != j){expected *= x[q];}}
+    assert(isclose(adjoints[j], expected));
+  }
+  tape_hessian(&tape, values, &lambda, full, dvalues, adjoints, dadjoints, full.values);
+  for (int l=0; l<n; l++){
+    for (int k=full.indptr[l]; k<full.indptr[l+1]; k++){
+      int j = full.indices[k];
+      double expected = l == j ? 0.0 : 1.0;
+      for (int q=0; q<n; q++){if (q != j && q != l){expected *= x[q];}}
+      assert(isclose(full.values[k], expected));
+    }
+  }
+  printf("Product of %d variables matches\n", n);
+  free(x);
+  free(values);
+  free(dvalues);
+  free(adjoints);
+  free(dadjoints);
+  free_csrmatrix(full);
+  free_tape(tape);
+  free_expression(expr);
+  free(args);
+  free(variables);
+}
+
+int main(int narg, char ** argv){
+  if (narg < 2){
+    printf("No file provided. Please provide an nl file.\n");
+    return -1;
+  }
+
+  struct Variable v[4];
+  for (int j=0; j<4; j++){v[j].index = j;}
+  // v0 * v1 + sin(v2) + v3 only has entries (1, 0) and (2, 2)
+  struct Node prod_args[2] = {variable(&v[0]), variable(&v[1])};
+  struct Node sin_args[1] = {variable(&v[2])};
+  struct Node sum_args[3] = {operator(PRODUCT, 2, prod_args), operator(SIN, 1, sin_args), variable(&v[3])};
+  struct Node expr = operator(SUM, 3, sum_args);
+  struct CSRMatrix hess = hessian_sparsity(&expr, 1, 4);
+  int rows0[2] = {1, 2};
+  int cols0[2] = {0, 2};
+  check_structure(hess, 2, rows0, cols0);
+  free_csrmatrix(hess);
+  free_expression(expr);
+  // v2 / v3 is linear in v2
+  struct Node div_args[2] = {variable(&v[2]), variable(&v[3])};
+  expr = operator(DIVISION, 2, div_args);
+  hess = hessian_sparsity(&expr, 1, 4);
+  int rows1[2] = {3, 3};
+  int cols1[2] = {2, 3};
+  check_structure(hess, 2, rows1, cols1);
+  free_csrmatrix(hess);
+  free_expression(expr);
+
+  // The constraints and objective of the .nl file
+  FILE * fp = fopen(argv[1], "r");
+  struct NLHeader header = read_nl_header(fp);
+  fclose(fp);
+  int nvar = header.nvar;
+  int ncon = header.ncon;
+  struct Variable * variables = malloc(nvar * sizeof(struct Variable));
+  for (int i=0; i<nvar; i++){variables[i].index = i;}
+  struct Node * exprs = malloc((ncon + header.nobj) * sizeof(struct Node));
+  int * sense = malloc(header.nobj * sizeof(int));
+  fp = fopen(argv[1], "r");
+  read_nl_constraints(fp, exprs, ncon, variables, nvar);
+  fclose(fp);
+  fp = fopen(argv[1], "r");
+  read_nl_objectives(fp, exprs + ncon, sense, header.nobj, variables, nvar);
+  fclose(fp);
+  check_colored_hessian(exprs, ncon + header.nobj, nvar);
+  for (int i=0; i<ncon+header.nobj; i++){free_expression(exprs[i]);}
+  free(exprs);
+  free(sense);
+  free(variables);
+
+  // Larger models, whose Hessians only need a few colors:
+  // sin(v[i] * v[i+1]), which is tridiagonal, and exp(v[0] + v[i]), an
+  // arrowhead.
+  int n = 200;
+  variables = malloc(n * sizeof(struct Variable));
+  for (int i=0; i<n; i++){variables[i].index = i;}
+  exprs = malloc(n * sizeof(struct Node));
+  for (int i=0; i<n-1; i++){
+    struct Node args[2] = {variable(&variables[i]), variable(&variables[i+1])};
+    struct Node sin_arg[1] = {operator(PRODUCT, 2, args)};
+    exprs[i] = operator(SIN, 1, sin_arg);
+  }
+  assert(check_colored_hessian(exprs, n-1, n) <= 3);
+  for (int i=0; i<n-1; i++){free_expression(exprs[i]);}
+  for (int i=1; i<n; i++){
+    struct Node args[2] = {variable(&variables[0]), variable(&variables[i])};
+    struct Node exp_arg[1] = {operator(SUM, 2, args)};
+    exprs[i-1] = operator(EXP, 1, exp_arg);
+  }
+  assert(check_colored_hessian(exprs, n-1, n) == 2);
+  for (int i=0; i<n-1; i++){free_expression(exprs[i]);}
+
+  // Nested nonlinear operators add their block once:
+  // exp(sin(cos(v[0] + ... + v[n-1]))) is dense, and
+  // log(v[i] * v[i+1] * sin(v[i+2]) / cos(v[i+3])) is dense in each group
+  struct Node * terms = malloc(n * sizeof(struct Node));
+  for (int i=0; i<n; i++){terms[i] = variable(&variables[i]);}
+  exprs[0] = operator(SUM, n, terms);
+  exprs[0] = operator(COS, 1, &exprs[0]);
+  exprs[0] = operator(SIN, 1, &exprs[0]);
+  exprs[0] = operator(EXP, 1, &exprs[0]);
+  hess = hessian_sparsity(exprs, 1, n);
+  assert(hess.nnz == n * (n + 1) / 2);
+  free_csrmatrix(hess);
+  free_expression(exprs[0]);
+  for (int i=0; i<n-3; i++){
+    struct Node sin_arg[1] = {variable(&variables[i+2])};
+    struct Node cos_arg[1] = {variable(&variables[i+3])};
+    struct Node prod_args[3] = {variable(&variables[i]), variable(&variables[i+1]), operator(SIN, 1, sin_arg)};
+    struct Node div_args[2] = {operator(PRODUCT, 3, prod_args), operator(COS, 1, cos_arg)};
+    struct Node log_arg[1] = {operator(DIVISION, 2, div_args)};
+    exprs[i] = operator(LOG, 1, log_arg);
+  }
+  check_colored_hessian(exprs, n-3, n);
+  check_product(3);
+  check_product(7);
+  for (int i=0; i<n-3; i++){free_expression(exprs[i]);}
+  free(terms);
+  free(exprs);
+  free(variables);
+  return 0;
+}
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#include "expr.h"
+#include "nl.h"
+#include "sparse.h"
+#include "op_derivs.h"
+#include "reverse_diff.h"
+#include "tape.h"
+
+int count_operator_nodes(struct Node expr, long * nargs){
+  if (expr.type != OP_NODE){
+    return 0;
+  }
+  int count = 1;
+  *nargs += expr.data.expr->nargs;
+  for (int i=0; i<expr.data.expr->nargs; i++){
+    count += count_operator_nodes(expr.data.expr->args[i], nargs);
+  }
+  return count;
+}
+
+int main(int narg, char ** argv){
+  if (narg < 2){
+    printf("No file provided. Please provide an nl file.\n");
+    return -1;
+  }
+  // Nothing is allocated before we read the model
+  assert(memory_total().bytes == 0 && memory_total().count == 0);
+
+  FILE * fp = fopen(argv[1], "r");
+  struct NLHeader header = read_nl_header(fp);
+  fclose(fp);
+  int nvar = header.nvar;
+  int ncon = header.ncon;
+  struct Variable * variables = malloc(nvar * sizeof(struct Variable));
+  for (int j=0; j<nvar; j++){variables[j].index = j;}
+  struct Node * constraints = malloc(ncon * sizeof(struct Node));
+  fp = fopen(argv[1], "r");
+  read_nl_constraints(fp, constraints, ncon, variables, nvar);
+  fclose(fp);
+  fp = fopen(argv[1], "r");
+  read_starting_point(fp, variables, nvar, NULL, 0);
+  fclose(fp);
+
+  printf("After loading:\n");
+  print_memory_usage(stdout);
+  long nop = 0;
+  long nargs = 0;
+  for (int i=0; i<ncon; i++){nop += count_operator_nodes(constraints[i], &nargs);}
+  struct MemoryCounter opnodes = memory_usage(MEM_OPERATOR_NODES);
+  struct MemoryCounter args = memory_usage(MEM_ARGS);
+  assert(opnodes.count == nop);
+  assert(args.count == nop);
+  assert(opnodes.bytes >= nop * (long)sizeof(struct OperatorNode));
+  assert(args.bytes >= nargs * (long)sizeof(struct Node));
+  // The starting point is streamed, so the file is never held in a buffer
+  assert(memory_usage(MEM_BUFFERS).peak == 0);
+  long loaded = memory_total().bytes;
+  assert(memory_total().peak >= loaded);
+
+  // Differentiation allocates variable lists, which are freed, and
+  // derivative matrices, which we keep until the end
+  memory_reset_peak();
+  struct CSRMatrix * derivs = malloc(ncon * sizeof(struct CSRMatrix));
+  for (int i=0; i<ncon; i++){
+    derivs[i] = reverse_diff_expression(constraints[i], nvar);
+  }
+  struct CSRMatrix jac = identify_jacobian_structure(constraints, ncon, nvar);
+  struct Tape tape = compile_tape(constraints, ncon, nvar);
+  struct CSRMatrix hess = tape_hessian_structure(&tape);
+  printf("After differentiating:\n");
+  print_memory_usage(stdout);
+  struct MemoryCounter varlists = memory_usage(MEM_VARLISTS);
+  assert(varlists.bytes == 0 && varlists.count == 0);
+  assert(varlists.peak >= (long)sizeof(struct VarListNode));
+  // Three arrays per matrix
+  assert(memory_usage(MEM_SPARSE).count == 3 * (ncon + 2));
+  assert(memory_total().peak > loaded);
+
+  for (int i=0; i<ncon; i++){free_csrmatrix(derivs[i]);}
+  free_csrmatrix(jac);
+  free_csrmatrix(hess);
+  free_tape(tape);
+  for (int i=0; i<ncon; i++){free_expression(constraints[i]);}
+  printf("After freeing:\n");
+  print_memory_usage(stdout);
+  for (int c=0; c<N_MEMORY_CATEGORIES; c++){
+    assert(memory_usage(c).bytes == 0 && memory_usage(c).count == 0);
+  }
+  assert(memory_total().bytes == 0);
+
+  free(derivs);
+  free(constraints);
+  free(variables);
+  return 0;
+}
@@ -0,0 +1,368 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#include "expr.h"
+#include "nl.h"
+#include "sparse.h"
+#include "op_derivs.h"
+#include "reverse_diff.h"
+#include "tape.h"
+#include "hessian.h"
+#include "evaluator.h"
+#include "codegen.h"
+
+/*
+ * Check the operator registry (see operators.h): each operator's kernels
+ * against finite differences, the tape's fused code against the kernels,
+ * and a model using the operators we read from .nl files against every
+ * engine (tree, tape and compiled code).
+ */
+
+bool isclose(double a, double b, double rtol){
+  return fabs(a - b) <= rtol * fmax(1.0, fmax(fabs(a), fabs(b)));
+}
+
+// Index of the constant operand of a specialized power, or -1
+int constant_operand(enum OperatorType op){
+  switch(op){
+    case POW_CONST_INT:
+    case POW_CONST_REAL:
+      return 1;
+    case EXP_CONST_BASE:
+      return 0;
+    default:
+      return -1;
+  }
+}
+
+// Arguments in the operator's domain, and away from kinks and ties
+int sample_args(enum OperatorType op, double * x){
+  int nargs = OPERATOR_DATA[op].nargs > 0 ? OPERATOR_DATA[op].nargs : 3;
+  x[0] = 0.6;
+  x[1] = 0.35;
+  x[2] = 0.8;
+  switch(op){
+    case POW_CONST_INT:
+      x[1] = 3.0;
+      break;
+    case POW_CONST_REAL:
+      x[1] = 2.5;
+      break;
+    case EXP_CONST_BASE:
+      x[0] = 2.0;
+      break;
+    case ACOSH:
+      x[0] = 1.7;
+      break;
+    case REM:
+      x[0] = 2.7;
+      break;
+    default:
+      break;
+  }
+  return nargs;
+}
+
+void test_registry(){
+  for (int op=0; op<N_OPERATORS; op++){
+    const struct OperatorData * data = &OPERATOR_DATA[op];
+    assert(data->optype == op);
+    assert(data->opstring != NULL && data->value != NULL && data->deriv != NULL);
+    if (data->constant_deriv){
+      // Must not read the arguments
+      double grad[3];
+      assert(data->deriv(data->nargs > 0 ? data->nargs : 3, NULL, 0.0, grad) == 0);
+    }
+    // Every code maps back to the operator
+    const char * lists[2] = {data->opcodes, data->list_opcodes};
+    for (int l=0; l<2; l++){
+      const char * codes = lists[l];
+      int code;
+      int len;
+      while (codes != NULL && sscanf(codes, " o%d%n", &code, &len) == 1){
+        bool list;
+        assert(nl_operator(code, &list) == op);
+        assert(list == (l == 1));
+        codes += len;
+      }
+    }
+    for (int k=0; k<data->nvariant; k++){
+      assert(data->variants[k] != op && OPERATOR_DATA[data->variants[k]].nvariant == 0);
+    }
+  }
+  bool list;
+  // trunc and alldiff
+  assert(nl_operator(58, &list) == -1);
+  assert(nl_operator(74, &list) == -1);
+  assert(nl_operator(1000, &list) == -1);
+}
+
+// Kernels against central differences
+void test_kernels(){
+  double h = 1e-6;
+  for (int op=0; op<N_OPERATORS; op++){
+    if (op == EXTERNAL){
+      // See test-external
+      continue;
+    }
+    const struct OperatorData * data = &OPERATOR_DATA[op];
+    double x[3];
+    int nargs = sample_args(op, x);
+    double value = data->value(nargs, x);
+    double grad[3];
+    double hes[6] = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+    assert(isfinite(value));
+    assert(data->deriv(nargs, x, value, grad) == 0);
+    if (data->deriv2 != NULL){
+      assert(data->deriv2(nargs, x, value, hes) == 0);
+    }
+    for (int i=0; i<nargs; i++){
+      if (i == constant_operand(op)){
+        assert(grad[i] == 0.0);
+        continue;
+      }
+      double xi = x[i];
+      double grad_plus[3];
+      double grad_minus[3];
+      x[i] = xi + h;
+      double plus = data->value(nargs, x);
+      data->deriv(nargs, x, plus, grad_plus);
+      x[i] = xi - h;
+      double minus = data->value(nargs, x);
+      data->deriv(nargs, x, minus, grad_minus);
+      x[i] = xi;
+      assert(isclose(grad[i], (plus - minus) / (2.0 * h), 1e-6));
+      for (int j=0; j<nargs; j++){
+        if (j == constant_operand(op)){
+          continue;
+        }
+        double fd = (grad_plus[j] - grad_minus[j]) / (2.0 * h);
+        assert(isclose(hes[hessian_index(i, j)], fd, 1e-5));
+      }
+    }
+  }
+  printf("Kernels match finite differences\n");
+}
+
+// Products of many arguments, one of them zero, against the products of
+// the other arguments
+void test_product_kernels(){
+  int n = 7;
+  double x[7] = {1.5, -0.5, 0.0, 2.0, 1.25, -3.0, 0.75};
+  double grad[7];
+  double hes[28];
+  const struct OperatorData * data = &OPERATOR_DATA[PRODUCT];
+  double value = data->value(n, x);
+  assert(data->deriv(n, x, value, grad) == 0);
+  assert(data->deriv2(n, x, value, hes) == 0);
+  for (int j=0; j<n; j++){
+    double expected = 1.0;
+    for (int k=0; k<n; k++){if (k != j){expected *= x[k];}}
+    assert(isclose(grad[j], expected, 1e-15));
+    for (int i=0; i<=j; i++){
+      expected = i == j ? 0.0 : 1.0;
+      for (int k=0; k<n; k++){if (k != i && k != j){expected *= x[k];}}
+      assert(isclose(hes[hessian_index(i, j)], expected, 1e-15));
+    }
+  }
+  printf("Product kernels match\n");
+}
+
+// The tape's kernels, fused or generic, against the registry's
+void test_tape_kernels(){
+  for (int op=0; op<N_OPERATORS; op++){
+    if (op == EXTERNAL){
+      continue;
+    }
+    const struct OperatorData * data = &OPERATOR_DATA[op];
+    double x[3];
+    int nargs = sample_args(op, x);
+    uint32_t a[3] = {0, 1, 2};
+    double dv[3] = {0.3, -0.2, 0.5};
+    if (constant_operand(op) >= 0){dv[constant_operand(op)] = 0.0;}
+    double w = 0.7;
+    double dw = -0.4;
+    double value = data->value(nargs, x);
+    double grad[3];
+    double hes[6] = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+    data->deriv(nargs, x, value, grad);
+    if (data->deriv2 != NULL){data->deriv2(nargs, x, value, hes);}
+
+    assert(isclose(_tape_op_value(op, nargs, a, x), value, 1e-14));
+    double tangent = 0.0;
+    for (int i=0; i<nargs; i++){tangent += grad[i] * dv[i];}
+    assert(isclose(_tape_op_tangent(op, nargs, a, x, dv, value), tangent, 1e-14));
+    double adj[3] = {0.0, 0.0, 0.0};
+    double adj2[3] = {0.0, 0.0, 0.0};
+    double dadj[3] = {0.0, 0.0, 0.0};
+    _tape_op_reverse(op, nargs, a, x, value, w, adj);
+    _tape_op_reverse2(op, nargs, a, x, dv, value, w, dw, adj2, dadj);
+    for (int i=0; i<nargs; i++){
+      if (i == constant_operand(op)){
+        continue;
+      }
+      double second = 0.0;
+      for (int j=0; j<nargs; j++){second += hes[hessian_index(i, j)] * dv[j];}
+      assert(isclose(adj[i], w * grad[i], 1e-14));
+      assert(isclose(adj2[i], w * grad[i], 1e-14));
+      assert(isclose(dadj[i], dw * grad[i] + w * second, 1e-14));
+    }
+  }
+  printf("Tape kernels match the registry\n");
+}
+
+void write_nl(const char * filename){
+  FILE * fp = fopen(filename, "w");
+  fprintf(fp, "g3 1 1 0\t# problem operators\n");
+  fprintf(fp, " 4 7 0 0 7\t# vars, constraints, objectives, ranges, eqns\n");
+  fprintf(fp, " 7 0\t# nonlinear constraints, objectives\n");
+  fprintf(fp, " 0 0\t# network constraints: nonlinear, linear\n");
+  fprintf(fp, " 4 0 0\t# nonlinear vars in constraints, objectives, both\n");
+  fprintf(fp, " 0 0 0 1\t# linear network variables; functions; arith, flags\n");
+  fprintf(fp, " 0 0 0 0 0\t# discrete variables: binary, integer, nonlinear (b,c,o)\n");
+  fprintf(fp, " 20 0\t# nonzeros in Jacobian, gradients\n");
+  fprintf(fp, " 0 0\t# max name lengths: constraints, variables\n");
+  fprintf(fp, " 0 0 0 0 0\t# common exprs: b,c,o,c1,o1\n");
+  // abs(v0 - v1) + tanh(v2) * atan(v3)
+  fprintf(fp, "C0\no0\no15\no1\nv0\nv1\no2\no37\nv2\no49\nv3\n");
+  // min(v0, v1 * v2, v3)
+  fprintf(fp, "C1\no11\n3\nv0\no2\nv1\nv2\nv3\n");
+  // max(v0, sinh(v1))
+  fprintf(fp, "C2\no12\n2\nv0\no40\nv1\n");
+  // if v0 < v1 && v2 >= 0.5 then v0 * v3 else sqrt(v2 - 5). The else
+  // branch is undefined, but isn't taken.
+  fprintf(fp, "C3\no35\no70\n2\no22\nv0\nv1\no28\nv2\nn0.5\no2\nv0\nv3\no39\no1\nv2\nn5\n");
+  // atan2(v0, v1) + asinh(v2) - cosh(v3)
+  fprintf(fp, "C4\no1\no0\no48\nv0\nv1\no50\nv2\no45\nv3\n");
+  // asin(v0 / 4) * acos(v1 / 4) + acosh(v2 + 1) + atanh(v3 / 4) + log10(v0)
+  fprintf(fp, "C5\no54\n4\no2\no51\no3\nv0\nn4\no53\no3\nv1\nn4\no52\no0\nv2\nn1\no47\no3\nv3\nn4\no42\nv0\n");
+  // floor(v0) + ceil(v1) + mod(v2, 0.3) + (v3 != v0) + !(v1 == v2)
+  //   + (v0 > v1) + (v0 <= v2) + (v0 || 0) + v3
+  fprintf(fp, "C6\no54\n9\no13\nv0\no14\nv1\no4\nv2\nn0.3\no30\nv3\nv0\no34\no24\nv1\nv2\n");
+  fprintf(fp, "o29\nv0\nv1\no23\nv0\nv2\no71\n2\nv0\nn0\nv3\n");
+  fclose(fp);
+}
+
+void test_model(){
+  const char * filename = "test-operators.nl";
+  write_nl(filename);
+  int nvar = 4;
+  int ncon = 7;
+  double x[4] = {1.1, 1.2, 1.3, 1.4};
+  struct Variable variables[4];
+  for (int j=0; j<nvar; j++){
+    variables[j].index = j;
+    variables[j].value = x[j];
+  }
+  struct Node constraints[7];
+  FILE * fp = fopen(filename, "r");
+  assert(read_nl_constraints(fp, constraints, ncon, variables, nvar) == 0);
+  fclose(fp);
+  remove(filename);
+
+  double expected[7] = {
+    fabs(x[0] - x[1]) + tanh(x[2]) * atan(x[3]),
+    fmin(x[0], fmin(x[1] * x[2], x[3])),
+    fmax(x[0], sinh(x[1])),
+    x[0] * x[3],
+    atan2(x[0], x[1]) + asinh(x[2]) - cosh(x[3]),
+    asin(x[0] / 4) * acos(x[1] / 4) + acosh(x[2] + 1) + atanh(x[3] / 4) + log10(x[0]),
+    1.0 + 2.0 + fmod(x[2], 0.3) + 1.0 + 1.0 + 0.0 + 1.0 + 1.0 + x[3],
+  };
+  for (int i=0; i<ncon; i++){
+    assert(isclose(evaluate(constraints[i]), expected[i], 1e-14));
+  }
+
+  // Tree and tape Jacobians agree, and are defined even though the branch
+  // of the if-then-else that wasn't taken isn't
+  struct Evaluator tape_ev = tape_evaluator(constraints, ncon, nvar);
+  double g[7];
+  double * jac = malloc(tape_ev.jacobian.nnz * sizeof(double));
+  assert(tape_ev.eval_g(tape_ev.data, x, NULL, g) == 0);
+  assert(tape_ev.eval_jac(tape_ev.data, x, NULL, jac) == 0);
+  for (int i=0; i<ncon; i++){
+    assert(isclose(g[i], expected[i], 1e-14));
+    struct CSRMatrix row = reverse_diff_expression(constraints[i], nvar);
+    for (int k=0; k<row.nnz; k++){
+      assert(isfinite(row.values[k]));
+      int kk = csr_find_entry(tape_ev.jacobian, i, row.indices[k]);
+      double tape_value = kk >= 0 ? jac[kk] : 0.0;
+      assert(isclose(row.values[k], tape_value, 1e-14));
+    }
+    free_csrmatrix(row);
+  }
+  // min chooses v0, and the if-then-else its then branch
+  assert(jac[csr_find_entry(tape_ev.jacobian, 1, 0)] == 1.0);
+  assert(csr_find_entry(tape_ev.jacobian, 3, 2) < 0 || jac[csr_find_entry(tape_ev.jacobian, 3, 2)] == 0.0);
+
+  // Compiled code agrees with the tape, whose Hessian agrees with central
+  // differences of its Jacobian
+  struct Evaluator native_ev;
+  assert(compiled_evaluator(&native_ev, constraints, ncon, nvar, "test-operators-model") == 0);
+  double lambda[7] = {1.0, -0.5, 2.0, 1.5, -1.0, 0.5, 3.0};
+  double g_native[7];
+  double * jac_native = malloc(native_ev.jacobian.nnz * sizeof(double));
+  double * hess = malloc(tape_ev.hessian.nnz * sizeof(double));
+  double * hess_native = malloc(native_ev.hessian.nnz * sizeof(double));
+  assert(native_ev.eval_g(native_ev.data, x, NULL, g_native) == 0);
+  assert(native_ev.eval_jac(native_ev.data, x, NULL, jac_native) == 0);
+  assert(tape_ev.eval_hess(tape_ev.data, x, NULL, lambda, hess) == 0);
+  assert(native_ev.eval_hess(native_ev.data, x, NULL, lambda, hess_native) == 0);
+  for (int i=0; i<ncon; i++){assert(isclose(g[i], g_native[i], 1e-12));}
+  assert(native_ev.jacobian.nnz == tape_ev.jacobian.nnz);
+  for (int k=0; k<tape_ev.jacobian.nnz; k++){assert(isclose(jac[k], jac_native[k], 1e-12));}
+
+  double h = 1e-6;
+  double * jac_plus = malloc(tape_ev.jacobian.nnz * sizeof(double));
+  double * jac_minus = malloc(tape_ev.jacobian.nnz * sizeof(double));
+  for (int j=0; j<nvar; j++){
+    double xj = x[j];
+    x[j] = xj + h;
+    tape_ev.eval_jac(tape_ev.data, x, NULL, jac_plus);
+    x[j] = xj - h;
+    tape_ev.eval_jac(tape_ev.data, x, NULL, jac_minus);
+    x[j] = xj;
+    for (int l=j; l<nvar; l++){
+      // d/dx_j of sum_i lambda_i dg_i/dx_l
+      double fd = 0.0;
+      for (int i=0; i<ncon; i++){
+        int k = csr_find_entry(tape_ev.jacobian, i, l);
+        if (k >= 0){fd += lambda[i] * (jac_plus[k] - jac_minus[k]) / (2.0 * h);}
+      }
+      int kt = csr_find_entry(tape_ev.hessian, l, j);
+      int kn = csr_find_entry(native_ev.hessian, l, j);
+      double tape_value = kt >= 0 ? hess[kt] : 0.0;
+      double native_value = kn >= 0 ? hess_native[kn] : 0.0;
+      assert(isclose(tape_value, fd, 1e-5));
+      assert(isclose(tape_value, native_value, 1e-12));
+    }
+  }
+  printf("Tree, tape and compiled code agree on a model with %d operators\n", N_OPERATORS);
+
+  free(jac);
+  free(jac_native);
+  free(jac_plus);
+  free(jac_minus);
+  free(hess);
+  free(hess_native);
+  free_evaluator(tape_ev);
+  free_evaluator(native_ev);
+  remove("test-operators-model.c");
+  remove("test-operators-model.so");
+  for (int i=0; i<ncon; i++){free_expression(constraints[i]);}
+}
+
+int main(int narg, char ** argv){
+  test_registry();
+  test_kernels();
+  test_product_kernels();
+  test_tape_kernels();
+  test_model();
+  assert(memory_total().bytes == 0);
+  printf("OK\n");
+  return 0;
+}
@@ -10,6 +10,8 @@
 #include "op_derivs.h"
 #include "forward_diff.h"
 #include "reverse_diff.h"
+#include "incremental.h"
+#include "cse.h"
 
 const bool REVERSE = true;
 
@@ -206,6 +208,9 @@ int main(int narg, char ** argv){
   printf("%s has %d variables\n", argv[1], nvar);
   printf("%s has %d constraints\n", argv[1], ncon);
 
+  int nshared = share_common_subexpressions(constraint_expressions, ncon);
+  printf("Removed %d duplicate subexpressions\n", nshared);
+
   for (int i = 0; i < nvar; i++){
     printf("Variable %2d: value = %f\n", i, variables[i].value);
   }
@@ -220,6 +225,57 @@ int main(int narg, char ** argv){
     printf("Constraint %2d: value = %f\n", i, value);
   }
 
+  // Re-evaluate constraints after changing a single variable, and make sure
+  // the incrementally updated values match a full evaluation.
+  struct DependencyMap depmap = build_dependency_map(constraint_expressions, ncon, nvar);
+  double * con_values = malloc(ncon * sizeof(double));
+  evaluate_constraints_cached(constraint_expressions, ncon, con_values);
+  int changed[1] = {3};
+  variables[3].value = 0.7;
+  int ncon_updated = reevaluate_constraints(constraint_expressions, ncon, con_values, &depmap, changed, 1);
+  printf("v3 <- 0.7. Re-evaluated %d of %d constraints\n", ncon_updated, ncon);
+  for (int i = 0; i < ncon; i++){
+    double value = evaluate(constraint_expressions[i]);
+    printf("Constraint %2d: value = %f, incremental value = %f\n", i, value, con_values[i]);
+    assert(value == con_values[i]);
+  }
+  // Several variables at once, with a repeat, through shared subexpressions,
+  // and then back to the original values
+  double original[2] = {variables[0].value, variables[2].value};
+  int changed2[3] = {0, 2, 0};
+  variables[0].value = 1.3;
+  variables[2].value = 0.4;
+  ncon_updated = reevaluate_constraints(constraint_expressions, ncon, con_values, &depmap, changed2, 3);
+  printf("v0 <- 1.3, v2 <- 0.4. Re-evaluated %d of %d constraints\n", ncon_updated, ncon);
+  for (int i = 0; i < ncon; i++){
+    assert(evaluate(constraint_expressions[i]) == con_values[i]);
+  }
+  variables[0].value = original[0];
+  variables[2].value = original[1];
+  int changed3[2] = {2, 0};
+  reevaluate_constraints(constraint_expressions, ncon, con_values, &depmap, changed3, 2);
+  for (int i = 0; i < ncon; i++){
+    assert(evaluate(constraint_expressions[i]) == con_values[i]);
+  }
+  int bad[2] = {0, -1};
+  assert(reevaluate_constraints(constraint_expressions, ncon, con_values, &depmap, bad, 2) == -1);
+  bad[1] = nvar;
+  assert(reevaluate_constraints(constraint_expressions, ncon, con_values, &depmap, bad, 2) == -1);
+  free(con_values);
+  free_dependency_map(depmap);
+
+  // Turn the exponent of v2^3 into a parameter, and change its value
+  // without changing the structure of the expression.
+  struct Parameter exponent = {0, 3.0};
+  int nbound = bind_parameter(constraint_expressions, ncon, 3.0, &exponent);
+  char param_str[82];
+  to_string(param_str, 82, constraint_expressions[4]);
+  printf("Bound %d constant(s) to p0. Constraint 4: body = %s\n", nbound, param_str);
+  printf("p0 = %1.1f: Constraint 4 value = %f\n", exponent.value, evaluate(constraint_expressions[4]));
+  exponent.value = 2.0;
+  printf("p0 = %1.1f: Constraint 4 value = %f\n", exponent.value, evaluate(constraint_expressions[4]));
+  exponent.value = 3.0;
+
   // Identify the variables that participate in each expression
   int * in_expr_lookup = malloc(nvar * sizeof(int));
   // Initialize to -1, i.e. the var has not appeared anywhere yet.
@@ -269,43 +325,12 @@ int main(int narg, char ** argv){
     free_csrmatrix(deriv);
   }
 
-  // TODO: Function to construct CSRMatrix for a group of constraints
-  // Construct indptr and indices for CSR matrix
-  // indptr has length nrow+1
-  int jac_nrow = ncon;
-  int jac_ncol = nvar;
-  int * jac_indptr = malloc((jac_nrow+1) * sizeof(int));
-  int * jac_indices = malloc(jac_nnz * sizeof(int));
-  double * jac_values = malloc(jac_nnz * sizeof(double));
-  int k = 0; // k is the nnz index
-  for (int i=0; i<jac_nrow; i++){
-    struct VarListNode * varnode = varlists[i];
-    jac_indptr[i] = k; // indptr[i] stores the index of the first nz in row i
-    while (varnode){
-      // Here we are making an important assumption: That variables know their indices
-      int j = varnode->variable->index;
-
-      jac_indices[k] = j;
-      jac_values[k] = 0.0; // Initialize nz value to zero
-
-      // We update the nnz index *after* setting the column index and nz value
-      k += 1;
-      varnode = varnode->next;
-    }
-  }
-  // Add the last row-index bound
-  jac_indptr[ncon] = k;
-
-  struct CSRMatrix jacobian = {
-    jac_nnz,
-    jac_nrow,
-    jac_ncol,
-    jac_indptr,
-    jac_indices,
-    jac_values,
-  };
+  struct CSRMatrix jacobian = identify_jacobian_structure(constraint_expressions, ncon, nvar);
+  // Make sure this agrees with the number of nonzeros we counted above
+  assert(jacobian.nnz == jac_nnz);
 
   print_csrmatrix(jacobian);
+  free_csrmatrix(jacobian);
 
   // Free linked lists of variables
   for (int i=0; i<ncon; i++){
@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#include "expr.h"
+#include "nl.h"
+#include "sparse.h"
+#include "op_derivs.h"
+#include "reverse_diff.h"
+#include "pipeline.h"
+
+/*
+ * Read a model with the pipeline, and check that every constraint's value
+ * and Jacobian row arrive in order and are the same as when the whole model
+ * is read first, while only a few expressions are in memory at a time.
+ */
+
+struct Expected {
+  int next;
+  double * values;
+  struct CSRMatrix * rows;
+  int * status;
+  int nerror;
+};
+
+void check_result(struct ConstraintResult * result, void * data){
+  struct Expected * expected = data;
+  assert(result->index == expected->next);
+  expected->next += 1;
+  if (result->status != 0){
+    expected->nerror += 1;
+  }
+  if (expected->values == NULL){
+    return;
+  }
+  struct CSRMatrix row = expected->rows[result->index];
+  assert(result->status == expected->status[result->index]);
+  assert(memcmp(&result->value, &expected->values[result->index], sizeof(double)) == 0);
+  assert(result->jac.nnz == row.nnz);
+  assert(memcmp(result->jac.indices, row.indices, row.nnz * sizeof(int)) == 0);
+  assert(memcmp(result->jac.values, row.values, row.nnz * sizeof(double)) == 0);
+}
+
+void test_model(char * filename){
+  FILE * fp = fopen(filename, "r");
+  struct NLHeader header = read_nl_header(fp);
+  fclose(fp);
+  int nvar = header.nvar;
+  int ncon = header.ncon;
+  struct Variable * variables = malloc(nvar * sizeof(struct Variable));
+  for (int j=0; j<nvar; j++){variables[j].index = j;}
+  fp = fopen(filename, "r");
+  read_starting_point(fp, variables, nvar, NULL, 0);
+  fclose(fp);
+
+  // Everything at once
+  struct Node * constraints = malloc(ncon * sizeof(struct Node));
+  fp = fopen(filename, "r");
+  assert(read_nl_constraints(fp, constraints, ncon, variables, nvar) == 0);
+  fclose(fp);
+  long loaded = memory_usage(MEM_OPERATOR_NODES).bytes;
+  struct Expected expected = {
+    .values = malloc(ncon * sizeof(double)),
+    .rows = malloc(ncon * sizeof(struct CSRMatrix)),
+    .status = calloc(ncon, sizeof(int)),
+  };
+  for (int i=0; i<ncon; i++){
+    expected.values[i] = evaluate(constraints[i]);
+    expected.rows[i] = reverse_diff_expression(constraints[i], nvar);
+    if (!isfinite(expected.values[i])){expected.status[i] = -1;}
+    for (int k=0; k<expected.rows[i].nnz; k++){
+      if (!isfinite(expected.rows[i].values[k])){expected.status[i] = -1;}
+    }
+    free_expression(constraints[i]);
+  }
+  free(constraints);
+
+  int nworker = 4;
+  int capacity = 16;
+  memory_reset_peak();
+  fp = fopen(filename, "r");
+  assert(pipeline_nl_constraints(fp, ncon, variables, nvar, nworker, capacity, check_result, &expected) == 0);
+  fclose(fp);
+  assert(expected.next == ncon);
+  long peak = memory_usage(MEM_OPERATOR_NODES).peak;
+  printf("%s: %d constraints, %ld bytes of expressions loaded, %ld at most in the pipeline\n", filename, ncon, loaded, peak);
+  if (ncon >= 10 * (capacity + nworker + 1)){
+    assert(peak < loaded / 4);
+  }
+  assert(memory_usage(MEM_OPERATOR_NODES).bytes == 0);
+
+  for (int i=0; i<ncon; i++){free_csrmatrix(expected.rows[i]);}
+  free(expected.values);
+  free(expected.rows);
+  free(expected.status);
+  free(variables);
+}
+
+void write_nl(const char * filename, bool missing){
+  FILE * fp = fopen(filename, "w");
+  fprintf(fp, "g3 1 1 0\t# problem pipeline\n");
+  fprintf(fp, " 2 3 0 0 3\t# vars, constraints, objectives, ranges, eqns\n");
+  fprintf(fp, " 3 0\t# nonlinear constraints, objectives\n");
+  fprintf(fp, " 0 0\t# network constraints: nonlinear, linear\n");
+  fprintf(fp, " 2 0 0\t# nonlinear vars in constraints, objectives, both\n");
+  fprintf(fp, " 0 0 0 1\t# linear network variables; functions; arith, flags\n");
+  fprintf(fp, " 0 0 0 0 0\t# discrete variables: binary, integer, nonlinear (b,c,o)\n");
+  fprintf(fp, " 4 0\t# nonzeros in Jacobian, gradients\n");
+  fprintf(fp, " 0 0\t# max name lengths: constraints, variables\n");
+  fprintf(fp, " 0 0 0 0 0\t# common exprs: b,c,o,c1,o1\n");
+  // Out of order, and log(v0 - 2) is undefined at v0 = 1
+  fprintf(fp, "C2\no43\no1\nv0\nn2\n");
+  if (!missing){
+    fprintf(fp, "C0\no2\nv0\nv1\n");
+  }
+  fprintf(fp, "C1\no5\nv1\nn2\n");
+  fclose(fp);
+}
+
+void test_order(){
+  const char * filename = "test-pipeline.nl";
+  struct Variable variables[2] = {{.index = 0, .value = 1.0}, {.index = 1, .value = 3.0}};
+  struct Expected expected = {.next = 0};
+  write_nl(filename, false);
+  FILE * fp = fopen(filename, "r");
+  assert(pipeline_nl_constraints(fp, 3, variables, 2, 2, 1, check_result, &expected) == 0);
+  fclose(fp);
+  assert(expected.next == 3);
+  assert(expected.nerror == 1);
+
+  // Nothing after the missing constraint can be emitted
+  struct Expected missing = {.next = 0};
+  write_nl(filename, true);
+  fp = fopen(filename, "r");
+  assert(pipeline_nl_constraints(fp, 3, variables, 2, 2, 1, check_result, &missing) == -1);
+  fclose(fp);
+  assert(missing.next == 0);
+
+  // With one worker and a queue of one, the reorder window has two slots,
+  // and C2 comes before C0 is read
+  struct Expected ahead = {.next = 0};
+  write_nl(filename, false);
+  fp = fopen(filename, "r");
+  assert(pipeline_nl_constraints(fp, 3, variables, 2, 1, 1, check_result, &ahead) == -1);
+  fclose(fp);
+  assert(ahead.next == 2);
+  assert(memory_total().bytes == 0);
+  remove(filename);
+}
+
+int main(int narg, char ** argv){
+  if (narg < 2){
+    printf("No file provided. Please provide an nl file.\n");
+    return -1;
+  }
+  for (int k=1; k<narg; k++){
+    test_model(argv[k]);
+  }
+  test_order();
+  printf("OK\n");
+  return 0;
+}
@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#include "expr.h"
+#include "nl.h"
+#include "sparse.h"
+#include "op_derivs.h"
+#include "tape.h"
+#include "hessian.h"
+#include "evaluator.h"
+#include "quadratic.h"
+
+const double RTOL = 1e-12;
+
+bool isclose(double a, double b){
+  return fabs(a - b) <= RTOL * fmax(1.0, fmax(fabs(a), fabs(b)));
+}
+
+// Entry (row, col) of a matrix with unsorted rows, or 0 if it isn't stored
+double matrix_entry(struct CSRMatrix csr, double * values, int row, int col){
+  for (int k=csr.indptr[row]; k<csr.indptr[row+1]; k++){
+    if (csr.indices[k] == col){
+      return values[k];
+    }
+  }
+  return 0.0;
+}
+
+// Helpers for constructing expressions by hand
+struct Node constant(double value){
+  struct Node node = {.type = CONST_NODE, .data = {.value = value}};
+  return node;
+}
+
+struct Node variable(struct Variable * var){
+  struct Node node = {.type = VAR_NODE, .data = {.var = var}};
+  return node;
+}
+
+struct Node operator(enum OperatorType op, int nargs, struct Node * args){
+  struct OperatorNode * expr = new_operator_node(op, nargs);
+  for (int i=0; i<nargs; i++){expr->args[i] = args[i];}
+  specialize_power_node(expr);
+  struct Node node = {.type = OP_NODE, .data = {.expr = expr}};
+  return node;
+}
+
+int main(int narg, char ** argv){
+  if (narg < 2){
+    printf("No file provided. Please provide an nl file.\n");
+    return -1;
+  }
+
+  FILE * fp = fopen(argv[1], "r");
+  struct NLHeader header = read_nl_header(fp);
+  fclose(fp);
+  int nvar = header.nvar;
+  int ncon = header.ncon;
+  int nobj = header.nobj;
+  struct Variable * variables = malloc(nvar * sizeof(struct Variable));
+  for (int i=0; i<nvar; i++){variables[i].index = i;}
+  // The constraints, then the objective, then the expressions below
+  int nexpr = ncon + nobj + 4;
+  struct Node * exprs = malloc(nexpr * sizeof(struct Node));
+  fp = fopen(argv[1], "r");
+  read_nl_constraints(fp, exprs, ncon, variables, nvar);
+  fclose(fp);
+  int * sense = malloc(nobj * sizeof(int));
+  fp = fopen(argv[1], "r");
+  read_nl_objectives(fp, exprs + ncon, sense, nobj, variables, nvar);
+  fclose(fp);
+
+  // (v0 + 2 * v1) * (v2 - 3) + v3^2 / 4 - 5
+  struct Node twice_args[2] = {constant(2.0), variable(&variables[1])};
+  struct Node sum_args[2] = {variable(&variables[0]), operator(PRODUCT, 2, twice_args)};
+  struct Node sub_args[2] = {variable(&variables[2]), constant(3.0)};
+  struct Node prod_args[2] = {operator(SUM, 2, sum_args), operator(SUBTRACTION, 2, sub_args)};
+  struct Node sq_args[2] = {variable(&variables[3]), constant(2.0)};
+  struct Node div_args[2] = {operator(POWER, 2, sq_args), constant(4.0)};
+  struct Node quad_args[2] = {operator(PRODUCT, 2, prod_args), operator(DIVISION, 2, div_args)};
+  struct Node quad_minus[2] = {operator(SUM, 2, quad_args), constant(5.0)};
+  // 3 * v0 - v4 * exp(0)
+  struct Node three_args[2] = {constant(3.0), variable(&variables[0])};
+  struct Node exp_args[1] = {constant(0.0)};
+  struct Node v4_args[2] = {variable(&variables[4]), operator(EXP, 1, exp_args)};
+  struct Node lin_args[2] = {operator(PRODUCT, 2, three_args), operator(PRODUCT, 2, v4_args)};
+  // v0 * v1 * v2, and (v1 - v1) * v2 * v3, which is zero
+  struct Node cubic_args[3] = {variable(&variables[0]), variable(&variables[1]), variable(&variables[2])};
+  struct Node cancel_args[2] = {variable(&variables[1]), variable(&variables[1])};
+  struct Node cancel_prod[3] = {operator(SUBTRACTION, 2, cancel_args), variable(&variables[2]), variable(&variables[3])};
+  exprs[ncon + nobj] = operator(SUBTRACTION, 2, quad_minus);
+  exprs[ncon + nobj + 1] = operator(SUBTRACTION, 2, lin_args);
+  exprs[ncon + nobj + 2] = operator(PRODUCT, 3, cubic_args);
+  exprs[ncon + nobj + 3] = operator(PRODUCT, 3, cancel_prod);
+
+  for (int i=0; i<nexpr; i++){
+    char expr_str[256];
+    to_string(expr_str, 256, exprs[i]);
+    enum ExpressionClass class = classify_expression(exprs[i], NULL);
+    char * names[3] = {"linear", "quadratic", "nonlinear"};
+    printf("Expression %2d (%s): %s\n", i, names[class], expr_str);
+  }
+  // Every constraint in model.nl is nonlinear, and the objective is a sum
+  // of squares
+  for (int i=0; i<ncon; i++){
+    assert(classify_expression(exprs[i], NULL) == NONLINEAR_EXPRESSION);
+  }
+  struct QuadraticForm form;
+  assert(nobj == 1 && sense[0] == 0);
+  assert(classify_expression(exprs[ncon], &form) == QUADRATIC_EXPRESSION);
+  assert(form.nlin == 0 && form.nquad == nvar && form.constant == 0.0);
+  for (int k=0; k<nvar; k++){
+    assert(form.quad[k].row == k && form.quad[k].col == k && form.quad[k].coef == 1.0);
+  }
+  free_quadratic_form(form);
+
+  // v0*v2 - 3*v0 + 2*v1*v2 - 6*v1 + 0.25*v3^2 - 5
+  assert(classify_expression(exprs[ncon + nobj], &form) == QUADRATIC_EXPRESSION);
+  assert(form.constant == -5.0);
+  assert(form.nlin == 2 && form.nquad == 3 && form.nvar == 4);
+  assert(form.lin[0].var == 0 && form.lin[0].coef == -3.0);
+  assert(form.lin[1].var == 1 && form.lin[1].coef == -6.0);
+  assert(form.quad[0].row == 2 && form.quad[0].col == 0 && form.quad[0].coef == 1.0);
+  assert(form.quad[1].row == 2 && form.quad[1].col == 1 && form.quad[1].coef == 2.0);
+  assert(form.quad[2].row == 3 && form.quad[2].col == 3 && form.quad[2].coef == 0.25);
+  free_quadratic_form(form);
+  assert(classify_expression(exprs[ncon + nobj + 1], &form) == LINEAR_EXPRESSION);
+  assert(form.nlin == 2 && form.nquad == 0 && form.grad_matrix.nnz == 0);
+  free_quadratic_form(form);
+  assert(classify_expression(exprs[ncon + nobj + 2], NULL) == NONLINEAR_EXPRESSION);
+  assert(classify_expression(exprs[ncon + nobj + 3], &form) == LINEAR_EXPRESSION);
+  assert(form.nlin == 0 && form.nvar == 0 && form.constant == 0.0);
+  free_quadratic_form(form);
+
+  // Parameters make an expression nonlinear
+  struct Parameter p = {.index = 0, .value = 2.0};
+  struct Node param_args[2] = {variable(&variables[0]), {.type = PARAM_NODE, .data = {.param = &p}}};
+  struct Node param_expr = operator(PRODUCT, 2, param_args);
+  assert(classify_expression(param_expr, NULL) == NONLINEAR_EXPRESSION);
+  free_expression(param_expr);
+
+  // Compare the quadratic evaluator against the tape, treating the
+  // objective as another constraint.
+  struct Evaluator tape_ev = tape_evaluator(exprs, nexpr, nvar);
+  struct Evaluator quad_ev = quadratic_evaluator(exprs, nexpr, nvar);
+  printf("Jacobian nnz: tape = %d, quadratic = %d\n", tape_ev.jacobian.nnz, quad_ev.jacobian.nnz);
+  printf("Hessian nnz: tape = %d, quadratic = %d\n", tape_ev.hessian.nnz, quad_ev.hessian.nnz);
+  assert(quad_ev.jacobian.nnz <= tape_ev.jacobian.nnz);
+  assert(quad_ev.hessian.nnz <= tape_ev.hessian.nnz);
+
+  double * x = malloc(nvar * sizeof(double));
+  double * lambda = malloc(nexpr * sizeof(double));
+  for (int j=0; j<nvar; j++){x[j] = 1.0 + (j+1) / 10.0;}
+  for (int i=0; i<nexpr; i++){lambda[i] = (i % 2 == 0 ? 1.0 : -1.0) * (i + 1) / 2.0;}
+  double * g_tape = malloc(nexpr * sizeof(double));
+  double * g_quad = malloc(nexpr * sizeof(double));
+  double * jac_tape = malloc(tape_ev.jacobian.nnz * sizeof(double));
+  double * jac_quad = malloc(quad_ev.jacobian.nnz * sizeof(double));
+  double * hess_tape = malloc(tape_ev.hessian.nnz * sizeof(double));
+  double * hess_quad = malloc(quad_ev.hessian.nnz * sizeof(double));
+  // Evaluate the Hessian twice, to check that the constant entries aren't
+  // accumulated across calls
+  for (int rep=0; rep<2; rep++){
+    tape_ev.eval_g(tape_ev.data, x, NULL, g_tape);
+    quad_ev.eval_g(quad_ev.data, x, NULL, g_quad);
+    tape_ev.eval_jac(tape_ev.data, x, NULL, jac_tape);
+    quad_ev.eval_jac(quad_ev.data, x, NULL, jac_quad);
+    tape_ev.eval_hess(tape_ev.data, x, NULL, lambda, hess_tape);
+    quad_ev.eval_hess(quad_ev.data, x, NULL, lambda, hess_quad);
+  }
+  for (int i=0; i<nexpr; i++){
+    assert(isclose(g_tape[i], g_quad[i]));
+    for (int j=0; j<nvar; j++){
+      double tape_value = matrix_entry(tape_ev.jacobian, jac_tape, i, j);
+      double quad_value = matrix_entry(quad_ev.jacobian, jac_quad, i, j);
+      assert(isclose(tape_value, quad_value));
+    }
+  }
+  for (int l=0; l<nvar; l++){
+    for (int j=0; j<=l; j++){
+      double tape_value = matrix_entry(tape_ev.hessian, hess_tape, l, j);
+      double quad_value = matrix_entry(quad_ev.hessian, hess_quad, l, j);
+      assert(isclose(tape_value, quad_value));
+    }
+  }
+  printf("Quadratic evaluator matches the tape\n");
+
+  free(x);
+  free(lambda);
+  free(g_tape);
+  free(g_quad);
+  free(jac_tape);
+  free(jac_quad);
+  free(hess_tape);
+  free(hess_quad);
+  free_evaluator(tape_ev);
+  free_evaluator(quad_ev);
+  for (int i=0; i<nexpr; i++){free_expression(exprs[i]);}
+  free(exprs);
+  free(sense);
+  free(variables);
+  return 0;
+}
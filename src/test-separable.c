@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#include "expr.h"
+#include "nl.h"
+#include "sparse.h"
+#include "op_derivs.h"
+#include "tape.h"
+#include "separable.h"
+
+const double RTOL = 1e-12;
+
+bool isclose(double a, double b){
+  return fabs(a - b) <= RTOL * fmax(1.0, fmax(fabs(a), fabs(b)));
+}
+
+// Helpers for constructing expressions by hand
+struct Node constant(double value){
+  struct Node node = {.type = CONST_NODE, .data = {.value = value}};
+  return node;
+}
+
+struct Node variable(struct Variable * var){
+  struct Node node = {.type = VAR_NODE, .data = {.var = var}};
+  return node;
+}
+
+struct Node parameter(struct Parameter * param){
+  struct Node node = {.type = PARAM_NODE, .data = {.param = param}};
+  return node;
+}
+
+struct Node operator(enum OperatorType op, int nargs, struct Node * args){
+  struct OperatorNode * expr = new_operator_node(op, nargs);
+  for (int i=0; i<nargs; i++){expr->args[i] = args[i];}
+  specialize_power_node(expr);
+  struct Node node = {.type = OP_NODE, .data = {.expr = expr}};
+  return node;
+}
+
+/*
+ * Compare the separable function's value, gradient and Hessian against a
+ * tape of the whole expression, at parameter values p.
+ */
+void check_separable(struct Node expr, int nvar, double * p){
+  struct SeparableFunction sf = separable_function(expr, nvar);
+  struct Tape tape = compile_tape(&expr, 1, nvar);
+  struct CSRMatrix full = tape_hessian_structure(&tape);
+  printf(
+    "%d elements, Hessian nnz = %d (%d as one expression)\n",
+    sf.nelement, sf.hessian.nnz, full.nnz
+  );
+
+  double * x = malloc(nvar * sizeof(double));
+  for (int j=0; j<nvar; j++){x[j] = 1.0 + (j % 7) / 10.0;}
+  double * values = malloc(tape.nnode * sizeof(double));
+  double * dvalues = malloc(tape.nnode * sizeof(double));
+  double * adjoints = malloc(tape.nnode * sizeof(double));
+  double * dadjoints = malloc(tape.nnode * sizeof(double));
+  double * grad = malloc(nvar * sizeof(double));
+  double * tape_grad = malloc(nvar * sizeof(double));
+  double * hess_values = malloc(sf.hessian.nnz * sizeof(double));
+  double scale = 0.5;
+  tape_evaluate(&tape, x, p, values);
+  double value;
+  tape_expression_values(&tape, values, &value);
+  for (int j=0; j<nvar; j++){adjoints[j] = 0.0;}
+  tape_reverse(&tape, 0, values, adjoints);
+  for (int j=0; j<nvar; j++){tape_grad[j] = adjoints[j];}
+  tape_hessian(&tape, values, &scale, full, dvalues, adjoints, dadjoints, full.values);
+
+  assert(isclose(value, separable_value(&sf, x, p)));
+  separable_gradient(&sf, x, p, grad);
+  for (int j=0; j<nvar; j++){assert(isclose(tape_grad[j], grad[j]));}
+  separable_hessian(&sf, x, p, scale, hess_values);
+  for (int l=0; l<nvar; l++){
+    for (int k=full.indptr[l]; k<full.indptr[l+1]; k++){
+      int ks = csr_find_entry(sf.hessian, l, full.indices[k]);
+      assert(isclose(full.values[k], ks >= 0 ? hess_values[ks] : 0.0));
+    }
+  }
+  printf("Separable function matches the tape\n");
+
+  free(x);
+  free(values);
+  free(dvalues);
+  free(adjoints);
+  free(dadjoints);
+  free(grad);
+  free(tape_grad);
+  free(hess_values);
+  free_csrmatrix(full);
+  free_tape(tape);
+  free_separable_function(sf);
+}
+
+int main(int narg, char ** argv){
+  if (narg < 2){
+    printf("No file provided. Please provide an nl file.\n");
+    return -1;
+  }
+
+  // The objective of the .nl file is a sum of squares
+  FILE * fp = fopen(argv[1], "r");
+  struct NLHeader header = read_nl_header(fp);
+  fclose(fp);
+  int nvar = header.nvar;
+  struct Variable * variables = malloc(nvar * sizeof(struct Variable));
+  for (int i=0; i<nvar; i++){variables[i].index = i;}
+  struct Node * objectives = malloc(header.nobj * sizeof(struct Node));
+  int * sense = malloc(header.nobj * sizeof(int));
+  fp = fopen(argv[1], "r");
+  read_nl_objectives(fp, objectives, sense, header.nobj, variables, nvar);
+  fclose(fp);
+  struct SeparableFunction sf = separable_function(objectives[0], nvar);
+  assert(sf.nelement == nvar);
+  for (int e=0; e<sf.nelement; e++){assert(sf.elements[e].nvar == 1);}
+  free_separable_function(sf);
+  check_separable(objectives[0], nvar, NULL);
+  for (int i=0; i<header.nobj; i++){free_expression(objectives[i]);}
+  free(objectives);
+  free(sense);
+  free(variables);
+
+  // 3 + sum_i (v[i] - v[i+1])^2 - sum_i (-sin(v[i] * v[i+2]))
+  int n = 300;
+  variables = malloc(n * sizeof(struct Variable));
+  for (int i=0; i<n; i++){variables[i].index = i;}
+  struct Node * squares = malloc(n * sizeof(struct Node));
+  struct Node * sines = malloc(n * sizeof(struct Node));
+  squares[0] = constant(3.0);
+  for (int i=0; i<n-1; i++){
+    struct Node diff_args[2] = {variable(&variables[i]), variable(&variables[i+1])};
+    struct Node sq_args[2] = {operator(SUBTRACTION, 2, diff_args), constant(2.0)};
+    squares[i+1] = operator(POWER, 2, sq_args);
+  }
+  for (int i=0; i<n-2; i++){
+    struct Node prod_args[2] = {variable(&variables[i]), variable(&variables[i+2])};
+    struct Node sin_args[1] = {operator(PRODUCT, 2, prod_args)};
+    struct Node neg_args[1] = {operator(SIN, 1, sin_args)};
+    sines[i] = operator(NEG, 1, neg_args);
+  }
+  struct Node sums[2] = {operator(SUM, n, squares), operator(SUM, n-2, sines)};
+  struct Node objective = operator(SUBTRACTION, 2, sums);
+  sf = separable_function(objective, n);
+  assert(sf.nelement == 2 * n - 3);
+  assert(sf.constant == 3.0);
+  free_separable_function(sf);
+  check_separable(objective, n, NULL);
+  free_expression(objective);
+  free(squares);
+  free(sines);
+  free(variables);
+
+  // p0 * v0 + v1^2 + exp(p1) + p1 * v0 * v1: exp(p1) has no variables, but
+  // has to follow p1
+  struct Parameter params[2] = {{.index = 0, .value = 2.0}, {.index = 1, .value = 0.5}};
+  double p[2];
+  variables = malloc(2 * sizeof(struct Variable));
+  for (int i=0; i<2; i++){variables[i].index = i;}
+  struct Node lin_args[2] = {parameter(&params[0]), variable(&variables[0])};
+  struct Node sq_args[2] = {variable(&variables[1]), constant(2.0)};
+  struct Node exp_args[1] = {parameter(&params[1])};
+  struct Node prod_args[3] = {parameter(&params[1]), variable(&variables[0]), variable(&variables[1])};
+  struct Node terms[4] = {
+    operator(PRODUCT, 2, lin_args),
+    operator(POWER, 2, sq_args),
+    operator(EXP, 1, exp_args),
+    operator(PRODUCT, 3, prod_args),
+  };
+  objective = operator(SUM, 4, terms);
+  sf = separable_function(objective, 2);
+  assert(sf.nelement == 4);
+  assert(sf.constant == 0.0);
+  double x[2] = {1.0, 1.1};
+  for (int r=0; r<2; r++){
+    gather_parameter_values(params, 2, p);
+    double expected = p[0] * x[0] + x[1] * x[1] + exp(p[1]) + p[1] * x[0] * x[1];
+    assert(isclose(separable_value(&sf, x, p), expected));
+    check_separable(objective, 2, p);
+    params[0].value = -1.0;
+    params[1].value = 3.0;
+  }
+  free_separable_function(sf);
+  free_expression(objective);
+  free(variables);
+  return 0;
+}
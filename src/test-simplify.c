@@ -0,0 +1,200 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#include "expr.h"
+#include "nl.h"
+#include "sparse.h"
+#include "op_derivs.h"
+#include "reverse_diff.h"
+#include "tape.h"
+#include "simplify.h"
+
+const double RTOL = 1e-12;
+
+bool isclose(double a, double b){
+  return fabs(a - b) <= RTOL * fmax(1.0, fmax(fabs(a), fabs(b)));
+}
+
+// Helpers for constructing expressions by hand
+struct Node constant(double value){
+  struct Node node = {.type = CONST_NODE, .data = {.value = value}};
+  return node;
+}
+
+struct Node variable(struct Variable * var){
+  struct Node node = {.type = VAR_NODE, .data = {.var = var}};
+  return node;
+}
+
+struct Node operator(enum OperatorType op, int nargs, struct Node * args){
+  struct OperatorNode * expr = new_operator_node(op, nargs);
+  for (int i=0; i<nargs; i++){expr->args[i] = args[i];}
+  struct Node node = {.type = OP_NODE, .data = {.expr = expr}};
+  return node;
+}
+
+// Simplify expr and check that the result prints as `expected`
+void check_simplify(struct Node expr, char * expected){
+  char before[256];
+  char after[256];
+  double value = evaluate(expr);
+  to_string(before, 256, expr);
+  simplify_expression(&expr);
+  to_string(after, 256, expr);
+  printf("%s -> %s\n", before, after);
+  assert(strcmp(after, expected) == 0);
+  assert(isclose(value, evaluate(expr)));
+  free_expression(expr);
+}
+
+int main(int narg, char ** argv){
+  if (narg < 2){
+    printf("No file provided. Please provide an nl file.\n");
+    return -1;
+  }
+
+  struct Variable x = {.index = 0, .value = 1.5};
+  struct Parameter p = {.index = 0, .value = 2.5};
+  struct Node param = {.type = PARAM_NODE, .data = {.param = &p}};
+
+  // (2 + 3) * v0 * 1
+  struct Node sum_args[2] = {constant(2.0), constant(3.0)};
+  struct Node prod_args[3] = {operator(SUM, 2, sum_args), variable(&x), constant(1.0)};
+  check_simplify(operator(PRODUCT, 3, prod_args), "(v0 * 5.000)");
+  // v0 - 0 and 0 - v0
+  struct Node sub_args[2] = {variable(&x), constant(0.0)};
+  check_simplify(operator(SUBTRACTION, 2, sub_args), "v0");
+  struct Node rsub_args[2] = {constant(0.0), variable(&x)};
+  check_simplify(operator(SUBTRACTION, 2, rsub_args), "-(v0)");
+  // -(-(v0))
+  struct Node neg_args[1] = {variable(&x)};
+  struct Node negneg_args[1] = {operator(NEG, 1, neg_args)};
+  check_simplify(operator(NEG, 1, negneg_args), "v0");
+  // v0^1, v0^0, v0^2, v0^3, v0^0.5
+  double exponents[5] = {1.0, 0.0, 2.0, 3.0, 0.5};
+  char * expected[5] = {"v0", "1.000", "sq(v0)", "(v0 ^ 3.000)", "(v0 ^ 0.500)"};
+  enum OperatorType expected_op[5] = {-1, -1, SQUARE, POW_CONST_INT, POW_CONST_REAL};
+  for (int i=0; i<5; i++){
+    struct Node pow_args[2] = {variable(&x), constant(exponents[i])};
+    struct Node expr = operator(POWER, 2, pow_args);
+    simplify_expression(&expr);
+    if (expected_op[i] != -1){
+      assert(expr.type == OP_NODE && expr.data.expr->op == expected_op[i]);
+    }
+    char buffer[256];
+    to_string(buffer, 256, expr);
+    assert(strcmp(buffer, expected[i]) == 0);
+    free_expression(expr);
+  }
+  // Specialized powers match generic powers, in value and in the partial
+  // derivative with respect to the non-constant operand
+  double constants[6] = {2.0, 3.0, -3.0, 0.5, 7.0, -1.25};
+  for (int i=0; i<6; i++){
+    for (int ibase=0; ibase<2; ibase++){
+      if (ibase == 0 && constants[i] < 0.0){
+        // Negative constant bases give NaN for non-integer exponents
+        continue;
+      }
+      struct Node pow_args[2];
+      pow_args[ibase] = constant(constants[i]);
+      pow_args[1-ibase] = variable(&x);
+      struct Node generic = operator(POWER, 2, pow_args);
+      struct Node special = operator(POWER, 2, pow_args);
+      assert(specialize_power_node(special.data.expr) == 1);
+      double generic_deriv[2];
+      double special_deriv[2];
+      diff_operator(POWER, generic.data.expr->args, 2, generic_deriv);
+      diff_operator(special.data.expr->op, special.data.expr->args, special.data.expr->nargs, special_deriv);
+      printf("%s: %f, %f\n", OPERATOR_DATA[special.data.expr->op].opstring, evaluate(special), special_deriv[1-ibase]);
+      assert(isclose(evaluate(generic), evaluate(special)));
+      assert(isclose(generic_deriv[1-ibase], special_deriv[1-ibase]));
+      free_expression(generic);
+      free_expression(special);
+    }
+  }
+
+  // Parameters are never folded: p0 + 1 * 2
+  struct Node two_args[2] = {constant(1.0), constant(2.0)};
+  struct Node param_args[2] = {param, operator(PRODUCT, 2, two_args)};
+  check_simplify(operator(SUM, 2, param_args), "(p0 + 2.000)");
+
+  // Simplify the constraints of the .nl file and compare values and
+  // derivatives, with both the tree and the tape, against the originals.
+  FILE * fp = fopen(argv[1], "r");
+  struct NLHeader header = read_nl_header(fp);
+  fclose(fp);
+  int nvar = header.nvar;
+  int ncon = header.ncon;
+  struct Variable * variables = malloc(nvar * sizeof(struct Variable));
+  for (int i=0; i<nvar; i++){
+    variables[i].index = i;
+    variables[i].value = 1.0 + (i+1) / 10.0;
+  }
+  struct Node * original = malloc(ncon * sizeof(struct Node));
+  struct Node * simplified = malloc(ncon * sizeof(struct Node));
+  fp = fopen(argv[1], "r");
+  read_nl_constraints(fp, original, ncon, variables, nvar);
+  fclose(fp);
+  fp = fopen(argv[1], "r");
+  read_nl_constraints(fp, simplified, ncon, variables, nvar);
+  fclose(fp);
+  int nsimplified = simplify_expressions(simplified, ncon);
+  printf("Made %d simplifications to %d constraints\n", nsimplified, ncon);
+
+  struct Tape tape = compile_tape(simplified, ncon, nvar);
+  double * values = malloc(tape.nnode * sizeof(double));
+  double * adjoints = malloc(tape.nnode * sizeof(double));
+  double * x_values = malloc(nvar * sizeof(double));
+  double * con_values = malloc(ncon * sizeof(double));
+  gather_variable_values(variables, nvar, x_values);
+  tape_evaluate(&tape, x_values, NULL, values);
+  tape_expression_values(&tape, values, con_values);
+  struct CSRMatrix jac = tape_jacobian_structure(&tape);
+  tape_jacobian(&tape, values, adjoints, jac.values);
+
+  for (int i=0; i<ncon; i++){
+    char con_str[82];
+    to_string(con_str, 82, simplified[i]);
+    printf("Constraint %2d: %s\n", i, con_str);
+    double value = evaluate(original[i]);
+    assert(isclose(value, evaluate(simplified[i])));
+    assert(isclose(value, con_values[i]));
+
+    struct CSRMatrix orig_row = reverse_diff_expression(original[i], nvar);
+    struct CSRMatrix simp_row = reverse_diff_expression(simplified[i], nvar);
+    for (int k=0; k<orig_row.nnz; k++){
+      for (int kk=0; kk<simp_row.nnz; kk++){
+        if (orig_row.indices[k] == simp_row.indices[kk]){
+          assert(isclose(orig_row.values[k], simp_row.values[kk]));
+        }
+      }
+      for (int kk=jac.indptr[i]; kk<jac.indptr[i+1]; kk++){
+        if (orig_row.indices[k] == jac.indices[kk]){
+          assert(isclose(orig_row.values[k], jac.values[kk]));
+        }
+      }
+    }
+    free_csrmatrix(orig_row);
+    free_csrmatrix(simp_row);
+  }
+  printf("Simplified constraints match the originals\n");
+
+  free_csrmatrix(jac);
+  free(values);
+  free(adjoints);
+  free(x_values);
+  free(con_values);
+  free_tape(tape);
+  for (int i=0; i<ncon; i++){
+    free_expression(original[i]);
+    free_expression(simplified[i]);
+  }
+  free(original);
+  free(simplified);
+  free(variables);
+  return 0;
+}
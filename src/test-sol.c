@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#include "expr.h"
+#include "nl.h"
+#include "sol.h"
+
+// Fewest significant digits in "%.*e" that round-trip
+int printf_digits(double value){
+  char buffer[64];
+  for (int p=1; p<17; p++){
+    snprintf(buffer, 64, "%.*e", p - 1, value);
+    if (strtod(buffer, NULL) == value){
+      return p;
+    }
+  }
+  return 17;
+}
+
+/*
+ * Check that _format_double round-trips, on random bit patterns (a quarter of
+ * them subnormal), and uses as few digits as the shortest "%.*e" that does.
+ * It may use fewer at powers of two, where the interval of reals rounding to
+ * the value is lopsided and the closest decimal with fewer digits is on the
+ * wrong side.
+ */
+void test_format_double(){
+  char buffer[SOL_DOUBLE_MAXLEN];
+  struct {double value; char * expected;} cases[] = {
+    {0.1, "0.1"},
+    {-3.0, "-3"},
+    {-0.0, "-0"},
+    {1.0 / 3.0, "0.3333333333333333"},
+    {1e23, "1e+23"},
+    {1.5e16, "15000000000000000"},
+    {1e-5, "1e-05"},
+    {0.000123, "0.000123"},
+    {5e-324, "5e-324"},
+    {-2.2250738585072014e-308, "-2.2250738585072014e-308"},
+    {1.7976931348623157e308, "1.7976931348623157e+308"},
+  };
+  for (int i=0; i<sizeof(cases)/sizeof(cases[0]); i++){
+    _format_double(buffer, cases[i].value);
+    assert(strcmp(buffer, cases[i].expected) == 0);
+  }
+
+  uint64_t state = 88172645463325252ull;
+  int nchecked = 0;
+  for (int n=0; n<200000; n++){
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    uint64_t bits = n % 4 == 0 ? state & 0x800fffffffffffffull : state;
+    double value;
+    memcpy(&value, &bits, sizeof(double));
+    if (!isfinite(value) || value == 0.0){
+      continue;
+    }
+    int len = _format_double(buffer, value);
+    assert(len < SOL_DOUBLE_MAXLEN && strtod(buffer, NULL) == value);
+    uint64_t digits;
+    int exponent;
+    shortest_decimal(fabs(value), &digits, &exponent);
+    while (digits % 10 == 0){digits /= 10;}
+    int ndigit = 0;
+    for (; digits>0; digits/=10){ndigit++;}
+    int expected = printf_digits(value);
+    bool power_of_two = (bits & 0xfffffffffffffull) == 0;
+    assert(ndigit == expected || (power_of_two && ndigit < expected));
+    nchecked++;
+  }
+  printf("%d random doubles round-trip with the fewest digits\n", nchecked);
+}
+
+/*
+ * Writing to a stream opened for reading fails when the buffer is flushed.
+ * On a full device (if there is one), stdio accepts the start of the file,
+ * and writing the binary duals, which are too large for the buffer and are
+ * written directly, fails.
+ */
+void test_write_errors(char * filename){
+  int ndual = SOL_BUFSIZE / sizeof(double) + 1;
+  double * duals = calloc(ndual, sizeof(double));
+  struct Variable variable = {.index = 0, .value = 1.0};
+  FILE * fp = fopen(filename, "r");
+  assert(write_sol(fp, "test-sol", &variable, 1, duals, 1, 0, false) == -1);
+  fclose(fp);
+  fp = fopen("/dev/full", "w");
+  if (fp != NULL){
+    assert(write_sol(fp, "test-sol", &variable, 1, duals, ndual, 0, true) == -1);
+    fclose(fp);
+  }
+  free(duals);
+  printf("Failed writes are reported\n");
+}
+
+int main(int narg, char ** argv){
+  if (narg < 2){
+    printf("No file provided. Please provide an nl file.\n");
+    return -1;
+  }
+
+  FILE * fp = fopen(argv[1], "r");
+  struct NLHeader header = read_nl_header(fp);
+  fclose(fp);
+
+  int nvar = header.nvar;
+  int ncon = header.ncon;
+  struct Variable * variables = malloc(nvar * sizeof(struct Variable));
+  for (int i=0; i<nvar; i++){variables[i].index = i;}
+  fp = fopen(argv[1], "r");
+  read_nl_variables(fp, variables, nvar);
+  fclose(fp);
+
+  // Values that exercise both the integer and general formatting paths
+  variables[0].value = 0.1;
+  variables[1].value = -3.0;
+  variables[2].value = 1.0 / 3.0;
+  double * duals = malloc(ncon * sizeof(double));
+  for (int i=0; i<ncon; i++){duals[i] = -1.5e-300 * (i + 1);}
+
+  char * message = "test-sol: Optimal Solution Found\nSecond line of message";
+
+  // Temporary files, so we don't leave anything in the working directory
+  FILE * solfps[2] = {tmpfile(), tmpfile()};
+  assert(write_sol(solfps[0], message, variables, nvar, duals, ncon, 0, false) == 0);
+  assert(write_sol(solfps[1], message, variables, nvar, duals, ncon, 0, true) == 0);
+
+  printf("Wrote ASCII .sol file:\n");
+  rewind(solfps[0]);
+  char line[82];
+  while (fgets(line, 82, solfps[0])){
+    printf("  %s", line);
+  }
+
+  // Read the values back and make sure they round-trip exactly
+  double * expected = malloc(nvar * sizeof(double));
+  for (int i=0; i<nvar; i++){expected[i] = variables[i].value;}
+  double * duals_read = malloc(ncon * sizeof(double));
+  for (int b=0; b<2; b++){
+    bool binary = b == 1;
+    for (int i=0; i<nvar; i++){variables[i].value = 0.0;}
+    for (int i=0; i<ncon; i++){duals_read[i] = 0.0;}
+    rewind(solfps[b]);
+    int solve_result = read_sol(solfps[b], variables, nvar, duals_read, ncon, binary);
+    fclose(solfps[b]);
+    printf("Read %s .sol file. solve_result_num = %d\n", binary ? "binary" : "ASCII", solve_result);
+    assert(solve_result == 0);
+    for (int i=0; i<nvar; i++){assert(variables[i].value == expected[i]);}
+    for (int i=0; i<ncon; i++){assert(duals_read[i] == duals[i]);}
+  }
+
+  // Load a new starting point from a small buffer containing x and d segments
+  char * segments = "x2\n1 2.5\n4 -0.25\nd1\n3 7\n";
+  int nloaded = read_starting_point_buffer(segments, strlen(segments), variables, nvar, duals_read, ncon);
+  printf("Loaded %d values from buffer\n", nloaded);
+  assert(nloaded == 3);
+  assert(variables[1].value == 2.5 && variables[4].value == -0.25);
+  assert(variables[0].value == expected[0]);
+  assert(duals_read[3] == 7.0);
+
+  // Re-load the starting point from the .nl file itself, skipping everything
+  // but the x segment.
+  fp = fopen(argv[1], "r");
+  nloaded = read_starting_point(fp, variables, nvar, NULL, ncon);
+  fclose(fp);
+  printf("Loaded %d values from %s\n", nloaded, argv[1]);
+  for (int i=0; i<nvar; i++){
+    printf("Variable %2d: value = %f\n", i, variables[i].value);
+  }
+  // The file is streamed, and gives the same values as parsing it from memory
+  for (int i=0; i<nvar; i++){expected[i] = variables[i].value;}
+  fp = fopen(argv[1], "r");
+  long bsize;
+  char * buffer = read_to_buffer(fp, &bsize);
+  fclose(fp);
+  assert(read_starting_point_buffer(buffer, bsize, variables, nvar, NULL, ncon) == nloaded);
+  for (int i=0; i<nvar; i++){assert(variables[i].value == expected[i]);}
+  mem_free(MEM_BUFFERS, buffer);
+
+  // Streaming skips long lines in other segments, and stops at a truncated
+  // segment
+  fp = tmpfile();
+  fprintf(fp, "# %079dx9\nx2\n1 2.5\n4 -0.25\nd1\n3 7\n", 0);
+  rewind(fp);
+  assert(read_starting_point(fp, variables, nvar, duals_read, ncon) == 3);
+  assert(variables[1].value == 2.5 && variables[4].value == -0.25);
+  fprintf(fp, "x3\n0 1.0\n");
+  fseek(fp, 0, SEEK_SET);
+  assert(read_starting_point(fp, variables, nvar, duals_read, ncon) == -1);
+  fclose(fp);
+
+  free(expected);
+  free(duals_read);
+  free(duals);
+  free(variables);
+
+  test_format_double();
+  test_write_errors(argv[1]);
+  return 0;
+}
@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#include "expr.h"
+#include "sparse.h"
+
+const double RTOL = 1e-12;
+
+bool isclose(double a, double b){
+  return fabs(a - b) <= RTOL * fmax(1.0, fmax(fabs(a), fabs(b)));
+}
+
+int main(int narg, char ** argv){
+  // A 3 x 4 matrix in triplet form, in no particular order:
+  //
+  //     [1 0 2 0]
+  //     [0 0 3 4]
+  //     [5 6 0 0]
+  int rows[6] = {1, 0, 2, 1, 0, 2};
+  int cols[6] = {3, 2, 0, 2, 0, 1};
+  double values[6] = {4.0, 2.0, 5.0, 3.0, 1.0, 6.0};
+  struct COOMatrix coo = {.nnz = 6, .nrow = 3, .ncol = 4, .rows = rows, .cols = cols, .values = values};
+  double dense[3][4] = {{1, 0, 2, 0}, {0, 0, 3, 4}, {5, 6, 0, 0}};
+
+  int coo_perm[6];
+  struct CSRMatrix csr = coo_to_csr(coo, coo_perm);
+  print_csrmatrix(csr);
+  int expected_indptr[4] = {0, 2, 4, 6};
+  int expected_indices[6] = {0, 2, 2, 3, 0, 1};
+  for (int i=0; i<=3; i++){assert(csr.indptr[i] == expected_indptr[i]);}
+  for (int k=0; k<6; k++){
+    assert(csr.indices[k] == expected_indices[k]);
+    assert(csr.values[k] == values[coo_perm[k]]);
+  }
+
+  int csc_perm[6];
+  struct CSCMatrix csc = csr_to_csc(csr, csc_perm);
+  for (int j=0; j<4; j++){
+    for (int k=csc.indptr[j]; k<csc.indptr[j+1]; k++){
+      assert(csc.values[k] == dense[csc.indices[k]][j]);
+      // Row indices are sorted within each column
+      assert(k == csc.indptr[j] || csc.indices[k-1] < csc.indices[k]);
+    }
+  }
+  struct CSRMatrix back = csc_to_csr(csc, NULL);
+  for (int k=0; k<6; k++){
+    assert(back.indices[k] == csr.indices[k] && back.values[k] == csr.values[k]);
+  }
+  struct COOMatrix triplets = csr_to_coo(csr);
+  for (int k=0; k<6; k++){
+    assert(triplets.values[k] == dense[triplets.rows[k]][triplets.cols[k]]);
+  }
+
+  // New values in the original triplet order only need the permutations
+  double new_values[6];
+  for (int k=0; k<6; k++){new_values[k] = 10.0 * values[k];}
+  permute_values(6, coo_perm, new_values, csr.values);
+  permute_values(6, csc_perm, csr.values, csc.values);
+  for (int i=0; i<3; i++){dense[i][0] *= 10.0; dense[i][1] *= 10.0; dense[i][2] *= 10.0; dense[i][3] *= 10.0;}
+
+  double x[4] = {1.0, -2.0, 0.5, 3.0};
+  double w[3] = {2.0, -1.0, 0.25};
+  double y[3];
+  double yt[4];
+  double yt_csc[4];
+  csr_matvec(csr, x, y);
+  csr_matvec_transpose(csr, w, yt);
+  csc_matvec_transpose(csc, w, yt_csc);
+  for (int i=0; i<3; i++){
+    double expected = 0.0;
+    for (int j=0; j<4; j++){expected += dense[i][j] * x[j];}
+    assert(isclose(expected, y[i]));
+  }
+  for (int j=0; j<4; j++){
+    double expected = 0.0;
+    for (int i=0; i<3; i++){expected += dense[i][j] * w[i];}
+    assert(isclose(expected, yt[j]));
+    assert(isclose(expected, yt_csc[j]));
+  }
+  printf("Conversions and products match the dense matrix\n");
+
+  free_csrmatrix(csr);
+  free_csrmatrix(back);
+  free_cscmatrix(csc);
+  free_coomatrix(triplets);
+  return 0;
+}
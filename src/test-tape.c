@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#include "expr.h"
+#include "nl.h"
+#include "sparse.h"
+#include "op_derivs.h"
+#include "reverse_diff.h"
+#include "tape.h"
+#include "cse.h"
+
+// Relative tolerance for comparing results of the tree and tape
+const double RTOL = 1e-12;
+
+bool isclose(double a, double b){
+  return fabs(a - b) <= RTOL * fmax(1.0, fmax(fabs(a), fabs(b)));
+}
+
+int main(int narg, char ** argv){
+  if (narg < 2){
+    printf("No file provided. Please provide an nl file.\n");
+    return -1;
+  }
+
+  FILE * fp = fopen(argv[1], "r");
+  struct NLHeader header = read_nl_header(fp);
+  fclose(fp);
+  int nvar = header.nvar;
+  int ncon = header.ncon;
+  struct Variable * variables = malloc(nvar * sizeof(struct Variable));
+  for (int i=0; i<nvar; i++){variables[i].index = i;}
+  // Read the constraints twice, so every subexpression appears (at least)
+  // twice, and share the copies. This exercises shared nodes on the tape.
+  struct Node * constraints = malloc(2 * ncon * sizeof(struct Node));
+  fp = fopen(argv[1], "r");
+  read_nl_constraints(fp, constraints, ncon, variables, nvar);
+  fclose(fp);
+  fp = fopen(argv[1], "r");
+  read_nl_constraints(fp, constraints + ncon, ncon, variables, nvar);
+  fclose(fp);
+  int nremoved = share_common_subexpressions(constraints, 2 * ncon);
+  printf("Shared subexpressions: removed %d operator nodes\n", nremoved);
+  for (int i=0; i<ncon; i++){
+    if (constraints[i].type == OP_NODE){
+      assert(constraints[i].data.expr == constraints[ncon + i].data.expr);
+    }
+  }
+  ncon = 2 * ncon;
+  for (int i=0; i<nvar; i++){variables[i].value = 1.0 + (i+1) / 10.0;}
+
+  struct Tape tape = compile_tape(constraints, ncon, nvar);
+  printf("Compiled %d constraints into a tape of %d nodes and %d arguments\n", ncon, tape.nnode, tape.narg);
+  // The second copy of the constraints is entirely shared with the first
+  assert(tape.expr_start[ncon] == tape.expr_start[ncon / 2]);
+  printf("sizeof(struct Node) = %d, sizeof(struct OperatorNode) = %d, sizeof(struct TapeNode) = %d\n",
+    (int)sizeof(struct Node), (int)sizeof(struct OperatorNode), (int)sizeof(struct TapeNode));
+  assert(sizeof(struct TapeNode) == 16);
+
+  double * x = malloc(nvar * sizeof(double));
+  double * values = malloc(tape.nnode * sizeof(double));
+  double * adjoints = malloc(tape.nnode * sizeof(double));
+  double * con_values = malloc(ncon * sizeof(double));
+  gather_variable_values(variables, nvar, x);
+  tape_evaluate(&tape, x, NULL, values);
+  tape_expression_values(&tape, values, con_values);
+  for (int i=0; i<ncon; i++){
+    double tree_value = evaluate(constraints[i]);
+    printf("Constraint %2d: tree value = %f, tape value = %f\n", i, tree_value, con_values[i]);
+    assert(isclose(tree_value, con_values[i]));
+  }
+
+  struct CSRMatrix jac = tape_jacobian_structure(&tape);
+  tape_jacobian(&tape, values, adjoints, jac.values);
+  print_csrmatrix(jac);
+  for (int i=0; i<ncon; i++){
+    struct CSRMatrix row = reverse_diff_expression(constraints[i], nvar);
+    assert(row.nnz == jac.indptr[i+1] - jac.indptr[i]);
+    // Rows may list variables in a different order
+    for (int k=jac.indptr[i]; k<jac.indptr[i+1]; k++){
+      for (int kk=0; kk<row.nnz; kk++){
+        if (row.indices[kk] == jac.indices[k]){
+          assert(isclose(row.values[kk], jac.values[k]));
+        }
+      }
+    }
+    free_csrmatrix(row);
+  }
+  printf("Tape Jacobian matches reverse_diff_expression\n");
+
+  // Matrix-free products match products with the Jacobian
+  double * v = malloc(nvar * sizeof(double));
+  double * w = malloc(ncon * sizeof(double));
+  double * jv = malloc(ncon * sizeof(double));
+  double * jtw = malloc(nvar * sizeof(double));
+  double * dvalues = malloc(tape.nnode * sizeof(double));
+  for (int j=0; j<nvar; j++){v[j] = (j % 3) - 0.5;}
+  for (int i=0; i<ncon; i++){w[i] = 1.0 / (i + 1);}
+  tape_jacobian_vector_product(&tape, values, v, dvalues, jv);
+  tape_jacobian_transpose_product(&tape, values, w, adjoints, jtw);
+  for (int j=0; j<nvar; j++){
+    double expected = 0.0;
+    for (int i=0; i<ncon; i++){
+      for (int k=jac.indptr[i]; k<jac.indptr[i+1]; k++){
+        if (jac.indices[k] == j){expected += jac.values[k] * w[i];}
+      }
+    }
+    assert(isclose(expected, jtw[j]));
+  }
+  for (int i=0; i<ncon; i++){
+    double expected = 0.0;
+    for (int k=jac.indptr[i]; k<jac.indptr[i+1]; k++){
+      expected += jac.values[k] * v[jac.indices[k]];
+    }
+    assert(isclose(expected, jv[i]));
+  }
+  printf("Jacobian-vector products match the Jacobian\n");
+  free(v);
+  free(w);
+  free(jv);
+  free(jtw);
+  free(dvalues);
+
+  free_csrmatrix(jac);
+  free(x);
+  free(values);
+  free(adjoints);
+  free(con_values);
+  free_tape(tape);
+  for (int i=0; i<ncon; i++){free_expression(constraints[i]);}
+  free(constraints);
+  free(variables);
+  return 0;
+}
@@ -0,0 +1,133 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Optional timeline of the stages of loading and evaluating a model, written
+ * in the Chrome trace event format, which chrome://tracing, Perfetto and
+ * speedscope can all open.
+ *
+ * Events are only recorded with -DTRACE. Otherwise TRACE_BEGIN and
+ * TRACE_END expand to nothing. Each event records the thread it happened on,
+ * so parallel loops (e.g. over element functions in separable.h) show one
+ * row per thread.
+ *
+ * Usage (with -DTRACE):
+ *
+ *     trace_start(1 << 20);
+ *     ... read, compile and evaluate a model ...
+ *     trace_write("model.trace.json");
+ *     trace_stop();
+ *
+ * Events go into a buffer of fixed capacity, which threads append to with
+ * an atomic increment, so recording doesn't take a lock. Events after the
+ * buffer is full are dropped (and counted). Names must be string literals,
+ * or otherwise outlive the trace, as we only store the pointer.
+ */
+
+// Included by nl.h and tape.h, so this needs an include guard
+
+#ifdef TRACE
+#define TRACE_BEGIN(name) trace_event((name), 'B')
+#define TRACE_END(name) trace_event((name), 'E')
+#else
+#define TRACE_BEGIN(name)
+#define TRACE_END(name)
+#endif
+
+struct TraceEvent {
+  const char * name;
+  // 'B' (begin) or 'E' (end)
+  char phase;
+  int tid;
+  // Nanoseconds since trace_start
+  uint64_t time;
+};
+
+struct TraceBuffer {
+  long capacity;
+  long nevent;
+  long ndropped;
+  uint64_t origin;
+  struct TraceEvent * events;
+};
+
+struct TraceBuffer TRACE_BUFFER = {.capacity = 0, .nevent = 0, .ndropped = 0, .events = NULL};
+
+// Small thread ids, in the order threads first record an event
+_Thread_local int _trace_tid = -1;
+int _trace_next_tid = 0;
+
+void trace_start(long capacity);
+void trace_event(const char * name, char phase);
+/*
+ * Write the events recorded so far as JSON. Returns -1 if the file can't be
+ * written.
+ */
+int trace_write(const char * filename);
+void trace_stop();
+uint64_t _trace_now();
+
+uint64_t _trace_now(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void trace_start(long capacity){
+  free(TRACE_BUFFER.events);
+  TRACE_BUFFER.capacity = capacity;
+  TRACE_BUFFER.nevent = 0;
+  TRACE_BUFFER.ndropped = 0;
+  TRACE_BUFFER.origin = _trace_now();
+  TRACE_BUFFER.events = malloc((capacity > 0 ? capacity : 1) * sizeof(struct TraceEvent));
+}
+
+void trace_event(const char * name, char phase){
+  if (_trace_tid < 0){
+    _trace_tid = __atomic_fetch_add(&_trace_next_tid, 1, __ATOMIC_RELAXED);
+  }
+  long k = __atomic_fetch_add(&TRACE_BUFFER.nevent, 1, __ATOMIC_RELAXED);
+  if (k >= TRACE_BUFFER.capacity){
+    __atomic_fetch_add(&TRACE_BUFFER.ndropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  struct TraceEvent * event = &TRACE_BUFFER.events[k];
+  event->name = name;
+  event->phase = phase;
+  event->tid = _trace_tid;
+  event->time = _trace_now() - TRACE_BUFFER.origin;
+}
+
+int trace_write(const char * filename){
+  FILE * fp = fopen(filename, "w");
+  if (fp == NULL){
+    printf("ERROR: Could not open %s to write trace\n", filename);
+    return -1;
+  }
+  long nevent = TRACE_BUFFER.nevent < TRACE_BUFFER.capacity ? TRACE_BUFFER.nevent : TRACE_BUFFER.capacity;
+  fprintf(fp, "{\"traceEvents\": [\n");
+  for (long k=0; k<nevent; k++){
+    struct TraceEvent event = TRACE_BUFFER.events[k];
+    // Timestamps are in microseconds
+    fprintf(
+      fp, "{\"name\": \"%s\", \"ph\": \"%c\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f}%s\n",
+      event.name, event.phase, event.tid, event.time / 1000.0, k + 1 < nevent ? "," : ""
+    );
+  }
+  fprintf(fp, "],\n\"displayTimeUnit\": \"ms\",\n");
+  fprintf(fp, "\"otherData\": {\"dropped_events\": %ld}}\n", TRACE_BUFFER.ndropped);
+  fclose(fp);
+  return 0;
+}
+
+void trace_stop(){
+  free(TRACE_BUFFER.events);
+  TRACE_BUFFER.events = NULL;
+  TRACE_BUFFER.capacity = 0;
+  TRACE_BUFFER.nevent = 0;
+}
+
+#endif
@@ -4,3 +4,11 @@ struct Variable {
   int index;
   double value;
 };
+
+// Parameters are data that may change between evaluations, but are not
+// variables. They are stored in their own array, so their values can be
+// updated in place without changing the structure of any expression.
+struct Parameter {
+  int index;
+  double value;
+};